@@ -19,39 +19,420 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "mongoose.h"
 #include "conf.h"
 #include "util.h"
 #include "json.h"
 #include "bean.h"
 
+/*
+ * Jobs are queued in memory and written to beanstalkd over a non-blocking
+ * connection on our mongoose manager, with up to `pipeline' `put' commands
+ * outstanding at any time; beanstalkd answers in order, so replies are
+ * matched to the oldest job in flight. While beanstalkd is unreachable or
+ * stalled, or when the queue is full, jobs are appended to a spool file
+ * (one JSON document per line) which is replayed once we're connected
+ * again. Delivery is at least once: jobs in flight when a connection
+ * breaks are spooled and put again.
+ */
+
+#define PRIORITY	2000		/* 0 == Urgent */
+#define DELAY		0
+#define TTR		30		/* time to run, seconds */
+#define STALLED		10.0		/* seconds without a reply */
+#define BACKOFF_MIN	1.0
+#define BACKOFF_MAX	60.0
+
+struct beanjob {
+	char *data;
+	size_t len;
+	double sent;			/* when the put was written */
+	struct beanjob *next;
+};
+
+static struct {
+	struct mg_connection *nc;
+	bool connected;			/* `use' acknowledged */
+	double since;			/* connect started */
+	double next_connect;
+	double backoff;
+	struct beanjob *head, *tail;	/* waiting to be written */
+	struct beanjob *fhead, *ftail;	/* written, awaiting reply */
+	long depth, inflight;
+	int spoolfd;
+	bool spool_dirty;		/* spool may hold jobs */
+	FILE *replay;			/* spool being replayed */
+	long spooled, puts, errors;
+	double lat_sum, lat_max;
+	long lat_n;
+} bs = { .spoolfd = -1, .spool_dirty = true };
+
+static struct udata *bud;
+
+static char *replay_path(struct udata *ud)
+{
+	static char path[BUFSIZ];
+
+	snprintf(path, sizeof(path), "%s.replay", ud->cf->bean_spool);
+	return (path);
+}
+
+static void job_free(struct beanjob *j)
+{
+	free(j->data);
+	free(j);
+}
+
+static void spool(struct udata *ud, char *data, size_t len)
+{
+	if (bs.spoolfd == -1) {
+		bs.spoolfd = open(ud->cf->bean_spool, O_WRONLY | O_APPEND | O_CREAT, 0644);
+		if (bs.spoolfd == -1) {
+			xlog(ud, "Cannot open bean spool %s: %s; job lost\n",
+				ud->cf->bean_spool, strerror(errno));
+			bs.errors++;
+			return;
+		}
+	}
+	if (write(bs.spoolfd, data, len) != (ssize_t)len || write(bs.spoolfd, "\n", 1) != 1) {
+		xlog(ud, "Cannot write bean spool %s: %s\n", ud->cf->bean_spool, strerror(errno));
+		bs.errors++;
+		return;
+	}
+	bs.spooled++;
+	bs.spool_dirty = true;
+	STATSD_INC(ud->cf->sd, "bean.spool");
+}
+
+static void enqueue(char *data, size_t len)
+{
+	struct beanjob *j = (struct beanjob *)malloc(sizeof(struct beanjob));
+
+	j->data	= data;
+	j->len	= len;
+	j->next	= NULL;
+	if (bs.tail)
+		bs.tail->next = j;
+	else
+		bs.head = j;
+	bs.tail = j;
+	bs.depth++;
+}
+
+/*
+ * Start replaying the spool file unless we're already doing so. A
+ * replay file left over from a previous run is picked up first.
+ */
+
+static void replay_start(struct udata *ud)
+{
+	if (bs.replay != NULL)
+		return;
+
+	if (access(replay_path(ud), F_OK) != 0) {
+		if (!bs.spool_dirty)
+			return;
+		if (bs.spoolfd != -1) {
+			close(bs.spoolfd);
+			bs.spoolfd = -1;
+		}
+		bs.spool_dirty = false;
+		if (rename(ud->cf->bean_spool, replay_path(ud)) != 0)
+			return;
+	}
+
+	if ((bs.replay = fopen(replay_path(ud), "r")) != NULL) {
+		xlog(ud, "Replaying bean spool %s\n", replay_path(ud));
+	}
+}
+
+/*
+ * Top up the queue from the replay file, keeping memory bounded.
+ */
+
+static void replay_fill(struct udata *ud)
+{
+	char *line = NULL;
+	size_t n = 0;
+	ssize_t len;
+
+	while (bs.replay != NULL && bs.depth < ud->cf->bean_pipeline * 2) {
+		if ((len = getline(&line, &n, bs.replay)) == -1) {
+			fclose(bs.replay);
+			bs.replay = NULL;
+			unlink(replay_path(ud));
+			xlog(ud, "Bean spool replayed\n");
+			replay_start(ud);
+			continue;
+		}
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = 0;
+		if (len > 0) {
+			enqueue(line, len);
+			line = NULL;
+			n = 0;
+		}
+	}
+	free(line);
+}
+
+/*
+ * Write as many puts as the pipeline allows in one go; mongoose sends
+ * them with a single write when we next poll.
+ */
+
+static void pump(struct udata *ud)
+{
+	struct beanjob *j;
+	double now = mg_time();
+
+	if (!bs.connected)
+		return;
+
+	if (bs.replay == NULL && bs.spool_dirty && bs.head == NULL)
+		replay_start(ud);
+	replay_fill(ud);
+
+	while ((j = bs.head) != NULL && bs.inflight < ud->cf->bean_pipeline) {
+		if ((bs.head = j->next) == NULL)
+			bs.tail = NULL;
+		bs.depth--;
+
+		mg_printf(bs.nc, "put %d %d %d %lu\r\n", PRIORITY, DELAY, TTR, (unsigned long)j->len);
+		mg_send(bs.nc, j->data, j->len);
+		mg_send(bs.nc, "\r\n", 2);
+
+		j->sent = now;
+		j->next = NULL;
+		if (bs.ftail)
+			bs.ftail->next = j;
+		else
+			bs.fhead = j;
+		bs.ftail = j;
+		bs.inflight++;
+	}
+}
+
+/*
+ * Move everything we hold in memory into the spool; called when the
+ * connection is lost.
+ */
+
+static void spool_all(struct udata *ud)
+{
+	struct beanjob *j, *next;
+
+	for (j = bs.fhead; j; j = next) {
+		next = j->next;
+		spool(ud, j->data, j->len);
+		job_free(j);
+	}
+	for (j = bs.head; j; j = next) {
+		next = j->next;
+		spool(ud, j->data, j->len);
+		job_free(j);
+	}
+	bs.fhead = bs.ftail = bs.head = bs.tail = NULL;
+	bs.depth = bs.inflight = 0;
+}
+
+/*
+ * Handle one reply line from beanstalkd.
+ */
+
+static void reply(struct udata *ud, char *line)
+{
+	struct beanjob *j;
+
+	if (!strncmp(line, "USING ", 6)) {
+		bs.connected = true;
+		bs.backoff = BACKOFF_MIN;
+		xlog(ud, "Connected to beanstalkd on %s:%d for tube %s\n",
+			ud->cf->bean_host, ud->cf->bean_port, ud->cf->bean_tube);
+		replay_start(ud);
+		return;
+	}
+
+	if ((j = bs.fhead) == NULL) {
+		xlog(ud, "Unexpected reply from beanstalkd: %s\n", line);
+		return;
+	}
+	if ((bs.fhead = j->next) == NULL)
+		bs.ftail = NULL;
+	bs.inflight--;
+
+	if (!strncmp(line, "INSERTED ", 9)) {
+		double lat = mg_time() - j->sent;
+
+		bs.puts++;
+		bs.lat_sum += lat;
+		bs.lat_n++;
+		if (lat > bs.lat_max)
+			bs.lat_max = lat;
+		STATSD_INC(ud->cf->sd, "bean.put");
+	} else if (!strcmp(line, "DRAINING") || !strcmp(line, "OUT_OF_MEMORY") ||
+			!strcmp(line, "INTERNAL_ERROR")) {
+		/* beanstalkd can't take it now; keep it for later */
+		spool(ud, j->data, j->len);
+	} else {
+		/* BURIED, JOB_TOO_BIG, EXPECTED_CRLF, ... */
+		xlog(ud, "bean put failed: %s\n", line);
+		bs.errors++;
+		STATSD_INC(ud->cf->sd, "bean.error");
+	}
+	job_free(j);
+}
+
+static void bean_ev_handler(struct mg_connection *nc, int ev, void *ev_data)
+{
+	struct udata *ud = bud;
+	struct mbuf *io = &nc->recv_mbuf;
+	char *eol;
+
+	switch (ev) {
+		case MG_EV_CONNECT:
+			if (*(int *)ev_data != 0) {
+				xlog(ud, "Cannot connect to beanstalkd on %s:%d: %s\n",
+					ud->cf->bean_host, ud->cf->bean_port, strerror(*(int *)ev_data));
+				break;
+			}
+			mg_printf(nc, "use %s\r\n", ud->cf->bean_tube);
+			break;
+
+		case MG_EV_RECV:
+			while ((eol = memchr(io->buf, '\n', io->len)) != NULL) {
+				size_t n = eol - io->buf + 1;
+
+				*eol = 0;
+				if (eol > io->buf && eol[-1] == '\r')
+					eol[-1] = 0;
+				reply(ud, io->buf);
+				mbuf_remove(io, n);
+			}
+			pump(ud);
+			break;
+
+		case MG_EV_CLOSE:
+			if (bs.nc == nc) {
+				if (bs.connected)
+					xlog(ud, "Lost connection to beanstalkd\n");
+				bs.nc = NULL;
+				bs.connected = false;
+				spool_all(ud);
+				bs.next_connect = mg_time() + bs.backoff;
+				bs.backoff = (bs.backoff * 2 > BACKOFF_MAX) ? BACKOFF_MAX : bs.backoff * 2;
+			}
+			break;
+
+		default:
+			break;
+	}
+}
+
+static void bean_connect(struct udata *ud)
+{
+	char address[BUFSIZ];
+
+	snprintf(address, sizeof(address), "tcp://%s:%d", ud->cf->bean_host, ud->cf->bean_port);
+	bs.since = mg_time();
+	if ((bs.nc = mg_connect(ud->mgr, address, bean_ev_handler)) == NULL) {
+		xlog(ud, "Cannot connect to beanstalkd on %s\n", address);
+		bs.next_connect = bs.since + bs.backoff;
+	}
+}
+
+void bean_init(struct udata *ud)
+{
+	bud = ud;
+	bs.backoff = BACKOFF_MIN;
+	bs.next_connect = 0;
+	if (ud->mgr)
+		bean_connect(ud);
+}
+
 void bean_put(struct udata *ud, JsonNode *jfull)
 {
-	const int priority = 2000;	/* 0 == Urgent */
-	const int delay = 0;
-	const int ttr = 30;		/* <ttr> -- time to run -- is an
-					 * integer number of seconds to allow a
-					 * worker to run this job. This time is
-					 * counted from the moment a worker
-					 * reserves this job. If the worker
-					 * does not delete, release, or bury
-					 * the job within <ttr> seconds, the
-					 * job will time out and the server
-					 * will release the job.  The minimum
-					 * ttr is 1. If the client sends 0, the
-					 * server will silently increase the
-					 * ttr to 1.
-					 */
-	int id;
 	char *js;
 
-	if ((js = json_encode(jfull)) != NULL) {
-		id = bs_put(ud->bean_socket, priority, delay, ttr, js, strlen(js) + 0);
+	if ((js = json_encode(jfull)) == NULL) {
+		xlog(ud, "Cannot encode JSON for bean\n");
+		return;
+	}
 
-		xlog(ud, "bean put: job id: %d\n", id);
-		assert(id != -1);
+	if (!bs.connected || bs.depth >= ud->cf->bean_maxqueue || bs.replay != NULL) {
+		/* spool if we can't send now, or to stay behind the replay */
+		spool(ud, js, strlen(js));
 		free(js);
-	} else {
-		xlog(ud, "Cannot encode JSON for bean\n");
+		return;
+	}
+
+	enqueue(js, strlen(js));
+	pump(ud);
+}
+
+/*
+ * Called from the main loop: (re-)connect with backoff, notice a stalled
+ * beanstalkd, and keep the pipeline full.
+ */
+
+void bean_poll(struct udata *ud)
+{
+	double now = mg_time();
+
+	if (ud->mgr == NULL)
+		return;
+
+	if (bs.nc == NULL) {
+		if (now >= bs.next_connect)
+			bean_connect(ud);
+		return;
+	}
+
+	if ((!bs.connected && now - bs.since > STALLED) ||
+	    (bs.fhead && now - bs.fhead->sent > STALLED)) {
+		xlog(ud, "beanstalkd on %s:%d isn't answering; reconnecting\n",
+			ud->cf->bean_host, ud->cf->bean_port);
+		STATSD_INC(ud->cf->sd, "bean.stalled");
+		bs.nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+		return;
 	}
+
+	pump(ud);
+}
+
+/*
+ * Poll until everything queued and spooled has been put, or until
+ * `seconds' have passed. Used when replaying files.
+ */
+
+void bean_drain(struct udata *ud, int seconds)
+{
+	double end = mg_time() + seconds;
+
+	while (mg_time() < end) {
+		if (bs.connected && bs.head == NULL && bs.fhead == NULL &&
+		    bs.replay == NULL && !bs.spool_dirty)
+			break;
+		mg_mgr_poll(ud->mgr, 100);
+		bean_poll(ud);
+	}
+}
+
+/*
+ * Queue depth and put latency since the last call.
+ */
+
+void bean_stats(char *buf, size_t buflen)
+{
+	snprintf(buf, buflen, "bean %s depth=%ld inflight=%ld spooled=%ld puts=%ld errors=%ld latency_avg=%.1fms latency_max=%.1fms",
+		bs.connected ? "up" : "down",
+		bs.depth, bs.inflight, bs.spooled, bs.puts, bs.errors,
+		bs.lat_n ? (bs.lat_sum / bs.lat_n) * 1000.0 : 0.0,
+		bs.lat_max * 1000.0);
+	bs.lat_sum = bs.lat_max = 0;
+	bs.lat_n = 0;
 }
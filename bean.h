@@ -21,10 +21,14 @@
 #ifndef _BEAN_H_INCL_
 # define  _BEAN_H_INCL_
 
-#include <beanstalk.h>
 #include "udata.h"
+#include "json.h"
 
+void bean_init(struct udata *ud);
 void bean_put(struct udata *ud, JsonNode *jfull);
+void bean_poll(struct udata *ud);
+void bean_drain(struct udata *ud, int seconds);
+void bean_stats(char *buf, size_t buflen);
 
 #endif
 #endif /* WITH_BEAN */
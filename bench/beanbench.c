@@ -0,0 +1,277 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * beanbench: bean.c against a beanstalkd which stalls. A child process
+ * is a minimal stand-in for beanstalkd (`use' and `put', nothing else)
+ * which notes each job it is given. -n jobs, each {"seq":<n>}, are put
+ * at -r per second through bean_put() as qtripp would; once a third of
+ * them are out, the stand-in is stopped with SIGSTOP for -p seconds and
+ * then continued with SIGCONT. Pausing it for longer than bean.c waits
+ * for a reply makes it give up on the connection, spool what it has and
+ * reconnect. When everything has been put and drained, every job must
+ * have arrived at least once, or beanbench exits 1. Jobs which arrived
+ * more than once (delivery is at least once) are counted.
+ *
+ *	beanbench -n 200000 -r 20000 -p 15
+ */
+
+#define _GNU_SOURCE		/* memmem */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "mongoose.h"
+#include "conf.h"
+#include "udata.h"
+#include "json.h"
+#include "bean.h"
+
+#ifndef WITH_BEAN
+# error "beanbench needs qtripp built with BEANSTALK=yes"
+#endif
+
+#define MAXCONN		16
+#define INSIZE		(256 * 1024)
+
+struct conn {
+	int fd;
+	char *in;
+	size_t len;
+};
+
+static unsigned char *seen;		/* shared: times the stand-in got job n */
+static long njobs = 100000;
+
+/* Answer the complete commands in `c->in'; the rest stays for later */
+static void serve(struct conn *c)
+{
+	static unsigned long id = 0;
+	static char out[INSIZE];
+	char *p = c->in, *end = c->in + c->len, *eol, *body, *s;
+	unsigned long bytes;
+	size_t olen = 0;
+	long seq;
+
+	while ((eol = memmem(p, end - p, "\r\n", 2)) != NULL && olen < sizeof(out) - 128) {
+		if (strncmp(p, "use ", 4) == 0) {
+			olen += snprintf(out + olen, sizeof(out) - olen, "USING %.*s\r\n",
+				(int)(eol - p - 4), p + 4);
+			p = eol + 2;
+		} else if (sscanf(p, "put %*u %*u %*u %lu", &bytes) == 1) {
+			body = eol + 2;
+			if ((size_t)(end - body) < bytes + 2)
+				break;
+			if ((s = memmem(body, bytes, "\"seq\":", 6)) != NULL &&
+			    (seq = strtol(s + 6, NULL, 10)) >= 0 && seq < njobs && seen[seq] < 255)
+				seen[seq]++;
+			olen += snprintf(out + olen, sizeof(out) - olen, "INSERTED %lu\r\n", ++id);
+			p = body + bytes + 2;
+		} else {
+			olen += snprintf(out + olen, sizeof(out) - olen, "UNKNOWN_COMMAND\r\n");
+			p = eol + 2;
+		}
+	}
+	c->len = end - p;
+	memmove(c->in, p, c->len);
+	if (olen > 0 && write(c->fd, out, olen) != (ssize_t)olen) {
+		/* qtripp has gone; so has the connection */
+	}
+}
+
+/* The stand-in for beanstalkd, in the child, until it's killed */
+static void standin(int lfd)
+{
+	struct conn conns[MAXCONN];
+	struct pollfd pfd[MAXCONN + 1];
+	int nconns = 0, i, fd;
+	ssize_t nr;
+
+	for (;;) {
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		for (i = 0; i < nconns; i++) {
+			pfd[i + 1].fd = conns[i].fd;
+			pfd[i + 1].events = POLLIN;
+		}
+		if (poll(pfd, nconns + 1, -1) == -1 && errno != EINTR)
+			_exit(2);
+
+		for (i = nconns - 1; i >= 0; i--) {
+			if ((pfd[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) == 0)
+				continue;
+			nr = read(conns[i].fd, conns[i].in + conns[i].len, INSIZE - conns[i].len);
+			if (nr > 0) {
+				conns[i].len += nr;
+				serve(&conns[i]);
+				if (conns[i].len < INSIZE)
+					continue;
+			}
+			close(conns[i].fd);
+			free(conns[i].in);
+			conns[i] = conns[--nconns];
+		}
+		if ((pfd[0].revents & POLLIN) && (fd = accept(lfd, NULL, NULL)) != -1) {
+			if (nconns == MAXCONN) {
+				close(fd);
+				continue;
+			}
+			conns[nconns].fd = fd;
+			conns[nconns].in = malloc(INSIZE);
+			conns[nconns].len = 0;
+			nconns++;
+		}
+	}
+}
+
+static void put(struct udata *ud, long seq)
+{
+	JsonNode *obj = json_mkobject();
+
+	json_append_member(obj, "seq", json_mknumber(seq));
+	bean_put(ud, obj);
+	json_delete(obj);
+}
+
+int main(int argc, char **argv)
+{
+	static config cf = {
+		.bean_host	= "127.0.0.1",
+		.bean_tube	= "beanbench",
+		.bean_maxqueue	= 10000,
+		.bean_pipeline	= 64,
+	};
+	struct udata udata, *ud = &udata;
+	struct mg_mgr mgr;
+	struct sockaddr_in sin;
+	socklen_t slen = sizeof(sin);
+	char dir[] = "/tmp/beanbench.XXXXXX", spool[BUFSIZ];
+	double rate = 20000, pause = 15, t0, t, tstop = 0, tcont = 0;
+	long sent = 0, lost = 0, dups = 0, n;
+	int ch, lfd, on = 1;
+	pid_t child;
+
+	while ((ch = getopt(argc, argv, "n:r:p:")) != EOF) {
+		switch (ch) {
+			case 'n': njobs = atol(optarg); break;
+			case 'r': rate = atof(optarg); break;
+			case 'p': pause = atof(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-n jobs] [-r jobs/s] [-p pause-seconds]\n", *argv);
+				exit(2);
+		}
+	}
+	if (njobs < 3 || rate <= 0)
+		exit(2);
+
+	/* the stand-in on a port of the kernel's choosing */
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((lfd = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+	    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+	    bind(lfd, (struct sockaddr *)&sin, sizeof(sin)) == -1 ||
+	    listen(lfd, 16) == -1 || getsockname(lfd, (struct sockaddr *)&sin, &slen) == -1) {
+		perror("stand-in");
+		exit(2);
+	}
+	seen = mmap(NULL, njobs, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (seen == MAP_FAILED) {
+		perror("mmap");
+		exit(2);
+	}
+	if ((child = fork()) == -1) {
+		perror("fork");
+		exit(2);
+	}
+	if (child == 0)
+		standin(lfd);
+	close(lfd);
+
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		kill(child, SIGKILL);
+		exit(2);
+	}
+	snprintf(spool, sizeof(spool), "%s/bean.spool", dir);
+	cf.bean_port = ntohs(sin.sin_port);
+	cf.bean_spool = spool;
+
+	signal(SIGPIPE, SIG_IGN);
+	memset(ud, 0, sizeof(struct udata));
+	ud->cf = &cf;
+	ud->logfp = stderr;
+	mg_mgr_init(&mgr, ud);
+	ud->mgr = &mgr;
+	bean_init(ud);
+
+	t0 = mg_time();
+	while (sent < njobs || tcont == 0) {
+		t = mg_time();
+		for (n = (t - t0) * rate; sent < njobs && sent < n; sent++)
+			put(ud, sent);
+		if (tstop == 0 && sent >= njobs / 3) {
+			kill(child, SIGSTOP);
+			tstop = t;
+			printf("stand-in stopped after %ld jobs\n", sent);
+		}
+		if (tstop > 0 && tcont == 0 && t - tstop >= pause) {
+			kill(child, SIGCONT);
+			tcont = t;
+			printf("stand-in continued after %.1fs, %ld jobs\n", t - tstop, sent);
+		}
+		mg_mgr_poll(&mgr, 1);
+		bean_poll(ud);
+	}
+	bean_drain(ud, 120);
+	t = mg_time();
+
+	for (n = 0; n < njobs; n++) {
+		if (seen[n] == 0)
+			lost++;
+		else if (seen[n] > 1)
+			dups++;
+	}
+	{
+		char stats[BUFSIZ];
+
+		bean_stats(stats, sizeof(stats));
+		printf("%s\n", stats);
+	}
+	printf("jobs: %ld put in %.1fs, %ld lost, %ld delivered more than once\n",
+		njobs, t - t0, lost, dups);
+
+	kill(child, SIGKILL);
+	waitpid(child, NULL, 0);
+	mg_mgr_free(&mgr);
+	unlink(spool);
+	snprintf(spool, sizeof(spool), "%s/bean.spool.replay", dir);
+	unlink(spool);
+	rmdir(dir);
+	return (lost > 0 ? 1 : 0);
+}
@@ -0,0 +1,171 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * connbench: memory per idle device connection. -n connections are set up
+ * the way qtripp's ev_handler does on accept and after a first record
+ * (conndata from the pool, client IP, IMEI, idle timer; the record
+ * consumed so nothing is left buffered), each with the mg_connection
+ * mongoose would have allocated for it. Heap in use before and after is
+ * reported per connection, then all connections are closed and opened
+ * again -c times to show that reconnects reuse the memory.
+ *
+ * With -m, each connection also gets the 1 KB struct mbuf every accept
+ * used to allocate, for comparison.
+ *
+ *	connbench -n 100000
+ *	connbench -n 100000 -m
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <malloc.h>
+#include "mongoose.h"
+#include "conf.h"
+#include "udata.h"
+#include "conn.h"
+
+static size_t heap_inuse(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+	struct mallinfo2 mi = mallinfo2();
+#else
+	struct mallinfo mi = mallinfo();
+#endif
+
+	return ((size_t)mi.uordblks + (size_t)mi.hblkhd);
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+static struct mg_connection **ncs;
+static struct mbuf **mbs;
+
+static void open_all(struct mg_mgr *mgr, struct udata *ud, int n, int oldmbuf)
+{
+	struct conndata *co;
+	char ip[32], imei[32];
+	int i;
+
+	for (i = 0; i < n; i++) {
+		ncs[i] = calloc(1, sizeof(struct mg_connection));
+		ncs[i]->mgr = mgr;
+		ncs[i]->sock = i + 16;
+
+		co = add_conn(ncs[i]->sock);
+		snprintf(ip, sizeof(ip), "10.%d.%d.%d", (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+		co->client_ip = strdup(ip);
+		co->nc = ncs[i];
+		co->idle_secs = idle_timeout(ud->cf, NULL);
+		ncs[i]->user_data = co;
+		idle_refresh(co);
+
+		snprintf(imei, sizeof(imei), "86%013d", i);
+		conn_set_imei(ud, co, imei);
+
+		if (oldmbuf) {
+			mbs[i] = malloc(sizeof(struct mbuf));
+			mbuf_init(mbs[i], 1024);
+		}
+	}
+}
+
+static void close_all(int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		delete_conn((struct conndata *)ncs[i]->user_data);
+		free(ncs[i]);
+		if (mbs[i] != NULL) {
+			mbuf_free(mbs[i]);
+			free(mbs[i]);
+			mbs[i] = NULL;
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static config cf = { .idle_timeout = 20 * 60 };
+	struct udata udata, *ud = &udata;
+	struct mg_mgr mgr;
+	int ch, n = 100000, cycles = 3, oldmbuf = 0, c;
+	size_t h0, h1, h2, peak;
+	double t0, t1;
+
+	while ((ch = getopt(argc, argv, "n:c:m")) != EOF) {
+		switch (ch) {
+			case 'n': n = atoi(optarg); break;
+			case 'c': cycles = atoi(optarg); break;
+			case 'm': oldmbuf = 1; break;
+			default:
+				fprintf(stderr, "usage: %s [-n connections] [-c cycles] [-m]\n", *argv);
+				exit(2);
+		}
+	}
+	if (n < 1)
+		n = 1;
+
+	memset(ud, 0, sizeof(struct udata));
+	ud->cf = &cf;
+	mg_mgr_init(&mgr, ud);
+	ncs = calloc(n, sizeof(struct mg_connection *));
+	mbs = calloc(n, sizeof(struct mbuf *));
+
+	h0 = heap_inuse();
+	t0 = now_ns();
+	open_all(&mgr, ud, n, oldmbuf);
+	t1 = now_ns();
+	h1 = heap_inuse();
+
+	printf("connections: %d%s\n", n, oldmbuf ? " (with 1 KB mbuf each)" : "");
+	printf("heap per idle connection: %.0f bytes (of which mg_connection %lu, conndata %lu)\n",
+		(double)(h1 - h0) / n, (unsigned long)sizeof(struct mg_connection),
+		(unsigned long)sizeof(struct conndata));
+	printf("open: %.0f ns per connection\n", (t1 - t0) / n);
+
+	peak = h1;
+	for (c = 0; c < cycles; c++) {
+		t0 = now_ns();
+		close_all(n);
+		open_all(&mgr, ud, n, oldmbuf);
+		t1 = now_ns();
+		if ((h2 = heap_inuse()) > peak)
+			peak = h2;
+	}
+	if (cycles > 0) {
+		printf("reconnect: %.0f ns per connection\n", (t1 - t0) / n);
+		printf("heap growth over %d reconnect cycles: %.0f bytes per connection\n",
+			cycles, (double)(peak - h1) / n);
+	}
+
+	close_all(n);
+	mg_mgr_free(&mgr);
+	return (0);
+}
@@ -0,0 +1,413 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * decbench: decoder micro-benchmark. For every entry (subtype-version) in
+ * the devices[] table generated from devices.yml, synthesize a valid line
+ * twice: once with a single position block and AC100 reading, and once
+ * with the worst case (-s segments and, if the layout has AC100 data, -a
+ * readings). Each line is fed to handle_report() as qtripp would, timing
+ * separately
+ *
+ *	split	clean_split() of the line into fields
+ *	decode	handle_report() without the split and the encoding
+ *	encode	json_encode() of each JSON object the report produced
+ *
+ * Layouts with a binary (`hex') format are run again as binary frames
+ * through handle_hex(), with hex_split() as the split; the JSON must be
+ * the same as for the ASCII line, or decbench exits 1. The two are
+ * compared on stderr. The frames are encoded by synth.c, so this shows
+ * the two paths agree, not that real devices' frames decode.
+ *
+ * Each case is run -r rounds of -n iterations and the fastest round is
+ * kept. Results go to stdout (or -o file) as JSON; given an earlier
+ * result with -b, each case's total is compared to it and decbench exits
+ * 1 if any is more than -t percent slower.
+ *
+ *	decbench -o base.json
+ *	... change things ...
+ *	decbench -b base.json -t 10
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "conf.h"
+#include "udata.h"
+#include "util.h"
+#include "json.h"
+#include "tline.h"
+#include "hex.h"
+#include "hextypes.h"
+#include "synth.h"
+
+#define MAXLINE		(64 * 1024)
+#define MAXSEGMENTS	15	/* `Number' goes up to 15 in the protocol docs */
+#define MAXANUM		19	/* up to 19 AC100 readings */
+
+struct result {
+	char id[64];
+	const char *format;		/* "ascii" or "hex" */
+	int segments, anum, nfields;
+	size_t linelen, jsonlen;
+	double split, decode, encode;	/* ns per record */
+};
+
+static double encode_ns;
+static size_t encode_bytes;
+static char *captured;			/* the JSON of a run, if wanted */
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+/* Called by transmit_json() for each object; encode and throw away */
+static void onjson(struct udata *ud, char *topic, JsonNode *obj)
+{
+	double t0 = now_ns();
+	char *js;
+
+	if ((js = json_encode(obj)) != NULL) {
+		encode_bytes += strlen(js);
+		if (captured != NULL &&
+		    (captured = realloc(captured, strlen(captured) + strlen(js) + 2)) != NULL)
+			strcat(strcat(captured, js), "\n");
+		free(js);
+	}
+	encode_ns += now_ns() - t0;
+}
+
+/* The JSON which decoding `line' (`len' bytes, binary if `hex') produces */
+static char *decode_json(struct udata *ud, char *line, size_t len, bool hex)
+{
+	static char buf[MAXLINE], text[HEX_LINESIZE];
+	struct reply resp;
+	char *js;
+
+	captured = strdup("");
+	resp.len = 0;
+	memcpy(buf, line, len);
+	buf[len] = 0;
+	if (hex)
+		free(handle_hex(ud, buf, len, text, sizeof(text), &resp));
+	else
+		free(handle_report(ud, buf, &resp));
+	js = captured;
+	captured = NULL;
+	return (js);
+}
+
+/*
+ * Run `line' (`len' bytes; a binary frame if `r->format' says so) through
+ * the decoder `iterations' times, `rounds' times over, and keep the
+ * fastest round in `r'. Returns false if the decoder produced nothing
+ * from it.
+ */
+
+static bool run(struct udata *ud, char *line, size_t len, int iterations, int rounds, struct result *r)
+{
+	static char buf[MAXLINE], text[HEX_LINESIZE];
+	bool hex = strcmp(r->format, "hex") == 0;
+	double split, total, best = -1;
+	char **parts, *imei;
+	struct reply resp;
+	int i, round, nparts;
+
+	for (round = 0; round < rounds; round++) {
+		split = total = 0;
+		encode_ns = 0;
+		encode_bytes = 0;
+
+		for (i = 0; i < iterations; i++) {
+			double t0, t1, t2;
+
+			memcpy(buf, line, len + 1);
+			t0 = now_ns();
+			if (hex)
+				hex_split(ud, buf, len, &nparts);
+			else if ((parts = clean_split(ud, buf, &nparts)) != NULL)
+				splitterfree(parts);
+			t1 = now_ns();
+
+			memcpy(buf, line, len + 1);
+			resp.len = 0;
+			t2 = now_ns();
+			if (hex)
+				imei = handle_hex(ud, buf, len, text, sizeof(text), &resp);
+			else
+				imei = handle_report(ud, buf, &resp);
+			total += now_ns() - t2;
+			split += t1 - t0;
+			free(imei);
+		}
+
+		if (encode_bytes == 0)
+			return (false);
+		if (best < 0 || total < best) {
+			best = total;
+			r->split = split / iterations;
+			r->encode = encode_ns / iterations;
+			r->decode = (total - split - encode_ns) / iterations;
+			r->jsonlen = encode_bytes / iterations;
+		}
+	}
+	r->linelen = len;
+	r->nfields = nparts;
+	return (true);
+}
+
+static JsonNode *tojson(struct result *r)
+{
+	JsonNode *o = json_mkobject();
+
+	json_append_member(o, "id", json_mkstring(r->id));
+	json_append_member(o, "format", json_mkstring(r->format));
+	json_append_member(o, "segments", json_mknumber(r->segments));
+	json_append_member(o, "anum", json_mknumber(r->anum));
+	json_append_member(o, "fields", json_mknumber(r->nfields));
+	json_append_member(o, "line_bytes", json_mknumber(r->linelen));
+	json_append_member(o, "json_bytes", json_mknumber(r->jsonlen));
+	json_append_member(o, "split_ns", json_mkdouble(r->split, 1));
+	json_append_member(o, "decode_ns", json_mkdouble(r->decode, 1));
+	json_append_member(o, "encode_ns", json_mkdouble(r->encode, 1));
+	json_append_member(o, "total_ns", json_mkdouble(r->split + r->decode + r->encode, 1));
+	return (o);
+}
+
+/* "id/format/segments/anum" of case `c'; results without a format are ASCII */
+static void casekey(JsonNode *c, char *key, size_t size)
+{
+	JsonNode *f = json_find_member(c, "format");
+
+	snprintf(key, size, "%s/%s/%g/%g",
+		json_find_member(c, "id")->string_,
+		(f && f->tag == JSON_STRING) ? f->string_ : "ascii",
+		json_find_member(c, "segments")->number_,
+		json_find_member(c, "anum")->number_);
+}
+
+/*
+ * Compare `cases' to the same cases in `basefile'; return the number of
+ * cases which are more than `pct' percent slower.
+ */
+
+static int compare(JsonNode *cases, char *basefile, double pct)
+{
+	JsonNode *base, *bcases, *c, *b, *j;
+	char *js, key[96];
+	int slower = 0, compared = 0;
+
+	if ((js = slurp_file(basefile, false)) == NULL) {
+		perror(basefile);
+		exit(2);
+	}
+	if ((base = json_decode(js)) == NULL ||
+	    (bcases = json_find_member(base, "cases")) == NULL) {
+		fprintf(stderr, "%s: not a decbench result\n", basefile);
+		exit(2);
+	}
+	free(js);
+
+	json_foreach(c, cases) {
+		double now, then;
+
+		casekey(c, key, sizeof(key));
+
+		then = -1;
+		json_foreach(b, bcases) {
+			char bkey[96];
+
+			if ((j = json_find_member(b, "id")) == NULL || j->tag != JSON_STRING)
+				continue;
+			casekey(b, bkey, sizeof(bkey));
+			if (strcmp(key, bkey) == 0) {
+				then = json_find_member(b, "total_ns")->number_;
+				break;
+			}
+		}
+		if (then <= 0) {
+			fprintf(stderr, "%-28s new\n", key);
+			continue;
+		}
+		compared++;
+		now = json_find_member(c, "total_ns")->number_;
+		if (now > then * (1.0 + pct / 100.0)) {
+			fprintf(stderr, "%-28s %10.1f ns, was %10.1f ns: %+.1f%%\n",
+				key, now, then, (now - then) * 100.0 / then);
+			slower++;
+		}
+	}
+	fprintf(stderr, "%d of %d cases more than %g%% slower than %s\n",
+		slower, compared, pct, basefile);
+	json_delete(base);
+	return (slower);
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s [-n iterations] [-r rounds] [-s segments] [-a anum]\n"
+		"\t[-m match] [-o outfile] [-b baseline [-t percent]]\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int iterations = 200, rounds = 3, segments = MAXSEGMENTS, anum = MAXANUM;
+	char *match = NULL, *outfile = NULL, *basefile = NULL, *js, *ajs, *hjs;
+	char line[MAXLINE], frame[MAXLINE];
+	double pct = 10.0;
+	struct _device *dp;
+	struct udata udata, *ud = &udata;
+	static config cf;
+	JsonNode *doc, *cases;
+	FILE *fp = stdout;
+	int ch, ncases = 0, nhex = 0, mismatched = 0, rc = 0, flen;
+
+	while ((ch = getopt(argc, argv, "n:r:s:a:m:o:b:t:")) != EOF) {
+		switch (ch) {
+			case 'n': iterations = atoi(optarg); break;
+			case 'r': rounds = atoi(optarg); break;
+			case 's': segments = atoi(optarg); break;
+			case 'a': anum = atoi(optarg); break;
+			case 'm': match = optarg; break;
+			case 'o': outfile = optarg; break;
+			case 'b': basefile = optarg; break;
+			case 't': pct = atof(optarg); break;
+			default: usage(*argv);
+		}
+	}
+	if (iterations < 1 || rounds < 1 || segments < 1 || anum < 1)
+		usage(*argv);
+
+	/* No logging, no sinks: just decode, with encoding done in onjson() */
+	memset(&udata, 0, sizeof(udata));
+	ud->cf = &cf;
+	ud->sinks = SINK_NULL;
+	ud->onjson = onjson;
+
+	load_devices();
+	load_hextypes();
+
+	doc = json_mkobject();
+	cases = json_mkarray();
+	json_append_member(doc, "iterations", json_mknumber(iterations));
+	json_append_member(doc, "rounds", json_mknumber(rounds));
+
+	for (dp = devices; dp->id != NULL; dp++) {
+		struct synth sy;
+		struct result r, h;
+		int pass;
+
+		if (match && strstr(dp->id, match) == NULL)
+			continue;
+
+		for (pass = 0; pass < 2; pass++) {
+			memset(&sy, 0, sizeof(sy));
+			sy.dp = dp;
+			sy.abr = "RESP";
+			sy.imei = "860000000000001";
+			sy.segments = pass ? segments : 1;
+			sy.anum = (pass && dp->anum > 0) ? anum : 1;
+			sy.count = 1;
+			sy.tst = 1514764800;
+			sy.lat = 52.5;
+			sy.lon = 13.4;
+
+			/* Layouts without repeating parts have no worst case */
+			if (pass && (dp->num <= 0 || dp->acc <= 0) && dp->anum <= 0)
+				break;
+			if (pass && (dp->num <= 0 || dp->acc <= 0))
+				sy.segments = 1;
+
+			if (synth_line(&sy, line, sizeof(line)) < 0) {
+				fprintf(stderr, "%s: cannot synthesize %d/%d\n", dp->id, sy.segments, sy.anum);
+				continue;
+			}
+
+			memset(&r, 0, sizeof(r));
+			snprintf(r.id, sizeof(r.id), "%s", dp->id);
+			r.format = "ascii";
+			r.segments = sy.segments;
+			r.anum = dp->anum > 0 ? sy.anum : 0;
+			if (run(ud, line, strlen(line), iterations, rounds, &r) == false) {
+				/* e.g. ignored subtypes */
+				continue;
+			}
+			json_append_element(cases, tojson(&r));
+			ncases++;
+
+			if ((flen = synth_hex(&sy, frame, sizeof(frame))) < 0)
+				continue;
+
+			ajs = decode_json(ud, line, strlen(line), false);
+			hjs = decode_json(ud, frame, flen, true);
+			if (strcmp(ajs, hjs) != 0) {
+				fprintf(stderr, "%s/%d/%d: binary decodes differently\n  ascii: %s  hex:   %s",
+					dp->id, r.segments, r.anum, ajs, hjs);
+				mismatched++;
+			}
+			free(ajs);
+			free(hjs);
+
+			h = r;
+			h.format = "hex";
+			if (run(ud, frame, flen, iterations, rounds, &h) == false)
+				continue;
+			json_append_element(cases, tojson(&h));
+			ncases++;
+			nhex++;
+
+			fprintf(stderr, "%-24s %2d/%2d  ascii %8.1f ns  hex %8.1f ns  (split %.1f vs %.1f)  %.2fx\n",
+				dp->id, r.segments, r.anum,
+				r.split + r.decode + r.encode, h.split + h.decode + h.encode,
+				r.split, h.split,
+				(r.split + r.decode + r.encode) / (h.split + h.decode + h.encode));
+		}
+	}
+	json_append_member(doc, "cases", cases);
+
+	if (outfile && (fp = fopen(outfile, "w")) == NULL) {
+		perror(outfile);
+		exit(2);
+	}
+	if ((js = json_stringify(doc, " ")) != NULL) {
+		fprintf(fp, "%s\n", js);
+		free(js);
+	}
+	if (fp != stdout)
+		fclose(fp);
+	fprintf(stderr, "%d cases, %d of them binary", ncases, nhex);
+	if (mismatched > 0) {
+		fprintf(stderr, "; %d binary decoded differently", mismatched);
+		rc = 1;
+	}
+	fprintf(stderr, "\n");
+
+	if (basefile != NULL && compare(cases, basefile, pct) > 0)
+		rc = 1;
+
+	json_delete(doc);
+	return (rc);
+}
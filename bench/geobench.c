@@ -0,0 +1,207 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * geobench: geofence evaluation. -f fences (a fifth of them polygons, the
+ * rest circles of 50 m to 2 km) are scattered over a square of -w degrees
+ * around Berlin and indexed with cells of -c degrees. Then
+ *
+ *	lookup	geo_inside() for random points in the square
+ *	stream	geo_update() for -v devices driving about in it, -p
+ *		positions/s for -d seconds' worth, with the transitions
+ *		built and encoded as qtripp would publish them
+ *
+ * are timed, and for the stream, the share of a CPU it would take at -p
+ * positions/s is reported.
+ *
+ *	geobench -f 100000 -w 4 -p 10000
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <malloc.h>
+#include "conf.h"
+#include "udata.h"
+#include "json.h"
+#include "geo.h"
+
+#define LAT0		52.5
+#define LON0		13.4
+
+static unsigned long events;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+static size_t heap_inuse(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+	struct mallinfo2 mi = mallinfo2();
+#else
+	struct mallinfo mi = mallinfo();
+#endif
+
+	return ((size_t)mi.uordblks + (size_t)mi.hblkhd);
+}
+
+static double rnd(double lo, double hi)
+{
+	return (lo + (hi - lo) * (random() / (double)RAND_MAX));
+}
+
+/* Transitions are encoded, as they would be for publishing, and counted */
+static void onjson(struct udata *ud, char *topic, JsonNode *obj)
+{
+	char *js;
+
+	if ((js = json_encode(obj)) != NULL)
+		free(js);
+	events++;
+}
+
+struct car {
+	char imei[16];
+	double lat, lon, heading;
+	struct geostate gs;
+};
+
+int main(int argc, char **argv)
+{
+	int nfences = 100000, ndevs = 10000, rate = 10000, duration = 10, ch, i, n;
+	double width = 4, cell = GEO_CELL, t0, t1, lat, lon;
+	long lookups = 1000000, hits = 0, positions;
+	struct udata udata, *ud = &udata;
+	static config cf;
+	struct car *cars;
+	double *pts;
+	size_t heap0;
+	int ids[GEO_MAXINSIDE];
+
+	while ((ch = getopt(argc, argv, "f:v:p:d:w:c:n:")) != EOF) {
+		switch (ch) {
+			case 'f': nfences = atoi(optarg); break;
+			case 'v': ndevs = atoi(optarg); break;
+			case 'p': rate = atoi(optarg); break;
+			case 'd': duration = atoi(optarg); break;
+			case 'w': width = atof(optarg); break;
+			case 'c': cell = atof(optarg); break;
+			case 'n': lookups = atol(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-f fences] [-v devices] [-p positions/s] [-d seconds]\n"
+					"\t[-w degrees] [-c cell] [-n lookups]\n", *argv);
+				exit(2);
+		}
+	}
+	if (nfences < 1 || ndevs < 1 || rate < 1 || duration < 1 || width <= 0)
+		exit(2);
+
+	memset(&udata, 0, sizeof(udata));
+	ud->cf = &cf;
+	ud->sinks = SINK_NULL;
+	ud->onjson = onjson;
+	srandom(42);
+
+	heap0 = heap_inuse();
+	for (i = 0; i < nfences; i++) {
+		char desc[32];
+
+		lat = rnd(LAT0 - width / 2, LAT0 + width / 2);
+		lon = rnd(LON0 - width / 2, LON0 + width / 2);
+		snprintf(desc, sizeof(desc), "fence-%d", i);
+		if (i % 5 == 0) {
+			double pts[16], r = rnd(100, 3000) / 111195.0;
+			int k, npts = 3 + random() % 6;
+
+			for (k = 0; k < npts; k++) {
+				double a = 2 * M_PI * k / npts;
+
+				pts[2 * k] = lat + r * sin(a) * rnd(0.5, 1);
+				pts[2 * k + 1] = lon + r * cos(a) * rnd(0.5, 1) / cos(lat * M_PI / 180);
+			}
+			geo_add_polygon(desc, i, pts, npts);
+		} else {
+			geo_add_circle(desc, i, lat, lon, rnd(50, 2000));
+		}
+	}
+	t0 = now_ns();
+	geo_index(cell);
+	t1 = now_ns();
+	printf("fences: %d over %g degrees square, cells of %g degrees\n", nfences, width, cell);
+	printf("index: built in %.1f ms, %.0f bytes per fence with the fences\n",
+		(t1 - t0) / 1e6, (double)(heap_inuse() - heap0) / nfences);
+
+	if ((pts = malloc(lookups * 2 * sizeof(double))) == NULL) {
+		perror("malloc");
+		exit(2);
+	}
+	for (i = 0; i < lookups; i++) {
+		pts[2 * i] = rnd(LAT0 - width / 2, LAT0 + width / 2);
+		pts[2 * i + 1] = rnd(LON0 - width / 2, LON0 + width / 2);
+	}
+	t0 = now_ns();
+	for (i = 0; i < lookups; i++) {
+		n = geo_inside(pts[2 * i], pts[2 * i + 1], ids, GEO_MAXINSIDE);
+		hits += n;
+	}
+	t1 = now_ns();
+	free(pts);
+	printf("lookup: %.0f ns per position, %.2f fences per position\n",
+		(t1 - t0) / lookups, (double)hits / lookups);
+
+	if ((cars = calloc(ndevs, sizeof(struct car))) == NULL) {
+		perror("calloc");
+		exit(2);
+	}
+	for (i = 0; i < ndevs; i++) {
+		snprintf(cars[i].imei, sizeof(cars[i].imei), "86%013d", i);
+		cars[i].lat = rnd(LAT0 - width / 2, LAT0 + width / 2);
+		cars[i].lon = rnd(LON0 - width / 2, LON0 + width / 2);
+		cars[i].heading = rnd(0, 2 * M_PI);
+	}
+
+	/* each device reports every ndevs/rate seconds, some 14 m/s */
+	positions = (long)rate * duration;
+	double step = 14.0 * ndevs / rate / 111195.0;
+
+	t0 = now_ns();
+	for (i = 0; i < positions; i++) {
+		struct car *c = &cars[i % ndevs];
+
+		c->heading += rnd(-0.3, 0.3);
+		c->lat += step * sin(c->heading);
+		c->lon += step * cos(c->heading) / cos(c->lat * M_PI / 180);
+		if (fabs(c->lat - LAT0) > width / 2 || fabs(c->lon - LON0) > width / 2)
+			c->heading += M_PI;
+		geo_update(ud, c->imei, &c->gs, c->lat, c->lon, 1514764800 + (long)i * ndevs / rate + 1);
+	}
+	t1 = now_ns();
+	printf("stream: %ld positions of %d devices, %lu transitions, %.0f ns per position\n",
+		positions, ndevs, events, (t1 - t0) / positions);
+	printf("at %d positions/s: %.2f%% of a CPU\n", rate, (t1 - t0) / positions * rate / 1e7);
+	return (0);
+}
@@ -0,0 +1,904 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * qsim: a synthetic fleet of Queclink trackers for load-testing qtripp.
+ *
+ * qsim opens one TCP connection per simulated device to qtripp's listener
+ * and sends @Track records built from the layouts in devices.yml at a
+ * given aggregate rate: GTFRI/GTERI (or whatever subtypes are requested)
+ * with a configurable number of position segments, +BUFF backlogs when a
+ * device connects, and GTHBD heartbeats for which it expects a +SACK.
+ *
+ * It also is the MQTT broker qtripp publishes to: a minimal stand-in
+ * which acknowledges everything and, for each publish, looks up when the
+ * record with that device's `count' was sent, so we get receive-to-publish
+ * latency without needing synchronized clocks.
+ *
+ * With -u the devices report over UDP instead, one socket and address
+ * per device, each record and heartbeat in a datagram of its own.
+ *
+ * With -F n,records, a third into the run the first n devices each dump
+ * that many +BUFF records at once, as vehicles regaining coverage do;
+ * latency is reported separately for backlog records, for live records of
+ * the flooding devices (which queue behind their own backlog) and for live
+ * records of all others, to show what the flood does to the latter.
+ *
+ * With -k the devices behave as with SACK enabled: a record for which no
+ * "+SACK:<count>$" arrives within the given seconds is sent again, up to
+ * SACKTRIES times, so the duplicates qtripp saves by acknowledging show.
+ * Subtypes which qtripp ignores (e.g. GTINF) may be given with -t too;
+ * they are never published, but must be acknowledged all the same.
+ *
+ * With -x the devices send binary frames (in hex.h's simplified framing)
+ * rather than ASCII, for the layouts which have a `hex' format in
+ * devices.yml.
+ */
+
+#define _GNU_SOURCE		/* memmem */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "hextypes.h"
+#include "ignores.h"
+#include "synth.h"
+
+#define IMEIBASE	860000000000000ULL
+#define RING		256		/* send times remembered per device */
+#define MAXBROKERCONN	16
+#define SACKTRIES	3
+#define FLOODCHUNK	500		/* backlog records queued per loop */
+
+struct buf {
+	char *data;
+	size_t len, size;
+};
+
+/* What it takes to send record `count' again */
+struct record {
+	unsigned count;
+	time_t tst;
+	double lat;
+	unsigned char layout, tries;
+	bool buff, acked;
+};
+
+/* Records awaiting their SACK, in the order they're due */
+struct pend {
+	int dev;
+	unsigned count;
+	double due;
+};
+
+/* When record `count' was sent, and whether it was backlog */
+struct sent {
+	double t;
+	unsigned count;
+	bool buff;
+};
+
+struct dev {
+	int fd;
+	bool connected;
+	char imei[16];
+	unsigned count;			/* next record number */
+	unsigned hbcount;
+	double hb_sent;			/* when the outstanding heartbeat went out */
+	struct sent sent[RING];		/* of record `count' % RING */
+	struct record *unacked;		/* RING of them, with -k */
+	struct buf out;
+	char in[512];
+	size_t inlen;
+};
+
+struct mqconn {
+	int fd;
+	struct buf in, out;
+};
+
+struct samples {
+	double *v;
+	size_t n, size;
+};
+
+static struct dev *devs;
+static int ndevs = 1000;
+static struct mqconn mq[MAXBROKERCONN];
+static int nmq = 0, mqlisten = -1;
+static bool mqseen = false;		/* qtripp has connected to us */
+
+static unsigned long st_records, st_backlog, st_heartbeats, st_sacks;
+static unsigned long st_publishes, st_matched, st_failed, st_dropped, st_unsent;
+static unsigned long st_acked, st_resent, st_unacked;
+static bool udp = false;
+static bool hex = false;		/* -x: binary frames */
+static double sackwait = 0;
+static struct pend *pends;
+static size_t npends, pendhead, pendsize;
+static struct _device *layouts[32];	/* NULL: a subtype qtripp ignores */
+static char *ignored[32];
+static char *protov = "380603";
+static int nlayouts = 0, segments = 1, anum = 1;
+static struct samples lat, buflat, floodlat, hblat;
+static int flooders = 0;
+static volatile sig_atomic_t stop = 0;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void onsig(int sig)
+{
+	stop = 1;
+}
+
+static void buf_append(struct buf *b, const void *data, size_t len)
+{
+	if (b->len + len > b->size) {
+		b->size = (b->len + len) * 2;
+		if ((b->data = realloc(b->data, b->size)) == NULL) {
+			perror("realloc");
+			exit(2);
+		}
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void buf_consume(struct buf *b, size_t len)
+{
+	memmove(b->data, b->data + len, b->len - len);
+	b->len -= len;
+}
+
+/* Write as much of `b' as the socket takes; -1 on error */
+static int buf_flush(int fd, struct buf *b)
+{
+	while (b->len > 0) {
+		ssize_t nw = send(fd, b->data, b->len, MSG_NOSIGNAL);
+
+		if (nw == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				return (0);
+			return (-1);
+		}
+		buf_consume(b, nw);
+	}
+	return (0);
+}
+
+static void sample(struct samples *s, double v)
+{
+	if (s->n == s->size) {
+		s->size = s->size ? s->size * 2 : 4096;
+		s->v = realloc(s->v, s->size * sizeof(double));
+	}
+	s->v[s->n++] = v;
+}
+
+static int dcmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return ((x > y) - (x < y));
+}
+
+static void report(char *what, struct samples *s)
+{
+	if (s->n == 0) {
+		printf("%s: no samples\n", what);
+		return;
+	}
+	qsort(s->v, s->n, sizeof(double), dcmp);
+	printf("%s: p50 %.3fms p99 %.3fms p999 %.3fms max %.3fms (n=%zu)\n", what,
+		s->v[s->n / 2] * 1e3,
+		s->v[(size_t)(s->n * 0.99)] * 1e3,
+		s->v[(size_t)(s->n * 0.999)] * 1e3,
+		s->v[s->n - 1] * 1e3, s->n);
+}
+
+static int nonblock(int fd)
+{
+	return (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK));
+}
+
+/*
+ * ---- MQTT stand-in ----------------------------------------------------
+ */
+
+static void mq_publish(unsigned char *p, size_t len, int qos)
+{
+	size_t tlen;
+	char topic[256], *slash, *c;
+	unsigned long long imei;
+	double t = now();
+
+	if (len < 2)
+		return;
+	tlen = (p[0] << 8) | p[1];
+	if (tlen + 2 > len)
+		return;
+	snprintf(topic, sizeof(topic), "%.*s", (int)tlen, p + 2);
+	p += 2 + tlen;
+	len -= 2 + tlen;
+	if (qos > 0) {
+		p += 2;
+		len -= 2;
+	}
+
+	st_publishes++;
+
+	slash = strrchr(topic, '/');
+	imei = strtoull(slash ? slash + 1 : topic, NULL, 10);
+	if (imei < IMEIBASE || imei >= IMEIBASE + ndevs)
+		return;
+
+	/* find "count":"XXXX" in the payload */
+	if ((c = memmem(p, len, "\"count\":\"", 9)) != NULL) {
+		struct dev *d = &devs[imei - IMEIBASE];
+		unsigned count = strtoul(c + 9, NULL, 16);
+		struct sent *s = &d->sent[count % RING];
+
+		if (s->t > 0 && s->count == count) {
+			sample(s->buff ? &buflat : d - devs < flooders ? &floodlat : &lat, t - s->t);
+			st_matched++;
+		}
+	}
+}
+
+/* Handle complete MQTT packets in c->in */
+static void mq_input(struct mqconn *c)
+{
+	unsigned char *p = (unsigned char *)c->in.data;
+
+	while (c->in.len >= 2) {
+		size_t rl = 0, hl = 1;
+		int mult = 1;
+		unsigned char type;
+
+		do {
+			if (hl >= c->in.len)
+				return;
+			rl += (p[hl] & 127) * mult;
+			mult *= 128;
+		} while (p[hl++] & 128);
+		if (hl + rl > c->in.len)
+			return;
+
+		type = p[0] >> 4;
+		switch (type) {
+			case 1:	{	/* CONNECT */
+				unsigned char ack[] = { 0x20, 0x02, 0x00, 0x00 };
+
+				buf_append(&c->out, ack, sizeof(ack));
+				mqseen = true;
+				break;
+				}
+			case 3: {	/* PUBLISH */
+				int qos = (p[0] >> 1) & 3;
+				unsigned char *v = p + hl;
+
+				mq_publish(v, rl, qos);
+				if (qos > 0) {
+					size_t tlen = (v[0] << 8) | v[1];
+					unsigned char ack[4] = { qos == 1 ? 0x40 : 0x50, 0x02, v[2 + tlen], v[3 + tlen] };
+
+					buf_append(&c->out, ack, sizeof(ack));
+				}
+				break;
+				}
+			case 6: {	/* PUBREL */
+				unsigned char ack[4] = { 0x70, 0x02, p[hl], p[hl + 1] };
+
+				buf_append(&c->out, ack, sizeof(ack));
+				break;
+				}
+			case 8: {	/* SUBSCRIBE: grant QoS 0 to every filter */
+				unsigned char *v = p + hl, *end = p + hl + rl, hdr[5];
+				struct buf acks = { NULL, 0, 0 };
+				size_t n;
+
+				for (v += 2; v + 2 <= end; ) {
+					unsigned char q = 0;
+
+					v += 2 + ((v[0] << 8) | v[1]) + 1;
+					buf_append(&acks, &q, 1);
+				}
+				n = acks.len + 2;
+				hdr[0] = 0x90;
+				hdr[1] = n;
+				hdr[2] = p[hl];
+				hdr[3] = p[hl + 1];
+				buf_append(&c->out, hdr, 4);
+				buf_append(&c->out, acks.data, acks.len);
+				free(acks.data);
+				break;
+				}
+			case 12: {	/* PINGREQ */
+				unsigned char ack[] = { 0xD0, 0x00 };
+
+				buf_append(&c->out, ack, sizeof(ack));
+				break;
+				}
+			default:
+				break;
+		}
+		buf_consume(&c->in, hl + rl);
+	}
+}
+
+static void mq_close(int i)
+{
+	close(mq[i].fd);
+	free(mq[i].in.data);
+	free(mq[i].out.data);
+	mq[i] = mq[--nmq];
+}
+
+/*
+ * ---- devices ----------------------------------------------------------
+ */
+
+/* Queue a record for the TCP connection, or send it as a datagram */
+static void dev_write(struct dev *d, const char *line, size_t len)
+{
+	if (!udp) {
+		buf_append(&d->out, line, len);
+	} else if (send(d->fd, line, len, 0) != (ssize_t)len) {
+		st_unsent++;
+	}
+}
+
+static void pend_push(int dev, unsigned count, double due)
+{
+	if (npends == pendsize) {
+		struct pend *np = malloc((pendsize ? pendsize * 2 : 4096) * sizeof(struct pend));
+		size_t i;
+
+		if (np == NULL) {
+			perror("malloc");
+			exit(2);
+		}
+		for (i = 0; i < npends; i++)
+			np[i] = pends[(pendhead + i) % pendsize];
+		free(pends);
+		pends = np;
+		pendhead = 0;
+		pendsize = pendsize ? pendsize * 2 : 4096;
+	}
+	pends[(pendhead + npends++) % pendsize] = (struct pend){ dev, count, due };
+}
+
+static bool send_record(struct dev *d, struct record *r, double t)
+{
+	struct synth sy;
+	char line[8192];
+	int len;
+
+	if (layouts[r->layout] == NULL) {
+		len = synth_other(r->buff ? "BUFF" : "RESP", ignored[r->layout], protov, d->imei,
+			r->count, r->tst, line, sizeof(line));
+		d->sent[r->count % RING] = (struct sent){ t, r->count, r->buff };
+		dev_write(d, line, len);
+		return (true);
+	}
+
+	memset(&sy, 0, sizeof(sy));
+	sy.dp = layouts[r->layout];
+	sy.abr = r->buff ? "BUFF" : "RESP";
+	sy.imei = d->imei;
+	sy.segments = segments;
+	sy.anum = anum;
+	sy.count = r->count;
+	sy.tst = r->tst;
+	sy.lat = r->lat;
+	sy.lon = 13.4;
+	len = hex ? synth_hex(&sy, line, sizeof(line)) : synth_line(&sy, line, sizeof(line));
+	if (len <= 0)
+		return (false);
+	d->sent[r->count % RING] = (struct sent){ t, r->count, r->buff };
+	dev_write(d, line, len);
+	return (true);
+}
+
+/* Send the device's next record; with -k it waits for its SACK */
+static bool new_record(struct dev *d, int layout, bool buff, time_t tst, double lat, double t)
+{
+	struct record r = { d->count, tst, lat, layout, 0, buff, false };
+
+	if (!send_record(d, &r, t))
+		return (false);
+	if (d->unacked != NULL) {
+		d->unacked[r.count % RING] = r;
+		pend_push(d - devs, r.count, t + sackwait);
+	}
+	d->count = (d->count + 1) & 0xFFFF;
+	return (true);
+}
+
+/* Resend the records whose SACK is overdue */
+static void resend(double t)
+{
+	while (npends > 0 && pends[pendhead].due <= t) {
+		struct pend *p = &pends[pendhead];
+		struct dev *d = &devs[p->dev];
+		struct record *r = &d->unacked[p->count % RING];
+
+		pendhead = (pendhead + 1) % pendsize;
+		npends--;
+		if (r->count != p->count || r->acked || !d->connected)
+			continue;
+		if (r->tries == SACKTRIES) {
+			st_unacked++;
+			continue;
+		}
+		if (send_record(d, r, t)) {
+			r->tries++;
+			st_resent++;
+			pend_push(d - devs, r->count, t + sackwait);
+		}
+	}
+}
+
+static void dev_input(struct dev *d, double t)
+{
+	char *p = d->in, *end = d->in + d->inlen, *dollar;
+
+	while ((dollar = memchr(p, '$', end - p)) != NULL) {
+		char *sack = memmem(p, dollar - p, "+SACK:", 6);
+
+		if (sack && strncmp(sack + 6, "GTHBD,,", 7) == 0) {
+			if (d->hb_sent > 0 &&
+			    strtoul(sack + 13, NULL, 16) == ((d->hbcount - 1) & 0xFFFF)) {
+				sample(&hblat, t - d->hb_sent);
+				d->hb_sent = 0;
+				st_sacks++;
+			}
+		} else if (sack && d->unacked != NULL) {
+			unsigned count = strtoul(sack + 6, NULL, 16);
+			struct record *r = &d->unacked[count % RING];
+
+			if (r->count == count && !r->acked) {
+				r->acked = true;
+				st_acked++;
+			}
+		}
+		p = dollar + 1;
+	}
+	d->inlen = end - p;
+	memmove(d->in, p, d->inlen);
+	if (d->inlen == sizeof(d->in)) {
+		d->inlen = 0;	/* garbage */
+	}
+}
+
+static void dev_close(struct dev *d)
+{
+	if (d->fd != -1)
+		close(d->fd);
+	d->fd = -1;
+	if (d->connected)
+		st_dropped++;
+	d->connected = false;
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s [-h host] [-p port] [-c devices] [-r records/s] [-d seconds]\n"
+		"\t[-m protov] [-t subtype,...] [-s segments] [-a anum] [-b backlog]\n"
+		"\t[-H heartbeat-interval] [-M mqtt-port] [-w wait] [-u] [-k sack-wait]\n"
+		"\t[-F devices,records] [-x]\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	char *host = "127.0.0.1", *subtypes = "GTFRI,GTERI";
+	int port = 1492, mqport = 1883, duration = 30;
+	int backlog = 0, hbint = 60, wait = 30, ch, i;
+	int floodrecs = 0;
+	long flooded = 0;
+	double rate = 1000.0, t0, tend, tconn, hbdue;
+	struct sockaddr_in sin;
+	struct pollfd *pfd;
+	struct rlimit rl;
+	unsigned long next = 0, rr = 0, hbrr = 0;
+	char line[8192], *s, *tok;
+
+	while ((ch = getopt(argc, argv, "h:p:c:r:d:m:t:s:a:b:H:M:w:uk:F:x")) != EOF) {
+		switch (ch) {
+			case 'h': host = optarg; break;
+			case 'p': port = atoi(optarg); break;
+			case 'c': ndevs = atoi(optarg); break;
+			case 'r': rate = atof(optarg); break;
+			case 'd': duration = atoi(optarg); break;
+			case 'm': protov = optarg; break;
+			case 't': subtypes = optarg; break;
+			case 's': segments = atoi(optarg); break;
+			case 'a': anum = atoi(optarg); break;
+			case 'b': backlog = atoi(optarg); break;
+			case 'H': hbint = atoi(optarg); break;
+			case 'M': mqport = atoi(optarg); break;
+			case 'w': wait = atoi(optarg); break;
+			case 'u': udp = true; break;
+			case 'x': hex = true; break;
+			case 'k': sackwait = atof(optarg); break;
+			case 'F':
+				if (sscanf(optarg, "%d,%d", &flooders, &floodrecs) != 2)
+					usage(*argv);
+				break;
+			default: usage(*argv);
+		}
+	}
+
+	load_devices();
+	load_hextypes();
+	load_ignores();
+	for (s = strdup(subtypes); (tok = strsep(&s, ",")) != NULL && nlayouts < 32; ) {
+		struct _device *dp = lookup_devices(tok, protov);
+
+		if (dp == NULL && !hex && lookup_ignores(tok) != NULL) {
+			ignored[nlayouts++] = tok;
+			continue;
+		}
+		if (dp == NULL) {
+			fprintf(stderr, "No layout for %s-%s in devices.yml\n", tok, protov);
+			exit(2);
+		}
+		if (hex && (dp->hexfields == NULL || lookup_hextypes_subtype(tok) == NULL)) {
+			fprintf(stderr, "No binary format for %s-%s in devices.yml\n", tok, protov);
+			exit(2);
+		}
+		layouts[nlayouts++] = dp;
+	}
+
+	signal(SIGINT, onsig);
+	signal(SIGPIPE, SIG_IGN);
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	devs = calloc(ndevs, sizeof(struct dev));
+	pfd = calloc(ndevs + MAXBROKERCONN + 1, sizeof(struct pollfd));
+
+	/* The broker first, and wait for qtripp to connect to it */
+	if (mqport > 0) {
+		int on = 1;
+
+		mqlisten = socket(AF_INET, SOCK_STREAM, 0);
+		setsockopt(mqlisten, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(mqport);
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (bind(mqlisten, (struct sockaddr *)&sin, sizeof(sin)) == -1 || listen(mqlisten, 16) == -1) {
+			perror("MQTT stand-in");
+			exit(1);
+		}
+		nonblock(mqlisten);
+		printf("MQTT stand-in on port %d, waiting for qtripp\n", mqport);
+		fflush(stdout);
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	if (inet_pton(AF_INET, host, &sin.sin_addr) != 1) {
+		fprintf(stderr, "%s: not an IPv4 address\n", host);
+		exit(2);
+	}
+
+	tconn = now();
+	tend = tconn + wait;
+	for (i = 0; i < ndevs; i++) {
+		devs[i].fd = -1;
+		snprintf(devs[i].imei, sizeof(devs[i].imei), "%015llu", IMEIBASE + i);
+		if (sackwait > 0 && (devs[i].unacked = calloc(RING, sizeof(struct record))) == NULL) {
+			perror("calloc");
+			exit(2);
+		}
+	}
+
+	/*
+	 * One poll loop does everything: broker I/O, connecting devices,
+	 * pacing records and heartbeats, and reading SACKs.
+	 */
+
+	t0 = 0;
+	hbdue = 0;
+	while (!stop) {
+		double t = now();
+		int n, np = 0, timeout = 1;
+
+		if (mqlisten != -1 && !mqseen && t > tend) {
+			fprintf(stderr, "qtripp didn't connect to the MQTT stand-in within %ds\n", wait);
+			exit(1);
+		}
+
+		/* once the broker has a client (or there is none), start the fleet */
+		if (t0 == 0 && (mqlisten == -1 || mqseen)) {
+			for (i = 0; i < ndevs; i++) {
+				struct dev *d = &devs[i];
+				int on = 1;
+
+				if ((d->fd = socket(AF_INET, udp ? SOCK_DGRAM : SOCK_STREAM, 0)) == -1) {
+					st_failed++;
+					continue;
+				}
+				nonblock(d->fd);
+				if (!udp)
+					setsockopt(d->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+				if (connect(d->fd, (struct sockaddr *)&sin, sizeof(sin)) == -1 && errno != EINPROGRESS) {
+					close(d->fd);
+					d->fd = -1;
+					st_failed++;
+				}
+			}
+			tconn = now();
+			t0 = tconn;
+			tend = t0 + duration;
+		}
+
+		if (t0 > 0 && t >= tend)
+			break;
+
+		/* records, round-robin over connected devices, at `rate' */
+		if (t0 > 0) {
+			double due = (t - t0) * rate;
+			int tries = 0;
+
+			while (next < due && tries < ndevs) {
+				struct dev *d = &devs[rr++ % ndevs];
+
+				if (!d->connected) {
+					tries++;
+					continue;
+				}
+				if (new_record(d, next % nlayouts, false, time(0), 52.5 + (d - devs) * 1e-5, t))
+					st_records++;
+				next++;
+				tries = 0;
+			}
+
+			if (sackwait > 0)
+				resend(t);
+
+			/* vehicles back in coverage, dumping their buffers */
+			if (flooders > 0 && t - t0 >= duration / 3.0) {
+				int n;
+
+				/* a chunk at a time, lest we stall our own clock */
+				for (n = 0; n < FLOODCHUNK && flooded < (long)flooders * floodrecs; n++, flooded++) {
+					struct dev *d = &devs[flooded % flooders];
+
+					ch = flooded / flooders;
+					if (d - devs < ndevs && d->connected &&
+					    new_record(d, ch % nlayouts, true, time(0) - (floodrecs - ch) * 30, 52.5, t))
+						st_backlog++;
+				}
+			}
+
+			/* heartbeats, spread evenly over the interval */
+			if (hbint > 0) {
+				double hbwant = (t - t0) * ndevs / hbint;
+
+				while (hbdue < hbwant) {
+					struct dev *d = &devs[hbrr++ % ndevs];
+					int len;
+
+					hbdue++;
+					if (!d->connected)
+						continue;
+					if (hex)
+						len = synth_hex_heartbeat(protov, d->imei, d->hbcount++, time(0), line, sizeof(line));
+					else
+						len = synth_heartbeat(protov, d->imei, d->hbcount++, time(0), line, sizeof(line));
+					dev_write(d, line, len);
+					d->hb_sent = t;
+					st_heartbeats++;
+				}
+			}
+		}
+
+		/* build the poll set */
+		if (mqlisten != -1) {
+			pfd[np].fd = mqlisten;
+			pfd[np++].events = POLLIN;
+			for (i = 0; i < nmq; i++) {
+				pfd[np].fd = mq[i].fd;
+				pfd[np++].events = POLLIN | (mq[i].out.len ? POLLOUT : 0);
+			}
+		}
+		for (i = 0; i < ndevs; i++) {
+			struct dev *d = &devs[i];
+
+			pfd[np].fd = d->fd;
+			pfd[np++].events = POLLIN | ((!d->connected || d->out.len) ? POLLOUT : 0);
+		}
+
+		if ((n = poll(pfd, np, timeout)) <= 0)
+			continue;
+		t = now();
+
+		np = 0;
+		if (mqlisten != -1) {
+			int nbefore = nmq;
+
+			if (pfd[np++].revents & POLLIN) {
+				int fd;
+
+				while (nmq < MAXBROKERCONN && (fd = accept(mqlisten, NULL, NULL)) != -1) {
+					nonblock(fd);
+					memset(&mq[nmq], 0, sizeof(struct mqconn));
+					mq[nmq++].fd = fd;
+				}
+			}
+			for (i = nbefore - 1; i >= 0; i--) {
+				struct pollfd *p = &pfd[np + i];
+				struct mqconn *c = &mq[i];
+
+				if (p->revents & POLLIN) {
+					char rbuf[65536];
+					ssize_t nr = recv(c->fd, rbuf, sizeof(rbuf), 0);
+
+					if (nr <= 0 && !(nr == -1 && errno == EAGAIN)) {
+						mq_close(i);
+						continue;
+					}
+					if (nr > 0) {
+						buf_append(&c->in, rbuf, nr);
+						mq_input(c);
+					}
+				}
+				if (c->out.len && buf_flush(c->fd, &c->out) == -1)
+					mq_close(i);
+			}
+			np += nbefore;
+		}
+
+		for (i = 0; i < ndevs; i++, np++) {
+			struct dev *d = &devs[i];
+			short re = pfd[np].revents;
+
+			if (d->fd == -1 || re == 0)
+				continue;
+
+			if (!d->connected) {
+				int err = 0;
+				socklen_t el = sizeof(err);
+
+				if (!(re & (POLLOUT | POLLERR | POLLHUP)))
+					continue;
+				getsockopt(d->fd, SOL_SOCKET, SO_ERROR, &err, &el);
+				if (err) {
+					close(d->fd);
+					d->fd = -1;
+					st_failed++;
+					continue;
+				}
+				d->connected = true;
+
+				/* a device which has been out of reach sends its buffer first */
+				for (ch = 0; ch < backlog; ch++) {
+					if (new_record(d, ch % nlayouts, true, time(0) - (backlog - ch) * 30, 52.5, t))
+						st_backlog++;
+				}
+			}
+
+			if (re & POLLIN) {
+				ssize_t nr = recv(d->fd, d->in + d->inlen, sizeof(d->in) - d->inlen, 0);
+
+				if ((nr == 0 && !udp) || (nr == -1 && errno != EAGAIN)) {
+					dev_close(d);
+					continue;
+				}
+				if (nr > 0) {
+					d->inlen += nr;
+					dev_input(d, t);
+				}
+			}
+			if (d->out.len && buf_flush(d->fd, &d->out) == -1)
+				dev_close(d);
+		}
+	}
+
+	/* give qtripp a moment to publish what it has */
+	{
+		double quiet = now() + 1, limit = now() + 10;
+		unsigned long last = st_publishes;
+
+		while (mqlisten != -1 && now() < quiet && now() < limit) {
+			struct pollfd p[MAXBROKERCONN];
+
+			for (i = 0; i < nmq; i++) {
+				p[i].fd = mq[i].fd;
+				p[i].events = POLLIN;
+			}
+			poll(p, nmq, 100);
+			for (i = nmq - 1; i >= 0; i--) {
+				char rbuf[65536];
+				ssize_t nr;
+
+				if (!(p[i].revents & POLLIN))
+					continue;
+				if ((nr = recv(mq[i].fd, rbuf, sizeof(rbuf), 0)) > 0) {
+					buf_append(&mq[i].in, rbuf, nr);
+					mq_input(&mq[i]);
+					buf_flush(mq[i].fd, &mq[i].out);
+				}
+			}
+			if (st_publishes != last) {
+				last = st_publishes;
+				quiet = now() + 1;
+			}
+		}
+	}
+
+	{
+		int connected = 0;
+		double secs = (t0 > 0) ? now() - t0 : 0;
+
+		for (i = 0; i < ndevs; i++) {
+			if (devs[i].connected)
+				connected++;
+		}
+
+		printf("devices: %d of %d connected, %lu failed, %lu dropped\n",
+			connected, ndevs, st_failed, st_dropped);
+		printf("sent: %lu records + %lu backlog, %lu heartbeats in %.1fs: %.0f records/s\n",
+			st_records, st_backlog, st_heartbeats, secs,
+			secs > 0 ? (st_records + st_backlog) / secs : 0);
+		if (mqlisten != -1) {
+			printf("published: %lu (%lu matched to a record): %.0f/s\n",
+				st_publishes, st_matched, secs > 0 ? st_publishes / secs : 0);
+			report("receive-to-publish", &lat);
+			if (buflat.n > 0)
+				report("backlog receive-to-publish", &buflat);
+			if (floodlat.n > 0)
+				report("flooding devices' live receive-to-publish", &floodlat);
+		}
+		if (st_unsent > 0)
+			printf("datagrams: %lu not sent\n", st_unsent);
+		if (sackwait > 0) {
+			printf("SACK: %lu of %lu records acknowledged, %lu resent, %lu given up\n",
+				st_acked, st_records + st_backlog, st_resent, st_unacked);
+		}
+		printf("heartbeats: %lu of %lu acknowledged\n", st_sacks, st_heartbeats);
+		report("heartbeat-to-SACK", &hblat);
+	}
+
+	return (0);
+}
@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# Run qtripp against a qsim fleet on scratch ports: qsim is the listener
+# for qtripp's MQTT connection, so no broker is needed. Arguments are
+# passed to qsim. qtripp reads qtripp.ini from its working directory, so
+# it is started in a temporary directory with one pointing at qsim.
+
+PORT=${PORT:-15492}
+MQTTPORT=${MQTTPORT:-11883}
+here=$(cd $(dirname $0) && pwd)
+dir=$(mktemp -d /tmp/qbench.XXXXXX) || exit 1
+
+cat > $dir/qtripp.ini <<EOINI
+[defaults]
+logfile = $dir/qtripp.log
+listen_port = $PORT
+[devices]
+*		= owntracks/qtripp/
+[mqtt]
+host = 127.0.0.1
+port = $MQTTPORT
+client_id = qbench
+EOINI
+
+# With -k qsim's devices expect a +SACK for each record
+case " $* " in
+	*" -k"*) printf '[sack]\nreports = RESP,BUFF\n' >> $dir/qtripp.ini ;;
+esac
+
+$here/qsim -p $PORT -M $MQTTPORT "$@" &
+qsim=$!
+sleep 1
+
+(cd $dir && exec $here/../qtripp) > $dir/qtripp.out 2>&1 &
+qtripp=$!
+
+wait $qsim
+rc=$?
+kill $qtripp 2>/dev/null
+wait $qtripp 2>/dev/null
+
+echo "qtripp log and output are in $dir"
+exit $rc
@@ -0,0 +1,197 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * snapbench: snapshots of -v devices (a million by default), every one
+ * with a last position and one in -N of them with a name. Reported are
+ * how long the ingest loop is held up by snap_save() (the fork), how long
+ * the child takes to write the file, its size, and how long snap_load()
+ * takes to restore it in a fresh process, as at startup. The file goes
+ * to -f (a temporary one, removed after) and is read from the page cache.
+ *
+ *	snapbench -v 1000000
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "conf.h"
+#include "util.h"
+#include "udata.h"
+#include "tline.h"
+#include "snap.h"
+
+#define LAT0		52.5
+#define LON0		13.4
+#define T0		1514764800	/* 2018-01-01 */
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+static double rnd(double lo, double hi)
+{
+	return (lo + (hi - lo) * (random() / (double)RAND_MAX));
+}
+
+static long maxrss_kb(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_maxrss);
+}
+
+static bool check(struct snap_dev *sd, const char *name, void *arg)
+{
+	long *counts = (long *)arg;
+
+	counts[0]++;
+	if (sd->validpos)
+		counts[1]++;
+	if (name != NULL && strcmp(name, ".") != 0)
+		counts[2]++;
+	return (true);
+}
+
+/* -r: restore the snapshot at `path', as qtripp would at startup */
+static int restore(struct udata *ud, const char *path)
+{
+	long counts[3] = { 0, 0, 0 };
+	double t0, t1;
+
+	t0 = now_ns();
+	if (snap_load(ud, path) == false)
+		return (1);
+	t1 = now_ns() - t0;
+	imei_snapshot(check, counts);
+	printf("restore: %ld devices, %ld with a position, %ld named, in %.1f ms (%.0f ns per device)\n",
+		counts[0], counts[1], counts[2], t1 / 1e6, t1 / counts[0]);
+	printf("memory: %.1f MB after restore\n", maxrss_kb() / 1024.0);
+	return (0);
+}
+
+int main(int argc, char **argv)
+{
+	int ndevs = 1000000, named = 100, ch, i;
+	char tmpl[] = "/tmp/snapbench.XXXXXX", *path = NULL, *from = NULL, buf[BUFSIZ];
+	char *strings, *sp;
+	double t0, tfork, tchild;
+	struct udata udata, *ud = &udata;
+	struct snap_dev *devs, *sd;
+	static config cf;
+	struct stat st;
+	bool keep = false;
+	int fd;
+
+	while ((ch = getopt(argc, argv, "v:N:f:r:")) != EOF) {
+		switch (ch) {
+			case 'v': ndevs = atoi(optarg); break;
+			case 'N': named = atoi(optarg); break;
+			case 'f': path = optarg; keep = true; break;
+			case 'r': from = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-v devices] [-N one-in-named] [-f file]\n", *argv);
+				exit(2);
+		}
+	}
+
+	memset(&udata, 0, sizeof(udata));
+	ud->cf = &cf;
+	ud->logfp = stderr;
+	cf.namesdir = "/nonexistent";
+	if (from != NULL)
+		return (restore(ud, from));
+
+	if (ndevs < 1 || named < 1)
+		exit(2);
+	if (path == NULL) {
+		if ((fd = mkstemp(tmpl)) == -1) {
+			perror("mkstemp");
+			exit(2);
+		}
+		close(fd);
+		path = tmpl;
+	}
+	cf.snap_file = path;
+
+	/* what qtripp would know after hearing from them all */
+	devs = (struct snap_dev *)calloc(ndevs, sizeof(struct snap_dev));
+	strings = sp = (char *)malloc((ndevs / named + 1) * 16);
+	for (i = 0; i < ndevs; i++) {
+		sd = &devs[i];
+		snprintf(sd->imei, sizeof(sd->imei), "86%013d", i);
+		sd->seq = i + 1;
+		sd->reports = random() % 10000;
+		sd->last_seen = T0 + random() % 86400;
+		sd->tst = sd->last_seen - random() % 60;
+		sd->lat = LAT0 + rnd(-1, 1);
+		sd->lon = LON0 + rnd(-1, 1);
+		sd->vel = rnd(0, 120);
+		sd->cog = random() % 360;
+		sd->validpos = 1;
+		if (i % named == 0) {
+			sd->name = sp - strings;
+			sp += sprintf(sp, "car %d", i) + 1;
+		} else {
+			sd->name = SNAP_NONAME;
+		}
+	}
+	imei_restore(devs, ndevs, strings, sp - strings);
+	free(devs);
+	free(strings);
+	printf("devices: %d, %d named\n", ndevs, (ndevs + named - 1) / named);
+	printf("memory: %.1f MB\n", maxrss_kb() / 1024.0);
+
+	/* in the child, as qtripp does it, and waited for */
+	t0 = now_ns();
+	snap_save(ud, true);
+	tchild = now_ns() - t0;
+
+	/* fork() alone, which is what the ingest loop waits for */
+	t0 = now_ns();
+	snap_save(ud, false);
+	tfork = now_ns() - t0;
+	snap_save(ud, true);
+
+	if (stat(path, &st) == -1) {
+		perror(path);
+		exit(1);
+	}
+	printf("save: loop held up %.2f ms by fork, file written in %.1f ms by the child\n",
+		tfork / 1e6, tchild / 1e6);
+	printf("size: %.1f MB, %.1f bytes per device\n", st.st_size / 1048576.0, (double)st.st_size / ndevs);
+	fflush(stdout);
+
+	snprintf(buf, sizeof(buf), "%s -r %s", argv[0], path);
+	if (system(buf) != 0)
+		exit(1);
+
+	if (!keep)
+		unlink(path);
+	return (0);
+}
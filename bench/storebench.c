@@ -0,0 +1,297 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * storebench: the track store against datadir's text files. -v devices
+ * each report -n fixes (a day's worth, every 30 seconds, by default),
+ * driving about and now and then parked, interleaved as they would
+ * arrive. They are written
+ *
+ *	store	with store_add(), in blocks of -b fixes
+ *	text	as datadir does, a GTFRI line appended to data-<imei> per fix
+ *
+ * and then read back: every fix of every device, and one hour of each
+ * device's (the store with trk_scan(), the text by splitting its lines
+ * and parsing their time). Reported are the write and scan rates, the
+ * time per one-hour query, and the bytes per fix. Reads are from the
+ * page cache. Files go to -d (a temporary directory, removed after).
+ * Fixes of IMEIs which aren't all digits are checked to be turned away.
+ *
+ *	storebench -v 200 -n 2880
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <math.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "conf.h"
+#include "util.h"
+#include "udata.h"
+#include "track.h"
+#include "store.h"
+
+#define LAT0		52.5
+#define LON0		13.4
+#define T0		1514764800	/* 2018-01-01 */
+#define INTERVAL	30
+
+static const char *hostile[] = { "../escaped", "1/../../escaped", "", "8600000000000000001", NULL };
+
+struct car {
+	char imei[16];
+	double lat, lon, heading, vel;
+	int parked;			/* reports to go until it drives on */
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+static double rnd(double lo, double hi)
+{
+	return (lo + (hi - lo) * (random() / (double)RAND_MAX));
+}
+
+static bool count(struct trk_fix *f, void *arg)
+{
+	(*(long *)arg)++;
+	return (true);
+}
+
+/* The GTFRI line datadir would have for the fix */
+static int line(char *buf, size_t size, struct car *c, time_t tst)
+{
+	struct tm tm;
+	char utc[16];
+
+	gmtime_r(&tst, &tm);
+	strftime(utc, sizeof(utc), "%Y%m%d%H%M%S", &tm);
+	return (snprintf(buf, size, "+RESP:GTFRI,2C0600,%s,car,0,0,1,1,%.1f,%d,42.0,%.6f,%.6f,%s,"
+		"0262,0003,1234,5678,100.0,90,%s,0000$\n",
+		c->imei, c->vel, (int)(c->heading * 180 / M_PI) % 360, c->lon, c->lat, utc, utc));
+}
+
+/* The fixes from `from' to `to' in the text file at `path' */
+static long text_scan(const char *path, time_t from, time_t to)
+{
+	char buf[512], *p, *f;
+	time_t tst;
+	long n = 0;
+	int field;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return (0);
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		/* the fix's time is the 14th field */
+		for (p = buf, field = 0; field < 14 && (f = strsep(&p, ",")) != NULL; field++)
+			;
+		if (field == 14 && str_time_to_secs(f, &tst) == 1 && tst >= from && tst <= to)
+			n++;
+	}
+	fclose(fp);
+	return (n);
+}
+
+static size_t du(const char *path)
+{
+	char sub[BUFSIZ];
+	struct dirent *de;
+	struct stat st;
+	size_t total = 0;
+	DIR *dp;
+
+	if ((dp = opendir(path)) == NULL)
+		return (0);
+	while ((de = readdir(dp)) != NULL) {
+		if (*de->d_name == '.')
+			continue;
+		snprintf(sub, sizeof(sub), "%s/%s", path, de->d_name);
+		if (stat(sub, &st) == 0)
+			total += S_ISDIR(st.st_mode) ? du(sub) : (size_t)st.st_size;
+	}
+	closedir(dp);
+	return (total);
+}
+
+int main(int argc, char **argv)
+{
+	int ndevs = 200, nfixes = 2880, block = 256, ch, i, j, len;
+	char tmpl[] = "/tmp/storebench.XXXXXX", *dir = NULL, path[BUFSIZ], buf[512];
+	double t0, t1, tstore, ttext;
+	long total, n, nstore, ntext;
+	size_t textbytes = 0, storebytes;
+	struct udata udata, *ud = &udata;
+	static config cf;
+	struct car *cars;
+	bool keep = false;
+	int fd;
+
+	while ((ch = getopt(argc, argv, "v:n:b:d:")) != EOF) {
+		switch (ch) {
+			case 'v': ndevs = atoi(optarg); break;
+			case 'n': nfixes = atoi(optarg); break;
+			case 'b': block = atoi(optarg); break;
+			case 'd': dir = optarg; keep = true; break;
+			default:
+				fprintf(stderr, "usage: %s [-v devices] [-n fixes] [-b block] [-d dir]\n", *argv);
+				exit(2);
+		}
+	}
+	if (ndevs < 1 || nfixes < 1)
+		exit(2);
+	if (dir == NULL && (dir = mkdtemp(tmpl)) == NULL) {
+		perror("mkdtemp");
+		exit(2);
+	}
+
+	memset(&udata, 0, sizeof(udata));
+	ud->cf = &cf;
+	snprintf(path, sizeof(path), "%s/store", dir);
+	cf.store_dir = strdup(path);
+	cf.store_flush = 3600;
+	cf.store_block = block;
+	if (!store_init(ud))
+		exit(2);
+	snprintf(path, sizeof(path), "%s/text", dir);
+	mkdir(path, 0755);
+
+	if ((cars = calloc(ndevs, sizeof(struct car))) == NULL) {
+		perror("calloc");
+		exit(2);
+	}
+	srandom(42);
+	for (i = 0; i < ndevs; i++) {
+		snprintf(cars[i].imei, sizeof(cars[i].imei), "86%013d", i);
+		cars[i].lat = rnd(LAT0 - 0.5, LAT0 + 0.5);
+		cars[i].lon = rnd(LON0 - 0.5, LON0 + 0.5);
+		cars[i].heading = rnd(0, 2 * M_PI);
+	}
+
+	total = (long)ndevs * nfixes;
+	tstore = ttext = 0;
+	for (j = 0; j < nfixes; j++) {
+		for (i = 0; i < ndevs; i++) {
+			struct car *c = &cars[i];
+			time_t tst = T0 + (time_t)j * INTERVAL + i % INTERVAL;
+
+			if (c->parked > 0) {
+				c->parked--;
+				c->vel = 0;
+			} else {
+				c->vel = fmax(0, fmin(130, c->vel + rnd(-10, 10)));
+				c->heading = fmod(c->heading + rnd(-0.3, 0.3) + 2 * M_PI, 2 * M_PI);
+				c->lat += c->vel / 3.6 * INTERVAL * sin(c->heading) / 111195.0;
+				c->lon += c->vel / 3.6 * INTERVAL * cos(c->heading) / 111195.0 / cos(c->lat * M_PI / 180);
+				if (random() % 100 == 0)
+					c->parked = random() % 240;
+			}
+
+			t0 = now_ns();
+			store_add(ud, c->imei, c->lat, c->lon, c->vel, (long)(c->heading * 180 / M_PI) % 360, tst);
+			t1 = now_ns();
+			tstore += t1 - t0;
+
+			len = line(buf, sizeof(buf), c, tst);
+			textbytes += len;
+			t0 = now_ns();
+			snprintf(path, sizeof(path), "%s/text/data-%s", dir, c->imei);
+			if ((fd = open(path, O_CREAT|O_WRONLY|O_APPEND, 0644)) != -1) {
+				write(fd, buf, len);
+				close(fd);
+			}
+			ttext += now_ns() - t0;
+		}
+	}
+	/* IMEIs as a hostile client might send them mustn't make paths */
+	for (i = 0; hostile[i] != NULL; i++)
+		store_add(ud, hostile[i], LAT0, LON0, 0, 0, T0);
+	t0 = now_ns();
+	store_flush(ud);
+	tstore += now_ns() - t0;
+	snprintf(path, sizeof(path), "%s/escaped", dir);
+	if (access(path, F_OK) == 0 || trk_scan(cf.store_dir, hostile[0], 0, T0 + 86400, count, &n) != -1) {
+		fprintf(stderr, "store: a hostile IMEI made it into a path\n");
+		exit(1);
+	}
+
+	snprintf(path, sizeof(path), "%s/store", dir);
+	storebytes = du(path);
+	printf("fixes: %ld of %d devices\n", total, ndevs);
+	printf("write: store %.0f fixes/s, text %.0f fixes/s\n", total / (tstore / 1e9), total / (ttext / 1e9));
+	printf("size: store %.1f bytes per fix, text %.1f bytes per fix (%.1fx)\n",
+		(double)storebytes / total, (double)textbytes / total, (double)textbytes / storebytes);
+
+	/* all of it */
+	nstore = ntext = 0;
+	t0 = now_ns();
+	for (i = 0; i < ndevs; i++)
+		trk_scan(cf.store_dir, cars[i].imei, 0, T0 + 365 * 86400, count, &nstore);
+	tstore = now_ns() - t0;
+	t0 = now_ns();
+	for (i = 0; i < ndevs; i++) {
+		snprintf(path, sizeof(path), "%s/text/data-%s", dir, cars[i].imei);
+		ntext += text_scan(path, 0, T0 + 365 * 86400);
+	}
+	ttext = now_ns() - t0;
+	printf("scan: store %.0f fixes/s, text %.0f fixes/s\n", nstore / (tstore / 1e9), ntext / (ttext / 1e9));
+	if (nstore != total || ntext != total) {
+		fprintf(stderr, "scan: %ld fixes from the store, %ld from text, of %ld\n", nstore, ntext, total);
+		exit(1);
+	}
+
+	/* an hour of each */
+	nstore = ntext = 0;
+	tstore = ttext = 0;
+	for (i = 0; i < ndevs; i++) {
+		time_t from = T0 + random() % ((long)nfixes * INTERVAL), to = from + 3600 - 1;
+
+		n = 0;
+		t0 = now_ns();
+		trk_scan(cf.store_dir, cars[i].imei, from, to, count, &n);
+		tstore += now_ns() - t0;
+		nstore += n;
+
+		snprintf(path, sizeof(path), "%s/text/data-%s", dir, cars[i].imei);
+		t0 = now_ns();
+		ntext += text_scan(path, from, to);
+		ttext += now_ns() - t0;
+	}
+	printf("hour: store %.1f us per query, text %.1f us per query, %.1f fixes each\n",
+		tstore / 1e3 / ndevs, ttext / 1e3 / ndevs, (double)nstore / ndevs);
+	if (nstore != ntext) {
+		fprintf(stderr, "hour: %ld fixes from the store, %ld from text\n", nstore, ntext);
+		exit(1);
+	}
+
+	if (!keep) {
+		snprintf(buf, sizeof(buf), "rm -rf %s", dir);
+		system(buf);
+	}
+	return (0);
+}
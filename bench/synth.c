@@ -0,0 +1,375 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "hextypes.h"
+#include "hex.h"
+#include "synth.h"
+
+/*
+ * Build @Track lines from the field layouts in devices.yml (i.e. the
+ * generated devices[] table), so that whatever handle_report() decodes
+ * can also be produced. Position blocks (`acc' .. `acc' + 11) repeat
+ * `segments' times and AC100 readings (`adid', `adty', `adda') repeat
+ * `anum' times; fields behind them move up accordingly.
+ *
+ * The same fields encoded per the layout's `hex' make a binary frame.
+ */
+
+#define BLOCK		12		/* fields per position block */
+#define MAXFIELDS	1024
+#define FIELDLEN	24
+
+static int maxidx(struct _device *dp)
+{
+	int *f = &dp->imei, *last = &dp->flvl, m = 0;
+
+	for (; f <= last; f++) {
+		if (*f > m)
+			m = *f;
+	}
+	return (m);
+}
+
+/* Number of fields in a line with one block and one AC100 reading */
+int synth_nfields(struct _device *dp)
+{
+	return (maxidx(dp) + 1);
+}
+
+/*
+ * Where layout index `idx' ends up in block `rep' / reading `a'.
+ */
+
+static int place(struct synth *sy, int idx, int rep, int a)
+{
+	struct _device *dp = sy->dp;
+	int orig = idx, anum = sy->anum > 0 ? sy->anum : 1;
+
+	if (orig <= 0)
+		return (orig);
+
+	if (dp->acc > 0 && orig >= dp->acc) {
+		if (orig < dp->acc + BLOCK)
+			idx += rep * BLOCK;
+		else
+			idx += (sy->segments - 1) * BLOCK;
+	}
+	if (dp->adid > 0 && orig >= dp->adid) {
+		if (orig <= dp->adid + 2)
+			idx += a * 3;
+		else
+			idx += (anum - 1) * 3;
+	}
+	return (idx);
+}
+
+static void set(char **fields, int nfields, int idx, const char *val)
+{
+	if (idx > 0 && idx < nfields) {
+		snprintf(fields[idx], FIELDLEN, "%s", val);
+	}
+}
+
+static char store[MAXFIELDS][FIELDLEN];
+static char *fields[MAXFIELDS];
+static char subtype[16], protov[16];
+
+/* Fill fields[] for `sy'; returns how many there are */
+static int fill(struct synth *sy)
+{
+	struct _device *dp = sy->dp;
+	char tbuf[FIELDLEN], v[FIELDLEN];
+	int nfields, rep, a, n, anum;
+	char *dash;
+
+	if (sy->segments < 1)
+		sy->segments = 1;
+	anum = sy->anum > 0 ? sy->anum : 1;
+
+	nfields = maxidx(dp) + 1 + (sy->segments - 1) * BLOCK;
+	if (dp->adid > 0)
+		nfields += (anum - 1) * 3;
+	if (nfields > MAXFIELDS)
+		return (-1);
+
+	for (n = 0; n < nfields; n++) {
+		fields[n] = store[n];
+		*store[n] = 0;
+	}
+
+	snprintf(subtype, sizeof(subtype), "%s", dp->id);
+	if ((dash = strchr(subtype, '-')) != NULL)
+		*dash = 0;
+	snprintf(protov, sizeof(protov), "%s", dash ? strchr(dp->id, '-') + 1 : "");
+
+	strftime(tbuf, sizeof(tbuf), "%Y%m%d%H%M%S", gmtime(&sy->tst));
+
+	set(fields, nfields, 1, protov);
+	set(fields, nfields, place(sy, dp->imei, 0, 0), sy->imei);
+	set(fields, nfields, place(sy, dp->name, 0, 0), "sim");
+	set(fields, nfields, place(sy, dp->vin, 0, 0), "WVWZZZ1JZXW000001");
+	set(fields, nfields, place(sy, dp->uext, 0, 0), "12000");
+	set(fields, nfields, place(sy, dp->rit, 0, 0), "10");
+	set(fields, nfields, place(sy, dp->rid, 0, 0), "1");
+	set(fields, nfields, place(sy, dp->rty, 0, 0), "0");
+	snprintf(v, sizeof(v), "%d", sy->segments);
+	set(fields, nfields, place(sy, dp->num, 0, 0), v);
+
+	for (rep = 0; rep < sy->segments; rep++) {
+		double dlat = sy->lat + rep * 0.0001, dlon = sy->lon + rep * 0.0001;
+
+		set(fields, nfields, place(sy, dp->acc, rep, 0), "1");
+		set(fields, nfields, place(sy, dp->vel, rep, 0), "42.5");
+		set(fields, nfields, place(sy, dp->cog, rep, 0), "180");
+		set(fields, nfields, place(sy, dp->alt, rep, 0), "35.0");
+		snprintf(v, sizeof(v), "%.6f", dlon);
+		set(fields, nfields, place(sy, dp->lon, rep, 0), v);
+		snprintf(v, sizeof(v), "%.6f", dlat);
+		set(fields, nfields, place(sy, dp->lat, rep, 0), v);
+		set(fields, nfields, place(sy, dp->utc, rep, 0), tbuf);
+		set(fields, nfields, place(sy, dp->mcc, rep, 0), "0262");
+		set(fields, nfields, place(sy, dp->mnc, rep, 0), "0003");
+		set(fields, nfields, place(sy, dp->lac, rep, 0), "1A2B");
+		set(fields, nfields, place(sy, dp->cid, rep, 0), "3C4D");
+	}
+
+	set(fields, nfields, place(sy, dp->odometer, 0, 0), "1234.5");
+	set(fields, nfields, place(sy, dp->hmc, 0, 0), "00012:34:56");
+	set(fields, nfields, place(sy, dp->aiv, 0, 0), "5000");
+	set(fields, nfields, place(sy, dp->batt, 0, 0), "90");
+	set(fields, nfields, place(sy, dp->devs, 0, 0), "0000000200");
+	set(fields, nfields, place(sy, dp->din, 0, 0), "01");
+	set(fields, nfields, place(sy, dp->dout, 0, 0), "00");
+	set(fields, nfields, place(sy, dp->mst, 0, 0), "21");
+	set(fields, nfields, place(sy, dp->ios, 0, 0), "0002");
+	set(fields, nfields, place(sy, dp->ubatt, 0, 0), "4.1");
+	set(fields, nfields, place(sy, dp->don, 0, 0), "120");
+	set(fields, nfields, place(sy, dp->doff, 0, 0), "0");
+	set(fields, nfields, place(sy, dp->nmds, 0, 0), "0");
+	set(fields, nfields, place(sy, dp->rpm, 0, 0), "1500");
+	set(fields, nfields, place(sy, dp->fcon, 0, 0), "7.5");
+	set(fields, nfields, place(sy, dp->flvl, 0, 0), "60");
+
+	/* AC100 present (0x02) and CAN present (0x04) */
+	set(fields, nfields, place(sy, dp->erim, 0, 0), "00000006");
+	set(fields, nfields, place(sy, dp->uart, 0, 0), dp->anum > 0 ? "2" : "0");
+	snprintf(v, sizeof(v), "%d", anum);
+	set(fields, nfields, place(sy, dp->anum, 0, 0), v);
+	for (a = 0; a < anum; a++) {
+		snprintf(v, sizeof(v), "%02d", a + 1);
+		set(fields, nfields, place(sy, dp->adid, 0, a), v);
+		set(fields, nfields, place(sy, dp->adty, 0, a), "1");
+		snprintf(v, sizeof(v), "%04X", 0x190 + a);
+		set(fields, nfields, place(sy, dp->adda, 0, a), v);
+	}
+	set(fields, nfields, place(sy, dp->can, 0, 0), "");
+
+	set(fields, nfields, place(sy, dp->sent, 0, 0), tbuf);
+	snprintf(v, sizeof(v), "%04X", sy->count & 0xFFFF);
+	set(fields, nfields, place(sy, dp->count, 0, 0), v);
+	return (nfields);
+}
+
+int synth_line(struct synth *sy, char *buf, size_t size)
+{
+	int nfields, n, len;
+
+	if ((nfields = fill(sy)) < 0)
+		return (-1);
+
+	len = snprintf(buf, size, "+%s:%s", sy->abr ? sy->abr : "RESP", subtype);
+	for (n = 1; n < nfields && len < (int)size; n++) {
+		len += snprintf(buf + len, size - len, ",%s", fields[n]);
+	}
+	if (len + 2 > (int)size)
+		return (-1);
+	buf[len++] = '$';
+	buf[len] = 0;
+	return (len);
+}
+
+/* Field `hf' with the value `val' (as in the ASCII line) at `p' */
+static void encode(struct _hexfield *hf, const char *val, unsigned char *p)
+{
+	unsigned long long v = 0;
+	double d;
+	int n, i;
+
+	memset(p, 0, hf->size);
+	switch (hf->kind) {
+		case 'u':
+		case 's':
+			for (d = atof(val), n = 0; n < hf->prec; n++)
+				d *= 10;
+			v = (unsigned long long)(long long)(d < 0 ? d - 0.5 : d + 0.5);
+			for (n = hf->size - 1; n >= 0; n--, v >>= 8)
+				p[n] = v & 0xFF;
+			break;
+		case 'x':
+			v = strtoull(val, NULL, 16);
+			for (n = hf->size - 1; n >= 0; n--, v >>= 8)
+				p[n] = v & 0xFF;
+			break;
+		case 'a':
+			strncpy((char *)p, val, hf->size);
+			break;
+		case 't':
+			if (strlen(val) != 14)
+				break;
+			for (n = 0, v = 0; n < 4; n++)
+				v = v * 10 + val[n] - '0';
+			p[0] = v >> 8;
+			p[1] = v & 0xFF;
+			for (i = 2; i < 7; i++)
+				p[i] = (val[2 * i] - '0') * 10 + val[2 * i + 1] - '0';
+			break;
+		case 'm':
+			v = strtoul(val, NULL, 10);
+			p[0] = v >> 16;
+			p[1] = v >> 8;
+			p[2] = v;
+			if (strlen(val) >= 11) {
+				p[3] = atoi(val + 6);
+				p[4] = atoi(val + 9);
+			}
+			break;
+	}
+}
+
+/* The header of a binary frame, less its length */
+static void header(unsigned char *buf, const char *hdr, struct _hextype *ht, const char *protov, const char *imei)
+{
+	unsigned long long v = strtoull(imei, NULL, 10);
+	int n;
+
+	memcpy(buf, hdr, 4);
+	buf[4] = strtol(ht->id, NULL, 16);
+	for (n = 0; n < 3; n++) {
+		char two[3] = { protov[2 * n], protov[2 * n + 1], 0 };
+
+		buf[7 + n] = strtol(two, NULL, 16);
+	}
+	for (n = 17; n >= 10; n--, v >>= 8)
+		buf[n] = v & 0xFF;
+}
+
+static int finish(unsigned char *buf, int len)
+{
+	buf[len++] = '\r';
+	buf[len++] = '\n';
+	buf[5] = len >> 8;
+	buf[6] = len & 0xFF;
+	return (len);
+}
+
+/* `sy' as a binary frame; -1 if its layout has no `hex' */
+int synth_hex(struct synth *sy, char *buf, size_t size)
+{
+	struct _device *dp = sy->dp;
+	struct _hexfield *hf, *bend;
+	struct _hextype *ht;
+	unsigned char *b = (unsigned char *)buf;
+	int nfields, len = HEX_HDRLEN, shift = 0, rep, slot, n;
+
+	if (dp->hexfields == NULL || (nfields = fill(sy)) < 0 ||
+	    (ht = lookup_hextypes_subtype(subtype)) == NULL)
+		return (-1);
+
+	header(b, (sy->abr && strcmp(sy->abr, "BUFF") == 0) ? "+BSP" : "+RSP", ht, protov, sy->imei);
+
+	for (n = 0; n < dp->nhexfields; n++) {
+		hf = &dp->hexfields[n];
+		if (hf->block) {
+			for (bend = hf; bend < dp->hexfields + dp->nhexfields && bend->block; bend++)
+				;
+			for (rep = 0; rep < sy->segments; rep++) {
+				struct _hexfield *bf;
+
+				for (bf = hf; bf < bend; bf++) {
+					if (len + bf->size + 2 > (int)size)
+						return (-1);
+					slot = bf->slot > 0 ? bf->slot + rep * BLOCK : 0;
+					encode(bf, slot > 0 && slot < nfields ? fields[slot] : "", b + len);
+					len += bf->size;
+				}
+			}
+			shift = (sy->segments - 1) * BLOCK;
+			n = bend - dp->hexfields - 1;
+			continue;
+		}
+		if (len + hf->size + 2 > (int)size)
+			return (-1);
+		slot = hf->slot > 0 ? hf->slot + shift : 0;
+		encode(hf, slot > 0 && slot < nfields ? fields[slot] : "", b + len);
+		len += hf->size;
+	}
+	return (finish(b, len));
+}
+
+/* A binary heartbeat, per the GTHBD layout with its `hex' */
+int synth_hex_heartbeat(const char *protov, const char *imei, unsigned count, time_t tst, char *buf, size_t size)
+{
+	struct _hextype *ht;
+	struct _hexfield *hf;
+	struct _device *dp;
+	unsigned char *b = (unsigned char *)buf;
+	char tbuf[32], cbuf[8];
+	int n, len = HEX_HDRLEN;
+
+	if ((dp = lookup_devices("GTHBD", (char *)protov)) == NULL || dp->hexfields == NULL ||
+	    (ht = lookup_hextypes_subtype("GTHBD")) == NULL)
+		return (-1);
+
+	strftime(tbuf, sizeof(tbuf), "%Y%m%d%H%M%S", gmtime(&tst));
+	snprintf(cbuf, sizeof(cbuf), "%04X", count & 0xFFFF);
+	header(b, "+ACK", ht, protov, imei);
+	for (n = 0; n < dp->nhexfields; n++) {
+		hf = &dp->hexfields[n];
+		if (len + hf->size + 2 > (int)size)
+			return (-1);
+		encode(hf, hf->slot == dp->sent ? tbuf : hf->slot == dp->count ? cbuf : "", b + len);
+		len += hf->size;
+	}
+	return (finish(b, len));
+}
+
+/*
+ * A report of a subtype which has no layout in devices.yml, such as the
+ * GTINF qtripp ignores: only the trailing send time and count matter.
+ */
+int synth_other(const char *abr, const char *subtype, const char *protov, const char *imei, unsigned count, time_t tst, char *buf, size_t size)
+{
+	char tbuf[32];
+
+	strftime(tbuf, sizeof(tbuf), "%Y%m%d%H%M%S", gmtime(&tst));
+	return (snprintf(buf, size, "+%s:%s,%s,%s,,,,,%s,%04X$", abr, subtype, protov, imei, tbuf, count & 0xFFFF));
+}
+
+/* A heartbeat, answered by the server with "+SACK:GTHBD,,<count>$" */
+int synth_heartbeat(const char *protov, const char *imei, unsigned count, time_t tst, char *buf, size_t size)
+{
+	char tbuf[32];
+
+	strftime(tbuf, sizeof(tbuf), "%Y%m%d%H%M%S", gmtime(&tst));
+	return (snprintf(buf, size, "+ACK:GTHBD,%s,%s,,%s,%04X$", protov, imei, tbuf, count & 0xFFFF));
+}
@@ -0,0 +1,49 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _SYNTH_H_INCL_
+# define  _SYNTH_H_INCL_
+
+#include <time.h>
+#include "devices.h"
+
+/*
+ * Parameters for one synthesized @Track record. `dp' is the layout (an
+ * entry of devices[]) which decides which fields go where.
+ */
+
+struct synth {
+	struct _device *dp;
+	const char *abr;		/* "RESP" or "BUFF" */
+	const char *imei;
+	int segments;			/* `number' of position blocks */
+	int anum;			/* AC100 readings, if the layout has them */
+	unsigned count;			/* the trailing count number */
+	time_t tst;
+	double lat, lon;
+};
+
+int synth_line(struct synth *sy, char *buf, size_t size);
+int synth_heartbeat(const char *protov, const char *imei, unsigned count, time_t tst, char *buf, size_t size);
+int synth_other(const char *abr, const char *subtype, const char *protov, const char *imei, unsigned count, time_t tst, char *buf, size_t size);
+int synth_nfields(struct _device *dp);
+int synth_hex(struct synth *sy, char *buf, size_t size);
+int synth_hex_heartbeat(const char *protov, const char *imei, unsigned count, time_t tst, char *buf, size_t size);
+
+#endif
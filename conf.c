@@ -25,6 +25,74 @@
 #include "conf.h"
 
 #define _eq(n) (strcmp(key, n) == 0)
+
+/*
+ * Add the comma-separated names in `list' to the set at `names'. A `*'
+ * anywhere in the list empties the set, which means "all".
+ */
+
+static void free_names(struct my_name **names)
+{
+	struct my_name *n, *tmp;
+
+	HASH_ITER(hh, *names, n, tmp) {
+		HASH_DEL(*names, n);
+		free(n->key);
+		free(n);
+	}
+}
+
+static void add_names(struct my_name **names, const char *list)
+{
+	char *copy = strdup(list), *lp = copy, *tok;
+	struct my_name *n;
+
+	while ((tok = strsep(&lp, ", \t")) != NULL) {
+		if (*tok == 0)
+			continue;
+		if (strcmp(tok, "*") == 0) {
+			free_names(names);
+			break;
+		}
+		HASH_FIND_STR(*names, tok, n);
+		if (n == NULL) {
+			n = (struct my_name *)malloc(sizeof (struct my_name));
+			n->key = strdup(tok);
+			HASH_ADD_KEYPTR(hh, *names, n->key, strlen(n->key), n);
+		}
+	}
+	free(copy);
+}
+
+bool name_in(struct my_name *names, const char *key)
+{
+	struct my_name *n;
+
+	if (names == NULL)
+		return (true);
+	if (key == NULL)
+		return (false);
+
+	HASH_FIND_STR(names, key, n);
+	return (n != NULL);
+}
+
+/* A number of bytes, perhaps with a k, m or g */
+static size_t size_val(const char *val)
+{
+	char *end;
+	size_t n = strtoul(val, &end, 10);
+
+	switch (*end) {
+		case 'g': case 'G': n *= 1024;
+			/* FALLTHROUGH */
+		case 'm': case 'M': n *= 1024;
+			/* FALLTHROUGH */
+		case 'k': case 'K': n *= 1024;
+	}
+	return (n);
+}
+
 int ini_handler(void *cf, const char *section, const char *key, const char *val)
 {
 	config *c = (config *)cf;
@@ -33,6 +101,7 @@ int ini_handler(void *cf, const char *section, const char *key, const char *val)
 	
 	if (!strcmp(section, "defaults")) {
 		if (_eq("listen_port"))	c->listen_port = strdup(val);
+		if (_eq("http_listen"))	c->http_listen = strdup(val);
 		if (_eq("datalog"))	c->datalog = strdup(val);
 		if (_eq("logfile"))	c->logfile = strdup(val);
 		if (_eq("debughex"))	c->debughex = strdup(val);
@@ -66,9 +135,126 @@ int ini_handler(void *cf, const char *section, const char *key, const char *val)
 		if (_eq("host"))	c->bean_host = strdup(val);
 		if (_eq("port"))	c->bean_port = atoi(val);
 		if (_eq("tube"))	c->bean_tube = strdup(val);
+		if (_eq("spool"))	c->bean_spool = strdup(val);
+		if (_eq("maxqueue"))	c->bean_maxqueue = atoi(val);
+		if (_eq("pipeline"))	c->bean_pipeline = atoi(val);
 	}
 #endif
 
+	if (!strcmp(section, "raw")) {
+		if (_eq("mode")) {
+			if (!strcmp(val, "off"))		c->raw_mode = RAW_OFF;
+			else if (!strcmp(val, "compat"))	c->raw_mode = RAW_COMPAT;
+			else if (!strcmp(val, "line"))		c->raw_mode = RAW_LINE;
+			else if (!strcmp(val, "batch"))		c->raw_mode = RAW_BATCH;
+			else {
+				fprintf(stderr, "raw mode must be off, compat, line, or batch\n");
+				exit(3);
+			}
+		}
+		if (_eq("subtypes"))	add_names(&c->raw_subtypes, val);
+		if (_eq("devices"))	add_names(&c->raw_devices, val);
+		if (_eq("batch_lines"))	c->raw_batch_lines = atoi(val);
+		if (_eq("batch_ms"))	c->raw_batch_ms = atoi(val);
+		if (_eq("compress"))	c->raw_compress = (!strcmp(val, "true") || !strcmp(val, "1"));
+	}
+
+	if (!strcmp(section, "sack")) {
+		if (_eq("reports")) {
+			c->sack = (*val != 0);
+			add_names(&c->sack_reports, val);
+		}
+		if (_eq("subtypes"))	add_names(&c->sack_subtypes, val);
+		if (_eq("devices"))	add_names(&c->sack_devices, val);
+	}
+
+	if (!strcmp(section, "dedup")) {
+		if (_eq("window"))	c->dedup_window = atoi(val);
+		if (_eq("file"))	c->dedup_file = strdup(val);
+		if (_eq("save"))	c->dedup_save = atoi(val);
+	}
+
+	if (!strcmp(section, "sched")) {
+		if (_eq("quantum"))	c->sched_quantum = atol(val);
+		if (_eq("budget"))	c->sched_budget = atol(val);
+		if (_eq("maxqueue"))	c->sched_maxqueue = atol(val);
+		if (_eq("inflight"))	c->sched_inflight = atol(val);
+	}
+
+	if (!strcmp(section, "thin")) {
+		/*
+		 *	meters = 20		defaults, and
+		 *	meters.owntracks/gv/ = 50	for devices with that topic
+		 */
+
+		struct my_thin *th = &c->thin;
+		const char *dot = strchr(key, '.');
+		size_t n = dot ? (size_t)(dot - key) : strlen(key);
+
+		if (_eq("subtypes"))	add_names(&c->thin_subtypes, val);
+		if (dot != NULL && dot[1]) {
+			HASH_FIND_STR(c->thins, dot + 1, th);
+			if (th == NULL) {
+				th = (struct my_thin *)malloc(sizeof (struct my_thin));
+				th->topic = strdup(dot + 1);
+				th->meters = th->degrees = -1;
+				th->seconds = th->keepalive = -1;
+				HASH_ADD_KEYPTR(hh, c->thins, th->topic, strlen(th->topic), th);
+			}
+		}
+		if (n == 6 && !strncmp(key, "meters", n))	th->meters = atof(val);
+		if (n == 7 && !strncmp(key, "degrees", n))	th->degrees = atof(val);
+		if (n == 7 && !strncmp(key, "seconds", n))	th->seconds = atol(val);
+		if (n == 9 && !strncmp(key, "keepalive", n))	th->keepalive = atol(val);
+	}
+
+	if (!strcmp(section, "geofences")) {
+		if (_eq("file"))	c->geo_file = strdup(val);
+		if (_eq("cell"))	c->geo_cell = atof(val);
+	}
+
+	if (!strcmp(section, "trips")) {
+		if (_eq("enable"))	c->trips = (!strcmp(val, "true") || !strcmp(val, "1"));
+		if (_eq("speed"))	c->trip_speed = atof(val);
+		if (_eq("stop"))	c->trip_stop = atoi(val);
+		if (_eq("timeout"))	c->trip_timeout = atoi(val);
+		if (_eq("file"))	c->trip_file = strdup(val);
+		if (_eq("save"))	c->trip_save = atoi(val);
+	}
+
+	if (!strcmp(section, "store")) {
+		if (_eq("dir"))		c->store_dir = strdup(val);
+		if (_eq("flush"))	c->store_flush = atoi(val);
+		if (_eq("block"))	c->store_block = atoi(val);
+	}
+
+	if (!strcmp(section, "recent")) {
+		if (_eq("fixes"))	c->recent_fixes = atoi(val);
+		if (_eq("memory"))	c->recent_memory = size_val(val);
+	}
+
+	if (!strcmp(section, "snapshot")) {
+		if (_eq("file"))	c->snap_file = strdup(val);
+		if (_eq("interval"))	c->snap_interval = atoi(val);
+	}
+
+	if (!strcmp(section, "timeouts")) {
+		if (_eq("idle"))	c->idle_timeout = atoi(val);
+		if (_eq("command"))	c->command_timeout = atoi(val);
+		if (_eq("takeover"))	c->takeover = atoi(val);
+		if (!strncmp(key, "idle.", 5) && key[5]) {
+			struct my_timeout *t;
+
+			HASH_FIND_STR(c->idle_timeouts, key + 5, t);
+			if (t == NULL) {
+				t = (struct my_timeout *)malloc(sizeof (struct my_timeout));
+				t->model = strdup(key + 5);
+				HASH_ADD_KEYPTR(hh, c->idle_timeouts, t->model, strlen(t->model), t);
+			}
+			t->secs = atoi(val);
+		}
+	}
+
 	if (!strcmp(section, "mqtt")) {
 		if (_eq("host"))	c->host = strdup(val);
 		if (_eq("username"))    c->username = strdup(val);
@@ -98,3 +284,105 @@ int ini_handler(void *cf, const char *section, const char *key, const char *val)
 	}
 	return (1);
 }
+
+/*
+ * What a reload may change: what is looked up per device or record as
+ * it comes in. The rest (listeners, the broker, files and the state kept
+ * in them) needs a restart.
+ */
+
+static bool reloadable(const char *section, const char *key)
+{
+	if (!strcmp(section, "devices") || !strcmp(section, "sack") ||
+	    !strcmp(section, "thin") || !strcmp(section, "timeouts"))
+		return (true);
+	if (!strcmp(section, "defaults"))
+		return (_eq("namesdir") || _eq("extra_json"));
+	if (!strcmp(section, "raw"))
+		return (_eq("subtypes") || _eq("devices"));
+	return (false);
+}
+
+static int reload_handler(void *cf, const char *section, const char *key, const char *val)
+{
+	if (!reloadable(section, key))
+		return (1);
+	return (ini_handler(cf, section, key, val));
+}
+
+/* Free what reloadable() covers in `c', leaving it unset */
+void conf_release(config *c)
+{
+	struct my_device *d, *dtmp;
+	struct my_thin *th, *thtmp;
+	struct my_timeout *t, *ttmp;
+
+	HASH_ITER(hh, c->devices, d, dtmp) {
+		HASH_DEL(c->devices, d);
+		free(d->did);
+		free(d->topic);
+		free(d);
+	}
+	HASH_ITER(hh, c->thins, th, thtmp) {
+		HASH_DEL(c->thins, th);
+		free(th->topic);
+		free(th);
+	}
+	HASH_ITER(hh, c->idle_timeouts, t, ttmp) {
+		HASH_DEL(c->idle_timeouts, t);
+		free(t->model);
+		free(t);
+	}
+	free_names(&c->raw_subtypes);
+	free_names(&c->raw_devices);
+	free_names(&c->sack_reports);
+	free_names(&c->sack_subtypes);
+	free_names(&c->sack_devices);
+	free_names(&c->thin_subtypes);
+	free((char *)c->namesdir);
+	free((char *)c->extra_json);
+	c->namesdir = NULL;
+	c->extra_json = NULL;
+}
+
+/*
+ * A new configuration: `cur' with what reloadable() covers read afresh
+ * from `path', starting from `defaults'. It is built aside, so whoever
+ * uses `cur' can go on until switching over; NULL if `path' can't be
+ * parsed.
+ */
+
+config *conf_reload(const config *cur, const config *defaults, const char *path)
+{
+	config *fresh, *nc;
+
+	if ((fresh = (config *)malloc(sizeof(config))) == NULL)
+		return (NULL);
+	*fresh = *defaults;
+	if (ini_parse(path, reload_handler, fresh) < 0 ||
+	    (nc = (config *)malloc(sizeof(config))) == NULL) {
+		conf_release(fresh);
+		free(fresh);
+		return (NULL);
+	}
+
+	*nc = *cur;
+	nc->devices		= fresh->devices;
+	nc->namesdir		= fresh->namesdir;
+	nc->extra_json		= fresh->extra_json;
+	nc->raw_subtypes	= fresh->raw_subtypes;
+	nc->raw_devices		= fresh->raw_devices;
+	nc->sack		= fresh->sack;
+	nc->sack_reports	= fresh->sack_reports;
+	nc->sack_subtypes	= fresh->sack_subtypes;
+	nc->sack_devices	= fresh->sack_devices;
+	nc->thin		= fresh->thin;
+	nc->thins		= fresh->thins;
+	nc->thin_subtypes	= fresh->thin_subtypes;
+	nc->idle_timeout	= fresh->idle_timeout;
+	nc->idle_timeouts	= fresh->idle_timeouts;
+	nc->command_timeout	= fresh->command_timeout;
+	nc->takeover		= fresh->takeover;
+	free(fresh);
+	return (nc);
+}
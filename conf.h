@@ -21,6 +21,7 @@
 # define _CONF_H_INCL_
 
 #include <stdio.h>
+#include <stdbool.h>
 #include "uthash.h"
 #include "json.h"
 #include "ini.h"        /* https://github.com/benhoyt/inih */
@@ -39,8 +40,46 @@ struct my_device {
 	UT_hash_handle hh;
 };
 
+/*
+ * A set of names (subtypes, deviceIds) configured as a comma-separated
+ * list. An empty set (NULL) means "all".
+ */
+
+struct my_name {
+	char *key;
+	UT_hash_handle hh;
+};
+
+/* Idle timeout for connections from devices of a model */
+struct my_timeout {
+	char *model;		/* key, e.g. "GV65" */
+	int secs;
+	UT_hash_handle hh;
+};
+
+/*
+ * Thresholds for thinning the positions published to a topic (as given
+ * in [devices]); -1 in a topic's takes the default's.
+ */
+struct my_thin {
+	char *topic;		/* key; NULL for the defaults */
+	double meters;		/* moved at least this far, */
+	double degrees;		/* ... or turned at least this much, */
+	long seconds;		/* ... and at least this long after the last */
+	long keepalive;		/* published anyway after this long */
+	UT_hash_handle hh;
+};
+
+/* How raw lines are mirrored to `rawtopic' */
+#define RAW_UNSET	(-1)
+#define RAW_OFF		0	/* no mirroring */
+#define RAW_COMPAT	1	/* one publish per record, all subtypes */
+#define RAW_LINE	2	/* one publish per selected record */
+#define RAW_BATCH	3	/* selected records batched per device */
+
 typedef struct config {
         const char *listen_port;
+	const char *http_listen;
         const char *debughex;
         const char *host;
 	int port;
@@ -48,6 +87,9 @@ typedef struct config {
         const char *bean_host;
 	int bean_port;
         const char *bean_tube;
+	const char *bean_spool;
+	int bean_maxqueue;
+	int bean_pipeline;
 #endif
 	const char *datalog;
 	const char *logfile;
@@ -67,6 +109,45 @@ typedef struct config {
 	const char *datadir;
 	const char *namesdir;
 	const char *rawtopic;
+	int raw_mode;
+	struct my_name *raw_subtypes;
+	struct my_name *raw_devices;
+	int raw_batch_lines;
+	int raw_batch_ms;
+	bool raw_compress;
+	int idle_timeout;
+	struct my_timeout *idle_timeouts;
+	int command_timeout;
+	int takeover;
+	bool sack;
+	struct my_name *sack_reports;
+	struct my_name *sack_subtypes;
+	struct my_name *sack_devices;
+	int dedup_window;
+	const char *dedup_file;
+	int dedup_save;
+	size_t sched_quantum;
+	long sched_budget;
+	size_t sched_maxqueue;
+	unsigned long sched_inflight;
+	struct my_thin thin;
+	struct my_thin *thins;
+	struct my_name *thin_subtypes;
+	const char *geo_file;
+	double geo_cell;
+	bool trips;
+	double trip_speed;
+	int trip_stop;
+	int trip_timeout;
+	const char *trip_file;
+	int trip_save;
+	const char *store_dir;
+	int store_flush;
+	int store_block;
+	int recent_fixes;
+	size_t recent_memory;
+	const char *snap_file;
+	int snap_interval;
 	int protocol;
 #ifdef STATSD
 	statsd_link *sd;
@@ -75,5 +156,8 @@ typedef struct config {
 } config;
 
 int ini_handler(void *cf, const char *section, const char *key, const char *val);
+bool name_in(struct my_name *names, const char *key);
+config *conf_reload(const config *cur, const config *defaults, const char *path);
+void conf_release(config *c);
 
 #endif
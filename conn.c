@@ -0,0 +1,309 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mongoose.h"
+#include "util.h"
+#include "tline.h"
+#include "http.h"
+#include "pool.h"
+#include "conn.h"
+
+#define CONN_PER_SLAB	256
+
+/* The connections of an IMEI, newest (current) first */
+struct sessions {
+	char *imei;			/* key */
+	int refs;			/* number of connections */
+	struct conndata *conns;
+	UT_hash_handle hh;
+};
+
+static struct conndata *conns_by_sock = NULL;
+static struct sessions *sessions = NULL;
+static unsigned long conn_seq = 0L;
+static struct pool conn_pool, sess_pool;
+
+struct conndata *find_conn(int sock)
+{
+	struct conndata *co;
+
+	HASH_FIND_INT(conns_by_sock, &sock, co);
+	return (co);
+}
+
+/* The current (most recent) connection of `imei' */
+struct conndata *find_imei(char *imei)
+{
+	struct sessions *s;
+
+	HASH_FIND_STR(sessions, imei, s);
+	return (s ? s->conns : NULL);
+}
+
+/* Seconds of silence after which a connection from `model' is closed */
+int idle_timeout(config *cf, const char *model)
+{
+	struct my_timeout *t = NULL;
+
+	if (model != NULL)
+		HASH_FIND_STR(cf->idle_timeouts, model, t);
+	return (t ? t->secs : cf->idle_timeout);
+}
+
+/*
+ * The configuration was reloaded: connections keep their timers running,
+ * but the next refresh applies their model's idle timeout from the new one.
+ */
+
+void conn_reconfigure(config *cf)
+{
+	struct conndata *co, *tmp;
+
+	HASH_ITER(hh, conns_by_sock, co, tmp) {
+		if (!co->superseded)
+			co->idle_secs = idle_timeout(cf, co->model);
+	}
+}
+
+static void idle_expired(struct timer *t, void *arg)
+{
+	struct conndata *co = (struct conndata *)arg;
+	struct udata *ud = (struct udata *)co->nc->mgr->user_data;
+
+	if (co->superseded) {
+		xlog(ud, "Closing superseded connection on socket %d: IP is %s, IMEI <%s>\n",
+			co->sock, co->client_ip, co->imei);
+	} else {
+		xlog(ud, "Closing inactive connection on socket %d: IP is %s\n", co->sock, co->client_ip);
+		STATSD_INC(ud->cf->sd, "connection.forceclose");
+	}
+	co->nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+}
+
+/*
+ * Something was received on `co': restart its idle timer; 0 disables it.
+ * A superseded connection keeps the deadline of its grace period.
+ */
+void idle_refresh(struct conndata *co)
+{
+	if (co->superseded)
+		return;
+	if (co->idle_secs > 0)
+		timer_set(&co->idle, co->idle_secs);
+	else
+		timer_cancel(&co->idle);
+}
+
+static void ack_expired(struct timer *t, void *arg)
+{
+	struct conndata *co = (struct conndata *)arg;
+	struct udata *ud = (struct udata *)co->nc->mgr->user_data;
+
+	xlog(ud, "No ACK from %s within %ds for %s\n",
+		co->imei ? co->imei : co->client_ip, ud->cf->command_timeout, co->command);
+	STATSD_INC(ud->cf->sd, "command.timeout");
+	free(co->command);
+	co->command = NULL;
+}
+
+/* `payload' was written to the device; expect its +ACK within `secs' */
+void command_sent(struct conndata *co, const char *payload, int secs)
+{
+	if (secs <= 0)
+		return;
+	if (co->command) free(co->command);
+	co->command = strdup(payload);
+	timer_set(&co->ack, secs);
+}
+
+void command_acked(struct conndata *co)
+{
+	if (co->command != NULL) {
+		timer_cancel(&co->ack);
+		free(co->command);
+		co->command = NULL;
+	}
+}
+
+struct conndata *add_conn(int sock)
+{
+	struct conndata *co;
+
+	if (conn_pool.size == 0) {
+		pool_init(&conn_pool, sizeof(struct conndata), CONN_PER_SLAB);
+		pool_init(&sess_pool, sizeof(struct sessions), CONN_PER_SLAB);
+	}
+
+	HASH_FIND_INT(conns_by_sock, &sock, co);		/* imei already in hash? */
+	if (co == NULL) {
+		if ((co = (struct conndata *)pool_get(&conn_pool)) == NULL)
+			return (NULL);
+		co->sock = sock;
+		co->seq = ++conn_seq;
+		timer_init(&co->idle, idle_expired, co);
+		timer_init(&co->ack, ack_expired, co);
+		HASH_ADD_INT(conns_by_sock, sock, co);
+	}
+	co->imei	= NULL;
+	co->client_ip	= NULL;
+	co->nc		= NULL;
+	co->model	= NULL;
+	co->command	= NULL;
+	return (co);
+}
+
+/*
+ * `old' is an earlier connection of the IMEI which `co' now is. A device
+ * which reconnects (e.g. through a new NAT mapping) rarely closes the
+ * socket it had, so close that `takeover' seconds from now (a negative
+ * value leaves it alone).
+ */
+
+static void takeover(struct udata *ud, struct conndata *old, struct conndata *co)
+{
+	int grace = ud->cf->takeover;
+
+	if (grace < 0 || old->superseded)
+		return;
+
+	xlog(ud, "Connection on socket %d for IMEI <%s> supersedes socket %d (IP %s); closing that in %ds\n",
+		co->sock, co->imei, old->sock, old->client_ip, grace);
+	STATSD_INC(ud->cf->sd, "connection.takeover");
+	old->superseded = true;
+	timer_set(&old->idle, grace);
+}
+
+/* `co' turns out to be from `imei'; it becomes that device's current connection */
+void conn_set_imei(struct udata *ud, struct conndata *co, const char *imei)
+{
+	struct sessions *s;
+	struct conndata *old;
+
+	if (co->imei != NULL)
+		return;
+
+	HASH_FIND_STR(sessions, imei, s);
+	if (s == NULL) {
+		if ((s = (struct sessions *)pool_get(&sess_pool)) == NULL)
+			return;
+		s->imei = strdup(imei);
+		HASH_ADD_KEYPTR(hh, sessions, s->imei, strlen(s->imei), s);
+	}
+
+	co->imei = strdup(imei);
+	xlog(ud, "Found connection on socket %d: IP is %s: IMEI <%s>\n", co->sock, co->client_ip, co->imei);
+	STATSD_INC(ud->cf->sd, "connection.reuse");
+
+	co->sess = s;
+	if ((co->snext = s->conns) != NULL)
+		co->snext->sprev = &co->snext;
+	co->sprev = &s->conns;
+	s->conns = co;
+	s->refs++;
+
+	for (old = co->snext; old != NULL; old = old->snext)
+		takeover(ud, old, co);
+}
+
+void delete_conn(struct conndata *co)
+{
+	struct sessions *s;
+
+	if ((s = co->sess) != NULL) {
+		if ((*co->sprev = co->snext) != NULL)
+			co->snext->sprev = co->sprev;
+		if (--s->refs == 0) {
+			HASH_DEL(sessions, s);
+			free(s->imei);
+			pool_put(&sess_pool, s);
+		}
+	}
+	if (co->imei) free(co->imei);
+	if (co->client_ip) free(co->client_ip);
+	if (co->command) free(co->command);
+	timer_cancel(&co->idle);
+	timer_cancel(&co->ack);
+
+	http_forget(co, co->hh.next);
+	HASH_DEL(conns_by_sock, co);
+	pool_put(&conn_pool, co);
+}
+
+/* Number of connections from `imei' */
+int count_conns(char *imei)
+{
+	struct sessions *s;
+
+	HASH_FIND_STR(sessions, imei, s);
+	return (s ? s->refs : 0);
+}
+
+void print_conns(struct udata *ud)
+{
+	struct conndata *co;
+
+	for (co = conns_by_sock; co != NULL; co = (struct conndata *)(co->hh.next)) {
+		char buf[BUFSIZ];
+
+		snprintf(buf, sizeof(buf), "sock %d: %s (%s)", co->sock,
+			co->imei ? co->imei : "nil",
+			co->client_ip ? co->client_ip : "nil");
+
+		xlog(ud, "%s\n", buf);
+		if (ud->cf->reporttopic)
+			pub(ud, (char *)ud->cf->reporttopic, buf, false);
+	}
+}
+
+/* Connections for /connections, in the order they were added */
+
+static void *connections_first(unsigned long after)
+{
+	struct conndata *co;
+
+	for (co = conns_by_sock; co != NULL && co->seq <= after; co = co->hh.next)
+		;
+	return (co);
+}
+
+static void *connections_next(void *it)
+{
+	return (((struct conndata *)it)->hh.next);
+}
+
+static unsigned long connections_json(void *it, struct mbuf *mb)
+{
+	struct conndata *co = (struct conndata *)it;
+
+	mbuf_printf(mb, "{\"sock\": %d, \"imei\": ", co->sock);
+	mbuf_json_string(mb, co->imei);
+	mbuf_printf(mb, ", \"ip\": ");
+	mbuf_json_string(mb, co->client_ip);
+	if (co->nc) {
+		mbuf_printf(mb, ", \"buffered\": %lu", (unsigned long)co->nc->recv_mbuf.len);
+		mbuf_printf(mb, ", \"last_io\": %ld", (long)co->nc->last_io_time);
+	}
+	mbuf_printf(mb, "}");
+	return (co->seq);
+}
+
+struct http_source http_connections = { "connections", connections_first, connections_next, connections_json };
@@ -0,0 +1,76 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _CONN_H_INCL_
+# define  _CONN_H_INCL_
+
+#include <stdbool.h>
+#include "uthash.h"
+#include "udata.h"
+#include "conf.h"
+#include "timer.h"
+#include "lanes.h"
+
+struct mg_connection;
+
+/*
+ * We'll be hashing connection information by socket (sock). Once a
+ * connection's IMEI is known it joins that IMEI's sessions, newest first,
+ * so the current connection for a device and whether it has others are
+ * a lookup away. What a device sends stays in mongoose's recv_mbuf until
+ * it makes up complete records, so there is no buffer of our own but for
+ * the +BUFF records waiting in its lane.
+ */
+
+struct sessions;
+
+struct conndata {
+	int sock;		/* key */
+	unsigned long seq;	/* order in which connections were added */
+	char *imei;
+	char *client_ip;
+	struct mg_connection *nc;
+	const char *model;		/* once known from its records */
+	int idle_secs;
+	struct timer idle;		/* closes the connection if nothing is received */
+	char *command;			/* last command sent, awaiting +ACK */
+	struct timer ack;
+	struct sessions *sess;		/* of its IMEI */
+	struct conndata *snext, **sprev;
+	bool superseded;		/* a newer session for the IMEI took over */
+	struct lane lane;		/* its +BUFF records, for the scheduler */
+	bool paused;			/* not read from until the lane is served */
+	UT_hash_handle hh;		/* makes this hashable for key sock */
+};
+
+struct conndata *find_conn(int sock);
+struct conndata *find_imei(char *imei);
+struct conndata *add_conn(int sock);
+void delete_conn(struct conndata *co);
+void conn_set_imei(struct udata *ud, struct conndata *co, const char *imei);
+int count_conns(char *imei);
+void print_conns(struct udata *ud);
+
+int idle_timeout(config *cf, const char *model);
+void conn_reconfigure(config *cf);
+void idle_refresh(struct conndata *co);
+void command_sent(struct conndata *co, const char *payload, int secs);
+void command_acked(struct conndata *co);
+
+#endif
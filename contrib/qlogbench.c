@@ -0,0 +1,287 @@
+/*
+ * qlogbench
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Capture-rate benchmark for qlog: open many concurrent connections which
+ * each send a number of GTFRI records, deliberately cut at random points
+ * into several writes, and measure how quickly they arrive. With -f, the
+ * data file qlog writes to is then checked: every record must be on a
+ * line of its own, intact, and each sender's sequence numbers must be
+ * complete and in order.
+ *
+ *	qlog -s 0 -f /tmp/q.data 5001 &
+ *	qlogbench -c 4000 -n 250 -f /tmp/q.data 127.0.0.1 5001
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define RECFMT	"+RESP:GTFRI,300400,86%013d,,0,0,1,1,0.0,0,42.0,13.376043,52.463398,20180101000000,0262,0003,1234,5678,,%d,20180101000000,%04X$"
+
+struct sender {
+	int fd;
+	int id;
+	int seq;		/* next record to send */
+	char buf[256];
+	int len, off;		/* current record and how much of it is out */
+};
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec / 1e6);
+}
+
+static void next_record(struct sender *s)
+{
+	s->len = snprintf(s->buf, sizeof(s->buf), RECFMT, s->id, s->seq, s->seq & 0xffff);
+	s->off = 0;
+	s->seq++;
+}
+
+/*
+ * Read the data file and check that it holds exactly nconn * nrec intact
+ * records with per-sender sequences 0..nrec-1 in order.
+ */
+
+static int verify(char *path, int nconn, int nrec)
+{
+	FILE *fp;
+	char line[512];
+	int *expect, id, seq, bad = 0, missing = 0, i;
+	long lines = 0;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		perror(path);
+		return (1);
+	}
+	expect = calloc(nconn, sizeof(int));
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		size_t len = strlen(line);
+
+		lines++;
+		if (len < 3 || line[len - 1] != '\n' || line[len - 2] != '$' || *line != '+' ||
+		    strchr(line + 1, '+') || strchr(line, '$') != line + len - 2 ||
+		    sscanf(line, "+RESP:GTFRI,300400,86%13d,", &id) != 1 ||
+		    id < 0 || id >= nconn) {
+			if (bad++ < 5)
+				fprintf(stderr, "bad line %ld: %s", lines, line);
+			continue;
+		}
+		/* sequence is the 20th field */
+		{
+			char *p = line;
+			int f;
+
+			for (f = 0; f < 19 && p; f++) {
+				p = strchr(p, ',');
+				if (p)
+					p++;
+			}
+			if (p == NULL || sscanf(p, "%d", &seq) != 1 || seq != expect[id]) {
+				if (bad++ < 5)
+					fprintf(stderr, "out of sequence on line %ld (sender %d wants %d): %s",
+						lines, id, expect[id], line);
+				continue;
+			}
+		}
+		expect[id]++;
+	}
+	fclose(fp);
+
+	for (i = 0; i < nconn; i++) {
+		missing += nrec - expect[i];
+	}
+	free(expect);
+
+	printf("verify: %ld lines, %d bad, %d missing\n", lines, bad, missing);
+	return (bad || missing);
+}
+
+static off_t file_size(char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) == -1)
+		return (-1);
+	return (st.st_size);
+}
+
+int main(int argc, char **argv)
+{
+	int nconn = 1000, nrec = 100, ch, i, active, connected = 0;
+	char *datafile = NULL;
+	struct sockaddr_in sin;
+	struct sender *ss;
+	struct pollfd *pfd;
+	struct rlimit rl;
+	long long total, sent = 0;
+	double t0, t1;
+	off_t want;
+
+	while ((ch = getopt(argc, argv, "c:n:f:")) != EOF) {
+		switch (ch) {
+			case 'c': nconn = atoi(optarg); break;
+			case 'n': nrec = atoi(optarg); break;
+			case 'f': datafile = optarg; break;
+			default:
+				fprintf(stderr, "Usage: %s [-c conns] [-n records] [-f datafile] host port\n", *argv);
+				exit(2);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 2) {
+		fprintf(stderr, "Usage: qlogbench [-c conns] [-n records] [-f datafile] host port\n");
+		exit(2);
+	}
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(atoi(argv[1]));
+	inet_pton(AF_INET, argv[0], &sin.sin_addr);
+
+	if (datafile) {
+		if (file_size(datafile) > 0) {
+			fprintf(stderr, "%s is not empty; start qlog on a fresh file to verify\n", datafile);
+			exit(2);
+		}
+	}
+
+	ss = calloc(nconn, sizeof(struct sender));
+	pfd = calloc(nconn, sizeof(struct pollfd));
+	srandom(getpid());
+
+	for (i = 0; i < nconn; i++) {
+		struct sender *s = &ss[i];
+		int on = 1;
+
+		s->id = i;
+		if ((s->fd = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+		    connect(s->fd, (struct sockaddr *)&sin, sizeof(sin)) == -1) {
+			perror("connect");
+			exit(1);
+		}
+		setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL, 0) | O_NONBLOCK);
+		next_record(s);
+		pfd[i].fd = s->fd;
+		pfd[i].events = POLLOUT;
+		connected++;
+	}
+
+	total = (long long)nconn * nrec;
+	printf("%d senders connected, sending %lld records\n", connected, total);
+
+	t0 = now();
+	active = nconn;
+	while (active > 0) {
+		if (poll(pfd, nconn, 1000) <= 0)
+			continue;
+
+		for (i = 0; i < nconn; i++) {
+			struct sender *s = &ss[i];
+			int chunk, burst;
+			ssize_t nw;
+
+			if (!(pfd[i].revents & POLLOUT))
+				continue;
+
+			/*
+			 * Send up to a burst of records while the socket takes them,
+			 * cutting some at random points so qlog has to reassemble them.
+			 */
+			for (burst = 0; burst < 16; burst++) {
+				chunk = s->len - s->off;
+				if (random() % 4 == 0)
+					chunk = 1 + random() % chunk;
+
+				nw = send(s->fd, s->buf + s->off, chunk, 0);
+				if (nw == -1) {
+					if (errno == EAGAIN || errno == EINTR)
+						break;
+					perror("send");
+					exit(1);
+				}
+				s->off += nw;
+				if (s->off < s->len)
+					continue;
+
+				sent++;
+				if (s->seq == nrec) {
+					pfd[i].fd = -1;
+					shutdown(s->fd, SHUT_WR);
+					active--;
+					break;
+				}
+				next_record(s);
+			}
+		}
+	}
+	t1 = now();
+	printf("sent %lld records in %.3fs: %.0f records/s\n", sent, t1 - t0, sent / (t1 - t0));
+
+	if (datafile) {
+		/* wait until qlog has everything on disk */
+		struct sender tmp;
+		double deadline = now() + 30;
+
+		memset(&tmp, 0, sizeof(tmp));
+		want = 0;
+		for (i = 0; i < nconn; i++) {
+			tmp.id = i;
+			for (tmp.seq = 0; tmp.seq < nrec; ) {
+				next_record(&tmp);
+				want += tmp.len + 1;
+			}
+		}
+		while (file_size(datafile) < want && now() < deadline) {
+			usleep(1000);
+		}
+		t1 = now();
+		printf("captured %lld records in %.3fs: %.0f records/s\n",
+			total, t1 - t0, total / (t1 - t0));
+	}
+
+	for (i = 0; i < nconn; i++)
+		close(ss[i].fd);
+
+	return (datafile ? verify(datafile, nconn, nrec) : 0);
+}
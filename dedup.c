@@ -0,0 +1,253 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include "uthash.h"
+#include "conf.h"
+#include "util.h"
+#include "tline.h"
+#include "timer.h"
+#include "pool.h"
+#include "http.h"
+#include "dedup.h"
+
+/*
+ * Devices resend reports they think we didn't get (after a reconnect,
+ * or with SACK enabled and no +SACK in time), and +BUFF replays overlap
+ * with what came in live. Per IMEI we remember a fingerprint of the
+ * last `window' reports -- subtype, count, and the first fix's UTC, or
+ * the send time for reports without a fix -- and handle_report() drops
+ * those it finds again before building any JSON.
+ *
+ * The windows are written to `file' every `save' seconds (and by
+ * dedup_save()), and read back at startup, so a restart doesn't let
+ * through what devices resend because of it.
+ */
+
+#define DEDUP_MAGIC	"qdd1"
+#define DEDUP_MAXWINDOW	255
+
+struct window {
+	char imei[16];
+	unsigned char next;		/* slot the next fingerprint goes to */
+	UT_hash_handle hh;
+	uint32_t fp[];			/* 0 is an empty slot */
+};
+
+static struct window *windows = NULL;
+static struct pool window_pool;
+static struct timer save_timer;
+static int window;			/* 0: not deduplicating */
+static bool dirty = false;
+static unsigned long checked = 0, dropped = 0;
+
+static uint32_t fingerprint(const char *subtype, const char *count, const char *utc)
+{
+	const char *parts[3] = { subtype, count, utc }, *s;
+	uint32_t h = 2166136261u;	/* FNV-1a */
+	int n;
+
+	for (n = 0; n < 3; n++) {
+		for (s = parts[n]; s && *s; s++) {
+			h ^= (unsigned char)*s;
+			h *= 16777619u;
+		}
+		h ^= ',';
+		h *= 16777619u;
+	}
+	return (h ? h : 1);
+}
+
+static struct window *window_for(const char *imei, bool create)
+{
+	struct window *w;
+
+	HASH_FIND_STR(windows, imei, w);
+	if (w == NULL && create && (w = (struct window *)pool_get(&window_pool)) != NULL) {
+		snprintf(w->imei, sizeof(w->imei), "%s", imei);
+		HASH_ADD_STR(windows, imei, w);
+	}
+	return (w);
+}
+
+/*
+ * True if the report from `imei' with `subtype', `count' and `utc' is
+ * one of the last `window' we've had from it; if not, it is noted.
+ */
+
+bool dedup_seen(struct udata *ud, const char *imei, const char *subtype, const char *count, const char *utc)
+{
+	struct window *w;
+	uint32_t fp;
+	int n;
+
+	if (window == 0 || count == NULL || (w = window_for(imei, true)) == NULL)
+		return (false);
+
+	checked++;
+	fp = fingerprint(subtype, count, utc);
+	for (n = 0; n < window; n++) {
+		if (w->fp[n] == fp) {
+			dropped++;
+			STATSD_INC(ud->cf->sd, "reports.duplicate");
+			return (true);
+		}
+	}
+	w->fp[w->next] = fp;
+	w->next = (w->next + 1) % window;
+	dirty = true;
+	return (false);
+}
+
+/*
+ * File format: the magic, the window size and the number of windows as
+ * 32-bit integers in host order, then each window as it is in memory
+ * from `imei' through `fp'.
+ */
+
+static void load(struct udata *ud, const char *path)
+{
+	struct window *w;
+	uint32_t hdr[2];
+	char magic[4];
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		if (errno != ENOENT)
+			xlog(ud, "Dedup: cannot open %s: %s\n", path, strerror(errno));
+		return;
+	}
+	if (fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, DEDUP_MAGIC, 4) != 0 ||
+	    fread(hdr, sizeof(hdr), 1, fp) != 1 || hdr[0] != window) {
+		xlog(ud, "Dedup: %s is not for a window of %d; ignored\n", path, window);
+		fclose(fp);
+		return;
+	}
+	while (hdr[1]-- > 0) {
+		char imei[16];
+		unsigned char next;
+
+		if (fread(imei, sizeof(imei), 1, fp) != 1 || fread(&next, 1, 1, fp) != 1)
+			break;
+		imei[sizeof(imei) - 1] = 0;
+		if ((w = window_for(imei, true)) == NULL)
+			break;
+		w->next = next % window;
+		if (fread(w->fp, sizeof(uint32_t), window, fp) != window)
+			break;
+	}
+	fclose(fp);
+	xlog(ud, "Dedup: %u devices from %s\n", HASH_COUNT(windows), path);
+}
+
+/* Write the windows to a new file and rename it into place */
+bool dedup_save(struct udata *ud)
+{
+	const char *path = ud->cf->dedup_file;
+	char tmp[BUFSIZ];
+	struct window *w, *wtmp;
+	uint32_t hdr[2];
+	bool ok = true;
+	FILE *fp;
+
+	if (window == 0 || path == NULL || !dirty)
+		return (true);
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		xlog(ud, "Dedup: cannot create %s: %s\n", tmp, strerror(errno));
+		return (false);
+	}
+	hdr[0] = window;
+	hdr[1] = HASH_COUNT(windows);
+	ok = fwrite(DEDUP_MAGIC, 4, 1, fp) == 1 && fwrite(hdr, sizeof(hdr), 1, fp) == 1;
+	HASH_ITER(hh, windows, w, wtmp) {
+		if (!ok)
+			break;
+		ok = fwrite(w->imei, sizeof(w->imei), 1, fp) == 1 &&
+			fwrite(&w->next, 1, 1, fp) == 1 &&
+			fwrite(w->fp, sizeof(uint32_t), window, fp) == window;
+	}
+	if (fclose(fp) != 0)
+		ok = false;
+	if (!ok || rename(tmp, path) == -1) {
+		xlog(ud, "Dedup: cannot write %s: %s\n", path, strerror(errno));
+		unlink(tmp);
+		return (false);
+	}
+	dirty = false;
+	return (true);
+}
+
+static void save_expired(struct timer *t, void *arg)
+{
+	struct udata *ud = (struct udata *)arg;
+
+	dedup_save(ud);
+	timer_set(t, ud->cf->dedup_save);
+}
+
+bool dedup_init(struct udata *ud)
+{
+	config *cf = ud->cf;
+
+	if ((window = cf->dedup_window) <= 0) {
+		window = 0;
+		return (true);
+	}
+	if (window > DEDUP_MAXWINDOW) {
+		xlog(ud, "Dedup: window must be at most %d\n", DEDUP_MAXWINDOW);
+		return (false);
+	}
+	pool_init(&window_pool, sizeof(struct window) + window * sizeof(uint32_t), 1024);
+
+	if (cf->dedup_file != NULL) {
+		load(ud, cf->dedup_file);
+		if (cf->dedup_save > 0) {
+			timer_init(&save_timer, save_expired, ud);
+			timer_set(&save_timer, cf->dedup_save);
+		}
+	}
+	return (true);
+}
+
+void dedup_stats(struct udata *ud)
+{
+	char buf[BUFSIZ];
+
+	if (window == 0)
+		return;
+	snprintf(buf, sizeof(buf), "dedup window=%d devices=%u checked=%lu dropped=%lu",
+		window, HASH_COUNT(windows), checked, dropped);
+	xlog(ud, "stats: %s\n", buf);
+	if (ud->cf->reporttopic)
+		pub(ud, (char *)ud->cf->reporttopic, buf, false);
+}
+
+void dedup_metrics(struct mbuf *mb)
+{
+	mbuf_printf(mb, "# HELP qtripp_duplicates_total Reports dropped as already received.\n"
+		"# TYPE qtripp_duplicates_total counter\n"
+		"qtripp_duplicates_total %lu\n", dropped);
+}
@@ -0,0 +1,34 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _DEDUP_H_INCL_
+# define  _DEDUP_H_INCL_
+
+#include <stdbool.h>
+#include "udata.h"
+
+struct mbuf;
+
+bool dedup_init(struct udata *ud);
+bool dedup_seen(struct udata *ud, const char *imei, const char *subtype, const char *count, const char *utc);
+bool dedup_save(struct udata *ud);
+void dedup_stats(struct udata *ud);
+void dedup_metrics(struct mbuf *mb);
+
+#endif
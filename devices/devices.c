@@ -20,12 +20,144 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
 
 #include "devices.h"
 #include "devices.i"	/* generated from devices.j2 */
 
 static struct _device *myhash = NULL;
 
+/* The names of devices.yml, for the fields of binary layouts */
+#define FIELD(name, member)	{ name, offsetof(struct _device, member) }
+
+static struct {
+	char *name;
+	size_t off;
+} fieldnames[] = {
+	FIELD("imei", imei),	FIELD("name", name),	FIELD("uext", uext),
+	FIELD("rit", rit),	FIELD("rid", rid),	FIELD("rty", rty),
+	FIELD("number", num),	FIELD("acc", acc),	FIELD("cog", cog),
+	FIELD("alt", alt),	FIELD("vel", vel),	FIELD("lon", lon),
+	FIELD("lat", lat),	FIELD("utc", utc),	FIELD("mcc", mcc),
+	FIELD("mnc", mnc),	FIELD("lac", lac),	FIELD("cid", cid),
+	FIELD("odometer", odometer), FIELD("hmc", hmc),	FIELD("aiv", aiv),
+	FIELD("batt", batt),	FIELD("devs", devs),	FIELD("sent", sent),
+	FIELD("count", count),	FIELD("din", din),	FIELD("dout", dout),
+	FIELD("mst", mst),	FIELD("ios", ios),	FIELD("ubatt", ubatt),
+	FIELD("don", don),	FIELD("doff", doff),	FIELD("nmds", nmds),
+	FIELD("rpm", rpm),	FIELD("fcon", fcon),	FIELD("flvl", flvl),
+	FIELD("vin", vin),
+	{ NULL, 0 }
+};
+
+static void hexfatal(struct _device *dp, char *tok, char *why)
+{
+	fprintf(stderr, "Fatal: binary layout of %s: %s: %s\n", dp->id, tok, why);
+	exit(7);
+}
+
+/*
+ * Compile the `hex' of `dp', e.g. "rit:u1 number:u1 [ acc:u1 vel:u2.1 ... ]
+ * sent:t count:x2", into dp->hexfields. Each field is name:type, where
+ * name is that of the ASCII layout (or `reserved') and type is one of
+ *
+ *	uN	unsigned, N bytes; uN.P has P decimals (u2.1: 425 is 42.5)
+ *	sN	signed, likewise
+ *	xN	N bytes as 2N hex digits
+ *	aN	N bytes of text, NUL-padded
+ *	t	7 bytes of time: year (2), month, day, hour, minute, second
+ *	m	5 bytes of hour meter: hours (3), minutes, seconds
+ *
+ * [ and ] enclose the position block, which repeats `number' times.
+ */
+
+static void compile_hex(struct _device *dp)
+{
+	struct _hexfield *hf;
+	char *copy, *tok, *next, *colon, *type, *end;
+	bool inblock = false, blocked = false, numbered = false;
+	int n, max = 1;
+
+	for (tok = dp->hex; *tok; tok++) {
+		if (*tok == ' ')
+			max++;
+	}
+	if ((dp->hexfields = calloc(max, sizeof(struct _hexfield))) == NULL ||
+	    (copy = strdup(dp->hex)) == NULL) {
+		fprintf(stderr, "Fatal: out of memory\n");
+		exit(7);
+	}
+
+	for (next = copy; (tok = strsep(&next, " ")) != NULL; ) {
+		if (*tok == 0)
+			continue;
+		if (strcmp(tok, "[") == 0 || strcmp(tok, "]") == 0) {
+			if ((*tok == '[') == inblock || (*tok == '[' && blocked))
+				hexfatal(dp, tok, "one position block, please");
+			if (*tok == '[' && !numbered)
+				hexfatal(dp, tok, "the position block needs `number' before it");
+			inblock = !inblock;
+			blocked = true;
+			continue;
+		}
+
+		hf = &dp->hexfields[dp->nhexfields++];
+		hf->block = inblock;
+
+		if ((colon = strchr(tok, ':')) == NULL)
+			hexfatal(dp, tok, "expecting name:type");
+		*colon = 0;
+		if (strcmp(tok, "reserved") != 0) {
+			for (n = 0; fieldnames[n].name != NULL; n++) {
+				if (strcmp(fieldnames[n].name, tok) == 0)
+					break;
+			}
+			if (fieldnames[n].name == NULL)
+				hexfatal(dp, tok, "no such field");
+			hf->slot = *(int *)((char *)dp + fieldnames[n].off);
+			if (hf->slot <= 0)
+				hexfatal(dp, tok, "not in the ASCII layout");
+		}
+
+		type = colon + 1;
+		hf->kind = *type;
+		switch (hf->kind) {
+			case 't':
+				hf->size = 7;
+				break;
+			case 'm':
+				hf->size = 5;
+				break;
+			case 'u':
+			case 's':
+			case 'x':
+			case 'a':
+				n = strtol(type + 1, &end, 10);
+				if (n < 1 || n > (hf->kind == 'a' ? 64 : 8))
+					hexfatal(dp, type, "bad size");
+				hf->size = n;
+				if (*end == '.' && (hf->kind == 'u' || hf->kind == 's')) {
+					hf->prec = strtol(end + 1, &end, 10);
+					if (hf->prec > 9)
+						hexfatal(dp, type, "too many decimals");
+				}
+				if (*end != 0)
+					hexfatal(dp, type, "bad type");
+				break;
+			default:
+				hexfatal(dp, type, "bad type");
+		}
+		if (hf->slot > 0 && hf->slot == dp->num) {
+			if (hf->kind != 'u' || hf->prec != 0 || hf->block)
+				hexfatal(dp, tok, "`number' is an unsigned count");
+			numbered = true;
+		}
+	}
+	if (inblock)
+		hexfatal(dp, "[", "unterminated block");
+	free(copy);
+}
+
 void load_devices()
 {
 	struct _device *rp, *s;
@@ -36,6 +168,8 @@ void load_devices()
 			fprintf(stderr, "Fatal: device hash for %s already in hash\n", rp->id);
 			exit(7);
 		}
+		if (rp->hex != NULL)
+			compile_hex(rp);
 
 		HASH_ADD_KEYPTR(hh, myhash, rp->id, strlen(rp->id), rp);
 	}
@@ -46,7 +180,10 @@ void free_devices()
 
 	HASH_ITER(hh, myhash, s, tmp) {
 		HASH_DEL(myhash, s);
-		/* nothing to free as the structure itself is static */
+		/* the structure itself is static */
+		free(s->hexfields);
+		s->hexfields = NULL;
+		s->nhexfields = 0;
 		// free(s);
 	}
 }
@@ -19,8 +19,23 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include "uthash.h"
 
+/*
+ * A field of a binary (HEX) report, compiled from the layout's `hex' in
+ * devices.yml: `size' bytes, big-endian, which become ASCII field `slot'
+ * as the device would have sent it in an ASCII report.
+ */
+
+struct _hexfield {
+	int slot;		/* 0: not wanted (e.g. reserved) */
+	char kind;		/* u, s: decimal; x: hex digits; t: time; a: text; m: hour meter */
+	unsigned char size;	/* bytes */
+	unsigned char prec;	/* decimals of u and s */
+	bool block;		/* in the position block, which repeats `number' times */
+};
+
 struct _device {
 	char *id;		/* e.g. "GTFRI-MOMAMI" for MOdel, MAjor, MInor */
 
@@ -73,9 +88,15 @@ struct _device {
 
 	char *add_name;
 
+	char *hex;			/* binary layout, as in devices.yml */
+	struct _hexfield *hexfields;	/* ... compiled by load_devices() */
+	int nhexfields;
+
         UT_hash_handle hh;
 };
 
+extern struct _device devices[];	/* generated; ends with id == NULL */
+
 void load_devices();
 void free_devices();
 struct _device *lookup_devices(char *key, char *monami);
@@ -0,0 +1,66 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "hextypes.h"
+#include "hextypes.i"	/* generated from hextypes.j2 */
+
+/* There are but 256 message types: index them directly */
+static struct _hextype *bytype[256];
+
+void load_hextypes()
+{
+	struct _hextype *rp;
+	unsigned long type;
+	char *end;
+
+	for (rp = hextypes; rp->id != NULL; rp++) {
+		type = strtoul(rp->id, &end, 16);
+		if (*end != 0 || type > 0xFF || type == ':') {
+			fprintf(stderr, "Fatal: invalid binary message type %s for %s\n", rp->id, rp->subtype);
+			exit(7);
+		}
+		bytype[type] = rp;
+	}
+}
+
+void free_hextypes()
+{
+	memset(bytype, 0, sizeof(bytype));
+}
+
+struct _hextype *lookup_hextypes(int type)
+{
+	return (bytype[type & 0xFF]);
+}
+
+/* The other way round, for those who build binary reports */
+struct _hextype *lookup_hextypes_subtype(char *subtype)
+{
+	struct _hextype *rp;
+
+	for (rp = hextypes; rp->id != NULL; rp++) {
+		if (strcmp(rp->subtype, subtype) == 0)
+			return (rp);
+	}
+	return (NULL);
+}
@@ -0,0 +1,39 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+/*
+ * The message type of a binary (HEX) report, in its header, says which
+ * subtype it is. `:' (3A) can't be one, lest "+ACK:" be taken for a
+ * binary +ACK.
+ */
+
+struct _hextype {
+	char *id;		/* "01", the message type in hex */
+	char *subtype;		/* "GTFRI" */
+};
+
+extern struct _hextype hextypes[];	/* generated; ends with id == NULL */
+
+void load_hextypes();
+void free_hextypes();
+struct _hextype *lookup_hextypes(int type);
+struct _hextype *lookup_hextypes_subtype(char *subtype);
@@ -0,0 +1,492 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "json.h"
+#include "conf.h"
+#include "util.h"
+#include "tline.h"
+#include "http.h"
+#include "geo.h"
+
+/*
+ * Geofences, circles and polygons, from a JSON file (`file' in
+ * [geofences]) like OwnTracks' waypoints:
+ *
+ *	[
+ *	  { "desc": "Depot", "tst": 1514764800, "lat": 52.5, "lon": 13.4, "rad": 200 },
+ *	  { "desc": "Yard", "poly": [ [52.51, 13.40], [52.52, 13.41], [52.50, 13.42] ] }
+ *	]
+ *
+ * Each device's positions are checked against them, and when it enters
+ * or leaves one a `_type: transition' event is published to its topic
+ * + "/event". What a device was in is kept with the rest of what we know
+ * about it; its first position after startup only sets that.
+ *
+ * Fences are found through a grid of `cell' degrees: every cell their
+ * bounding box touches lists them, so a position is tested only against
+ * those of its own cell. The cells are an open-addressed table over one
+ * array of entries, each with its fence's bounding box, so that most
+ * fences are ruled out without looking at them. Fences spanning more
+ * than GEO_MAXCELLS cells are tested for every position.
+ */
+
+#define GEO_MAXCELLS	4096
+#define METERS_PER_DEG	111195.0	/* on a sphere of 6371 km */
+
+struct fence {
+	char *desc;
+	long wtst;
+	double lat, lon, rad;		/* a circle if rad > 0 ... */
+	double mpdlon;			/* ... and meters per degree of longitude there */
+	double *pts;			/* else a polygon, lat/lon pairs */
+	int npts;
+	double minlat, maxlat, minlon, maxlon;
+};
+
+/* A fence in a cell; the box is rounded outwards */
+struct entry {
+	float minlat, maxlat, minlon, maxlon;
+	int id;
+};
+
+struct cell {
+	int64_t key;
+	int start, n;			/* its entries, by ascending id */
+};
+
+static struct fence *fences = NULL;
+static int nfences = 0, fsize = 0;
+static struct entry *entries = NULL;
+static struct cell *cells = NULL;	/* the table; n == 0 is a free slot */
+static unsigned long cellmask = 0;	/* its size - 1 */
+static int ncells = 0;
+static int *big = NULL, nbig = 0;
+static double cellsize = GEO_CELL;
+static unsigned long checked = 0, transitions = 0;
+
+static int64_t cellkey(long y, long x)
+{
+	return (((int64_t)y << 32) | (uint32_t)x);
+}
+
+static struct fence *fence_new(const char *desc, long wtst)
+{
+	struct fence *f;
+
+	if (nfences == fsize) {
+		int size = fsize ? fsize * 2 : 1024;
+
+		if ((f = realloc(fences, size * sizeof(struct fence))) == NULL)
+			return (NULL);
+		fences = f;
+		fsize = size;
+	}
+	f = &fences[nfences];
+	memset(f, 0, sizeof(struct fence));
+	f->desc = strdup(desc ? desc : "");
+	f->wtst = wtst;
+	return (f);
+}
+
+int geo_add_circle(const char *desc, long wtst, double lat, double lon, double rad)
+{
+	struct fence *f;
+	double dlat, dlon;
+
+	if (rad <= 0 || fabs(lat) > 89 || fabs(lon) > 180 || (f = fence_new(desc, wtst)) == NULL)
+		return (-1);
+	f->lat = lat;
+	f->lon = lon;
+	f->rad = rad;
+	f->mpdlon = METERS_PER_DEG * cos(lat * M_PI / 180.0);
+	dlat = rad / METERS_PER_DEG;
+	dlon = rad / f->mpdlon;
+	f->minlat = lat - dlat;
+	f->maxlat = lat + dlat;
+	f->minlon = lon - dlon;
+	f->maxlon = lon + dlon;
+	return (nfences++);
+}
+
+int geo_add_polygon(const char *desc, long wtst, const double *latlon, int npoints)
+{
+	struct fence *f;
+	int n;
+
+	if (npoints < 3 || (f = fence_new(desc, wtst)) == NULL)
+		return (-1);
+	if ((f->pts = malloc(npoints * 2 * sizeof(double))) == NULL) {
+		free(f->desc);
+		return (-1);
+	}
+	memcpy(f->pts, latlon, npoints * 2 * sizeof(double));
+	f->npts = npoints;
+	f->minlat = f->maxlat = latlon[0];
+	f->minlon = f->maxlon = latlon[1];
+	for (n = 1; n < npoints; n++) {
+		f->minlat = fmin(f->minlat, latlon[2 * n]);
+		f->maxlat = fmax(f->maxlat, latlon[2 * n]);
+		f->minlon = fmin(f->minlon, latlon[2 * n + 1]);
+		f->maxlon = fmax(f->maxlon, latlon[2 * n + 1]);
+	}
+	return (nfences++);
+}
+
+static unsigned long cellhash(int64_t key)
+{
+	return ((unsigned long)(((uint64_t)key * 0x9E3779B97F4A7C15ULL) >> 32));
+}
+
+struct pair {
+	int64_t key;
+	int id;
+};
+
+static int bykey(const void *a, const void *b)
+{
+	const struct pair *x = a, *y = b;
+
+	if (x->key != y->key)
+		return (x->key < y->key ? -1 : 1);
+	return (x->id - y->id);
+}
+
+/*
+ * (Re)build the grid over the fences, with cells of `cell' degrees: list
+ * (cell, fence) pairs, sort them by cell, and make a table of the runs.
+ */
+
+void geo_index(double cell)
+{
+	struct pair *pairs = NULL;
+	long x, y, x0, x1, y0, y1;
+	size_t npairs = 0, psize = 0, n, i;
+	unsigned long size, h = 0;
+	int id;
+
+	free(entries);
+	free(cells);
+	free(big);
+	entries = NULL;
+	cells = NULL;
+	big = NULL;
+	nbig = ncells = 0;
+	cellmask = 0;
+
+	cellsize = cell > 0 ? cell : GEO_CELL;
+	for (id = 0; id < nfences; id++) {
+		struct fence *f = &fences[id];
+
+		y0 = floor(f->minlat / cellsize);
+		y1 = floor(f->maxlat / cellsize);
+		x0 = floor(f->minlon / cellsize);
+		x1 = floor(f->maxlon / cellsize);
+		if ((y1 - y0 + 1) * (x1 - x0 + 1) > GEO_MAXCELLS) {
+			if ((big = realloc(big, (nbig + 1) * sizeof(int))) != NULL)
+				big[nbig++] = id;
+			continue;
+		}
+		for (y = y0; y <= y1; y++) {
+			for (x = x0; x <= x1; x++) {
+				if (npairs == psize) {
+					psize = psize ? psize * 2 : 4096;
+					if ((pairs = realloc(pairs, psize * sizeof(struct pair))) == NULL)
+						return;
+				}
+				pairs[npairs].key = cellkey(y, x);
+				pairs[npairs++].id = id;
+			}
+		}
+	}
+	if (npairs == 0)
+		return;
+	qsort(pairs, npairs, sizeof(struct pair), bykey);
+
+	for (n = 1, i = 1; i < npairs; i++) {
+		if (pairs[i].key != pairs[i - 1].key)
+			n++;
+	}
+	for (size = 1024; size < 2 * n; size *= 2)
+		;
+	cells = calloc(size, sizeof(struct cell));
+	entries = malloc(npairs * sizeof(struct entry));
+	if (cells == NULL || entries == NULL) {
+		free(cells);
+		free(entries);
+		free(pairs);
+		cells = NULL;
+		entries = NULL;
+		return;
+	}
+	cellmask = size - 1;
+
+	for (i = 0; i < npairs; i++) {
+		struct fence *f = &fences[pairs[i].id];
+		struct entry *e = &entries[i];
+
+		if (i == 0 || pairs[i].key != pairs[i - 1].key) {
+			for (h = cellhash(pairs[i].key) & cellmask; cells[h].n > 0; h = (h + 1) & cellmask)
+				;
+			cells[h].key = pairs[i].key;
+			cells[h].start = i;
+			ncells++;
+		}
+		cells[h].n++;
+		e->minlat = nextafterf((float)f->minlat, -INFINITY);
+		e->maxlat = nextafterf((float)f->maxlat, INFINITY);
+		e->minlon = nextafterf((float)f->minlon, -INFINITY);
+		e->maxlon = nextafterf((float)f->maxlon, INFINITY);
+		e->id = pairs[i].id;
+	}
+	free(pairs);
+}
+
+static bool in_fence(struct fence *f, double lat, double lon)
+{
+	double dy, dx, *p, *q;
+	bool in = false;
+	int n;
+
+	if (lat < f->minlat || lat > f->maxlat || lon < f->minlon || lon > f->maxlon)
+		return (false);
+
+	if (f->rad > 0) {
+		dy = (lat - f->lat) * METERS_PER_DEG;
+		dx = (lon - f->lon) * f->mpdlon;
+		return (dx * dx + dy * dy <= f->rad * f->rad);
+	}
+
+	/* crossings of a ray from the point towards increasing longitude */
+	for (n = 0, q = f->pts + 2 * (f->npts - 1); n < f->npts; n++, q = p) {
+		p = f->pts + 2 * n;
+		if ((p[0] > lat) != (q[0] > lat) &&
+		    lon < (q[1] - p[1]) * (lat - p[0]) / (q[0] - p[0]) + p[1])
+			in = !in;
+	}
+	return (in);
+}
+
+/* The numbers of the fences `lat', `lon' is in, ascending, up to `max' */
+int geo_inside(double lat, double lon, int *ids, int max)
+{
+	int64_t key = cellkey(floor(lat / cellsize), floor(lon / cellsize));
+	struct cell *c = NULL;
+	struct entry *e, *end;
+	unsigned long h;
+	int n = 0, i, j, id;
+
+	for (h = cellhash(key) & cellmask; cells != NULL && cells[h].n > 0; h = (h + 1) & cellmask) {
+		if (cells[h].key == key) {
+			c = &cells[h];
+			break;
+		}
+	}
+	for (e = c ? entries + c->start : NULL, end = e + (c ? c->n : 0); e < end && n < max; e++) {
+		if (lat >= e->minlat && lat <= e->maxlat && lon >= e->minlon && lon <= e->maxlon &&
+		    in_fence(&fences[e->id], lat, lon))
+			ids[n++] = e->id;
+	}
+	for (i = 0; i < nbig && n < max; i++) {
+		if (!in_fence(&fences[big[i]], lat, lon))
+			continue;
+		/* keep them in order */
+		for (id = big[i], j = n++; j > 0 && ids[j - 1] > id; j--)
+			ids[j] = ids[j - 1];
+		ids[j] = id;
+	}
+	return (n);
+}
+
+static void transition(struct udata *ud, char *imei, int id, const char *event, double lat, double lon, time_t tst)
+{
+	struct fence *f = &fences[id];
+	JsonNode *obj = json_mkobject();
+
+	json_append_member(obj, "_type", json_mkstring("transition"));
+	json_append_member(obj, "event", json_mkstring(event));
+	json_append_member(obj, "desc", json_mkstring(f->desc));
+	json_append_member(obj, "t", json_mkstring("c"));
+	json_append_member(obj, "wtst", json_mknumber(f->wtst));
+	json_append_member(obj, "lat", json_mkdouble(lat, 6));
+	json_append_member(obj, "lon", json_mkdouble(lon, 6));
+	json_append_member(obj, "tst", json_mknumber(tst));
+
+	transitions++;
+	STATSD_INC(ud->cf->sd, "geofence.transition");
+	transmit_event(ud, imei, obj);
+	json_delete(obj);
+}
+
+/*
+ * `imei' is at `lat', `lon' as of `tst': publish transitions between
+ * the fences of `gs' and those it is in now. Positions older than the
+ * last (e.g. from +BUFF) don't count.
+ */
+
+void geo_update(struct udata *ud, char *imei, struct geostate *gs, double lat, double lon, time_t tst)
+{
+	int ids[GEO_MAXINSIDE], n, i = 0, j = 0;
+	bool first = (gs->tst == 0), changed = false;
+
+	if (nfences == 0 || tst < gs->tst)
+		return;
+
+	checked++;
+	n = geo_inside(lat, lon, ids, GEO_MAXINSIDE);
+	gs->tst = tst;
+
+	while (i < gs->ninside || j < n) {
+		if (j == n || (i < gs->ninside && gs->inside[i] < ids[j])) {
+			if (!first)
+				transition(ud, imei, gs->inside[i], "leave", lat, lon, tst);
+			i++;
+		} else if (i == gs->ninside || ids[j] < gs->inside[i]) {
+			if (!first)
+				transition(ud, imei, ids[j], "enter", lat, lon, tst);
+			j++;
+		} else {
+			i++;
+			j++;
+			continue;
+		}
+		changed = true;
+	}
+
+	if (changed) {
+		free(gs->inside);
+		gs->inside = NULL;
+		gs->ninside = 0;
+		if (n > 0 && (gs->inside = malloc(n * sizeof(int))) != NULL) {
+			memcpy(gs->inside, ids, n * sizeof(int));
+			gs->ninside = n;
+		}
+	}
+}
+
+/* Add the fences in the JSON file at `path'; returns how many, or -1 */
+int geo_load(struct udata *ud, const char *path)
+{
+	JsonNode *doc, *f, *j, *lat, *lon, *rad, *pt;
+	double *pts;
+	char *js, *desc;
+	int n, loaded = 0;
+	long wtst;
+
+	if ((js = slurp_file((char *)path, false)) == NULL) {
+		xlog(ud, "Geofences: cannot read %s\n", path);
+		return (-1);
+	}
+	doc = json_decode(js);
+	free(js);
+	if (doc == NULL || doc->tag != JSON_ARRAY) {
+		xlog(ud, "Geofences: %s is not a JSON array\n", path);
+		if (doc)
+			json_delete(doc);
+		return (-1);
+	}
+
+	json_foreach(f, doc) {
+		desc = ((j = json_find_member(f, "desc")) && j->tag == JSON_STRING) ? j->string_ : "";
+		wtst = ((j = json_find_member(f, "tst")) && j->tag == JSON_NUMBER) ? (long)j->number_ : 0;
+
+		if ((j = json_find_member(f, "poly")) != NULL && j->tag == JSON_ARRAY) {
+			n = 0;
+			json_foreach(pt, j)
+				n++;
+			if ((pts = malloc(n * 2 * sizeof(double) + 1)) == NULL)
+				break;
+			n = 0;
+			json_foreach(pt, j) {
+				lat = json_find_element(pt, 0);
+				lon = json_find_element(pt, 1);
+				if (lat == NULL || lon == NULL || lat->tag != JSON_NUMBER || lon->tag != JSON_NUMBER)
+					break;
+				pts[2 * n] = lat->number_;
+				pts[2 * n + 1] = lon->number_;
+				n++;
+			}
+			if (pt == NULL && geo_add_polygon(desc, wtst, pts, n) >= 0)
+				loaded++;
+			else
+				xlog(ud, "Geofences: bad polygon `%s' in %s\n", desc, path);
+			free(pts);
+			continue;
+		}
+
+		lat = json_find_member(f, "lat");
+		lon = json_find_member(f, "lon");
+		rad = json_find_member(f, "rad");
+		if (lat && lon && rad && lat->tag == JSON_NUMBER && lon->tag == JSON_NUMBER &&
+		    rad->tag == JSON_NUMBER &&
+		    geo_add_circle(desc, wtst, lat->number_, lon->number_, rad->number_) >= 0)
+			loaded++;
+		else
+			xlog(ud, "Geofences: bad fence `%s' in %s\n", desc, path);
+	}
+	json_delete(doc);
+	return (loaded);
+}
+
+bool geo_enabled(void)
+{
+	return (nfences > 0);
+}
+
+bool geo_init(struct udata *ud)
+{
+	config *cf = ud->cf;
+	int n;
+
+	if (cf->geo_file == NULL)
+		return (true);
+	if ((n = geo_load(ud, cf->geo_file)) < 0)
+		return (false);
+	geo_index(cf->geo_cell);
+	xlog(ud, "Geofences: %d from %s in %d cells of %g degrees, %d large\n",
+		n, cf->geo_file, ncells, cellsize, nbig);
+	return (true);
+}
+
+void geo_stats(struct udata *ud)
+{
+	char buf[BUFSIZ];
+
+	if (nfences == 0)
+		return;
+	snprintf(buf, sizeof(buf), "geofences fences=%d cells=%d checked=%lu transitions=%lu",
+		nfences, ncells, checked, transitions);
+	xlog(ud, "stats: %s\n", buf);
+	if (ud->cf->reporttopic)
+		pub(ud, (char *)ud->cf->reporttopic, buf, false);
+}
+
+void geo_metrics(struct mbuf *mb)
+{
+	mbuf_printf(mb, "# HELP qtripp_geofences Geofences loaded.\n"
+		"# TYPE qtripp_geofences gauge\n"
+		"qtripp_geofences %d\n", nfences);
+	mbuf_printf(mb, "# HELP qtripp_geofence_transitions_total Geofences entered or left.\n"
+		"# TYPE qtripp_geofence_transitions_total counter\n"
+		"qtripp_geofence_transitions_total %lu\n", transitions);
+}
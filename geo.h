@@ -0,0 +1,50 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _GEO_H_INCL_
+# define  _GEO_H_INCL_
+
+#include <stdbool.h>
+#include <time.h>
+#include "udata.h"
+
+struct mbuf;
+
+/* Where a device was as of its last position: the fences it is in */
+struct geostate {
+	int *inside;			/* fence numbers, ascending */
+	int ninside;
+	time_t tst;			/* of that position; 0: none yet */
+};
+
+#define GEO_CELL	0.01		/* default grid cell, in degrees */
+#define GEO_MAXINSIDE	64		/* fences a position can be in */
+
+bool geo_init(struct udata *ud);
+bool geo_enabled(void);
+int geo_load(struct udata *ud, const char *path);
+int geo_add_circle(const char *desc, long wtst, double lat, double lon, double rad);
+int geo_add_polygon(const char *desc, long wtst, const double *latlon, int npoints);
+void geo_index(double cell);
+int geo_inside(double lat, double lon, int *ids, int max);
+void geo_update(struct udata *ud, char *imei, struct geostate *gs, double lat, double lon, time_t tst);
+void geo_stats(struct udata *ud);
+void geo_metrics(struct mbuf *mb);
+
+#endif
@@ -0,0 +1,324 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "devices.h"
+#include "hextypes.h"
+#include "hex.h"
+
+/*
+ * Binary frames are turned into the fields the equivalent ASCII report
+ * would have had, at the same positions, so handle_report()'s decoding
+ * applies to both and produces the same. Fields are rendered straight
+ * from their bytes into a static arena, rather than being split off a
+ * line and allocated one by one.
+ */
+
+#define BLOCK		12		/* ASCII fields per position block */
+
+static const struct {
+	char hdr[5];
+	char *abr;
+} classes[] = {
+	{ "+RSP", "RESP" },
+	{ "+EVT", "RESP" },
+	{ "+BSP", "BUFF" },
+	{ "+BVT", "BUFF" },
+	{ "+ACK", "ACK" },
+};
+#define NCLASSES	(sizeof(classes) / sizeof(classes[0]))
+
+static const char hexdigits[] = "0123456789ABCDEF";
+static char *parts[MAXSPLITPARTS];
+static int nfilled;			/* parts[] set so far */
+static char arena[HEX_LINESIZE], *ap;
+
+static unsigned long long be(const unsigned char *p, int size)
+{
+	unsigned long long v = 0;
+
+	while (size-- > 0)
+		v = (v << 8) | *p++;
+	return (v);
+}
+
+/*
+ * How long the binary frame at the start of `buf' is: 0 if there isn't
+ * one there (but perhaps an ASCII record), -1 if more of it is to come.
+ */
+
+long hex_frame(const char *buf, size_t len)
+{
+	size_t cmp = len < 4 ? len : 4, c;
+	long flen;
+
+	if (len == 0 || *buf != '+')
+		return (0);
+	for (c = 0; c < NCLASSES; c++) {
+		if (memcmp(buf, classes[c].hdr, cmp) == 0)
+			break;
+	}
+	if (c == NCLASSES || (len > 4 && buf[4] == ':'))
+		return (0);
+	if (len < 7)
+		return (-1);
+
+	flen = be((const unsigned char *)buf + 5, 2);
+	if (flen < HEX_MINLEN || flen > HEX_MAXFRAME)
+		return (0);
+	return ((size_t)flen > len ? -1 : flen);
+}
+
+/* +BSP or +BVT */
+bool hex_buffered(const char *frame)
+{
+	return (frame[1] == 'B');
+}
+
+bool hex_imei(const char *frame, char *imei, size_t size)
+{
+	return (snprintf(imei, size, "%llu", be((const unsigned char *)frame + 10, 8)) < (int)size);
+}
+
+/* Decimal digits of `v', at least `width' of them, at `a'; returns the end */
+static char *digits(char *a, unsigned long long v, int width)
+{
+	char tmp[24], *t = tmp + sizeof(tmp);
+
+	do {
+		*--t = '0' + v % 10;
+		v /= 10;
+		width--;
+	} while (v > 0 || width > 0);
+	memcpy(a, t, tmp + sizeof(tmp) - t);
+	return (a + (tmp + sizeof(tmp) - t));
+}
+
+/* Put the string at `s' (in the arena) into field `slot' */
+static bool place(int slot, char *s)
+{
+	if (slot >= MAXSPLITPARTS - 1)
+		return (false);
+	while (nfilled <= slot)
+		parts[nfilled++] = "";
+	parts[slot] = s;
+	return (true);
+}
+
+/*
+ * Render field `hf' at `*pp' into field `slot', and advance `*pp'. Its
+ * value, if it's a number, goes to `*val'.
+ */
+
+static bool field(struct _hexfield *hf, const unsigned char **pp, const unsigned char *end, int slot, unsigned long long *val)
+{
+	const unsigned char *p = *pp;
+	unsigned long long v;
+	char *s = ap, *dot;
+	int n;
+
+	if (p + hf->size > end || arena + sizeof(arena) - ap < 32 + 2 * hf->size)
+		return (false);
+	if (slot <= 0) {
+		*pp = p + hf->size;
+		return (true);
+	}
+
+	switch (hf->kind) {
+		case 'u':
+		case 's':
+			v = be(p, hf->size);
+			if (hf->kind == 's' && hf->size < 8 && (v >> (hf->size * 8 - 1)) & 1)
+				v |= ~0ULL << (hf->size * 8);
+			*val = v;
+			if (hf->kind == 's' && (long long)v < 0) {
+				*ap++ = '-';
+				v = -(long long)v;
+			}
+			ap = digits(ap, v, hf->prec + 1);
+			if (hf->prec > 0) {
+				/* make room for the point */
+				dot = ap - hf->prec;
+				memmove(dot + 1, dot, hf->prec);
+				*dot = '.';
+				ap++;
+			}
+			break;
+
+		case 'x':
+			for (n = 0; n < hf->size; n++) {
+				*ap++ = hexdigits[p[n] >> 4];
+				*ap++ = hexdigits[p[n] & 0x0F];
+			}
+			break;
+
+		case 'a':
+			for (n = 0; n < hf->size && p[n] != 0; n++)
+				*ap++ = (p[n] == ',' || p[n] == '$') ? '.' : p[n];
+			break;
+
+		case 't':
+			/* all zeroes: no time, as with no fix */
+			for (n = 0; n < 7 && p[n] == 0; n++)
+				;
+			if (n < 7) {
+				ap = digits(ap, be(p, 2), 4);
+				for (n = 2; n < 7; n++)
+					ap = digits(ap, p[n], 2);
+			}
+			break;
+
+		case 'm':
+			ap = digits(ap, be(p, 3), 5);
+			*ap++ = ':';
+			ap = digits(ap, p[3], 2);
+			*ap++ = ':';
+			ap = digits(ap, p[4], 2);
+			break;
+	}
+	*ap++ = 0;
+	*pp = p + hf->size;
+	return (place(slot, s));
+}
+
+/*
+ * Split the binary frame at `frame' (as hex_frame() found it) into the
+ * fields of the equivalent ASCII report, like clean_split(): parts[0] is
+ * e.g. "RESP:GTFRI", 1 the protocol version and 2 the IMEI. The result
+ * is valid until the next call.
+ */
+
+char **hex_split(struct udata *ud, const char *frame, size_t len, int *nparts)
+{
+	const unsigned char *p = (const unsigned char *)frame, *end = p + len - 2;
+	unsigned long long number = 1, val;
+	struct _hextype *ht;
+	struct _device *dp;
+	struct _hexfield *hf, *bstart = NULL, *bend = NULL;
+	char protov[8];
+	int shift = 0, rep, n;
+	size_t c;
+
+	for (c = 0; c < NCLASSES && memcmp(frame, classes[c].hdr, 4) != 0; c++)
+		;
+	if (c == NCLASSES || len < HEX_MINLEN || p[len - 2] != '\r' || p[len - 1] != '\n') {
+		xlog(ud, "Binary frame of %lu bytes is malformed\n", (unsigned long)len);
+		return (NULL);
+	}
+	if ((ht = lookup_hextypes(p[4])) == NULL) {
+		xlog(ud, "Binary frame of unknown message type %02X\n", p[4]);
+		return (NULL);
+	}
+
+	ap = arena;
+	parts[0] = ap;
+	n = strlen(classes[c].abr);
+	memcpy(ap, classes[c].abr, n);
+	ap[n++] = ':';
+	ap += n;
+	n = strlen(ht->subtype);
+	memcpy(ap, ht->subtype, n + 1);
+	ap += n + 1;
+	for (n = 0; n < 3; n++) {
+		protov[2 * n] = hexdigits[p[7 + n] >> 4];
+		protov[2 * n + 1] = hexdigits[p[7 + n] & 0x0F];
+	}
+	protov[6] = 0;
+	parts[1] = ap;
+	memcpy(ap, protov, 7);
+	ap += 7;
+	parts[2] = ap;
+	ap = digits(ap, be(p + 10, 8), 1);
+	*ap++ = 0;
+	nfilled = 3;
+	p += HEX_HDRLEN;
+
+	if ((dp = lookup_devices(ht->subtype, protov)) == NULL || dp->hexfields == NULL) {
+		/* an +ACK to a command has nothing we'd want but who sent it */
+		if (strcmp(classes[c].abr, "ACK") != 0) {
+			xlog(ud, "MISSING: binary layout for %s-%s\n", ht->subtype, protov);
+			return (NULL);
+		}
+		p = end;
+		dp = NULL;
+	}
+
+	for (n = 0; dp != NULL && n < dp->nhexfields; n++) {
+		hf = &dp->hexfields[n];
+
+		if (!hf->block) {
+			if (!field(hf, &p, end, hf->slot > 0 ? hf->slot + shift : 0, &val))
+				goto short_frame;
+			if (hf->slot > 0 && hf->slot == dp->num)
+				number = val;
+			continue;
+		}
+
+		/* the position block, `number' times over; what follows moves up */
+		if (number < 1 || number > MAXSPLITPARTS / BLOCK) {
+			xlog(ud, "Binary %s-%s: %llu position blocks\n", ht->subtype, protov, number);
+			return (NULL);
+		}
+		for (bstart = hf, bend = hf; bend < dp->hexfields + dp->nhexfields && bend->block; bend++)
+			;
+		for (rep = 0; rep < (int)number; rep++) {
+			for (hf = bstart; hf < bend; hf++) {
+				if (!field(hf, &p, end, hf->slot > 0 ? hf->slot + rep * BLOCK : 0, &val))
+					goto short_frame;
+			}
+		}
+		shift = ((int)number - 1) * BLOCK;
+		n = bend - dp->hexfields - 1;
+	}
+
+	if (p != end) {
+		xlog(ud, "Binary %s-%s: %ld bytes more than its layout has\n",
+			ht->subtype, protov, (long)(end - p));
+	}
+	parts[nfilled] = NULL;
+	*nparts = nfilled;
+	return (parts);
+
+  short_frame:
+	xlog(ud, "Binary %s-%s: frame of %lu bytes too short for its layout\n",
+		ht->subtype, protov, (unsigned long)len);
+	return (NULL);
+}
+
+/* The ASCII report, "+RESP:GTFRI,...$", of `parts' */
+int hex_line(char **parts, int nparts, char *buf, size_t size)
+{
+	size_t len = 0, n;
+	int i;
+
+	for (i = 0; i < nparts; i++) {
+		n = strlen(parts[i]);
+		if (len + n + 3 > size)
+			return (-1);
+		buf[len++] = i == 0 ? '+' : ',';
+		memcpy(buf + len, parts[i], n);
+		len += n;
+	}
+	buf[len++] = '$';
+	buf[len] = 0;
+	return (len);
+}
@@ -0,0 +1,63 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _HEX_H_INCL_
+# define  _HEX_H_INCL_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "udata.h"
+
+/*
+ * Binary reports in a simplified, fixed-layout framing of our own. This
+ * is not Queclink's HEX format, although the tags are borrowed from it:
+ * there, a report mask in the header decides which fields a frame has,
+ * and the header carries a firmware version, neither of which is
+ * parsed here. Real devices in HEX mode can't be decoded by this; it
+ * is for senders which produce exactly this framing (a gateway in front
+ * of devices, or bench/qsim -x). A frame is
+ *
+ *	+RSP, +EVT	4	a report (RESP), or
+ *	+BSP, +BVT		... one from the device's buffer (BUFF), or
+ *	+ACK			an acknowledgement or heartbeat (ACK)
+ *	message type	1	the subtype, from `hextypes' in devices.yml
+ *	length		2	of the whole frame
+ *	device type	1	\ the protocol version: MO, MA and MI of
+ *	version		2	/ the ASCII reports' "MOMAMI"
+ *	IMEI		8
+ *	...			every field of the layout's `hex' in devices.yml,
+ *				in order, the position block `number' (>= 1) times
+ *	tail		2	\r\n
+ *
+ * with numbers big-endian. The fields become those of the equivalent
+ * ASCII report, which is then handled like any other.
+ */
+
+#define HEX_HDRLEN	18
+#define HEX_MINLEN	(HEX_HDRLEN + 2)
+#define HEX_MAXFRAME	4096
+#define HEX_LINESIZE	(4 * HEX_MAXFRAME)	/* enough for the ASCII of any frame */
+
+long hex_frame(const char *buf, size_t len);
+bool hex_buffered(const char *frame);
+bool hex_imei(const char *frame, char *imei, size_t size);
+char **hex_split(struct udata *ud, const char *frame, size_t len, int *nparts);
+int hex_line(char **parts, int nparts, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,81 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <string.h>
+#include "hist.h"
+
+/* Smallest and one past the largest value counted in bucket `i' */
+static void bucket_range(int i, uint64_t *lo, uint64_t *hi)
+{
+	int g, shift;
+
+	if (i < HIST_SUB) {
+		*lo = i;
+		*hi = i + 1;
+		return;
+	}
+	g = i / HIST_SUB;
+	shift = g - 1;
+	*lo = (uint64_t)(HIST_SUB + i % HIST_SUB) << shift;
+	*hi = *lo + ((uint64_t)1 << shift);
+}
+
+/*
+ * The value below which `pct' percent of those added lie, as the middle
+ * of the bucket it falls into (but never more than the maximum seen).
+ */
+
+uint64_t hist_pct(struct hist *h, double pct)
+{
+	uint64_t want, seen = 0, lo, hi, v;
+	int i;
+
+	if (h->count == 0)
+		return (0);
+	want = (uint64_t)(h->count * pct / 100.0 + 0.5);
+	if (want < 1)
+		want = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->b[i];
+		if (seen >= want) {
+			bucket_range(i, &lo, &hi);
+			v = lo + (hi - lo - 1) / 2;
+			return (v > h->max ? h->max : v);
+		}
+	}
+	return (h->max);
+}
+
+void hist_merge(struct hist *to, struct hist *from)
+{
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		to->b[i] += from->b[i];
+	to->count += from->count;
+	to->sum += from->sum;
+	if (from->max > to->max)
+		to->max = from->max;
+}
+
+void hist_reset(struct hist *h)
+{
+	memset(h, 0, sizeof(*h));
+}
@@ -0,0 +1,64 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _HIST_H_INCL_
+# define  _HIST_H_INCL_
+
+#include <stdint.h>
+
+/*
+ * Log-linear histogram: values below HIST_SUB are counted exactly, above
+ * that each power of two is split into HIST_SUB linear buckets, so any
+ * value is off by at most 1/HIST_SUB (6.25%) whatever its magnitude.
+ * Adding a value is a count-leading-zeros, a shift and an increment.
+ */
+
+#define HIST_SUBBITS	4
+#define HIST_SUB	(1 << HIST_SUBBITS)
+#define HIST_BUCKETS	((64 - HIST_SUBBITS + 1) * HIST_SUB)
+
+struct hist {
+	uint64_t count, sum, max;
+	uint64_t b[HIST_BUCKETS];
+};
+
+static inline int hist_index(uint64_t v)
+{
+	int e;
+
+	if (v < HIST_SUB)
+		return ((int)v);
+	e = 63 - __builtin_clzll(v);
+	return ((e - HIST_SUBBITS + 1) * HIST_SUB + (int)((v >> (e - HIST_SUBBITS)) & (HIST_SUB - 1)));
+}
+
+static inline void hist_add(struct hist *h, uint64_t v)
+{
+	h->b[hist_index(v)]++;
+	h->count++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+}
+
+uint64_t hist_pct(struct hist *h, double pct);
+void hist_merge(struct hist *to, struct hist *from);
+void hist_reset(struct hist *h);
+
+#endif
@@ -0,0 +1,329 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include "mongoose.h"
+#include "conf.h"
+#include "util.h"
+#include "json.h"
+#include "tline.h"
+#include "lag.h"
+#include "prof.h"
+#include "dedup.h"
+#include "thin.h"
+#include "geo.h"
+#include "trip.h"
+#include "store.h"
+#include "recent.h"
+#include "snap.h"
+#include "lanes.h"
+#include "http.h"
+
+/*
+ * An optional HTTP listener (`http_listen') on the mongoose manager:
+ *
+ *	/metrics	counters and latency summaries in Prometheus' text format
+ *	/connections	device connections, as JSON
+ *	/devices	devices seen, as JSON
+ *	/recent		a device's last positions, as JSON
+ *
+ * The latter two are paginated (?limit=N, default HTTP_LIMIT, and
+ * ?after=<next> from the previous page) and produced incrementally: a
+ * chunk of HTTP_BATCH objects is added whenever the socket has taken what
+ * we gave it before, so a large fleet never holds up the ingest loop nor
+ * sits in memory as one response.
+ */
+
+#define HTTP_LIMIT	1000
+#define HTTP_MAXLIMIT	100000
+#define HTTP_BATCH	100
+#define HTTP_LOWWATER	(16 * 1024)	/* refill below this much unsent */
+
+struct stream {
+	struct mg_connection *nc;
+	struct http_source *src;
+	void *it;			/* next item to send, NULL when done */
+	long left;			/* items still to send on this page */
+	unsigned long last;		/* sequence number of the last one sent */
+	bool first;
+	struct stream *next;
+};
+static struct stream *streams = NULL;
+static struct udata *http_ud;
+static struct http_source **http_sources;	/* NULL-terminated */
+
+void mbuf_printf(struct mbuf *mb, const char *fmt, ...)
+{
+	char buf[BUFSIZ], *p = buf;
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = mg_avprintf(&p, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		mbuf_append(mb, p, n);
+	if (p != buf)
+		free(p);
+}
+
+void mbuf_json_string(struct mbuf *mb, const char *s)
+{
+	char *js;
+
+	if (s == NULL) {
+		mbuf_append(mb, "null", 4);
+	} else if ((js = json_encode_string(s)) != NULL) {
+		mbuf_append(mb, js, strlen(js));
+		free(js);
+	}
+}
+
+/*
+ * The item `it' is about to go away (a connection closed); streams which
+ * were going to send it next continue with `next' instead.
+ */
+
+void http_forget(void *it, void *next)
+{
+	struct stream *s;
+
+	for (s = streams; s != NULL; s = s->next) {
+		if (s->it == it)
+			s->it = next;
+	}
+}
+
+static void stream_free(struct stream *st)
+{
+	struct stream **sp;
+
+	for (sp = &streams; *sp != NULL; sp = &(*sp)->next) {
+		if (*sp == st) {
+			*sp = st->next;
+			break;
+		}
+	}
+	free(st);
+}
+
+/*
+ * Send the next batch of `st' if the socket has drained; finish the page
+ * with the cursor for the next one.
+ */
+
+static void stream_more(struct stream *st)
+{
+	struct mg_connection *nc = st->nc;
+	struct mbuf mb;
+	int n;
+
+	if (nc->send_mbuf.len > HTTP_LOWWATER)
+		return;
+
+	mbuf_init(&mb, 8192);
+	for (n = 0; n < HTTP_BATCH && st->it != NULL && st->left > 0; n++) {
+		if (!st->first)
+			mbuf_append(&mb, ",\n", 2);
+		st->first = false;
+		st->last = st->src->json(st->it, &mb);
+		st->it = st->src->next(st->it);
+		st->left--;
+	}
+
+	if (st->it == NULL || st->left == 0) {
+		if (st->it != NULL)
+			mbuf_printf(&mb, "\n], \"next\": %lu}\n", st->last);
+		else
+			mbuf_printf(&mb, "\n], \"next\": null}\n");
+		mg_send_http_chunk(nc, mb.buf, mb.len);
+		mg_send_http_chunk(nc, "", 0);
+		nc->flags |= MG_F_SEND_AND_CLOSE;
+		nc->user_data = NULL;
+		stream_free(st);
+	} else if (mb.len > 0) {
+		mg_send_http_chunk(nc, mb.buf, mb.len);
+	}
+	mbuf_free(&mb);
+}
+
+static void stream_start(struct mg_connection *nc, struct http_message *hm, struct http_source *src)
+{
+	struct stream *st;
+	char val[32];
+	unsigned long after = 0;
+	long limit = HTTP_LIMIT;
+
+	if (mg_get_http_var(&hm->query_string, "limit", val, sizeof(val)) > 0)
+		limit = atol(val);
+	if (limit < 1 || limit > HTTP_MAXLIMIT)
+		limit = HTTP_LIMIT;
+	if (mg_get_http_var(&hm->query_string, "after", val, sizeof(val)) > 0)
+		after = strtoul(val, NULL, 10);
+
+	if ((st = calloc(1, sizeof(struct stream))) == NULL) {
+		mg_http_send_error(nc, 500, NULL);
+		return;
+	}
+	st->nc = nc;
+	st->src = src;
+	st->it = src->first(after);
+	st->left = limit;
+	st->first = true;
+	st->next = streams;
+	streams = st;
+	nc->user_data = st;
+
+	mg_send_head(nc, 200, -1, "Content-Type: application/json");
+	mg_printf_http_chunk(nc, "{\"%s\": [\n", src->name);
+	stream_more(st);
+}
+
+static void metrics(struct mg_connection *nc)
+{
+	struct udata *ud = http_ud;
+	struct mbuf mb;
+
+	mbuf_init(&mb, 8192);
+
+	mbuf_printf(&mb, "# HELP qtripp_mqtt_published_total Publishes handed to libmosquitto.\n"
+		"# TYPE qtripp_mqtt_published_total counter\n"
+		"qtripp_mqtt_published_total %lu\n", ud->published);
+	mbuf_printf(&mb, "# HELP qtripp_mqtt_acked_total Publishes acknowledged by the broker.\n"
+		"# TYPE qtripp_mqtt_acked_total counter\n"
+		"qtripp_mqtt_acked_total %lu\n", ud->acked);
+
+	stats_metrics(ud, &mb);
+	lag_metrics(&mb);
+	dedup_metrics(&mb);
+	thin_metrics(&mb);
+	geo_metrics(&mb);
+	trip_metrics(&mb);
+	store_metrics(&mb);
+	recent_metrics(&mb);
+	snap_metrics(&mb);
+	lanes_metrics(&mb);
+	prof_metrics(&mb);
+
+	mg_send_head(nc, 200, mb.len, "Content-Type: text/plain; version=0.0.4");
+	mg_send(nc, mb.buf, mb.len);
+	nc->flags |= MG_F_SEND_AND_CLOSE;
+	mbuf_free(&mb);
+}
+
+/* /recent?imei=<imei>[&n=<fixes>][&since=<epoch>] */
+static void recent(struct mg_connection *nc, struct http_message *hm)
+{
+	char imei[32], val[32];
+	struct mbuf mb;
+	time_t since = 0;
+	int max = 0;
+
+	if (mg_get_http_var(&hm->query_string, "imei", imei, sizeof(imei)) <= 0) {
+		mg_http_send_error(nc, 400, NULL);
+		return;
+	}
+	if (mg_get_http_var(&hm->query_string, "n", val, sizeof(val)) > 0)
+		max = atoi(val);
+	if (mg_get_http_var(&hm->query_string, "since", val, sizeof(val)) > 0)
+		since = atol(val);
+
+	mbuf_init(&mb, 8192);
+	mbuf_printf(&mb, "{\"imei\": ");
+	mbuf_json_string(&mb, imei);
+	mbuf_printf(&mb, ", \"fixes\": ");
+	if (recent_json(imei, since, max, &mb) < 0) {
+		mbuf_free(&mb);
+		mg_http_send_error(nc, 404, NULL);
+		return;
+	}
+	mbuf_append(&mb, "}\n", 2);
+
+	mg_send_head(nc, 200, mb.len, "Content-Type: application/json");
+	mg_send(nc, mb.buf, mb.len);
+	nc->flags |= MG_F_SEND_AND_CLOSE;
+	mbuf_free(&mb);
+}
+
+static void http_handler(struct mg_connection *nc, int ev, void *ev_data)
+{
+	struct http_message *hm = (struct http_message *)ev_data;
+	struct stream *st = (struct stream *)nc->user_data;
+	struct http_source **src;
+
+	switch (ev) {
+		case MG_EV_HTTP_REQUEST:
+			STATSD_INC(http_ud->cf->sd, "http.request");
+			if (st != NULL) {
+				/* pipelined while still streaming; not for us */
+				nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+				break;
+			}
+			if (mg_vcmp(&hm->uri, "/metrics") == 0) {
+				metrics(nc);
+				break;
+			}
+			if (mg_vcmp(&hm->uri, "/recent") == 0) {
+				recent(nc, hm);
+				break;
+			}
+			for (src = http_sources; *src != NULL; src++) {
+				if (hm->uri.len == strlen((*src)->name) + 1 && *hm->uri.p == '/' &&
+				    strncmp(hm->uri.p + 1, (*src)->name, hm->uri.len - 1) == 0) {
+					stream_start(nc, hm, *src);
+					break;
+				}
+			}
+			if (*src == NULL)
+				mg_http_send_error(nc, 404, NULL);
+			break;
+
+		case MG_EV_SEND:
+		case MG_EV_POLL:
+			if (st != NULL)
+				stream_more(st);
+			break;
+
+		case MG_EV_CLOSE:
+			if (st != NULL) {
+				nc->user_data = NULL;
+				stream_free(st);
+			}
+			break;
+	}
+}
+
+bool http_init(struct udata *ud, struct mg_mgr *mgr, struct http_source **sources)
+{
+	struct mg_connection *nc;
+
+	http_ud = ud;
+	http_sources = sources;
+	if ((nc = mg_bind(mgr, ud->cf->http_listen, http_handler)) == NULL) {
+		xlog(ud, "Cannot listen for HTTP on %s\n", ud->cf->http_listen);
+		return (false);
+	}
+	mg_set_protocol_http_websocket(nc);
+	xlog(ud, "Listening for HTTP on %s\n", ud->cf->http_listen);
+	return (true);
+}
@@ -0,0 +1,50 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _HTTP_H_INCL_
+# define  _HTTP_H_INCL_
+
+#include <stdarg.h>
+#include "mongoose.h"
+#include "udata.h"
+
+/*
+ * Something which can be streamed as a JSON array: first() returns the
+ * first item added after sequence number `after' (0 for all), next() the
+ * one following `it', and json() appends `it' as a JSON object to `mb'
+ * and returns its sequence number. Items are visited in the order they
+ * were added; sequence numbers grow in that order.
+ */
+
+struct http_source {
+	const char *name;		/* served at /<name> */
+	void *(*first)(unsigned long after);
+	void *(*next)(void *it);
+	unsigned long (*json)(void *it, struct mbuf *mb);
+};
+
+extern struct http_source http_devices;		/* tline.c */
+extern struct http_source http_connections;	/* conn.c */
+
+bool http_init(struct udata *ud, struct mg_mgr *mgr, struct http_source **sources);
+void http_forget(void *it, void *next);
+void mbuf_printf(struct mbuf *mb, const char *fmt, ...);
+void mbuf_json_string(struct mbuf *mb, const char *s);
+
+#endif
@@ -23,9 +23,23 @@
 #include <stdio.h>
 #include <util.h>
 
+#include "pool.h"
 #include "iinfo.h"
 
 static struct _iinfo *myhash = NULL;
+static struct pool iinfo_pool;
+static char nameless[] = ".";		/* shared by all without a name */
+
+static struct _iinfo *new_iinfo(const char *key)
+{
+	struct _iinfo *s;
+
+	if (iinfo_pool.size == 0)
+		pool_init(&iinfo_pool, sizeof(struct _iinfo), 4096);
+	if ((s = (struct _iinfo *)pool_get(&iinfo_pool)) != NULL)
+		strcpy(s->key, key);
+	return (s);
+}
 
 void free_iinfo()
 {
@@ -33,8 +47,10 @@ void free_iinfo()
 
 	HASH_ITER(hh, myhash, s, tmp) {
 		HASH_DEL(myhash, s);
-		free(s);
+		if (s->name != nameless)
+			free(s->name);
 	}
+	pool_free(&iinfo_pool);
 }
 
 /*
@@ -55,9 +71,11 @@ struct _iinfo *lookup_iinfo(const char *directory, char *key)
 		snprintf(path, sizeof(path), "%s/%s", directory, key);
 		char *name = slurp_file(path, true);
 
-		s = (struct _iinfo *)malloc(sizeof(struct _iinfo));
-		strcpy(s->key, key);
-		s->name = (name) ? name : strdup(".");
+		if ((s = new_iinfo(key)) == NULL) {
+			free(name);
+			return (NULL);
+		}
+		s->name = (name) ? name : nameless;
 
 		HASH_ADD_STR(myhash, key, s);
 	}
@@ -65,6 +83,33 @@ struct _iinfo *lookup_iinfo(const char *directory, char *key)
 	return (s);
 }
 
+/* What lookup_iinfo() has for `key', without going to the directory */
+struct _iinfo *cached_iinfo(const char *key)
+{
+	struct _iinfo *s;
+
+	HASH_FIND_STR(myhash, key, s);
+	return (s);
+}
+
+/*
+ * Remember `name' for `key' as though lookup_iinfo() had read it, e.g.
+ * from a snapshot taken before a restart.
+ */
+
+void restore_iinfo(const char *key, const char *name)
+{
+	struct _iinfo *s;
+
+	HASH_FIND_STR(myhash, key, s);
+	if (s != NULL || strlen(key) >= IINFOKEYSIZE)
+		return;
+	if ((s = new_iinfo(key)) == NULL)
+		return;
+	s->name = strcmp(name, nameless) == 0 ? nameless : strdup(name);
+	HASH_ADD_STR(myhash, key, s);
+}
+
 #ifdef TESTING
 int main()
 {
@@ -31,3 +31,5 @@ struct _iinfo {
 
 void free_iinfo();
 struct _iinfo *lookup_iinfo(const char *directory, char *key);
+struct _iinfo *cached_iinfo(const char *key);
+void restore_iinfo(const char *key, const char *name);
@@ -0,0 +1,432 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "uthash.h"
+#include "conf.h"
+#include "util.h"
+#include "tline.h"
+#include "hist.h"
+#include "lag.h"
+#include "http.h"
+
+/*
+ * Where reports spend their time before we publish them. For each report
+ * we record, per model and per subtype,
+ *
+ *	fix-send	from the position fix (`tst') to the device sending
+ *			the report (`sent'), i.e. how long it sat on the device
+ *	send-recv	from `sent' to process() having the record (only when
+ *			live, not when replaying)
+ *	recv-pub	from process() having it to handing the JSON to
+ *			libmosquitto
+ *
+ * Device times are whole seconds and converted like `tst' is (which is
+ * mktime(), i.e. local time), so we convert our clock the same way before
+ * comparing. Intervals a device clock can't have produced (more than
+ * LAG_AHEAD in the future or older than LAG_MAXAGE) are counted as skewed
+ * and not recorded.
+ *
+ * Per device we also keep a moving average of send-recv separately for
+ * +BUFF and live records. A device whose +BUFF records are persistently
+ * more than LAG_BACKLOG behind is flagged as draining a backlog, one
+ * whose live records are more than LAG_NETWORK behind as having network
+ * delay; flags are logged when they change and listed by `stats'.
+ */
+
+#define LAG_AHEAD	120		/* s a device clock may be ahead */
+#define LAG_MAXAGE	(30 * 86400)	/* s; older than that is a bad clock */
+#define LAG_BACKLOG	600		/* s +BUFF behind to flag a backlog */
+#define LAG_NETWORK	60		/* s live behind to flag network delay */
+#define LAG_MINREPORTS	20		/* before a device can be flagged */
+#define LAG_ALPHA	0.1		/* weight of a new sample in the averages */
+
+enum { FIX_SEND = 0, SEND_RECV, RECV_PUB, NLAGS };
+static const char *lagnames[NLAGS] = { "fix-send", "send-recv", "recv-pub" };
+#ifdef STATSD
+static const char *statsdnames[NLAGS] = { "fix_send", "send_recv", "recv_pub" };
+#endif
+
+struct lagstat {
+	char key[24];			/* model or subtype */
+	struct hist h[NLAGS];		/* microseconds */
+	long skewed;
+	UT_hash_handle hh;
+};
+static struct lagstat *by_model = NULL, *by_subtype = NULL;
+
+struct lagdev {
+	char key[18];			/* imei */
+	double live, buff;		/* moving average send-recv in s */
+	long nlive, nbuff;
+	bool backlog, network;		/* flagged */
+	UT_hash_handle hh;
+};
+static struct lagdev *devs = NULL;
+
+/* The report being handled */
+static struct {
+	bool active;
+	bool buffered;
+	struct lagstat *model, *subtype;
+	struct lagdev *dev;
+	time_t sent;
+} cur;
+
+static struct lagstat *lagstat(struct lagstat **head, const char *key)
+{
+	struct lagstat *ls;
+
+	HASH_FIND_STR(*head, key, ls);
+	if (ls == NULL) {
+		if ((ls = calloc(1, sizeof(struct lagstat))) == NULL)
+			return (NULL);
+		snprintf(ls->key, sizeof(ls->key), "%s", key);
+		HASH_ADD_STR(*head, key, ls);
+	}
+	return (ls);
+}
+
+/*
+ * `t' in the seconds str_time_to_secs() would produce for it as a UTC
+ * time string. The offset only changes with DST so is computed once a
+ * minute.
+ */
+
+static time_t device_time(time_t t)
+{
+	static time_t offset, computed = 0;
+
+	if (t - computed >= 60 || t < computed) {
+		struct tm tm;
+
+		gmtime_r(&t, &tm);
+		tm.tm_isdst = -1;
+		offset = mktime(&tm) - t;
+		computed = t;
+	}
+	return (t + offset);
+}
+
+static void add(struct udata *ud, int which, long long us)
+{
+	hist_add(&cur.model->h[which], us);
+	hist_add(&cur.subtype->h[which], us);
+
+#ifdef STATSD
+	if (ud->cf->sd) {
+		char metric[64];
+
+		snprintf(metric, sizeof(metric), "lag.%s.%s", cur.subtype->key, statsdnames[which]);
+		statsd_timing(ud->cf->sd, metric, us / 1000);
+	}
+#endif
+}
+
+static void skewed(struct udata *ud)
+{
+	cur.model->skewed++;
+	cur.subtype->skewed++;
+	STATSD_INC(ud->cf->sd, "lag.skewed");
+}
+
+/* A device interval from `from' to `to' in s, or -1 if implausible */
+static long long plausible(time_t from, time_t to)
+{
+	long long d = (long long)to - from;
+
+	if (d < -LAG_AHEAD || d > LAG_MAXAGE)
+		return (-1);
+	return (d < 0 ? 0 : d);
+}
+
+static void flag(struct udata *ud, struct lagdev *ld)
+{
+	bool backlog = ld->backlog, network = ld->network;
+
+	if (ld->nbuff >= LAG_MINREPORTS) {
+		if (!backlog && ld->buff > LAG_BACKLOG)
+			backlog = true;
+		else if (backlog && ld->buff < LAG_BACKLOG / 2)
+			backlog = false;
+	}
+	if (ld->nlive >= LAG_MINREPORTS) {
+		if (!network && ld->live > LAG_NETWORK)
+			network = true;
+		else if (network && ld->live < LAG_NETWORK / 2)
+			network = false;
+	}
+
+	if (backlog != ld->backlog) {
+		xlog(ud, "lag: %s %s draining a backlog: +BUFF %.0fs behind over %ld reports\n",
+			ld->key, backlog ? "is" : "no longer", ld->buff, ld->nbuff);
+		if (backlog)
+			STATSD_INC(ud->cf->sd, "lag.flagged.backlog");
+	}
+	if (network != ld->network) {
+		xlog(ud, "lag: %s %s network delay: live reports %.0fs behind over %ld reports\n",
+			ld->key, network ? "has" : "no longer has", ld->live, ld->nlive);
+		if (network)
+			STATSD_INC(ud->cf->sd, "lag.flagged.network");
+	}
+	ld->backlog = backlog;
+	ld->network = network;
+}
+
+/*
+ * Begin a report of `subtype' from `imei'; `buffered' for +BUFF.
+ */
+
+void lag_record(struct udata *ud, char *imei, const char *model, const char *subtype, bool buffered)
+{
+	struct lagdev *ld;
+
+	cur.active = false;
+	if ((cur.model = lagstat(&by_model, model ? model : "unknown")) == NULL ||
+	    (cur.subtype = lagstat(&by_subtype, subtype)) == NULL)
+		return;
+
+	HASH_FIND_STR(devs, imei, ld);
+	if (ld == NULL) {
+		if ((ld = calloc(1, sizeof(struct lagdev))) == NULL)
+			return;
+		snprintf(ld->key, sizeof(ld->key), "%s", imei);
+		HASH_ADD_STR(devs, key, ld);
+	}
+	cur.dev = ld;
+	cur.buffered = buffered;
+	cur.sent = 0;
+	cur.active = true;
+}
+
+void lag_sent(struct udata *ud, time_t sent)
+{
+	struct lagdev *ld = cur.dev;
+	long long d;
+
+	if (!cur.active)
+		return;
+	cur.sent = sent;
+
+	if (ud->received_us == 0)
+		return;		/* replaying */
+
+	if ((d = plausible(sent, device_time(ud->received_us / 1000000LL))) < 0) {
+		skewed(ud);
+		return;
+	}
+	add(ud, SEND_RECV, d * 1000000LL);
+
+	if (cur.buffered) {
+		ld->buff = ld->nbuff++ ? ld->buff + LAG_ALPHA * (d - ld->buff) : d;
+	} else {
+		ld->live = ld->nlive++ ? ld->live + LAG_ALPHA * (d - ld->live) : d;
+	}
+	flag(ud, ld);
+}
+
+void lag_fix(struct udata *ud, time_t tst)
+{
+	long long d;
+
+	if (!cur.active || cur.sent == 0)
+		return;
+	if ((d = plausible(tst, cur.sent)) < 0) {
+		skewed(ud);
+		return;
+	}
+	add(ud, FIX_SEND, d * 1000000LL);
+}
+
+void lag_publish(struct udata *ud)
+{
+	long long d;
+
+	if (!cur.active || ud->received_us == 0)
+		return;
+	if ((d = wall_us() - ud->received_us) >= 0)
+		add(ud, RECV_PUB, d);
+}
+
+void lag_done(void)
+{
+	cur.active = false;
+}
+
+static void stats_for(struct udata *ud, const char *what, struct lagstat *head)
+{
+	struct lagstat *ls, *tmp;
+	char buf[BUFSIZ];
+	int n;
+
+	HASH_ITER(hh, head, ls, tmp) {
+		for (n = 0; n < NLAGS; n++) {
+			struct hist *h = &ls->h[n];
+
+			if (h->count == 0)
+				continue;
+			snprintf(buf, sizeof(buf), "lag %s %s %s n=%llu p50=%.3f p90=%.3f p99=%.3f max=%.3f",
+				what, ls->key, lagnames[n],
+				(unsigned long long)h->count,
+				hist_pct(h, 50.0) / 1e3,
+				hist_pct(h, 90.0) / 1e3,
+				hist_pct(h, 99.0) / 1e3,
+				h->max / 1e3);
+			xlog(ud, "stats: %s\n", buf);
+			if (ud->cf->reporttopic)
+				pub(ud, (char *)ud->cf->reporttopic, buf, false);
+		}
+		if (ls->skewed) {
+			snprintf(buf, sizeof(buf), "lag %s %s skewed=%ld", what, ls->key, ls->skewed);
+			xlog(ud, "stats: %s\n", buf);
+			if (ud->cf->reporttopic)
+				pub(ud, (char *)ud->cf->reporttopic, buf, false);
+		}
+	}
+}
+
+/*
+ * Log (and publish to `reporttopic') percentiles in milliseconds per model
+ * and subtype, and the devices which are currently flagged.
+ */
+
+void lag_stats(struct udata *ud)
+{
+	struct lagdev *ld, *tmp;
+	char buf[BUFSIZ];
+
+	stats_for(ud, "model", by_model);
+	stats_for(ud, "subtype", by_subtype);
+
+	HASH_ITER(hh, devs, ld, tmp) {
+		if (!ld->backlog && !ld->network)
+			continue;
+		snprintf(buf, sizeof(buf), "lag device %s%s%s buff=%.0fs/%ld live=%.0fs/%ld",
+			ld->key,
+			ld->backlog ? " backlog" : "",
+			ld->network ? " network" : "",
+			ld->buff, ld->nbuff, ld->live, ld->nlive);
+		xlog(ud, "stats: %s\n", buf);
+		if (ud->cf->reporttopic)
+			pub(ud, (char *)ud->cf->reporttopic, buf, false);
+	}
+}
+
+static JsonNode *json_for(struct lagstat *head)
+{
+	JsonNode *obj = json_mkobject(), *o, *l;
+	struct lagstat *ls, *tmp;
+	int n;
+
+	HASH_ITER(hh, head, ls, tmp) {
+		o = json_mkobject();
+		for (n = 0; n < NLAGS; n++) {
+			struct hist *h = &ls->h[n];
+
+			if (h->count == 0)
+				continue;
+			l = json_mkobject();
+			json_append_member(l, "n", json_mknumber(h->count));
+			json_append_member(l, "p50", json_mkdouble(hist_pct(h, 50.0) / 1e3, 3));
+			json_append_member(l, "p90", json_mkdouble(hist_pct(h, 90.0) / 1e3, 3));
+			json_append_member(l, "p99", json_mkdouble(hist_pct(h, 99.0) / 1e3, 3));
+			json_append_member(l, "max", json_mkdouble(h->max / 1e3, 3));
+			json_append_member(o, lagnames[n], l);
+		}
+		json_append_member(o, "skewed", json_mknumber(ls->skewed));
+		json_append_member(obj, ls->key, o);
+	}
+	return (obj);
+}
+
+/* Everything as JSON, for dump_stats() */
+JsonNode *lag_json(void)
+{
+	JsonNode *obj = json_mkobject(), *flagged = json_mkobject(), *o;
+	struct lagdev *ld, *tmp;
+
+	json_append_member(obj, "model", json_for(by_model));
+	json_append_member(obj, "subtype", json_for(by_subtype));
+
+	HASH_ITER(hh, devs, ld, tmp) {
+		if (!ld->backlog && !ld->network)
+			continue;
+		o = json_mkobject();
+		json_append_member(o, "backlog", json_mkbool(ld->backlog));
+		json_append_member(o, "network", json_mkbool(ld->network));
+		json_append_member(o, "buff", json_mkdouble(ld->buff, 0));
+		json_append_member(o, "nbuff", json_mknumber(ld->nbuff));
+		json_append_member(o, "live", json_mkdouble(ld->live, 0));
+		json_append_member(o, "nlive", json_mknumber(ld->nlive));
+		json_append_member(flagged, ld->key, o);
+	}
+	json_append_member(obj, "flagged", flagged);
+	return (obj);
+}
+
+/*
+ * Summaries per subtype in seconds, and counts of skewed reports and
+ * flagged devices, for /metrics.
+ */
+
+void lag_metrics(struct mbuf *mb)
+{
+	static double quantiles[] = { 50.0, 90.0, 99.0 };
+	struct lagstat *ls, *tmp;
+	struct lagdev *ld, *dtmp;
+	long backlog = 0, network = 0;
+	int n, q;
+
+	mbuf_printf(mb, "# HELP qtripp_lag_seconds Report latency by subtype: fix-send, send-recv, recv-pub.\n"
+		"# TYPE qtripp_lag_seconds summary\n");
+	HASH_ITER(hh, by_subtype, ls, tmp) {
+		for (n = 0; n < NLAGS; n++) {
+			struct hist *h = &ls->h[n];
+
+			if (h->count == 0)
+				continue;
+			for (q = 0; q < 3; q++) {
+				mbuf_printf(mb, "qtripp_lag_seconds{subtype=\"%s\",interval=\"%s\",quantile=\"%g\"} %.6f\n",
+					ls->key, lagnames[n], quantiles[q] / 100.0, hist_pct(h, quantiles[q]) / 1e6);
+			}
+			mbuf_printf(mb, "qtripp_lag_seconds_sum{subtype=\"%s\",interval=\"%s\"} %.6f\n",
+				ls->key, lagnames[n], h->sum / 1e6);
+			mbuf_printf(mb, "qtripp_lag_seconds_count{subtype=\"%s\",interval=\"%s\"} %llu\n",
+				ls->key, lagnames[n], (unsigned long long)h->count);
+		}
+	}
+
+	mbuf_printf(mb, "# HELP qtripp_lag_skewed_total Reports with implausible device clocks.\n"
+		"# TYPE qtripp_lag_skewed_total counter\n");
+	HASH_ITER(hh, by_subtype, ls, tmp) {
+		mbuf_printf(mb, "qtripp_lag_skewed_total{subtype=\"%s\"} %ld\n", ls->key, ls->skewed);
+	}
+
+	HASH_ITER(hh, devs, ld, dtmp) {
+		backlog += ld->backlog;
+		network += ld->network;
+	}
+	mbuf_printf(mb, "# HELP qtripp_lag_flagged_devices Devices draining a backlog or with network delay.\n"
+		"# TYPE qtripp_lag_flagged_devices gauge\n"
+		"qtripp_lag_flagged_devices{reason=\"backlog\"} %ld\n"
+		"qtripp_lag_flagged_devices{reason=\"network\"} %ld\n", backlog, network);
+}
@@ -0,0 +1,39 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _LAG_H_INCL_
+# define  _LAG_H_INCL_
+
+#include <stdbool.h>
+#include <time.h>
+#include "udata.h"
+#include "json.h"
+
+struct mbuf;
+
+void lag_record(struct udata *ud, char *imei, const char *model, const char *subtype, bool buffered);
+void lag_sent(struct udata *ud, time_t sent);
+void lag_fix(struct udata *ud, time_t tst);
+void lag_publish(struct udata *ud);
+void lag_done(void);
+void lag_stats(struct udata *ud);
+JsonNode *lag_json(void);
+void lag_metrics(struct mbuf *mb);
+
+#endif
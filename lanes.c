@@ -0,0 +1,210 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "http.h"
+#include "hex.h"
+#include "lanes.h"
+
+static struct lane *head = NULL, *tail = NULL;	/* the active lanes */
+static size_t quantum = 4096, maxqueue = 256 * 1024;
+static long budget_us = 5000;
+static unsigned long st_queued = 0, st_served = 0, nactive = 0;
+
+static long long mono_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000LL + ts.tv_nsec / 1000);
+}
+
+void lanes_init(size_t q, long budget, size_t maxq)
+{
+	quantum = q;
+	budget_us = budget;
+	maxqueue = maxq;
+}
+
+void lane_init(struct lane *l, void (*serve)(struct lane *, char *, size_t), void (*done)(struct lane *), void *arg)
+{
+	memset(l, 0, sizeof(struct lane));
+	l->serve = serve;
+	l->done = done;
+	l->arg = arg;
+}
+
+static void activate(struct lane *l)
+{
+	l->active = true;
+	l->deficit = 0;
+	l->next = NULL;
+	if (tail)
+		tail->next = l;
+	else
+		head = l;
+	tail = l;
+	nactive++;
+}
+
+static void deactivate(struct lane *l)
+{
+	struct lane **lp, *prev = NULL;
+
+	for (lp = &head; *lp != NULL; prev = *lp, lp = &(*lp)->next) {
+		if (*lp == l) {
+			*lp = l->next;
+			if (tail == l)
+				tail = prev;
+			break;
+		}
+	}
+	l->active = false;
+	nactive--;
+}
+
+/* Queue a record; false if the lane already holds `maxqueue' bytes */
+bool lane_push(struct lane *l, const char *rec, size_t len)
+{
+	if (lane_queued(l) >= maxqueue)
+		return (false);
+
+	if (l->off > 0 && l->len + len > l->size) {
+		memmove(l->buf, l->buf + l->off, l->len - l->off);
+		l->len -= l->off;
+		l->off = 0;
+	}
+	if (l->len + len > l->size) {
+		size_t size = l->size ? l->size * 2 : 4096;
+		char *buf;
+
+		while (size < l->len + len)
+			size *= 2;
+		if ((buf = realloc(l->buf, size)) == NULL)
+			return (false);
+		l->buf = buf;
+		l->size = size;
+	}
+	memcpy(l->buf + l->len, rec, len);
+	l->len += len;
+	st_queued++;
+
+	if (!l->active)
+		activate(l);
+	return (true);
+}
+
+/* Serve one record of `l'; its buffer is released when it's empty */
+static size_t serve_one(struct lane *l)
+{
+	char *rec = l->buf + l->off;
+	long n = hex_frame(rec, l->len - l->off);
+
+	if (n <= 0)
+		n = (char *)memchr(rec, '$', l->len - l->off) - rec + 1;
+
+	l->off += n;
+	st_served++;
+	l->serve(l, rec, n);
+
+	if (l->off == l->len) {
+		free(l->buf);
+		l->buf = NULL;
+		l->off = l->len = l->size = 0;
+	}
+	return (n);
+}
+
+/* Serve everything `l' holds now and take it off the round-robin */
+void lane_drain(struct lane *l)
+{
+	while (lane_queued(l) > 0)
+		serve_one(l);
+	if (l->active)
+		deactivate(l);
+	free(l->buf);
+	l->buf = NULL;
+	l->off = l->len = l->size = 0;
+}
+
+/*
+ * One pass of deficit round-robin over the active lanes, or until the
+ * budget is spent. The lane at the head gets its quantum, is served while
+ * it has a deficit left, and goes to the back (or off the list when it's
+ * empty). Returns true if there is more to do.
+ */
+
+bool lanes_run(void)
+{
+	long long deadline = mono_us() + budget_us;
+	unsigned long turns = nactive;
+	struct lane *l;
+
+	while ((l = head) != NULL && turns-- > 0) {
+		/* off the head while it's served: done() may push to it */
+		head = l->next;
+		if (head == NULL)
+			tail = NULL;
+		l->next = NULL;
+
+		l->deficit += quantum;
+		while (lane_queued(l) > 0 && l->deficit > 0) {
+			l->deficit -= serve_one(l);
+			if (mono_us() >= deadline)
+				break;
+		}
+
+		if (lane_queued(l) == 0) {
+			l->active = false;
+			nactive--;
+		} else {
+			if (tail)
+				tail->next = l;
+			else
+				head = l;
+			tail = l;
+		}
+		if (l->done)
+			l->done(l);
+		if (mono_us() >= deadline)
+			break;
+	}
+	return (head != NULL);
+}
+
+bool lanes_pending(void)
+{
+	return (head != NULL);
+}
+
+void lanes_metrics(struct mbuf *mb)
+{
+	mbuf_printf(mb, "# HELP qtripp_buffered_queued_total +BUFF records queued for the scheduler.\n"
+		"# TYPE qtripp_buffered_queued_total counter\n"
+		"qtripp_buffered_queued_total %lu\n", st_queued);
+	mbuf_printf(mb, "# HELP qtripp_buffered_served_total +BUFF records handled by the scheduler.\n"
+		"# TYPE qtripp_buffered_served_total counter\n"
+		"qtripp_buffered_served_total %lu\n", st_served);
+	mbuf_printf(mb, "# HELP qtripp_buffered_lanes Devices with +BUFF records waiting.\n"
+		"# TYPE qtripp_buffered_lanes gauge\n"
+		"qtripp_buffered_lanes %lu\n", nactive);
+}
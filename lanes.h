@@ -0,0 +1,62 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _LANES_H_INCL_
+# define  _LANES_H_INCL_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct mbuf;
+
+/*
+ * Live (+RESP) and control (+ACK, heartbeats, `*') records are handled
+ * as soon as they're framed. A device's +BUFF records instead go to its
+ * lane, in the order received, and the lanes are served by deficit
+ * round-robin, `quantum' bytes of records per turn, for at most
+ * `budget' microseconds per lanes_run(); so a vehicle dumping its
+ * backlog gets a fair share between rounds of live traffic, and not
+ * more. A lane is embedded in whatever it is for and lane_init()ed.
+ */
+
+struct lane {
+	char *buf;			/* records, each ending in `$' */
+	size_t off, len, size;		/* next record at buf + off */
+	long deficit;
+	bool active;			/* on the round-robin */
+	struct lane *next;
+	void (*serve)(struct lane *l, char *rec, size_t len);
+	void (*done)(struct lane *l);	/* after its turn; may be NULL */
+	void *arg;
+};
+
+void lanes_init(size_t quantum, long budget_us, size_t maxqueue);
+void lane_init(struct lane *l, void (*serve)(struct lane *, char *, size_t), void (*done)(struct lane *), void *arg);
+bool lane_push(struct lane *l, const char *rec, size_t len);
+void lane_drain(struct lane *l);
+bool lanes_run(void);
+bool lanes_pending(void);
+void lanes_metrics(struct mbuf *mb);
+
+static inline size_t lane_queued(struct lane *l)
+{
+	return (l->len - l->off);
+}
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "pool.h"
+
+#define POOL_ALIGN	16
+#define SLAB_HEADER	POOL_ALIGN	/* room for the slab link, keeping alignment */
+
+void pool_init(struct pool *p, size_t size, int per_slab)
+{
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+	p->size = (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+	p->per_slab = per_slab > 0 ? per_slab : 64;
+	p->free = NULL;
+	p->slabs = NULL;
+	p->inuse = p->total = 0L;
+}
+
+static int pool_grow(struct pool *p)
+{
+	char *slab, *obj;
+	int n;
+
+	if ((slab = malloc(SLAB_HEADER + p->size * p->per_slab)) == NULL)
+		return (0);
+	*(void **)slab = p->slabs;
+	p->slabs = slab;
+
+	/* thread the new objects onto the free list, first one first */
+	obj = slab + SLAB_HEADER + p->size * (p->per_slab - 1);
+	for (n = 0; n < p->per_slab; n++, obj -= p->size) {
+		*(void **)obj = p->free;
+		p->free = obj;
+	}
+	p->total += p->per_slab;
+	return (1);
+}
+
+/* A zeroed object, or NULL if we're out of memory */
+void *pool_get(struct pool *p)
+{
+	void *obj;
+
+	if (p->free == NULL && !pool_grow(p))
+		return (NULL);
+	obj = p->free;
+	p->free = *(void **)obj;
+	p->inuse++;
+	memset(obj, 0, p->size);
+	return (obj);
+}
+
+void pool_put(struct pool *p, void *obj)
+{
+	if (obj == NULL)
+		return;
+	*(void **)obj = p->free;
+	p->free = obj;
+	p->inuse--;
+}
+
+void pool_free(struct pool *p)
+{
+	void *slab;
+
+	while ((slab = p->slabs) != NULL) {
+		p->slabs = *(void **)slab;
+		free(slab);
+	}
+	pool_init(p, p->size, p->per_slab);
+}
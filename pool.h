@@ -0,0 +1,45 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _POOL_H_INCL_
+# define  _POOL_H_INCL_
+
+#include <stddef.h>
+
+/*
+ * Fixed-size object pool: objects are carved out of slabs of `per_slab'
+ * at a time and go on a free list when put back, so churn (devices
+ * reconnecting) neither fragments the heap nor costs a malloc() per
+ * object. Slabs are kept until pool_free().
+ */
+
+struct pool {
+	size_t size;			/* of an object, rounded up */
+	int per_slab;
+	void *free;			/* free list, linked through the objects */
+	void *slabs;			/* linked through the slabs' first word */
+	unsigned long inuse, total;
+};
+
+void pool_init(struct pool *p, size_t size, int per_slab);
+void *pool_get(struct pool *p);
+void pool_put(struct pool *p, void *obj);
+void pool_free(struct pool *p);
+
+#endif
@@ -0,0 +1,146 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "conf.h"
+#include "util.h"
+#include "tline.h"
+#include "prof.h"
+#include "http.h"
+
+struct hist prof_hist[PROF_MAX];
+
+static const char *stagenames[PROF_MAX] = {
+	[PROF_FRAME]	= "frame",
+	[PROF_DATALOG]	= "datalog",
+	[PROF_RECORD]	= "record",
+	[PROF_SPLIT]	= "split",
+	[PROF_LOOKUP]	= "lookup",
+	[PROF_BUILD]	= "build",
+	[PROF_EXTRA]	= "extra",
+	[PROF_ENCODE]	= "encode",
+	[PROF_PUB]	= "pub",
+	[PROF_BEAN]	= "bean",
+	[PROF_RESPOND]	= "respond",
+	[PROF_RAW]	= "raw",
+	[PROF_DATADIR]	= "datadir",
+	[PROF_STORE]	= "store",
+};
+
+/*
+ * Ticks are converted to time when reporting, by comparing how many went
+ * by since prof_init() with the monotonic clock; no calibration loop.
+ */
+
+static uint64_t ticks0;
+static double ns0;
+
+static double mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+void prof_init(void)
+{
+	memset(prof_hist, 0, sizeof(prof_hist));
+	ticks0 = prof_ticks();
+	ns0 = mono_ns();
+}
+
+static double us_per_tick(void)
+{
+	uint64_t ticks = prof_ticks() - ticks0;
+
+	return (ticks > 0 ? (mono_ns() - ns0) / ticks / 1000.0 : 0);
+}
+
+/*
+ * Stage summaries in seconds for /metrics. They cover the time since the
+ * last `profile' command, which resets them.
+ */
+
+void prof_metrics(struct mbuf *mb)
+{
+	static double quantiles[] = { 50.0, 90.0, 99.0, 99.9 };
+	double upt = us_per_tick();
+	int n, q;
+
+	mbuf_printf(mb, "# HELP qtripp_stage_seconds Time spent per stage of handling a record.\n"
+		"# TYPE qtripp_stage_seconds summary\n");
+	for (n = 0; n < PROF_MAX; n++) {
+		struct hist *h = &prof_hist[n];
+
+		if (h->count == 0)
+			continue;
+		for (q = 0; q < 4; q++) {
+			mbuf_printf(mb, "qtripp_stage_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n",
+				stagenames[n], quantiles[q] / 100.0, hist_pct(h, quantiles[q]) * upt / 1e6);
+		}
+		mbuf_printf(mb, "qtripp_stage_seconds_sum{stage=\"%s\"} %.9f\n", stagenames[n], h->sum * upt / 1e6);
+		mbuf_printf(mb, "qtripp_stage_seconds_count{stage=\"%s\"} %llu\n", stagenames[n], (unsigned long long)h->count);
+	}
+}
+
+/*
+ * Log (and publish to `reporttopic') one line per stage seen since the
+ * last time with its count and percentiles in microseconds, then reset.
+ */
+
+void prof_dump(struct udata *ud)
+{
+	double us_per_tick, elapsed;
+	uint64_t ticks;
+	char buf[BUFSIZ];
+	int n;
+
+	ticks = prof_ticks() - ticks0;
+	elapsed = mono_ns() - ns0;
+	us_per_tick = (ticks > 0) ? elapsed / ticks / 1000.0 : 0;
+
+	for (n = 0; n < PROF_MAX; n++) {
+		struct hist *h = &prof_hist[n];
+
+		if (h->count == 0)
+			continue;
+		snprintf(buf, sizeof(buf), "profile %s n=%llu mean=%.1f p50=%.1f p90=%.1f p99=%.1f p999=%.1f max=%.1f",
+			stagenames[n],
+			(unsigned long long)h->count,
+			h->sum * us_per_tick / h->count,
+			hist_pct(h, 50.0) * us_per_tick,
+			hist_pct(h, 90.0) * us_per_tick,
+			hist_pct(h, 99.0) * us_per_tick,
+			hist_pct(h, 99.9) * us_per_tick,
+			h->max * us_per_tick);
+		xlog(ud, "%s\n", buf);
+		if (ud->cf->reporttopic)
+			pub(ud, (char *)ud->cf->reporttopic, buf, false);
+		hist_reset(h);
+	}
+	xlog(ud, "profile: %.1fs since the last profile, times in microseconds\n", elapsed / 1e9);
+
+	/* Keep the tick/ns reference but measure the next period afresh */
+	ticks0 += ticks;
+	ns0 += elapsed;
+}
@@ -0,0 +1,103 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _PROF_H_INCL_
+# define  _PROF_H_INCL_
+
+/*
+ * Per-stage latency profiling of the record path, built with PROFILE=yes
+ * (-DWITH_PROFILE). Without it the macros expand to nothing. A stage is
+ * timed with
+ *
+ *	PROF_START(t);
+ *	...
+ *	PROF_END(PROF_SPLIT, t);
+ *
+ * PROF_END also restarts `t', so a stage which directly follows another
+ * needs no PROF_START/PROF_RESTART of its own. The `profile' command sent
+ * to device `*' reports percentiles per stage and starts afresh.
+ */
+
+#include "udata.h"
+
+enum prof_stage {
+	PROF_FRAME = 0,		/* finding a record in the connection buffer */
+	PROF_DATALOG,		/* appending it to `datalog' */
+	PROF_RECORD,		/* all of process() */
+	PROF_SPLIT,		/* clean_split() and the type */
+	PROF_LOOKUP,		/* lookup_*() of report, model, device, names */
+	PROF_BUILD,		/* building one JSON object */
+	PROF_EXTRA,		/* extra_json() */
+	PROF_ENCODE,		/* json_encode() */
+	PROF_PUB,		/* handing it to libmosquitto */
+	PROF_BEAN,		/* bean_put() */
+	PROF_RESPOND,		/* writing a response to the device */
+	PROF_RAW,		/* raw_mirror() */
+	PROF_DATADIR,		/* appending to datadir/data-<imei> */
+	PROF_STORE,		/* writing a block to the track store */
+	PROF_MAX
+};
+
+#ifdef WITH_PROFILE
+# include <stdint.h>
+# include "hist.h"
+# if defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+# else
+#  include <time.h>
+# endif
+
+extern struct hist prof_hist[PROF_MAX];
+
+/* TSC ticks where we have them, else nanoseconds */
+static inline uint64_t prof_ticks(void)
+{
+# if defined(__x86_64__) || defined(__i386__)
+	return (__rdtsc());
+# else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+# endif
+}
+
+# define PROF_START(t)		uint64_t t = prof_ticks()
+# define PROF_RESTART(t)	((t) = prof_ticks())
+# define PROF_END(stage, t)	do { \
+		uint64_t _now = prof_ticks(); \
+		hist_add(&prof_hist[stage], _now - (t)); \
+		(t) = _now; \
+	} while (0)
+
+struct mbuf;
+
+void prof_init(void);
+void prof_dump(struct udata *ud);
+void prof_metrics(struct mbuf *mb);
+#else
+# define PROF_START(t)
+# define PROF_RESTART(t)
+# define PROF_END(stage, t)
+# define prof_init()
+# define prof_dump(ud)		xlog((ud), "profile: not built with PROFILE=yes\n")
+# define prof_metrics(mb)
+#endif
+
+#endif
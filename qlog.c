@@ -17,133 +17,622 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+/*
+ * qlog is a raw capture server: it accepts GPRS connections from devices
+ * and appends each `+...$' record on a line of its own to DATAFILE, which
+ * can later be replayed by naming it on qtripp's command line, as in
+ * `qtripp qlog.data' (see -j, -o and -O there). Every connection has its own
+ * framing buffer, and all records which become complete during one wakeup
+ * of the event loop are appended with a single writev(2).
+ *
+ * On Linux we use epoll; elsewhere poll(2). Unlike select(), neither is
+ * limited to FD_SETSIZE descriptors.
+ */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
 #include <syslog.h>
-#include "mongoose.h"
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+# include <sys/epoll.h>
+#else
+# include <poll.h>
+#endif
 
 #define DATAFILE	"qlog.data"
+#define ROTATESIZE	(64 * 1024 * 1024)
+#define MAXRECORD	(64 * 1024)		/* drop a connection with more unframed bytes */
+#define READCHUNK	(16 * 1024)
+#define MAXEVENTS	1024
+
+#ifndef IOV_MAX
+# define IOV_MAX	1024
+#endif
 
-struct udata {
-	int fd;			/* Open data file */
-	void *mb;		/* Will hold mbuf */
+struct conn {
+	int fd;
+	char *buf;		/* framing buffer */
+	size_t len;		/* bytes in buf */
+	size_t size;		/* allocated size of buf */
+	size_t used;		/* bytes of buf already queued for writing */
+	bool dirty;		/* on the dirty list */
+	struct conn *next_dirty;
+	char peer[64];
+#ifndef __linux__
+	int slot;		/* index into pollfds */
+#endif
 };
 
-static void ev_handler(struct mg_connection *nc, int ev, void *ev_data)
+static char *datafile = DATAFILE;
+static off_t rotatesize = ROTATESIZE;
+static bool compress_rotated = false;
+static int datafd = -1;
+static off_t datasize = 0;
+
+static struct iovec iov[IOV_MAX];
+static int niov = 0;
+static struct conn *dirty = NULL;	/* connections with queued records */
+
+static unsigned long long st_records = 0, st_bytes = 0, st_writes = 0;
+static unsigned long long st_accepts = 0, st_partials = 0, st_oversize = 0;
+static long nconns = 0;
+
+#ifdef __linux__
+static int epfd;
+#else
+static struct pollfd *pollfds;
+static struct conn **pollconns;
+static int npollfds, maxpollfds;
+#endif
+
+static int open_datafile(void)
 {
-	struct mbuf *io = &nc->recv_mbuf;
-	struct udata *ud = (struct udata *)nc->mgr->user_data;
-	size_t ml;      /* mb len */
-	struct mbuf *mb = (struct mbuf *)ud->mb;
-	char buf[BUFSIZ];
-
-	switch (ev) {
-		case MG_EV_POLL:
-
-			/*
-			 * A record is +...$
-			 * Search for the '$', cut there, process, and remove what we've
-			 * done thus far from `mb' and await more data.
-			 */
-
-			for (ml = 0; ml < mb->len; ml++) {
-				if (mb->buf[ml] == '$') {
-					off_t pos;
-					size_t nbytes = ml + 1;
-
-					write(ud->fd, mb->buf, nbytes);
-					write(ud->fd, "\n", 1);
-
-					pos = lseek(ud->fd, 0, SEEK_CUR);
-					if (pos > (1024*1024)) {
-						char path[BUFSIZ];
-
-						close(ud->fd);
-						snprintf(path, BUFSIZ, "%s.%ld", DATAFILE, time(0));
-						link(DATAFILE, path);
-						unlink(DATAFILE);
-						ud->fd = open(DATAFILE, O_WRONLY | O_CREAT, 0666);
-					}
-
-					/* Clear what we've used from `mb' */
-					mbuf_remove(mb, nbytes);
-					break;
-				}
-			}
+	struct stat st;
+	int fd;
+
+	if ((fd = open(datafile, O_WRONLY | O_APPEND | O_CREAT, 0666)) == -1) {
+		syslog(LOG_ERR, "Cannot open data file %s: %m", datafile);
+		return (-1);
+	}
+	datasize = (fstat(fd, &st) == 0) ? st.st_size : 0;
+	return (fd);
+}
+
+/*
+ * Rename the data file out of the way and start a new one. The rename is
+ * atomic and cheap; compression, if requested, happens in a child which
+ * we don't wait for (SIGCHLD is ignored).
+ */
+
+static void rotate(void)
+{
+	char path[PATH_MAX], gzpath[PATH_MAX + 3];
+	int fd, n = 0;
+	time_t now = time(0);
+
+	/* don't clobber an earlier rotation in the same second, compressed or not */
+	snprintf(path, sizeof(path), "%s.%ld", datafile, (long)now);
+	snprintf(gzpath, sizeof(gzpath), "%s.gz", path);
+	while (access(path, F_OK) == 0 || access(gzpath, F_OK) == 0) {
+		snprintf(path, sizeof(path), "%s.%ld.%d", datafile, (long)now, ++n);
+		snprintf(gzpath, sizeof(gzpath), "%s.gz", path);
+	}
+
+	if (rename(datafile, path) == -1) {
+		syslog(LOG_ERR, "Cannot rename %s to %s: %m", datafile, path);
+		return;
+	}
+
+	if ((fd = open_datafile()) == -1) {
+		/* keep appending to the renamed file rather than lose data */
+		return;
+	}
+	close(datafd);
+	datafd = fd;
+
+	syslog(LOG_INFO, "Rotated data to %s", path);
+
+	if (compress_rotated) {
+		pid_t pid = fork();
+
+		if (pid == 0) {
+			execlp("gzip", "gzip", "-f", path, (char *)NULL);
+			_exit(127);
+		} else if (pid == -1) {
+			syslog(LOG_ERR, "Cannot fork for gzip of %s: %m", path);
+		}
+	}
+}
+
+/*
+ * Append all queued records to the data file and release the framing
+ * buffers they point into.
+ */
+
+static void flush(void)
+{
+	struct iovec *v = iov;
+	int n = niov;
+	struct conn *c;
+
+	while (n > 0) {
+		ssize_t nw = writev(datafd, v, n > IOV_MAX ? IOV_MAX : n);
+
+		if (nw == -1) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "Cannot write to %s: %m", datafile);
 			break;
+		}
+		st_writes++;
+		st_bytes += nw;
+		datasize += nw;
+
+		while (n > 0 && (size_t)nw >= v->iov_len) {
+			nw -= v->iov_len;
+			v++;
+			n--;
+		}
+		if (n > 0) {
+			v->iov_base = (char *)v->iov_base + nw;
+			v->iov_len -= nw;
+		}
+	}
+	niov = 0;
+
+	while ((c = dirty) != NULL) {
+		dirty = c->next_dirty;
+		c->dirty = false;
+		c->next_dirty = NULL;
 
-		case MG_EV_ACCEPT:
-			mg_sock_addr_to_str(ev_data, buf, sizeof(buf), MG_SOCK_STRINGIFY_IP);
-			syslog(LOG_INFO, "Connection from socket %s", buf);
+		if (c->used > 0) {
+			memmove(c->buf, c->buf + c->used, c->len - c->used);
+			c->len -= c->used;
+			c->used = 0;
+		}
+	}
+
+	if (rotatesize > 0 && datasize >= rotatesize) {
+		rotate();
+	}
+}
+
+/*
+ * Find complete records in c's buffer and queue them for writing. Leading
+ * line terminators and whitespace some devices send between records are
+ * dropped; the record itself is written verbatim followed by a newline.
+ */
+
+static void frame(struct conn *c)
+{
+	char *start, *dollar, *end = c->buf + c->len;
+
+	start = c->buf + c->used;
+	while (start < end) {
+		while (start < end && (*start == '\r' || *start == '\n' || *start == ' ' || *start == '\0'))
+			start++;
+		if (start == end || (dollar = memchr(start, '$', end - start)) == NULL)
 			break;
 
-		case MG_EV_RECV:
-			/*
-			 * shove the bytes into our `mb' buffer, and return, after
-			 * clearing our working buffer;
-			 * we do the real work during POLL.
-			 */
+		if (niov + 2 > IOV_MAX) {
+			/* the iov array is full; write what we have (this compacts c) */
+			c->used = start - c->buf;
+			if (!c->dirty) {
+				c->dirty = true;
+				c->next_dirty = dirty;
+				dirty = c;
+			}
+			flush();
+			end = c->buf + c->len;
+			start = c->buf;
+			continue;
+		}
+
+		iov[niov].iov_base = start;
+		iov[niov].iov_len = dollar - start + 1;
+		niov++;
+		iov[niov].iov_base = "\n";
+		iov[niov].iov_len = 1;
+		niov++;
+		st_records++;
+
+		start = dollar + 1;
+	}
+	c->used = start - c->buf;
+
+	if (c->used > 0 && !c->dirty) {
+		c->dirty = true;
+		c->next_dirty = dirty;
+		dirty = c;
+	}
+}
+
+static int set_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+
+	return (fcntl(fd, F_SETFL, flags | O_NONBLOCK));
+}
+
+static int ev_add(struct conn *c)
+{
+#ifdef __linux__
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	return (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev));
+#else
+	if (npollfds == maxpollfds) {
+		maxpollfds = maxpollfds ? maxpollfds * 2 : 256;
+		pollfds = realloc(pollfds, maxpollfds * sizeof(struct pollfd));
+		pollconns = realloc(pollconns, maxpollfds * sizeof(struct conn *));
+		if (pollfds == NULL || pollconns == NULL) {
+			syslog(LOG_ERR, "Out of memory");
+			exit(2);
+		}
+	}
+	c->slot = npollfds++;
+	pollfds[c->slot].fd = c->fd;
+	pollfds[c->slot].events = POLLIN;
+	pollfds[c->slot].revents = 0;
+	pollconns[c->slot] = c;
+	return (0);
+#endif
+}
+
+static void ev_del(struct conn *c)
+{
+#ifdef __linux__
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+#else
+	int last = --npollfds;
+
+	if (c->slot != last) {
+		pollfds[c->slot] = pollfds[last];
+		pollconns[c->slot] = pollconns[last];
+		pollconns[c->slot]->slot = c->slot;
+	}
+#endif
+}
+
+static void conn_close(struct conn *c, const char *why)
+{
+	if (c->dirty) {
+		/* queued iovecs point into c->buf */
+		flush();
+	}
+	if (c->len > 0) {
+		st_partials++;
+		syslog(LOG_DEBUG, "Dropping %zu unterminated bytes from %s", c->len, c->peer);
+	}
+	syslog(LOG_DEBUG, "Closing connection from %s: %s", c->peer, why);
+
+	ev_del(c);
+	close(c->fd);
+	free(c->buf);
+	free(c);
+	nconns--;
+}
 
-			mbuf_append(mb, io->buf, io->len);
-			mbuf_remove(io, io->len);
+/*
+ * Read everything the socket has for us (bounded, so a single busy
+ * device can't starve the others) and frame it. Returns false if
+ * the connection has been closed.
+ */
+
+static bool conn_read(struct conn *c)
+{
+	int rounds;
+
+	for (rounds = 0; rounds < 4; rounds++) {
+		ssize_t nr;
+
+		if (c->size - c->len < READCHUNK) {
+			size_t nsize = c->size ? c->size * 2 : READCHUNK * 2;
+			char *nbuf;
+
+			if (c->len >= MAXRECORD + c->used) {
+				st_oversize++;
+				conn_close(c, "record too long");
+				return (false);
+			}
+			if (c->dirty) {
+				/* realloc would invalidate queued iovecs */
+				flush();
+				if (c->size - c->len >= READCHUNK)
+					goto doread;
+			}
+			if ((nbuf = realloc(c->buf, nsize)) == NULL) {
+				conn_close(c, "out of memory");
+				return (false);
+			}
+			c->buf = nbuf;
+			c->size = nsize;
+		}
+	    doread:
+		nr = recv(c->fd, c->buf + c->len, c->size - c->len, 0);
+		if (nr == 0) {
+			frame(c);
+			conn_close(c, "EOF");
+			return (false);
+		}
+		if (nr == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			conn_close(c, strerror(errno));
+			return (false);
+		}
+		c->len += nr;
+		if ((size_t)nr < READCHUNK)
 			break;
+	}
+
+	frame(c);
+	return (true);
+}
+
+static void do_accept(int lfd)
+{
+	struct sockaddr_storage ss;
+	socklen_t sl;
+	int fd, on = 1;
+
+	while (1) {
+		struct conn *c;
+		char host[INET6_ADDRSTRLEN], serv[16];
+
+		sl = sizeof(ss);
+		if ((fd = accept(lfd, (struct sockaddr *)&ss, &sl)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EMFILE || errno == ENFILE) {
+				syslog(LOG_WARNING, "accept: %m");
+			}
+			return;
+		}
+		set_nonblock(fd);
+		setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+
+		if ((c = calloc(1, sizeof(struct conn))) == NULL) {
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		if (getnameinfo((struct sockaddr *)&ss, sl, host, sizeof(host),
+				serv, sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+			snprintf(c->peer, sizeof(c->peer), "%s:%s", host, serv);
+		} else {
+			strcpy(c->peer, "?");
+		}
+
+		if (ev_add(c) == -1) {
+			syslog(LOG_ERR, "Cannot watch connection from %s: %m", c->peer);
+			close(fd);
+			free(c);
+			continue;
+		}
+		st_accepts++;
+		nconns++;
+		syslog(LOG_DEBUG, "Connection from %s", c->peer);
+	}
+}
+
+static int listen_on(char *addr)
+{
+	struct addrinfo hints, *res, *ai;
+	char *host = NULL, *port = addr, *p;
+	int fd = -1, on = 1, rc;
 
-		default:
+	/* "port", "host:port" or "[v6]:port" */
+	if ((p = strrchr(addr, ':')) != NULL) {
+		*p = 0;
+		host = addr;
+		port = p + 1;
+		if (*host == '[') {
+			host++;
+			if ((p = strchr(host, ']')) != NULL)
+				*p = 0;
+		}
+		if (*host == 0)
+			host = NULL;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	if ((rc = getaddrinfo(host, port, &hints, &res)) != 0) {
+		syslog(LOG_ERR, "Cannot resolve %s: %s", addr, gai_strerror(rc));
+		return (-1);
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 4096) == 0)
 			break;
+		close(fd);
+		fd = -1;
 	}
+	freeaddrinfo(res);
+
+	if (fd != -1)
+		set_nonblock(fd);
+	return (fd);
 }
 
-int main(int argc, char **argv)
+static void raise_nofile(void)
 {
-	struct mg_mgr mgr;
-	struct mg_connection *c;
-	struct mg_bind_opts bind_opts;
-	struct udata udata;
-	const char *e = NULL;
-	char *port_str;
+	struct rlimit rl;
 
-	if (argc != 2) {
-		fprintf(stderr, "Usage: %s port\n", *argv);
-		return (-2);
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
 	}
+}
 
-	openlog("qlog", LOG_PERROR|LOG_PID, LOG_DAEMON);
+/* "100", "512k", "64m", "1g"; 0 disables rotation */
+static off_t parse_size(char *s)
+{
+	char *ep;
+	off_t n = strtoll(s, &ep, 10);
 
-	port_str = strdup(argv[1]);
+	switch (*ep) {
+		case 'g': case 'G': n *= 1024;
+			/* FALLTHROUGH */
+		case 'm': case 'M': n *= 1024;
+			/* FALLTHROUGH */
+		case 'k': case 'K': n *= 1024;
+	}
+	return (n);
+}
 
-	memset(&udata, 0, sizeof(udata));
+static void usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s [-f datafile] [-s rotatesize[k|m|g]] [-z] [-v] [host:]port\n", prog);
+	exit(2);
+}
 
-	if ((udata.fd = open(DATAFILE, O_WRONLY | O_APPEND | O_CREAT, 0666)) == -1) {
-		syslog(LOG_ERR, "Cannot open data file %s: %m", DATAFILE);
-		exit(3);
+int main(int argc, char **argv)
+{
+	int ch, lfd, loglevel = LOG_INFO;
+	time_t last_stats = time(0);
+	char *progname = *argv;
+
+	while ((ch = getopt(argc, argv, "f:s:zv")) != EOF) {
+		switch (ch) {
+			case 'f':
+				datafile = optarg;
+				break;
+			case 's':
+				rotatesize = parse_size(optarg);
+				break;
+			case 'z':
+				compress_rotated = true;
+				break;
+			case 'v':
+				loglevel = LOG_DEBUG;
+				break;
+			default:
+				usage(progname);
+		}
 	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1)
+		usage(progname);
 
-	mg_mgr_init(&mgr, NULL);
+	openlog("qlog", LOG_PERROR|LOG_PID, LOG_DAEMON);
+	setlogmask(LOG_UPTO(loglevel));
 
-	memset(&bind_opts, 0, sizeof(bind_opts));
-	bind_opts.error_string = &e;
-	bind_opts.user_data = NULL;
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGCHLD, SIG_IGN);	/* gzip children reap themselves */
+	raise_nofile();
 
-	syslog(LOG_INFO, "Listening for GPRS on port %s", port_str);
+	if ((datafd = open_datafile()) == -1) {
+		exit(3);
+	}
 
-	c = mg_bind_opt(&mgr, port_str, ev_handler, bind_opts);
-	if (c == NULL) {
-		syslog(LOG_ERR, "Error starting server: %s: %m", *bind_opts.error_string);
+	if ((lfd = listen_on(argv[0])) == -1) {
+		syslog(LOG_ERR, "Error starting server on %s: %m", argv[0]);
 		exit(1);
 	}
 
-	struct mbuf mbi;
-	udata.mb = (struct mbuf *)&mbi;
-	mbuf_init(udata.mb, 48);
+#ifdef __linux__
+	{
+		struct epoll_event ev;
+
+		if ((epfd = epoll_create1(0)) == -1) {
+			syslog(LOG_ERR, "epoll_create1: %m");
+			exit(1);
+		}
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;	/* the listener */
+		epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+	}
+#else
+	{
+		struct conn *lc = calloc(1, sizeof(struct conn));
+
+		lc->fd = lfd;
+		ev_add(lc);		/* slot 0 is the listener */
+	}
+#endif
 
-	mgr.user_data = &udata; // experiment
+	syslog(LOG_INFO, "Listening for GPRS on %s, writing to %s", argv[0], datafile);
 
 	while (1) {
-		mg_mgr_poll(&mgr, 1000);
+		int n, i;
+		time_t now;
+
+#ifdef __linux__
+		struct epoll_event events[MAXEVENTS];
+
+		n = epoll_wait(epfd, events, MAXEVENTS, 1000);
+		for (i = 0; i < n; i++) {
+			struct conn *c = events[i].data.ptr;
+
+			if (c == NULL) {
+				do_accept(lfd);
+				continue;
+			}
+			conn_read(c);
+		}
+#else
+		n = poll(pollfds, npollfds, 1000);
+
+		/*
+		 * Walk backwards: conn_close() moves the last slot into
+		 * the hole, and that one has been looked at already.
+		 */
+		for (i = npollfds - 1; n > 0 && i >= 1; i--) {
+			if (pollfds[i].revents) {
+				pollfds[i].revents = 0;
+				conn_read(pollconns[i]);
+			}
+		}
+		if (n > 0 && pollfds[0].revents) {
+			pollfds[0].revents = 0;
+			do_accept(lfd);
+		}
+#endif
+
+		if (niov > 0 || dirty) {
+			flush();
+		}
+
+		now = time(0);
+		if (now - last_stats >= 60) {
+			syslog(LOG_INFO, "conns=%ld accepts=%llu records=%llu bytes=%llu writes=%llu partials=%llu oversize=%llu",
+				nconns, st_accepts, st_records, st_bytes, st_writes, st_partials, st_oversize);
+			last_stats = now;
+		}
 	}
 
 	/* NOTREACHED */
-	mg_mgr_free(&mgr);
 	return (0);
 }
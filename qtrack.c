@@ -0,0 +1,141 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * qtrack prints the fixes of a device from the track store which qtripp
+ * writes with [store] `dir':
+ *
+ *	qtrack [-f from] [-t to] [-j | -c] dir imei
+ *
+ * `from' and `to' are epoch seconds or UTC times, YYYY-MM-DD or
+ * YYYY-MM-DDTHH:MM:SS (to the end of the day if only a date). Fixes are
+ * printed as CSV, tst,lat,lon,vel,cog, or with -j as JSON lines; with
+ * -c only how many there are.
+ */
+
+#define _GNU_SOURCE		/* timegm() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "track.h"
+
+enum { CSV, JSON, COUNT };
+
+static bool print(struct trk_fix *f, void *arg)
+{
+	int how = *(int *)arg;
+	char vel[32] = "", cog[16] = "";
+
+	if (how == COUNT)
+		return (true);
+	if (how == JSON) {
+		printf("{\"tst\":%ld,\"lat\":%.6f,\"lon\":%.6f", (long)f->tst, f->lat, f->lon);
+		if (!isnan(f->vel))
+			printf(",\"vel\":%.1f", f->vel);
+		if (f->cog >= 0)
+			printf(",\"cog\":%d", f->cog);
+		printf("}\n");
+		return (true);
+	}
+	if (!isnan(f->vel))
+		snprintf(vel, sizeof(vel), "%.1f", f->vel);
+	if (f->cog >= 0)
+		snprintf(cog, sizeof(cog), "%d", f->cog);
+	printf("%ld,%.6f,%.6f,%s,%s\n", (long)f->tst, f->lat, f->lon, vel, cog);
+	return (true);
+}
+
+/* Epoch seconds, or a UTC date and perhaps time; `end' for a date's last second */
+static time_t parse_time(const char *s, bool end, char *prog)
+{
+	struct tm tm;
+	const char *p;
+
+	for (p = s; isdigit((unsigned char)*p); p++)
+		;
+	if (*p == 0 && p != s)
+		return ((time_t)atoll(s));
+
+	memset(&tm, 0, sizeof(tm));
+	if ((p = strptime(s, "%Y-%m-%d", &tm)) == NULL)
+		goto bad;
+	if (*p == 0) {
+		if (end) {
+			tm.tm_hour = 23;
+			tm.tm_min = tm.tm_sec = 59;
+		}
+	} else if ((p = strptime(p, "T%H:%M:%S", &tm)) == NULL || *p != 0) {
+		goto bad;
+	}
+	return (timegm(&tm));
+
+  bad:
+	fprintf(stderr, "%s: cannot make sense of the time %s\n", prog, s);
+	exit(2);
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s [-f from] [-t to] [-j | -c] dir imei\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	char *progname = *argv;
+	time_t from = 0, to = time(0) + 86400;
+	int ch, how = CSV;
+	long n;
+
+	while ((ch = getopt(argc, argv, "f:t:jc")) != EOF) {
+		switch (ch) {
+			case 'f':
+				from = parse_time(optarg, false, progname);
+				break;
+			case 't':
+				to = parse_time(optarg, true, progname);
+				break;
+			case 'j':
+				how = JSON;
+				break;
+			case 'c':
+				how = COUNT;
+				break;
+			default:
+				usage(progname);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2)
+		usage(progname);
+
+	if ((n = trk_scan(argv[0], argv[1], from, to, print, &how)) < 0) {
+		fprintf(stderr, "%s: no fixes of %s in %s\n", progname, argv[1], argv[0]);
+		exit(1);
+	}
+	if (how == COUNT)
+		printf("%ld\n", n);
+	return (0);
+}
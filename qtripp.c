@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <time.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <fcntl.h>
 #include <mosquitto.h>
@@ -29,6 +30,23 @@
 #include "uthash.h"
 #include "util.h"
 #include "tline.h"
+#include "raw.h"
+#include "replay.h"
+#include "prof.h"
+#include "http.h"
+#include "timer.h"
+#include "conn.h"
+#include "udp.h"
+#include "dedup.h"
+#include "thin.h"
+#include "geo.h"
+#include "trip.h"
+#include "store.h"
+#include "recent.h"
+#include "snap.h"
+#include "lanes.h"
+#include "iinfo.h"
+#include "hex.h"
 #ifdef WITH_BEAN
 # include "bean.h"
 #endif
@@ -39,14 +57,39 @@
 #include "devices.h"
 #include "reports.h"
 #include "ignores.h"
+#include "hextypes.h"
 
 #define SSL_VERIFY_PEER (1)
 #define SSL_VERIFY_NONE (0)
 
-static config cf = {
+#define MAXRECORD	(64 * 1024)	/* longest we wait for the `$' of a record */
+
+static const config defaults = {
         .host           = "localhost",
         .port           = 1883,
 		.protocol		= MQTT_PROTOCOL_V311,
+	.protocol_version = "mqttv311",
+	.raw_mode	= RAW_UNSET,
+	.raw_batch_lines = 50,
+	.raw_batch_ms	= 5000,
+	.idle_timeout	= 20 * 60,
+	.command_timeout = 60,
+	.dedup_window	= 32,
+	.sched_quantum	= 4096,
+	.sched_budget	= 5000,
+	.sched_maxqueue	= 256 * 1024,
+	.sched_inflight	= 500,
+	.dedup_save	= 60,
+	.thin		= { .keepalive = 15 * 60 },
+	.geo_cell	= GEO_CELL,
+	.trip_speed	= 5,
+	.trip_stop	= 5 * 60,
+	.trip_timeout	= 60 * 60,
+	.trip_save	= 60,
+	.store_flush	= 5 * 60,
+	.store_block	= 256,
+	.recent_memory	= 64 * 1024 * 1024,
+	.snap_interval	= 5 * 60,
 #ifdef STATSD
 	.statsdhost	= "127.0.0.1",
 #endif
@@ -54,160 +97,252 @@ static config cf = {
 	.bean_host	= "127.0.0.1",
 	.bean_port	= 11300,
 	.bean_tube	= "qtripp",
+	.bean_spool	= "bean.spool",
+	.bean_maxqueue	= 10000,
+	.bean_pipeline	= 64,
 #endif
 };
+static config cf;
+static volatile sig_atomic_t reload_pending = 0, stopping = 0;
+
+static struct http_source *http_sources[] = { &http_connections, &http_devices, NULL };
 
 /*
- * We'll be hashing connection information using alternate keys: one is
- * the socket (sock) and the other is by imei.
+ * We've obtained a "line" of text from a tracker in `buf' (`buflen' bytes),
+ * or a binary frame. Whatever is to be sent back to the device is added
+ * to `reply'.
  */
 
-struct conndata {
-	int sock;		/* key */
-	char *imei;
-	char *client_ip;
-	struct mbuf *mb;		/* Connection-specific mbuf */
-	struct mg_connection *nc;
-	UT_hash_handle hh;		/* makes this hashable for key sock */
-	UT_hash_handle hh_imei;		/* makes this hashable for alternate key imei */
-};
-struct conndata *conns_by_sock = NULL;
-struct conndata *conns_by_imei = NULL;
-
-struct conndata *find_conn(int sock)
+char *process(struct udata *ud, char *buf, size_t buflen, struct reply *reply)
 {
-	struct conndata *co;
-
-	HASH_FIND_INT(conns_by_sock, &sock, co);
-	return (co);
-}
+	char *imei, small[2048], *copy = small;
+	size_t size = sizeof(small);
 
-struct conndata *find_imei(char *imei)
-{
-	struct conndata *co;
+	STATSD_INC(ud->cf->sd, "line.process");
+	PROF_START(t0);
+	ud->received_us = wall_us();
 
-	HASH_FIND(hh_imei, conns_by_imei, imei, strlen(imei), co);
-	return (co);
-}
+	/*
+	 * handle_report() chops up the line it's given, but the record must
+	 * stay intact for the raw mirror and `datadir', so it gets a copy; on
+	 * the stack unless the record is unusually long. A binary frame is
+	 * mirrored and stored as the ASCII report it amounts to.
+	 */
 
+	if (hex_frame(buf, buflen) > 0) {
+		STATSD_INC(ud->cf->sd, "line.hex");
+		if ((copy = malloc(HEX_LINESIZE)) == NULL)
+			return (NULL);
+		*copy = 0;
+		imei = handle_hex(ud, buf, buflen, copy, HEX_LINESIZE, reply);
+		buf = copy;
+		buflen = strlen(copy);
+	} else {
+		if (buflen + 2 > size && (copy = malloc(size = buflen + 2)) == NULL)
+			return (NULL);
+		memcpy(copy, buf, buflen);
+		copy[buflen] = copy[buflen + 1] = 0;
+
+		imei = handle_report(ud, copy, reply);
+	}
 
-struct conndata *add_conn(int sock)
-{
-	struct conndata *co;
+	/* Mirror the RAW string to MQTT as a backup, unless we've had it */
 
-	HASH_FIND_INT(conns_by_sock, &sock, co);		/* imei already in hash? */
-	if (co == NULL) {
-		co = (struct conndata *)malloc(sizeof (struct conndata));
-		co->sock = sock;
-		HASH_ADD_INT(conns_by_sock, sock, co);
-	}
-	co->imei	= NULL;
-	co->client_ip	= NULL;
-	co->nc		= NULL;
-	co->mb		= NULL;
-	return (co);
-}
+	if (!ud->duplicate && buflen > 0) {
+		PROF_START(t);
+		raw_mirror(ud, buf, buflen);
+		PROF_END(PROF_RAW, t);
+	}
 
-void delete_conn(struct conndata *co)
-{
-#if 0
-	struct conndata *s;
-	if (co->imei) {
-		HASH_FIND(hh_imei, conns_by_imei, co->imei, strlen(co->imei), s);
-		if (s) {
-			HASH_DEL(conns_by_imei, s);
+	if (imei != NULL && ud->cf->datadir != NULL && !ud->duplicate) {
+		char path[BUFSIZ];
+		int fd;
+
+		PROF_START(t);
+		snprintf(path, sizeof(path), "%s/data-%s",
+			ud->cf->datadir, imei);
+		if ((fd = open(path, O_CREAT|O_WRONLY|O_APPEND, 0644)) != -1) {
+			write(fd, buf, buflen);
+			write(fd, "\n", 1);
+			close(fd);
 		}
+		PROF_END(PROF_DATADIR, t);
 	}
-#endif
 
-	if (co->imei) free(co->imei);
-	if (co->client_ip) free(co->client_ip);
-	if (co->mb) mbuf_free(co->mb);
-
-	HASH_DEL(conns_by_sock, co);
-	// free(co);
-	co = NULL;
+	if (copy != small)
+		free(copy);
+	PROF_END(PROF_RECORD, t0);
+	return (imei);
 }
 
-void print_conns(struct udata *ud)
+/* Write what has accumulated in `reply' to the device, in one go */
+static void reply_tcp(struct udata *ud, struct mg_connection *nc, struct reply *reply)
 {
-	struct conndata *co;
+	PROF_START(t);
+	xlog(ud, "Responding to terminal: %s\n", reply->buf);
+	mg_send(nc, reply->buf, reply->len);
+	reply->len = 0;
+	PROF_END(PROF_RESPOND, t);
+}
 
-	for (co = conns_by_sock; co != NULL; co = (struct conndata *)(co->hh.next)) {
-		char buf[BUFSIZ];
+/*
+ * A complete record from `co': process it, and see to what follows from
+ * it for the connection.
+ */
+
+static void handle_record(struct udata *ud, struct conndata *co, char *rec, size_t nbytes, struct reply *reply)
+{
+	char *imei;
 
-		snprintf(buf, sizeof(buf), "sock %d: %s (%s)", co->sock,
-			co->imei ? co->imei : "nil",
-			co->client_ip ? co->client_ip : "nil");
+	imei = process(ud, rec, nbytes, reply);
+	if (reply->len > REPLYSIZE / 2)
+		reply_tcp(ud, co->nc, reply);
 
-		xlog(ud, "%s\n", buf);
-		if (ud->cf->reporttopic)
-			pub(ud, (char *)ud->cf->reporttopic, buf, false);
+	/* Now that we know the model, its idle timeout applies */
+	if (ud->model != NULL && ud->model != co->model) {
+		co->model = ud->model;
+		co->idle_secs = idle_timeout(ud->cf, co->model);
+		idle_refresh(co);
+	}
+	if (co->command != NULL && ud->ack) {
+		command_acked(co);
 	}
-}
-
-int count_conns(char *imei)
-{
-        struct conndata *co;
-        int count = 0;
 
-        for (co = conns_by_sock; co != NULL; co = (struct conndata *)(co->hh.next)) {
-                if (co->imei && strcmp(co->imei, imei) == 0) {
-                        count++;
-                }
-        }
-        return count;
+	if (imei != NULL) {
+		conn_set_imei(ud, co, imei);
+		free(imei);
+	}
 }
 
 /*
- * We've obtained a "line" of text from a tracker via TCP in `buf' (0-terminated).
- * If `response' is non-Null, write its content back to the device.
+ * Process the complete records (+...$) at the start of what `nc' has
+ * received, right where mongoose put them, and drop them in one go. An
+ * incomplete record stays in recv_mbuf until the rest of it arrives; the
+ * buffer is released when nothing is left, so idle connections hold none.
+ *
+ * +BUFF records go to the connection's lane instead, for the scheduler.
+ * When that is full we stop, and stop reading from the socket, until the
+ * lane has been served.
+ *
+ * Binary frames are framed by their length rather than a `$', and logged
+ * as the ASCII report they amount to.
  */
 
-char *process(struct udata *ud, char *buf, size_t buflen, struct mg_connection *nc)
+static void frame_records(struct udata *ud, struct mg_connection *nc, struct conndata *co)
 {
-	char *imei, *response = NULL, rt[5120];
-	struct mbuf mcopy;
+	struct mbuf *io = &nc->recv_mbuf;
+	size_t off = 0, nbytes;
+	char *rec, *end;
+	struct reply reply;
+	bool buffered;
+	long n;
+
+	reply.len = 0;
+	PROF_START(tf);
+	while (off < io->len) {
+		rec = io->buf + off;
+		if ((n = hex_frame(rec, io->len - off)) < 0)
+			break;
+		if (n > 0) {
+			nbytes = n;
+		} else {
+			if ((end = memchr(rec, '$', io->len - off)) == NULL)
+				break;
+			nbytes = end - rec + 1;
+		}
 
-	STATSD_INC(ud->cf->sd, "line.process");
+		buffered = (ud->cf->sched_maxqueue > 0 &&
+			(n > 0 ? hex_buffered(rec) : (nbytes > 6 && memcmp(rec, "+BUFF:", 6) == 0)));
+		if (buffered && lane_queued(&co->lane) >= ud->cf->sched_maxqueue) {
+			co->paused = true;
+			nc->recv_mbuf_limit = 0;
+			STATSD_INC(ud->cf->sd, "sched.paused");
+			break;
+		}
 
-	/* I have to turn mbuf into a string and must not modify it; copy  yes,
-	 * ineffective, but ok for now. I could, alternatively chop the $ here,
-	 * and replace by 0
-	 */
+		PROF_END(PROF_FRAME, tf);
+		if (ud->datalog) {
+			static char text[HEX_LINESIZE];
+			char **parts;
+			off_t pos;
+			int nparts, len;
+
+			if (n == 0) {
+				write(ud->datalog, rec, nbytes);
+				write(ud->datalog, "\n", 1);
+			} else if ((parts = hex_split(ud, rec, nbytes, &nparts)) != NULL &&
+			    (len = hex_line(parts, nparts, text, sizeof(text))) > 0) {
+				write(ud->datalog, text, len);
+				write(ud->datalog, "\n", 1);
+			}
+
+			pos = lseek(ud->datalog, 0, SEEK_CUR);
+			if (pos > (10 * 1024*1024)) {
+				char path[BUFSIZ];
 
-	mbuf_init(&mcopy, buflen+16);
+				close(ud->datalog);
+				snprintf(path, BUFSIZ, "%s.%lld", ud->cf->datalog, (long long)time(0));
+				link(ud->cf->datalog, path);
+				unlink(ud->cf->datalog);
+				ud->datalog = open(ud->cf->datalog, O_WRONLY | O_CREAT, 0666);
+			}
+			PROF_END(PROF_DATALOG, tf);
+		}
 
-	mbuf_append(&mcopy, buf, buflen);
-	mbuf_append(&mcopy, "\0\0", 2);
+		if (!buffered || lane_push(&co->lane, rec, nbytes) == false)
+			handle_record(ud, co, rec, nbytes, &reply);
 
-	imei = handle_report(ud, mcopy.buf, &response);
-	if (response != NULL) {
-		xlog(ud, "Responding to terminal: %s\n", response);
-		mg_printf(nc, "%s", response);
-		free(response);
+		off += nbytes;
+		PROF_RESTART(tf);
+	}
+	if (reply.len > 0)
+		reply_tcp(ud, nc, &reply);
+
+	if (io->len - off > MAXRECORD) {
+		xlog(ud, "Discarding %lu bytes without a record from socket %d: IP is %s\n",
+			(unsigned long)(io->len - off), co->sock, co->client_ip);
+		STATSD_INC(ud->cf->sd, "line.toolong");
+		off = io->len;
 	}
 
-	/* If we have an IMEI, publish the RAW string
-	 * to MQTT as a backup
-	 */
+	mbuf_remove(io, off);
+	if (io->len == 0)
+		mbuf_free(io);
+}
 
-	snprintf(rt, sizeof(rt), "%s/%s", (char *)ud->cf->rawtopic, imei);
-	pub(ud, rt, mcopy.buf, false);
+/* The scheduler hands us a +BUFF record of `l''s connection */
+static struct reply lane_reply;
 
-	mbuf_free(&mcopy);
-	return (imei);
+static void serve_buffered(struct lane *l, char *rec, size_t len)
+{
+	struct conndata *co = (struct conndata *)l->arg;
+
+	handle_record((struct udata *)co->nc->mgr->user_data, co, rec, len, &lane_reply);
+}
+
+/* ... and is done with it for now: reply, and read again if we'd stopped */
+static void served_buffered(struct lane *l)
+{
+	struct conndata *co = (struct conndata *)l->arg;
+	struct mg_connection *nc = co->nc;
+	struct udata *ud = (struct udata *)nc->mgr->user_data;
+
+	if (lane_reply.len > 0)
+		reply_tcp(ud, nc, &lane_reply);
+	idle_refresh(co);
+	if (co->paused && lane_queued(l) == 0) {
+		co->paused = false;
+		nc->recv_mbuf_limit = ~0;
+		frame_records(ud, nc, co);
+	}
 }
 
 static void ev_handler(struct mg_connection *nc, int ev, void *ev_data)
 {
 	struct mbuf *io = &nc->recv_mbuf;
-	char *imei = NULL;
 	char buf[512];
 	struct conndata *co;
 	struct udata *ud = (struct udata *)nc->mgr->user_data;
-	size_t ml;	/* mb len */
-	struct mbuf *mb;
 
 	/*
 	 * On a new connection (EV_ACCEPT), add an an entry hashed by socket number
@@ -218,133 +353,45 @@ static void ev_handler(struct mg_connection *nc, int ev, void *ev_data)
 	 */
 
 	/*
-	 * The principle here is that on EV_RECV we fill our own buffer (called
-	 * `mb', and stored in connection data) and clear out what we received.
-	 * Then, on EV_POLL, we search through the buffer looking for our
-	 * records (+....$) and process each individually.
+	 * The principle here is that on EV_RECV we search through what has
+	 * been received for our records (+....$) and process each
+	 * individually; see frame_records().
 	 */
 
 	switch (ev) {
-		case MG_EV_POLL:
-			/*
-			 * If we haven't recorded a connection to us yet for the current
-			 * socket, abandon as we can't do anything anyway.
-			 */
-
-			if ((co = find_conn(nc->sock)) == NULL) {
-				return;
-			}
-
-			/*
-			 * If we don't receive anything from a device for more than
-			 * 20 minutes, we can assume the connection to be dead.
-			 * (Our devices are configured to a 15 minute heartbeat interval)
-			 */
-			if (time(NULL) - nc->last_io_time > 20 * 60) {
-				xlog(ud, "Closing inactive connection on socket %d: IP is %s\n", co->sock, co->client_ip);
-				STATSD_INC(ud->cf->sd, "connection.forceclose");
-				nc->flags |= MG_F_CLOSE_IMMEDIATELY;
-			}
-
-			mb = co->mb;
-
-			/*
-			 * A record is +...$
-			 * Search for the '$', cut there, process, and remove what we've
-			 * done thus far from `mb' and await more data.
-			 */
-
-			for (ml = 0; ml < mb->len; ml++) {
-				if (mb->buf[ml] == '$') {
-					size_t nbytes = ml + 1;
-
-					if (ud->datalog) {
-						off_t pos;
-
-						write(ud->datalog, mb->buf, nbytes);
-						write(ud->datalog, "\n", 1);
-
-						pos = lseek(ud->datalog, 0, SEEK_CUR);
-						if (pos > (10 * 1024*1024)) {
-							char path[BUFSIZ];
-
-							close(ud->datalog);
-							snprintf(path, BUFSIZ, "%s.%lld", ud->cf->datalog, (long long)time(0));
-							link(ud->cf->datalog, path);
-							unlink(ud->cf->datalog);
-							ud->datalog = open(ud->cf->datalog, O_WRONLY | O_CREAT, 0666);
-						}
-
-					}
-
-					imei = process(ud, mb->buf, nbytes, nc);
-
-					if (imei != NULL && ud->cf->datadir != NULL) {
-						char path[BUFSIZ];
-						int fd;
-
-						snprintf(path, sizeof(path), "%s/data-%s",
-							ud->cf->datadir, imei);
-						if ((fd = open(path, O_CREAT|O_WRONLY|O_APPEND, 0644)) != -1) {
-							write(fd, mb->buf, nbytes);
-							write(fd, "\n", 1);
-							close(fd);
-						}
-
-
-
-						if ((co = (struct conndata *)nc->user_data) != NULL) {
-							xlog(ud, "Found connection on socket %d: IP is %s: IMEI <%s>\n", co->sock, co->client_ip, imei);
-							STATSD_INC(ud->cf->sd, "connection.reuse");
-							if (co->imei == NULL) {
-								co->imei = strdup(imei);
-								HASH_ADD_KEYPTR(hh_imei, conns_by_imei, co->imei, strlen(co->imei), co);
-							}
-						}
-						free(imei);
-					}
-
-					/* Clear what we've used from `mb' */
-					mbuf_remove(mb, nbytes);
-					break;
-				}
-			}
-			break;
-
 		case MG_EV_ACCEPT:
 			mg_sock_addr_to_str(ev_data, buf, sizeof(buf), MG_SOCK_STRINGIFY_IP);
 
 			if ((co = find_conn(nc->sock)) == NULL) {
-				co = add_conn(nc->sock);
+				if ((co = add_conn(nc->sock)) == NULL) {
+					nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+					break;
+				}
 				co->client_ip = strdup(buf);
 				co->nc = nc;
-				co->mb = (struct mbuf *)malloc(sizeof (struct mbuf));
-				mbuf_init(co->mb, 1024);
+				co->idle_secs = idle_timeout(ud->cf, NULL);
+				lane_init(&co->lane, serve_buffered, served_buffered, co);
 				xlog(ud, "Adding connection on socket %d: IP is %s\n", nc->sock, co->client_ip);
 				STATSD_INC(ud->cf->sd, "connection.new");
 			}
 
 			nc->user_data = co;
+			idle_refresh(co);
 			break;
 
 		case MG_EV_RECV:
 
-			co = find_conn(nc->sock);	/* If we can't find a connection, panic */
+			co = (struct conndata *)nc->user_data;	/* If we can't find a connection, panic */
 			assert(co != NULL);
-
+			idle_refresh(co);
 
 			if (ud->cf->debughex) {
-				mg_hexdump_connection(nc, ud->cf->debughex, io->buf, io->len, ev);
-			}
+				int len = *(int *)ev_data;	/* just received, at the end */
 
-			/*
-			 * shove the bytes into our `mb' buffer, and return, after
-			 * clearing our working buffer;
-			 * we do the real work during POLL.
-			 */
+				mg_hexdump_connection(nc, ud->cf->debughex, io->buf + io->len - len, len, ev);
+			}
 
-			mbuf_append(co->mb, io->buf, io->len);
-			mbuf_remove(io, io->len);
+			frame_records(ud, nc, co);
 			break;
 
 		case MG_EV_CLOSE:
@@ -357,6 +404,12 @@ static void ev_handler(struct mg_connection *nc, int ev, void *ev_data)
 						co->imei ? co->imei : "");
 				}
 
+				/* what it sent is handled before it's forgotten */
+				lane_drain(&co->lane);
+				lane_reply.len = 0;
+
+				raw_flush_imei(ud, co->imei);
+
 				if (co->imei && strcmp(co->imei, "123456789012345") != 0 && count_conns(co->imei) < 2) {
 					pseudo_lwt(ud, co->imei);
 				}
@@ -442,6 +495,8 @@ void write_to_connection(struct mg_mgr *mgr, char *imei, char *payload)
 	struct udata *ud = (struct udata *)mgr->user_data;
 
 	if ((co = find_imei(imei)) == NULL) {
+		if (udp_send_imei(imei, payload) == true)
+			return;
 		xlog(ud, "Can't stab for imei %s\n", imei);
 		return;
 	}
@@ -453,6 +508,8 @@ void write_to_connection(struct mg_mgr *mgr, char *imei, char *payload)
 
 	xlog(ud, "sock=%d = %s. Sending %s\n", c->sock, co->imei, payload);
 	mg_printf(c, "%s", payload);
+
+	command_sent(co, payload, ud->cf->command_timeout);
 }
 
 void on_message(struct mosquitto *mosq, void *userdata, const struct mosquitto_message *m)
@@ -486,6 +543,10 @@ void on_message(struct mosquitto *mosq, void *userdata, const struct mosquitto_m
 			dump_stats(ud);
 		else if (strcmp((char *)m->payload, "ping") == 0)
 			pong(ud);
+		else if (strcmp((char *)m->payload, "profile") == 0)
+			prof_dump(ud);
+		else if (strcmp((char *)m->payload, "reload") == 0)
+			reload_pending = 1;
 
 		return;
 	}
@@ -493,6 +554,70 @@ void on_message(struct mosquitto *mosq, void *userdata, const struct mosquitto_m
 	free(device_id);
 }
 
+static void on_hup(int sig)
+{
+	reload_pending = 1;
+}
+
+static void on_term(int sig)
+{
+	stopping = 1;
+}
+
+/*
+ * SIGTERM or SIGINT: write out what is only held in memory (track fixes
+ * not yet in a block, trips, dedup windows, raw batches, a snapshot of
+ * the devices), so that a restart loses none of it, and give the broker
+ * a few seconds to take the publishes still queued.
+ */
+
+static void shutdown_flush(struct udata *ud, struct mosquitto *mosq)
+{
+	int n;
+
+	xlog(ud, "Terminating: flushing state\n");
+	raw_flush_expired(ud, true);
+	store_flush(ud);
+	trip_save(ud);
+	dedup_save(ud);
+	snap_save(ud, true);
+
+	for (n = 0; n < 50 && ud->published != ud->acked; n++)
+		mosquitto_loop(mosq, 100, 1);
+	mosquitto_disconnect(mosq);
+	mosquitto_loop(mosq, 100, 1);
+}
+
+/*
+ * SIGHUP or the `reload' command: read the parts of qtripp.ini which may
+ * change (see conf_reload()) into a new configuration, off to the side,
+ * and switch to it between polls, when nothing is using the old one.
+ * Connections are left as they are; what was looked up for them or their
+ * devices from the old configuration is looked up again, and names are
+ * read from `namesdir' afresh.
+ */
+
+static void reload(struct udata *ud)
+{
+	config *old = ud->cf, *nc;
+
+	reload_pending = 0;
+	if ((nc = conf_reload(old, &defaults, "qtripp.ini")) == NULL) {
+		xlog(ud, "Reload: can't load/parse ini file; configuration unchanged\n");
+		return;
+	}
+	ud->cf = nc;
+	thin_reconfigure(ud);
+	conn_reconfigure(nc);
+	free_iinfo();
+
+	conf_release(old);
+	if (old != &cf)
+		free(old);
+	STATSD_INC(nc->sd, "config.reload");
+	xlog(ud, "Reloaded qtripp.ini: %u device topics\n", HASH_COUNT(nc->devices));
+}
+
 void on_connect(struct mosquitto *mosq, void *userdata, int rc)
 {
 	struct udata *ud = (struct udata *)userdata;
@@ -524,78 +649,41 @@ void on_connect(struct mosquitto *mosq, void *userdata, int rc)
 	}
 }
 
-int main(int argc, char **argv)
+void on_publish(struct mosquitto *mosq, void *userdata, int mid)
 {
-	struct mg_mgr mgr;
-	struct mg_connection *c, *w;
-	struct mg_bind_opts bind_opts;
-	struct udata udata, *ud = &udata;
-	struct mosquitto *mosq;
-	bool clean_session = true;
-	const char *e = NULL;
-	struct my_device *d, *tmp;
-	int rc;
-
-        if (ini_parse("qtripp.ini", ini_handler, &cf) < 0) {
-		xlog(NULL, "Can't load/parse ini file.\n");
-                return (1);
-        }
-
-	memset(&udata, 0, sizeof(udata));
-    ud->debugging           = true;
-	ud->cf			= &cf;
-	ud->logfp		= fopen(cf.logfile, "a");
-
-        load_models();
-        load_reports();
-        load_devices();
-        load_ignores();
+	struct udata *ud = (struct udata *)userdata;
 
-#ifdef WITH_BEAN
-	if ((ud->bean_socket = bs_connect(cf.bean_host, cf.bean_port)) == BS_STATUS_FAIL) {
-		xlog(ud, "Cannot conect to beanstalkd on %s:%d: %s\n",
-			cf.bean_host, cf.bean_port, strerror(errno));
-		exit(7);
-	}
+	ud->acked++;
+}
 
-	if (bs_use(ud->bean_socket, cf.bean_tube) != BS_STATUS_OK)
-		xlog(ud, "Cannot use tube %s\n", ud->cf->bean_tube);
-	if (bs_watch(ud->bean_socket, cf.bean_tube) != BS_STATUS_OK)
-		xlog(ud, "Cannot watch tube %s\n", ud->cf->bean_tube);
-	if (bs_ignore(ud->bean_socket, "default") != BS_STATUS_OK)
-		xlog(ud, "Cannot ignore tube default\n");
+/*
+ * Create a mosquitto instance with the configured credentials and TLS
+ * settings, and connect it to the broker.
+ */
 
-	xlog(ud, "Connected to beanstalkd on %s:%d for tube %s\n",
-			cf.bean_host, cf.bean_port, cf.bean_tube);
-#endif
+static struct mosquitto *mqtt_connect(struct udata *ud, const char *client_id)
+{
+	struct mosquitto *mosq;
+	bool clean_session = true;
+	int rc;
 
-	mosquitto_lib_init();
-    xlog(ud, "Connecting to client_id  %s\n",cf.client_id);
+    xlog(ud, "Connecting to client_id  %s\n", client_id);
 	
-	mosq = mosquitto_new(cf.client_id, clean_session, &udata);
+	mosq = mosquitto_new(client_id, clean_session, ud);
 	if (!mosq) {
 		fprintf(stderr, "Error: mosquitto_new() says 'out of memory'.\n");
 		mosquitto_lib_cleanup();
-		return (-1);
+		exit(-1);
 	}
 
-#ifdef STATSD
-	if (cf.statsdhost) {
-		cf.sd = statsd_init_with_namespace(cf.statsdhost, 8125, "qtripp");
-		STATSD_INC(cf.sd, "program.launched");
-	}
-#endif
-
 	if (cf.username || cf.password) {
 		mosquitto_username_pw_set(mosq, cf.username, cf.password);
 	}
 
 	mosquitto_message_callback_set(mosq, on_message);
 	mosquitto_connect_callback_set(mosq, on_connect);
+	mosquitto_publish_callback_set(mosq, on_publish);
 
-
-    xlog(ud, "Connecting to client_id  %s\n",cf.client_id);
-	
 	if (cf.cafile && *cf.cafile) {
 
                         rc = mosquitto_tls_set(mosq,
@@ -618,7 +706,122 @@ int main(int argc, char **argv)
                                 );
 
 	}
-	printf("ok");
+
+	mosquitto_opts_set(mosq, MOSQ_OPT_PROTOCOL_VERSION, &(cf.protocol));
+
+	rc = mosquitto_connect(mosq, cf.host, cf.port, 60);
+
+	return (mosq);
+}
+
+/*
+ * Each replay worker has its own broker connection (client_id suffixed
+ * with the worker number) and beanstalk connection.
+ */
+
+static void replay_init(struct udata *ud, int worker)
+{
+	char id[BUFSIZ];
+
+	if (ud->sinks & SINK_MQTT) {
+		snprintf(id, sizeof(id), "%s-r%d", cf.client_id ? cf.client_id : "qtripp", worker);
+		ud->mosq = mqtt_connect(ud, id);
+		mosquitto_max_inflight_messages_set(ud->mosq, 1000);
+	}
+#ifdef WITH_BEAN
+	if (ud->sinks & SINK_BEAN) {
+		bean_init(ud);
+	}
+#endif
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s [-j workers] [-o mqtt|null|file%s] [-O jsonfile] [-q] [file ...]\n",
+		prog,
+#ifdef WITH_BEAN
+		"|bean"
+#else
+		""
+#endif
+		);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct mg_mgr mgr;
+	struct mg_connection *c;
+	struct mg_bind_opts bind_opts;
+	struct udata udata, *ud = &udata;
+	struct mosquitto *mosq;
+	const char *e = NULL;
+	struct my_device *d, *tmp;
+	char *progname = *argv, *sink = "mqtt", *sinkfile = NULL;
+	int ch, workers = 1;
+	bool quiet = false;
+
+	while ((ch = getopt(argc, argv, "j:o:O:q")) != EOF) {
+		switch (ch) {
+			case 'j':
+				workers = atoi(optarg);
+				break;
+			case 'o':
+				sink = optarg;
+				break;
+			case 'O':
+				sinkfile = optarg;
+				break;
+			case 'q':
+				quiet = true;
+				break;
+			default:
+				usage(progname);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	cf = defaults;
+        if (ini_parse("qtripp.ini", ini_handler, &cf) < 0) {
+		xlog(NULL, "Can't load/parse ini file.\n");
+                return (1);
+        }
+
+	if (cf.raw_mode == RAW_UNSET)
+		cf.raw_mode = cf.rawtopic ? RAW_COMPAT : RAW_OFF;
+	if (cf.raw_batch_lines < 1)
+		cf.raw_batch_lines = 1;
+
+	memset(&udata, 0, sizeof(udata));
+    ud->debugging           = true;
+	ud->cf			= &cf;
+	ud->logfp		= quiet ? NULL : fopen(cf.logfile, "a");
+	ud->sinks		= SINK_MQTT;
+#ifdef WITH_BEAN
+	ud->sinks		|= SINK_BEAN;
+#endif
+
+        load_models();
+        load_hextypes();
+        load_reports();
+        load_devices();
+        load_ignores();
+	prof_init();
+
+	mg_mgr_init(&mgr, NULL);
+	udata.mgr = &mgr;
+	mgr.user_data = &udata; // experiment
+
+	mosquitto_lib_init();
+
+#ifdef STATSD
+	if (cf.statsdhost) {
+		cf.sd = statsd_init_with_namespace(cf.statsdhost, 8125, "qtripp");
+		STATSD_INC(cf.sd, "program.launched");
+	}
+#endif
+
 	if  (!strcmp(cf.protocol_version, "mqttv31")){
 		cf.protocol=MQTT_PROTOCOL_V31;
 
@@ -632,33 +835,67 @@ int main(int argc, char **argv)
 
 	}
 
-	mosquitto_opts_set(mosq, MOSQ_OPT_PROTOCOL_VERSION, &(cf.protocol));
+	/*
+	 * With file arguments, replay them into the selected sink and exit.
+	 */
 
-	rc = mosquitto_connect(mosq, cf.host, cf.port, 60);
+	if (argc > 0) {
+		if (!strcmp(sink, "mqtt")) {
+			ud->sinks = SINK_MQTT;
+		} else if (!strcmp(sink, "null")) {
+			ud->sinks = SINK_NULL;
+		} else if (!strcmp(sink, "file") && sinkfile != NULL) {
+			ud->sinks = SINK_FILE;
+			if ((ud->sinkfd = open(sinkfile, O_WRONLY | O_APPEND | O_CREAT, 0666)) == -1) {
+				perror(sinkfile);
+				exit(3);
+			}
+#ifdef WITH_BEAN
+		} else if (!strcmp(sink, "bean")) {
+			ud->sinks = SINK_BEAN;
+#endif
+		} else {
+			usage(progname);
+		}
 
-	udata.mosq	= mosq;
-	udata.datalog 	= 0;
+		exit(replay(ud, argv, argc, workers, replay_init));
+	}
 
-	if (cf.datalog) {
-		udata.datalog	= open(cf.datalog, O_WRONLY | O_APPEND | O_CREAT, 0666);
+	lanes_init(cf.sched_quantum, cf.sched_budget, cf.sched_maxqueue);
+	if (dedup_init(ud) == false) {
+		exit(1);
+	}
+	if (thin_init(ud) == false) {
+		exit(1);
+	}
+	if (geo_init(ud) == false) {
+		exit(1);
+	}
+	if (trip_init(ud) == false) {
+		exit(1);
+	}
+	if (store_init(ud) == false) {
+		exit(1);
+	}
+	if (recent_init(ud) == false) {
+		exit(1);
+	}
+	if (snap_init(ud) == false) {
+		exit(1);
 	}
 
-	udata.cf  = &cf;
+	mosq = mqtt_connect(ud, cf.client_id);
 
-	if (argc == 2) {
-		FILE *fp = fopen(argv[1], "r");
+	udata.mosq	= mosq;
+	udata.datalog 	= 0;
 
-		if (fp == NULL) {
-			perror(argv[1]);
-			exit(3);
-		}
-		handle_file_reports(ud, fp);
-		mosquitto_disconnect(ud->mosq);
-		mosquitto_destroy(ud->mosq);
-		exit(0);
+	if (cf.datalog) {
+		udata.datalog	= open(cf.datalog, O_WRONLY | O_APPEND | O_CREAT, 0666);
 	}
 
-	mg_mgr_init(&mgr, NULL);
+#ifdef WITH_BEAN
+	bean_init(ud);
+#endif
 
 	memset(&bind_opts, 0, sizeof(bind_opts));
 #if 0
@@ -672,20 +909,19 @@ int main(int argc, char **argv)
 	xlog(ud, "Listening for GPRS on port %s\n", cf.listen_port);
 
 	c = mg_bind_opt(&mgr, cf.listen_port, ev_handler, bind_opts);
-	w = mg_bind_opt(&mgr, strcpy("udp://0.0.0.0:", cf.listen_port), ev_handler, bind_opts);
 
 	if (c == NULL) {
 		xlog(ud, "Error starting server: %s\n", *bind_opts.error_string);
 		exit(1);
 	}
 
-	if (w == NULL) {
-		xlog(ud, "Error starting UDP server: %s\n", *bind_opts.error_string);
+	if (udp_init(ud, &mgr, cf.listen_port, process) == false) {
 		exit(1);
 	}
 
-	udata.mgr = &mgr;
-	mgr.user_data = &udata; // experiment
+	if (cf.http_listen && http_init(ud, &mgr, http_sources) == false) {
+		exit(1);
+	}
 
 #if 0
 	const char *address = "127.0.0.1:8881";		// FIXME: config
@@ -704,9 +940,25 @@ int main(int argc, char **argv)
 	COCO_CONN;
 #endif
 
-	while (1) {
-		mg_mgr_poll(&mgr, 1000);
+	signal(SIGHUP, on_hup);
+	signal(SIGTERM, on_term);
+	signal(SIGINT, on_term);
+
+	while (!stopping) {
+		/* +BUFF records wait while the broker is behind; live ones don't */
+		bool serve = lanes_pending() && ud->published - ud->acked < cf.sched_inflight;
+
+		mg_mgr_poll(&mgr, serve ? 0 : lanes_pending() ? 10 : 1000);
+		timer_run();
+		if (serve)
+			lanes_run();
+		raw_flush_expired(ud, false);
+#ifdef WITH_BEAN
+		bean_poll(ud);
+#endif
 		mosquitto_loop(mosq, 0, 1);
+		if (reload_pending)
+			reload(ud);
 #if 0
 		fprintf(stderr, "Loop.. cocorun == %d\n", ud->cocorun); // FIXME
 		if (ud->cocorun == false) {
@@ -715,6 +967,7 @@ int main(int argc, char **argv)
 #endif
 	}
 
+	shutdown_flush(ud, mosq);
 	mg_mgr_free(&mgr);
 
 	HASH_ITER(hh, cf.devices, d, tmp) {
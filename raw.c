@@ -0,0 +1,214 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#ifdef WITH_ZLIB
+# include <zlib.h>
+#endif
+#include "mongoose.h"
+#include "uthash.h"
+#include "conf.h"
+#include "util.h"
+#include "tline.h"
+#include "raw.h"
+
+/*
+ * Mirror raw device lines to `rawtopic'. Depending on the configured
+ * mode we publish every record (compat), only those records whose
+ * subtype and IMEI are selected (line), or we collect selected records
+ * per device and publish them as one newline-separated message once
+ * `batch_lines' have accumulated or the oldest line has waited for
+ * `batch_ms' (batch). Batches are optionally deflated, in which case
+ * they're published to `rawtopic/<imei>/z'.
+ */
+
+#define RAW_KEYLEN	18
+
+struct rawbatch {
+	char key[RAW_KEYLEN];		/* imei */
+	struct mbuf mb;			/* newline-separated raw lines */
+	int nlines;
+	long long first_ms;		/* when the oldest line was queued */
+	UT_hash_handle hh;
+};
+static struct rawbatch *batches = NULL;
+
+/*
+ * Copy the `n'th comma-separated field after the ':' of a raw record
+ * such as "+RESP:GTFRI,360701,863123456789090,...$" into `buf'. Field
+ * 0 is the subtype, field 2 the IMEI. Returns false if not found.
+ */
+
+static bool raw_field(const char *line, size_t len, int n, char *buf, size_t buflen)
+{
+	const char *p, *end = line + len;
+	size_t flen;
+
+	*buf = 0;
+	if (len < 2 || *line != '+' || (p = memchr(line, ':', len)) == NULL)
+		return (false);
+
+	for (++p; n > 0 && p < end; p++) {
+		if (*p == ',')
+			--n;
+	}
+	if (n > 0)
+		return (false);
+
+	for (flen = 0; p + flen < end && p[flen] != ',' && p[flen] != '$'; flen++)
+		;
+	if (flen == 0 || flen >= buflen)
+		return (false);
+
+	memcpy(buf, p, flen);
+	buf[flen] = 0;
+	return (true);
+}
+
+static void raw_publish(struct udata *ud, char *imei, char *payload, size_t len, bool deflated)
+{
+	char topic[BUFSIZ];
+
+	snprintf(topic, sizeof(topic), "%s/%s%s", ud->cf->rawtopic, imei, deflated ? "/z" : "");
+	pubn(ud, topic, payload, len, false);
+}
+
+static void raw_flush(struct udata *ud, struct rawbatch *rb)
+{
+	if (rb->nlines == 0)
+		return;
+
+	STATSD_INC(ud->cf->sd, "raw.batch");
+
+#ifdef WITH_ZLIB
+	if (ud->cf->raw_compress) {
+		uLongf zlen = compressBound(rb->mb.len);
+		Bytef *z = malloc(zlen);
+
+		if (z && compress2(z, &zlen, (Bytef *)rb->mb.buf, rb->mb.len, Z_BEST_SPEED) == Z_OK) {
+			raw_publish(ud, rb->key, (char *)z, zlen, true);
+			free(z);
+			goto done;
+		}
+		xlog(ud, "Cannot deflate raw batch for %s; publishing uncompressed\n", rb->key);
+		free(z);
+	}
+#endif
+	raw_publish(ud, rb->key, rb->mb.buf, rb->mb.len, false);
+
+#ifdef WITH_ZLIB
+  done:
+#endif
+	/* Release the buffer so idle devices don't hold on to memory */
+	mbuf_free(&rb->mb);
+	rb->nlines = 0;
+}
+
+void raw_mirror(struct udata *ud, char *line, size_t len)
+{
+	config *cf = ud->cf;
+	char subtype[24], imei[RAW_KEYLEN];
+	struct rawbatch *rb;
+
+	if (cf->raw_mode == RAW_OFF || cf->rawtopic == NULL)
+		return;
+
+	raw_field(line, len, 0, subtype, sizeof(subtype));
+	raw_field(line, len, 2, imei, sizeof(imei));
+
+	if (cf->raw_mode == RAW_COMPAT) {
+		/* As we always have: every record, sans its terminating '$' */
+		if (len > 0 && line[len - 1] == '$')
+			--len;
+		raw_publish(ud, *imei ? imei : "unknown", line, len, false);
+		return;
+	}
+
+	if (*imei == 0) {
+		STATSD_INC(cf->sd, "raw.noimei");
+		return;
+	}
+
+	if (!name_in(cf->raw_subtypes, subtype) || !name_in(cf->raw_devices, imei)) {
+		STATSD_INC(cf->sd, "raw.skipped");
+		return;
+	}
+
+	if (cf->raw_mode == RAW_LINE) {
+		raw_publish(ud, imei, line, len, false);
+		return;
+	}
+
+	HASH_FIND_STR(batches, imei, rb);
+	if (rb == NULL) {
+		rb = (struct rawbatch *)calloc(1, sizeof(struct rawbatch));
+		strcpy(rb->key, imei);
+		HASH_ADD_STR(batches, key, rb);
+	}
+
+	if (rb->nlines == 0) {
+		mbuf_init(&rb->mb, (len + 1) * cf->raw_batch_lines);
+		rb->first_ms = mono_ms();
+	} else {
+		mbuf_append(&rb->mb, "\n", 1);
+	}
+	mbuf_append(&rb->mb, line, len);
+
+	if (++rb->nlines >= cf->raw_batch_lines)
+		raw_flush(ud, rb);
+}
+
+/*
+ * Publish what we have for `imei', e.g. because its device disconnected.
+ */
+
+void raw_flush_imei(struct udata *ud, char *imei)
+{
+	struct rawbatch *rb;
+
+	if (imei == NULL)
+		return;
+
+	HASH_FIND_STR(batches, imei, rb);
+	if (rb != NULL)
+		raw_flush(ud, rb);
+}
+
+/*
+ * Publish batches whose oldest line has waited for at least `batch_ms',
+ * or all pending batches if `all' is set.
+ */
+
+void raw_flush_expired(struct udata *ud, bool all)
+{
+	struct rawbatch *rb, *tmp;
+	long long now;
+
+	if (batches == NULL)
+		return;
+
+	now = mono_ms();
+	HASH_ITER(hh, batches, rb, tmp) {
+		if (rb->nlines > 0 && (all || now - rb->first_ms >= ud->cf->raw_batch_ms))
+			raw_flush(ud, rb);
+	}
+}
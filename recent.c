@@ -0,0 +1,249 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "uthash.h"
+#include "conf.h"
+#include "util.h"
+#include "tline.h"
+#include "pool.h"
+#include "http.h"
+#include "mongoose.h"
+#include "recent.h"
+
+/*
+ * The last [recent] `fixes' positions of each device, for dashboards
+ * which want a device's recent track (HTTP /recent) without going to a
+ * database. A fix takes 16 bytes in a ring of fixed size per device, and
+ * there are never more rings than fit into `memory': when that's used
+ * up, the ring of the device heard from least recently is taken over.
+ * Positions older than a ring's newest (e.g. from +BUFF) aren't added.
+ */
+
+struct rfix {
+	uint32_t tst;
+	int32_t lat, lon;		/* millionths of a degree */
+	uint16_t vel;			/* tenths of a km/h; 0xFFFF: unknown */
+	uint16_t cog;			/* 0xFFFF: unknown */
+};
+
+struct ring {
+	char imei[16];
+	struct ring *prev, *next;	/* least recently added to first */
+	uint32_t head, count;		/* next slot, fixes in it */
+	UT_hash_handle hh;
+	struct rfix fixes[];
+};
+
+static struct ring *rings = NULL;
+static struct ring *oldest = NULL, *newest = NULL;
+static struct pool ring_pool;
+static int nfixes = 0;			/* per ring; 0: not keeping any */
+static unsigned long nrings = 0, maxrings = 0, added = 0, evicted = 0;
+
+static void unlink_ring(struct ring *r)
+{
+	if (r->prev)	r->prev->next = r->next;
+	else		oldest = r->next;
+	if (r->next)	r->next->prev = r->prev;
+	else		newest = r->prev;
+	r->prev = r->next = NULL;
+}
+
+static void append_ring(struct ring *r)
+{
+	r->prev = newest;
+	r->next = NULL;
+	if (newest)	newest->next = r;
+	else		oldest = r;
+	newest = r;
+}
+
+static struct ring *ring_for(const char *imei)
+{
+	struct ring *r;
+
+	HASH_FIND_STR(rings, imei, r);
+	if (r != NULL)
+		return (r);
+
+	if (nrings < maxrings && (r = (struct ring *)pool_get(&ring_pool)) != NULL) {
+		nrings++;
+	} else if ((r = oldest) != NULL) {
+		unlink_ring(r);
+		HASH_DEL(rings, r);
+		evicted++;
+	} else {
+		return (NULL);
+	}
+	memset(r, 0, sizeof(struct ring));
+	snprintf(r->imei, sizeof(r->imei), "%s", imei);
+	HASH_ADD_STR(rings, imei, r);
+	append_ring(r);
+	return (r);
+}
+
+void recent_add(const char *imei, double lat, double lon, double vel, long cog, time_t tst)
+{
+	struct ring *r;
+	struct rfix *f;
+
+	if (nfixes == 0 || (r = ring_for(imei)) == NULL)
+		return;
+	if (r->count > 0 && tst < r->fixes[(r->head + nfixes - 1) % nfixes].tst)
+		return;
+
+	f = &r->fixes[r->head];
+	f->tst = tst;
+	f->lat = lround(lat * 1e6);
+	f->lon = lround(lon * 1e6);
+	f->vel = isnan(vel) || vel < 0 || vel >= 6553.5 ? 0xFFFF : lround(vel * 10);
+	f->cog = cog < 0 || cog > 360 ? 0xFFFF : cog;
+	r->head = (r->head + 1) % nfixes;
+	if (r->count < (uint32_t)nfixes)
+		r->count++;
+	added++;
+
+	if (r != newest) {
+		unlink_ring(r);
+		append_ring(r);
+	}
+}
+
+/* `v' / 10^`prec' in decimal at `p', with `prec' decimals; returns the end */
+static char *fixed(char *p, long v, int prec)
+{
+	char tmp[24], *t = tmp + sizeof(tmp);
+	unsigned long u = v < 0 ? -(unsigned long)v : (unsigned long)v;
+	int n = 0;
+
+	do {
+		*--t = '0' + u % 10;
+		u /= 10;
+		if (++n == prec)
+			*--t = '.';
+	} while (u > 0 || n <= prec);
+	if (v < 0)
+		*--t = '-';
+	memcpy(p, t, tmp + sizeof(tmp) - t);
+	return (p + (tmp + sizeof(tmp) - t));
+}
+
+/*
+ * Append to `mb' the JSON array of the last `max' (0: all) fixes of
+ * `imei' since `since', oldest first, formatting each on the stack;
+ * returns how many, or -1 if we have none of it.
+ */
+
+long recent_json(const char *imei, time_t since, int max, struct mbuf *mb)
+{
+	struct ring *r;
+	struct rfix *f;
+	char buf[128], *p;
+	uint32_t n, first;
+	long count = 0;
+
+	HASH_FIND_STR(rings, imei, r);
+	if (r == NULL || nfixes == 0)
+		return (-1);
+
+	/* the oldest wanted: skip those before `since', then all but `max' */
+	first = (r->head + nfixes - r->count) % nfixes;
+	for (n = 0; n < r->count && r->fixes[(first + n) % nfixes].tst < since; n++)
+		;
+	if (max > 0 && r->count - n > (uint32_t)max)
+		n = r->count - max;
+
+	mbuf_append(mb, "[", 1);
+	for (; n < r->count; n++, count++) {
+		f = &r->fixes[(first + n) % nfixes];
+		p = buf;
+		if (count)
+			*p++ = ',';
+		p = stpcpy(p, "\n{\"tst\":");
+		p = fixed(p, f->tst, 0);
+		p = stpcpy(p, ",\"lat\":");
+		p = fixed(p, f->lat, 6);
+		p = stpcpy(p, ",\"lon\":");
+		p = fixed(p, f->lon, 6);
+		if (f->vel != 0xFFFF) {
+			p = stpcpy(p, ",\"vel\":");
+			p = fixed(p, f->vel, 1);
+		}
+		if (f->cog != 0xFFFF) {
+			p = stpcpy(p, ",\"cog\":");
+			p = fixed(p, f->cog, 0);
+		}
+		*p++ = '}';
+		mbuf_append(mb, buf, p - buf);
+	}
+	mbuf_append(mb, "\n]", 2);
+	return (count);
+}
+
+bool recent_enabled(void)
+{
+	return (nfixes > 0);
+}
+
+bool recent_init(struct udata *ud)
+{
+	config *cf = ud->cf;
+	size_t size;
+
+	if (cf->recent_fixes <= 0)
+		return (true);
+	size = sizeof(struct ring) + cf->recent_fixes * sizeof(struct rfix);
+	if ((maxrings = cf->recent_memory / size) == 0) {
+		xlog(ud, "Recent: `memory' %lu too small for a ring of %d fixes\n",
+			(unsigned long)cf->recent_memory, cf->recent_fixes);
+		return (false);
+	}
+	pool_init(&ring_pool, size, 256);
+	nfixes = cf->recent_fixes;
+	xlog(ud, "Recent: %d fixes of up to %lu devices\n", nfixes, maxrings);
+	return (true);
+}
+
+void recent_stats(struct udata *ud)
+{
+	char buf[BUFSIZ];
+
+	if (nfixes == 0)
+		return;
+	snprintf(buf, sizeof(buf), "recent devices=%lu max=%lu fixes=%lu evicted=%lu",
+		nrings, maxrings, added, evicted);
+	xlog(ud, "stats: %s\n", buf);
+	if (ud->cf->reporttopic)
+		pub(ud, (char *)ud->cf->reporttopic, buf, false);
+}
+
+void recent_metrics(struct mbuf *mb)
+{
+	mbuf_printf(mb, "# HELP qtripp_recent_devices Devices with recent fixes in memory.\n"
+		"# TYPE qtripp_recent_devices gauge\n"
+		"qtripp_recent_devices %lu\n", nrings);
+	mbuf_printf(mb, "# HELP qtripp_recent_evicted_total Devices whose recent fixes made room for another's.\n"
+		"# TYPE qtripp_recent_evicted_total counter\n"
+		"qtripp_recent_evicted_total %lu\n", evicted);
+}
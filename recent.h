@@ -0,0 +1,36 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _RECENT_H_INCL_
+# define  _RECENT_H_INCL_
+
+#include <stdbool.h>
+#include <time.h>
+#include "udata.h"
+
+struct mbuf;
+
+bool recent_init(struct udata *ud);
+bool recent_enabled(void);
+void recent_add(const char *imei, double lat, double lon, double vel, long cog, time_t tst);
+long recent_json(const char *imei, time_t since, int max, struct mbuf *mb);
+void recent_stats(struct udata *ud);
+void recent_metrics(struct mbuf *mb);
+
+#endif
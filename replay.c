@@ -0,0 +1,410 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <mosquitto.h>
+#include "mongoose.h"
+#include "uthash.h"
+#include "conf.h"
+#include "util.h"
+#include "json.h"
+#include "tline.h"
+#include "replay.h"
+#ifdef WITH_BEAN
+# include "bean.h"
+#endif
+
+/*
+ * Replay files of raw device lines (e.g. rotated `datalog' files, or
+ * what qlog captured) through handle_report() as fast as we can.
+ *
+ * Input files are mmap(2)ed and lines are framed with memchr(3), which
+ * the C library vectorizes. handle_report() keeps its state in global
+ * hashes, so rather than threads we fork `workers' processes; each of
+ * them scans all files but decodes only the lines whose IMEI hashes to
+ * it. That keeps every device's reports in order without any locking or
+ * copying between processes. Workers report their counts and per-subtype
+ * decoder time to the parent through a pipe when they're done.
+ */
+
+#define MAXLINELEN	(8192 * 2)
+#define MAXPENDING	10000		/* unacknowledged MQTT publishes per worker */
+#define SINKBUFSIZE	(64 * 1024)
+
+struct subtime {
+	char key[24];			/* subtype */
+	unsigned long count;
+	long long ns;
+	UT_hash_handle hh;
+};
+static struct subtime *subtimes = NULL;
+
+static char *sinkbuf = NULL;
+static size_t sinklen = 0;
+
+static long long mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((long long)ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+static void subtime_add(char *subtype, unsigned long count, long long ns)
+{
+	struct subtime *st;
+
+	HASH_FIND_STR(subtimes, subtype, st);
+	if (st == NULL) {
+		st = calloc(1, sizeof(struct subtime));
+		snprintf(st->key, sizeof(st->key), "%s", subtype);
+		HASH_ADD_STR(subtimes, key, st);
+	}
+	st->count += count;
+	st->ns += ns;
+}
+
+/*
+ * Write JSON-lines output for SINK_FILE. Each worker buffers whole lines
+ * and appends them with one write(2) to the O_APPEND file, so lines from
+ * different workers never interleave.
+ */
+
+void sink_json(struct udata *ud, char *topic, char *js)
+{
+	char *jtopic;
+	size_t need;
+
+	if (sinkbuf == NULL && (sinkbuf = malloc(SINKBUFSIZE)) == NULL)
+		return;
+	/* the topic has the IMEI in it, as the device sent it */
+	if ((jtopic = json_encode_string(topic)) == NULL)
+		return;
+	need = strlen(jtopic) + strlen(js) + 32;
+	if (sinklen + need > SINKBUFSIZE)
+		sink_flush(ud);
+	if (need > SINKBUFSIZE) {
+		xlog(ud, "JSON too long for sink buffer; dropped\n");
+		free(jtopic);
+		return;
+	}
+
+	sinklen += sprintf(sinkbuf + sinklen, "{\"topic\":%s,\"payload\":%s}\n", jtopic, js);
+	free(jtopic);
+}
+
+void sink_flush(struct udata *ud)
+{
+	char *p = sinkbuf;
+
+	while (sinklen > 0) {
+		ssize_t nw = write(ud->sinkfd, p, sinklen);
+
+		if (nw == -1) {
+			if (errno == EINTR)
+				continue;
+			xlog(ud, "Cannot write to sink: %s\n", strerror(errno));
+			break;
+		}
+		p += nw;
+		sinklen -= nw;
+	}
+	sinklen = 0;
+}
+
+/*
+ * Which worker a line belongs to: hash the IMEI, the third field. Lines
+ * without one (e.g. "*PING") go to worker 0.
+ */
+
+static int shard(char *line, size_t len, int workers)
+{
+	char *p = line, *end = line + len;
+	unsigned long h = 5381;
+	int n;
+
+	for (n = 0; n < 2; n++) {
+		if ((p = memchr(p, ',', end - p)) == NULL)
+			return (0);
+		p++;
+	}
+	while (p < end && *p != ',' && *p != '$')
+		h = h * 33 + (unsigned char)*p++;
+
+	return (h % workers);
+}
+
+/* "+RESP:GTFRI,..." => "GTFRI" */
+static void line_subtype(char *line, char *subtype, size_t size)
+{
+	char *colon, *comma;
+	size_t n;
+
+	if (*line == '*') {
+		snprintf(subtype, size, "control");
+		return;
+	}
+	if ((colon = strchr(line, ':')) == NULL || (comma = strchr(colon, ',')) == NULL) {
+		snprintf(subtype, size, "unknown");
+		return;
+	}
+	n = comma - colon - 1;
+	if (n >= size)
+		n = size - 1;
+	memcpy(subtype, colon + 1, n);
+	subtype[n] = 0;
+}
+
+/* Keep the sinks moving and don't let libmosquitto queue without bound */
+static void sink_service(struct udata *ud)
+{
+	if ((ud->sinks & SINK_MQTT) && ud->mosq) {
+		mosquitto_loop(ud->mosq, 0, 1);
+		while (ud->published - ud->acked > MAXPENDING) {
+			if (mosquitto_loop(ud->mosq, 100, 1) != MOSQ_ERR_SUCCESS)
+				break;
+		}
+	}
+#ifdef WITH_BEAN
+	if (ud->sinks & SINK_BEAN) {
+		mg_mgr_poll(ud->mgr, 0);
+		bean_poll(ud);
+	}
+#endif
+}
+
+static void sink_drain(struct udata *ud)
+{
+	if (ud->sinks & SINK_FILE)
+		sink_flush(ud);
+
+	if ((ud->sinks & SINK_MQTT) && ud->mosq) {
+		long long deadline = mono_ms() + 30000;
+
+		while (ud->acked < ud->published && mono_ms() < deadline) {
+			if (mosquitto_loop(ud->mosq, 100, 1) != MOSQ_ERR_SUCCESS)
+				break;
+		}
+		if (ud->acked < ud->published) {
+			xlog(ud, "Replay: %lu MQTT publishes not acknowledged\n",
+				ud->published - ud->acked);
+		}
+		mosquitto_disconnect(ud->mosq);
+		mosquitto_loop(ud->mosq, 100, 1);
+		mosquitto_destroy(ud->mosq);
+	}
+#ifdef WITH_BEAN
+	if (ud->sinks & SINK_BEAN)
+		bean_drain(ud, 30);
+#endif
+}
+
+static int worker(struct udata *ud, char **files, int nfiles, int me, int workers, int outfd)
+{
+	char *line, subtype[24];
+	unsigned long records = 0, toolong = 0;
+	struct subtime *st, *tmp;
+	FILE *out;
+	int n;
+
+	if ((line = malloc(MAXLINELEN)) == NULL)
+		return (1);
+
+	for (n = 0; n < nfiles; n++) {
+		struct stat sb;
+		char *base, *p, *end;
+		int fd;
+
+		if ((fd = open(files[n], O_RDONLY)) == -1 || fstat(fd, &sb) == -1) {
+			xlog(ud, "Replay: cannot open %s: %s\n", files[n], strerror(errno));
+			if (fd != -1)
+				close(fd);
+			continue;
+		}
+		if (sb.st_size == 0) {
+			close(fd);
+			continue;
+		}
+		base = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (base == MAP_FAILED) {
+			xlog(ud, "Replay: cannot mmap %s: %s\n", files[n], strerror(errno));
+			continue;
+		}
+		madvise(base, sb.st_size, MADV_SEQUENTIAL);
+
+		for (p = base, end = base + sb.st_size; p < end; ) {
+			char *eol, *cr, *r;
+			struct reply reply;
+			size_t len;
+			long long t0;
+
+			if ((eol = memchr(p, '\n', end - p)) == NULL)
+				eol = end;
+			len = eol - p;
+			if ((cr = memchr(p, '\r', len)) != NULL)
+				len = cr - p;
+
+			if (len == 0 || *p == '#' ||
+			    (workers > 1 && shard(p, len, workers) != me)) {
+				p = eol + 1;
+				continue;
+			}
+			if (len >= MAXLINELEN) {
+				toolong++;
+				p = eol + 1;
+				continue;
+			}
+
+			memcpy(line, p, len);
+			line[len] = 0;
+			p = eol + 1;
+
+			line_subtype(line, subtype, sizeof(subtype));
+
+			t0 = mono_ns();
+			reply.len = 0;
+			r = handle_report(ud, line, &reply);
+			subtime_add(subtype, 1, mono_ns() - t0);
+
+			if (r)
+				free(r);
+
+			if ((++records % 64) == 0)
+				sink_service(ud);
+		}
+		munmap(base, sb.st_size);
+	}
+	free(line);
+
+	sink_drain(ud);
+
+	/* Hand our figures to the parent */
+	if ((out = fdopen(outfd, "w")) == NULL)
+		return (1);
+	fprintf(out, "R %lu %lu\n", records, toolong);
+	HASH_ITER(hh, subtimes, st, tmp) {
+		fprintf(out, "S %s %lu %lld\n", st->key, st->count, st->ns);
+	}
+	fclose(out);
+
+	return (0);
+}
+
+static int by_time(struct subtime *a, struct subtime *b)
+{
+	return ((a->ns < b->ns) - (a->ns > b->ns));
+}
+
+/*
+ * Fork `workers' processes to replay `files', wait for them, and print
+ * throughput and per-subtype decoder time. worker_init() is invoked in
+ * each child before it starts, to set up its connections to the sinks.
+ */
+
+int replay(struct udata *ud, char **files, int nfiles, int workers,
+	void (*worker_init)(struct udata *ud, int worker))
+{
+	int *fds, n, status, rc = 0;
+	unsigned long records = 0, toolong = 0;
+	long long t0 = mono_ns(), wall;
+	struct subtime *st, *tmp;
+	char buf[BUFSIZ];
+
+	if (workers < 1)
+		workers = 1;
+	fds = calloc(workers, sizeof(int));
+
+	fflush(NULL);
+	for (n = 0; n < workers; n++) {
+		int pfd[2];
+		pid_t pid;
+
+		if (pipe(pfd) == -1 || (pid = fork()) == -1) {
+			xlog(ud, "Replay: cannot start worker: %s\n", strerror(errno));
+			exit(2);
+		}
+		if (pid == 0) {
+			int i;
+
+			close(pfd[0]);
+			for (i = 0; i < n; i++)
+				close(fds[i]);
+			if (worker_init)
+				worker_init(ud, n);
+			_exit(worker(ud, files, nfiles, n, workers, pfd[1]));
+		}
+		close(pfd[1]);
+		fds[n] = pfd[0];
+	}
+
+	for (n = 0; n < workers; n++) {
+		FILE *in = fdopen(fds[n], "r");
+
+		while (in && fgets(buf, sizeof(buf), in) != NULL) {
+			char key[24];
+			unsigned long a, b;
+			long long ns;
+
+			if (sscanf(buf, "R %lu %lu", &a, &b) == 2) {
+				records += a;
+				toolong += b;
+			} else if (sscanf(buf, "S %23s %lu %lld", key, &a, &ns) == 3) {
+				subtime_add(key, a, ns);
+			}
+		}
+		if (in)
+			fclose(in);
+	}
+	while (wait(&status) > 0) {
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			rc = 1;
+	}
+	free(fds);
+
+	wall = mono_ns() - t0;
+	printf("replay: %lu records in %.3fs: %.0f records/s with %d worker%s",
+		records, wall / 1e9, records / (wall / 1e9), workers, workers == 1 ? "" : "s");
+	if (toolong)
+		printf(", %lu lines too long", toolong);
+	printf("\n");
+
+	HASH_SORT(subtimes, by_time);
+	printf("%-12s %10s %12s %10s\n", "subtype", "records", "decode ms", "us/record");
+	HASH_ITER(hh, subtimes, st, tmp) {
+		printf("%-12s %10lu %12.1f %10.2f\n", st->key, st->count,
+			st->ns / 1e6, st->count ? st->ns / 1e3 / st->count : 0.0);
+		HASH_DEL(subtimes, st);
+		free(st);
+	}
+	fflush(stdout);
+
+	return (rc);
+}
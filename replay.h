@@ -0,0 +1,30 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _REPLAY_H_INCL_
+# define  _REPLAY_H_INCL_
+
+#include "udata.h"
+
+int replay(struct udata *ud, char **files, int nfiles, int workers,
+	void (*worker_init)(struct udata *ud, int worker));
+void sink_json(struct udata *ud, char *topic, char *js);
+void sink_flush(struct udata *ud);
+
+#endif
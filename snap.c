@@ -0,0 +1,297 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "conf.h"
+#include "util.h"
+#include "tline.h"
+#include "timer.h"
+#include "http.h"
+#include "snap.h"
+
+/*
+ * After a restart we'd otherwise know nothing of the devices until they
+ * report again: not the last position GTHBD heartbeats are answered
+ * with, not the counters of /devices, and every names file would be read
+ * again as devices come back. So what we know of each device, and the
+ * names read from `namesdir', are written to `file' every `interval'
+ * seconds and read back at startup. (Devices without a name aren't
+ * remembered as such; finding there's no file for one is cheap.)
+ *
+ * The file is written by a child process, from its copy-on-write image
+ * of ours, to `file'.tmp which is then renamed into place; the ingest
+ * loop pauses only for fork(). Should the child still be busy when the
+ * next one is due, that one is skipped. Reading it back is one mmap()
+ * of fixed-size records (see snap.h) going straight into the tables.
+ *
+ * Geofence state isn't kept: the first position after a restart sets it
+ * without transitions, as it always has.
+ */
+
+struct writer {
+	FILE *fp;
+	uint64_t count;
+	char *strings;			/* the names */
+	size_t slen, ssize;
+};
+
+static struct timer snap_timer;
+static pid_t child = 0;
+static long long forked_ms;
+static unsigned long saves = 0, failures = 0, skipped = 0;
+static uint64_t restored = 0;
+static long long fork_us = 0, restore_ms = 0;
+
+static long long mono_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000LL + ts.tv_nsec / 1000);
+}
+
+static bool put(struct snap_dev *sd, const char *name, void *arg)
+{
+	struct writer *w = (struct writer *)arg;
+	size_t n;
+	char *p;
+
+	sd->name = SNAP_NONAME;
+	if (name != NULL && strcmp(name, ".") != 0) {
+		n = strlen(name) + 1;
+		if (w->slen + n > w->ssize) {
+			if ((p = realloc(w->strings, (w->ssize + n) * 2)) == NULL)
+				return (false);
+			w->strings = p;
+			w->ssize = (w->ssize + n) * 2;
+		}
+		if (w->slen + n <= SNAP_NONAME) {
+			sd->name = w->slen;
+			memcpy(w->strings + w->slen, name, n);
+			w->slen += n;
+		}
+	}
+	w->count++;
+	return (fwrite(sd, sizeof(struct snap_dev), 1, w->fp) == 1);
+}
+
+/*
+ * Write the snapshot to `path'.tmp and rename it into place; this blocks
+ * for as long as that takes, so it's usually done in a child.
+ */
+
+bool snap_write(struct udata *ud, const char *path)
+{
+	struct snap_hdr hdr;
+	struct writer w;
+	char tmp[BUFSIZ];
+	bool ok;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	memset(&w, 0, sizeof(w));
+	if ((w.fp = fopen(tmp, "w")) == NULL) {
+		xlog(ud, "Snapshot: cannot create %s: %s\n", tmp, strerror(errno));
+		return (false);
+	}
+	setvbuf(w.fp, NULL, _IOFBF, 1024 * 1024);
+
+	memset(&hdr, 0, sizeof(hdr));
+	ok = fwrite(&hdr, sizeof(hdr), 1, w.fp) == 1 &&
+		imei_snapshot(put, &w) &&
+		(w.slen == 0 || fwrite(w.strings, w.slen, 1, w.fp) == 1);
+
+	hdr.magic	= SNAP_MAGIC;
+	hdr.recsize	= sizeof(struct snap_dev);
+	hdr.count	= w.count;
+	hdr.strings	= w.slen;
+	hdr.created	= time(0);
+	ok = ok && fseek(w.fp, 0L, SEEK_SET) == 0 && fwrite(&hdr, sizeof(hdr), 1, w.fp) == 1 &&
+		fflush(w.fp) == 0 && fsync(fileno(w.fp)) == 0;
+	if (fclose(w.fp) != 0)
+		ok = false;
+	free(w.strings);
+
+	if (!ok || rename(tmp, path) == -1) {
+		xlog(ud, "Snapshot: cannot write %s: %s\n", path, strerror(errno));
+		unlink(tmp);
+		return (false);
+	}
+	return (true);
+}
+
+/* Reap the child writing the last snapshot; false if it's still at it */
+static bool reap(struct udata *ud, bool wait)
+{
+	int status;
+	pid_t pid;
+
+	if (child <= 0)
+		return (true);
+	if ((pid = waitpid(child, &status, wait ? 0 : WNOHANG)) == 0)
+		return (false);
+	if (pid == child && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		saves++;
+	} else {
+		failures++;
+		xlog(ud, "Snapshot: writer %d failed\n", (int)child);
+	}
+	child = 0;
+	return (true);
+}
+
+/*
+ * Start writing a snapshot in a child, unless one is still being written;
+ * if `wait', wait for it to be done.
+ */
+
+bool snap_save(struct udata *ud, bool wait)
+{
+	const char *path = ud->cf->snap_file;
+	long long t0;
+	pid_t pid;
+
+	if (path == NULL)
+		return (true);
+	if (reap(ud, wait) == false) {
+		skipped++;
+		xlog(ud, "Snapshot: still writing the one from %lld s ago; skipped\n",
+			(mono_ms() - forked_ms) / 1000);
+		return (false);
+	}
+
+	t0 = mono_us();
+	if ((pid = fork()) == -1) {
+		xlog(ud, "Snapshot: cannot fork: %s\n", strerror(errno));
+		failures++;
+		return (false);
+	}
+	if (pid == 0)
+		_exit(snap_write(ud, path) ? 0 : 1);
+
+	fork_us = mono_us() - t0;
+	forked_ms = mono_ms();
+	child = pid;
+	if (wait)
+		reap(ud, true);
+	return (true);
+}
+
+static void snap_expired(struct timer *t, void *arg)
+{
+	struct udata *ud = (struct udata *)arg;
+
+	snap_save(ud, false);
+	timer_set(t, ud->cf->snap_interval);
+}
+
+/* Take up the devices of the snapshot at `path' */
+bool snap_load(struct udata *ud, const char *path)
+{
+	const struct snap_hdr *hdr;
+	const char *strings;
+	struct stat st;
+	long long t0 = mono_ms();
+	size_t n;
+	void *map;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		if (errno != ENOENT)
+			xlog(ud, "Snapshot: cannot open %s: %s\n", path, strerror(errno));
+		return (errno == ENOENT);
+	}
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct snap_hdr) ||
+	    (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		xlog(ud, "Snapshot: cannot map %s\n", path);
+		close(fd);
+		return (false);
+	}
+	close(fd);
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	hdr = (const struct snap_hdr *)map;
+	strings = NULL;
+	if (hdr->magic == SNAP_MAGIC && hdr->recsize == sizeof(struct snap_dev) &&
+	    hdr->count <= ((size_t)st.st_size - sizeof(struct snap_hdr)) / sizeof(struct snap_dev) &&
+	    sizeof(struct snap_hdr) + hdr->count * sizeof(struct snap_dev) + hdr->strings == (size_t)st.st_size)
+		strings = (const char *)(hdr + 1) + hdr->count * sizeof(struct snap_dev);
+	if (strings == NULL || (hdr->strings > 0 && strings[hdr->strings - 1] != 0)) {
+		xlog(ud, "Snapshot: %s is not a snapshot of ours; ignored\n", path);
+		munmap(map, st.st_size);
+		return (false);
+	}
+
+	n = imei_restore((const struct snap_dev *)(hdr + 1), hdr->count, strings, hdr->strings);
+	restored = n;
+	restore_ms = mono_ms() - t0;
+	xlog(ud, "Snapshot: %lu devices from %s, taken %ld s ago, in %lld ms\n",
+		(unsigned long)n, path, (long)(time(0) - hdr->created), restore_ms);
+	munmap(map, st.st_size);
+	return (true);
+}
+
+bool snap_init(struct udata *ud)
+{
+	config *cf = ud->cf;
+
+	if (cf->snap_file == NULL)
+		return (true);
+	snap_load(ud, cf->snap_file);
+	if (cf->snap_interval > 0) {
+		timer_init(&snap_timer, snap_expired, ud);
+		timer_set(&snap_timer, cf->snap_interval);
+	}
+	return (true);
+}
+
+void snap_stats(struct udata *ud)
+{
+	char buf[BUFSIZ];
+
+	if (ud->cf->snap_file == NULL)
+		return;
+	snprintf(buf, sizeof(buf), "snapshot saves=%lu failed=%lu skipped=%lu fork_us=%lld restored=%lu",
+		saves, failures, skipped, fork_us, (unsigned long)restored);
+	xlog(ud, "stats: %s\n", buf);
+	if (ud->cf->reporttopic)
+		pub(ud, (char *)ud->cf->reporttopic, buf, false);
+}
+
+void snap_metrics(struct mbuf *mb)
+{
+	mbuf_printf(mb, "# HELP qtripp_snapshots_total Snapshots of the devices written.\n"
+		"# TYPE qtripp_snapshots_total counter\n"
+		"qtripp_snapshots_total %lu\n", saves);
+	mbuf_printf(mb, "# HELP qtripp_snapshot_failures_total Snapshots which couldn't be written.\n"
+		"# TYPE qtripp_snapshot_failures_total counter\n"
+		"qtripp_snapshot_failures_total %lu\n", failures);
+	mbuf_printf(mb, "# HELP qtripp_snapshot_fork_seconds How long the last snapshot held up the loop.\n"
+		"# TYPE qtripp_snapshot_fork_seconds gauge\n"
+		"qtripp_snapshot_fork_seconds %.6f\n", fork_us / 1e6);
+}
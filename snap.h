@@ -0,0 +1,68 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _SNAP_H_INCL_
+# define  _SNAP_H_INCL_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "udata.h"
+
+/*
+ * A snapshot of what we know of each device (see snap.c): a header,
+ * `count' fixed-size records in the order the devices were first seen,
+ * and `strings' bytes of NUL-terminated names they refer to, all in
+ * host byte order, so it can be used where it is mapped.
+ */
+
+#define SNAP_MAGIC	0x316e7371	/* "qsn1" */
+#define SNAP_NONAME	0xFFFFFFFF
+
+struct snap_hdr {
+	uint32_t magic;
+	uint32_t recsize;		/* sizeof(struct snap_dev) */
+	uint64_t count;
+	uint64_t strings;
+	int64_t created;
+};
+
+struct snap_dev {
+	char imei[16];
+	uint64_t seq;
+	int64_t reports;
+	int64_t last_seen;
+	int64_t tst;			/* of the last position, */
+	double lat, lon, vel;		/* ... if `validpos' */
+	int32_t cog;
+	uint32_t name;			/* offset in the strings, or SNAP_NONAME */
+	uint32_t validpos;
+	uint32_t reserved;
+};
+
+struct mbuf;
+
+bool snap_init(struct udata *ud);
+bool snap_write(struct udata *ud, const char *path);
+bool snap_save(struct udata *ud, bool wait);
+bool snap_load(struct udata *ud, const char *path);
+void snap_stats(struct udata *ud);
+void snap_metrics(struct mbuf *mb);
+
+#endif
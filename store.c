@@ -0,0 +1,222 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "uthash.h"
+#include "conf.h"
+#include "util.h"
+#include "tline.h"
+#include "timer.h"
+#include "pool.h"
+#include "http.h"
+#include "prof.h"
+#include "track.h"
+#include "store.h"
+
+/*
+ * Decoded fixes go to the track store in [store] `dir' (see track.h).
+ * Per IMEI they are collected until there are `block' of them, or for
+ * at most `flush' seconds, and are then appended to the device's file
+ * for the day as one block with a single write(2). A fix older than the
+ * one before it, or of another day, starts a new block. The IMEI names
+ * a directory, so one which isn't all digits is turned away.
+ */
+
+struct staged {
+	char imei[16];
+	struct trk_fix *fixes;
+	int n, size;
+	struct timer flush;
+	UT_hash_handle hh;
+};
+
+static struct staged *staged = NULL;
+static struct pool staged_pool;
+static struct udata *store_ud;
+static const char *dir = NULL;
+static unsigned char *buf;
+static unsigned long fixes = 0, blocks = 0, bytes = 0, failed = 0, rejected = 0;
+
+static int day(time_t tst)
+{
+	return (tst / 86400);
+}
+
+/* Append `s's fixes to its file, creating its directory if need be */
+static void write_block(struct udata *ud, struct staged *s)
+{
+	char path[BUFSIZ];
+	size_t len;
+	int fd;
+
+	if (s->n == 0)
+		return;
+	PROF_START(t);
+	len = trk_encode(s->fixes, s->n, buf);
+	if (trk_path(dir, s->imei, s->fixes[0].tst, path, sizeof(path)) < 0) {
+		snprintf(path, sizeof(path), "%s/%s", dir, s->imei);
+		errno = EINVAL;
+		fd = -1;
+	} else if ((fd = open(path, O_CREAT|O_WRONLY|O_APPEND, 0644)) == -1 && errno == ENOENT) {
+		char sub[BUFSIZ];
+
+		snprintf(sub, sizeof(sub), "%s/%s", dir, s->imei);
+		if (mkdir(sub, 0755) == 0 || errno == EEXIST)
+			fd = open(path, O_CREAT|O_WRONLY|O_APPEND, 0644);
+	}
+	if (fd == -1 || write(fd, buf, len) != (ssize_t)len) {
+		xlog(ud, "Store: cannot write %s: %s\n", path, strerror(errno));
+		failed += s->n;
+	} else {
+		fixes += s->n;
+		blocks++;
+		bytes += len;
+	}
+	if (fd != -1)
+		close(fd);
+	PROF_END(PROF_STORE, t);
+
+	/* an idle device keeps no buffer */
+	free(s->fixes);
+	s->fixes = NULL;
+	s->n = s->size = 0;
+	timer_cancel(&s->flush);
+}
+
+static void flush_expired(struct timer *t, void *arg)
+{
+	write_block(store_ud, (struct staged *)arg);
+}
+
+void store_add(struct udata *ud, const char *imei, double lat, double lon, double vel, long cog, time_t tst)
+{
+	struct staged *s;
+	struct trk_fix *f;
+
+	if (dir == NULL)
+		return;
+	if (!trk_imei(imei)) {
+		rejected++;
+		STATSD_INC(ud->cf->sd, "store.rejected");
+		return;
+	}
+
+	HASH_FIND_STR(staged, imei, s);
+	if (s == NULL) {
+		if ((s = (struct staged *)pool_get(&staged_pool)) == NULL)
+			return;
+		memset(s, 0, sizeof(struct staged));
+		snprintf(s->imei, sizeof(s->imei), "%s", imei);
+		timer_init(&s->flush, flush_expired, s);
+		HASH_ADD_STR(staged, imei, s);
+	}
+
+	if (s->n > 0 && (tst < s->fixes[s->n - 1].tst || day(tst) != day(s->fixes[0].tst)))
+		write_block(ud, s);
+	if (s->n == s->size) {
+		int size = s->size ? s->size * 2 : 8;
+
+		if (size > ud->cf->store_block)
+			size = ud->cf->store_block;
+		if ((f = realloc(s->fixes, size * sizeof(struct trk_fix))) == NULL)
+			return;
+		s->fixes = f;
+		s->size = size;
+	}
+
+	f = &s->fixes[s->n++];
+	f->tst = tst;
+	f->lat = lat;
+	f->lon = lon;
+	f->vel = vel;
+	f->cog = cog;
+
+	if (s->n == 1)
+		timer_set(&s->flush, ud->cf->store_flush);
+	if (s->n >= ud->cf->store_block)
+		write_block(ud, s);
+}
+
+/* Write out all that is collected */
+void store_flush(struct udata *ud)
+{
+	struct staged *s, *tmp;
+
+	HASH_ITER(hh, staged, s, tmp) {
+		write_block(ud, s);
+	}
+}
+
+bool store_enabled(void)
+{
+	return (dir != NULL);
+}
+
+bool store_init(struct udata *ud)
+{
+	config *cf = ud->cf;
+
+	if (cf->store_dir == NULL)
+		return (true);
+	if (cf->store_block < 1 || cf->store_block > TRK_MAXBLOCK) {
+		xlog(ud, "Store: block must be from 1 to %d\n", TRK_MAXBLOCK);
+		return (false);
+	}
+	if (mkdir(cf->store_dir, 0755) == -1 && errno != EEXIST) {
+		xlog(ud, "Store: cannot create %s: %s\n", cf->store_dir, strerror(errno));
+		return (false);
+	}
+	if ((buf = malloc(trk_maxlen(cf->store_block))) == NULL)
+		return (false);
+	if (cf->store_flush < 1)
+		cf->store_flush = 1;
+	pool_init(&staged_pool, sizeof(struct staged), 1024);
+	store_ud = ud;
+	dir = cf->store_dir;
+	return (true);
+}
+
+void store_stats(struct udata *ud)
+{
+	char buf[BUFSIZ];
+
+	if (dir == NULL)
+		return;
+	snprintf(buf, sizeof(buf), "store devices=%u fixes=%lu blocks=%lu bytes=%lu failed=%lu rejected=%lu",
+		HASH_COUNT(staged), fixes, blocks, bytes, failed, rejected);
+	xlog(ud, "stats: %s\n", buf);
+	if (ud->cf->reporttopic)
+		pub(ud, (char *)ud->cf->reporttopic, buf, false);
+}
+
+void store_metrics(struct mbuf *mb)
+{
+	mbuf_printf(mb, "# HELP qtripp_store_fixes_total Fixes written to the track store.\n"
+		"# TYPE qtripp_store_fixes_total counter\n"
+		"qtripp_store_fixes_total %lu\n", fixes);
+	mbuf_printf(mb, "# HELP qtripp_store_bytes_total Bytes written to the track store.\n"
+		"# TYPE qtripp_store_bytes_total counter\n"
+		"qtripp_store_bytes_total %lu\n", bytes);
+}
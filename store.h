@@ -0,0 +1,36 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _STORE_H_INCL_
+# define  _STORE_H_INCL_
+
+#include <stdbool.h>
+#include <time.h>
+#include "udata.h"
+
+struct mbuf;
+
+bool store_init(struct udata *ud);
+bool store_enabled(void);
+void store_add(struct udata *ud, const char *imei, double lat, double lon, double vel, long cog, time_t tst);
+void store_flush(struct udata *ud);
+void store_stats(struct udata *ud);
+void store_metrics(struct mbuf *mb);
+
+#endif
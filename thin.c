@@ -0,0 +1,223 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "uthash.h"
+#include "conf.h"
+#include "util.h"
+#include "tline.h"
+#include "pool.h"
+#include "http.h"
+#include "thin.h"
+
+/*
+ * Parked vehicles reporting every 30 seconds make most of what we'd
+ * publish, and say nothing new. Per IMEI we keep the last position we
+ * published, and positions of periodic reports (`subtypes' in [thin],
+ * GTFRI and GTERI by default) go out only if, since then, the device
+ * has moved at least `meters' or turned at least `degrees', and at least
+ * `seconds' have passed; or if `keepalive' seconds have. Other reports
+ * (ignition, power, alarms, ...) always pass.
+ *
+ * Thresholds are per topic, as a device's is given in [devices], with
+ * the section's own as defaults. Positions older than the last one
+ * published (e.g. from +BUFF) are let through without being compared.
+ */
+
+struct track {
+	char imei[16];
+	struct my_thin *th;		/* its thresholds */
+	double lat, lon;		/* last published */
+	long cog;			/* -1: none */
+	time_t tst;			/* 0: nothing published yet */
+	unsigned long suppressed;
+	UT_hash_handle hh;
+};
+
+static struct track *tracks = NULL;
+static struct pool track_pool;
+static bool thinning = false;
+static unsigned long checked = 0, suppressed = 0;
+static const char *periodic[] = { "GTFRI", "GTERI", NULL };
+
+/* True if `th' thins at all */
+static bool thins(struct my_thin *th)
+{
+	return (th->meters > 0 || th->degrees > 0 || th->seconds > 0);
+}
+
+/* The thresholds for `imei', by the topic of its entry in [devices] */
+static struct my_thin *thresholds(config *cf, const char *imei)
+{
+	struct my_device *d;
+	struct my_thin *th = NULL;
+
+	HASH_FIND_STR(cf->devices, imei, d);
+	if (d == NULL)
+		HASH_FIND_STR(cf->devices, "*", d);
+	if (d != NULL)
+		HASH_FIND_STR(cf->thins, d->topic, th);
+	return (th ? th : &cf->thin);
+}
+
+static bool thinned_subtype(config *cf, const char *subtype)
+{
+	int n;
+
+	if (cf->thin_subtypes != NULL)
+		return (name_in(cf->thin_subtypes, subtype));
+	for (n = 0; periodic[n] != NULL; n++) {
+		if (strcmp(periodic[n], subtype) == 0)
+			return (true);
+	}
+	return (false);
+}
+
+/*
+ * True if the position of `imei' at `lat', `lon' heading `cog' (-1 if
+ * unknown) at `tst' is to be published; it is then remembered as such.
+ */
+
+bool thin_pass(struct udata *ud, const char *imei, const char *subtype, double lat, double lon, long cog, time_t tst)
+{
+	struct my_thin *th;
+	struct track *t;
+	bool changed;
+	long turned;
+
+	if (!thinning || !thinned_subtype(ud->cf, subtype))
+		return (true);
+
+	HASH_FIND_STR(tracks, imei, t);
+	if (t == NULL) {
+		th = thresholds(ud->cf, imei);
+		if (!thins(th) || (t = (struct track *)pool_get(&track_pool)) == NULL)
+			return (true);
+		memset(t, 0, sizeof(struct track));
+		snprintf(t->imei, sizeof(t->imei), "%s", imei);
+		t->th = th;
+		HASH_ADD_STR(tracks, imei, t);
+	}
+	th = t->th;
+
+	checked++;
+	if (t->tst != 0 && tst >= t->tst) {
+		if (th->keepalive <= 0 || tst - t->tst < th->keepalive) {
+			changed = th->meters <= 0 && th->degrees <= 0;
+			if (th->meters > 0 && haversine_dist(t->lat, t->lon, lat, lon) >= th->meters)
+				changed = true;
+			if (th->degrees > 0 && cog >= 0 && t->cog >= 0) {
+				turned = labs(cog - t->cog) % 360;
+				if ((turned > 180 ? 360 - turned : turned) >= th->degrees)
+					changed = true;
+			}
+			if (!changed || tst - t->tst < th->seconds) {
+				t->suppressed++;
+				suppressed++;
+				STATSD_INC(ud->cf->sd, "reports.thinned");
+				return (false);
+			}
+		}
+	} else if (t->tst != 0) {
+		/* older than what we've published; not ours to judge */
+		return (true);
+	}
+
+	t->lat = lat;
+	t->lon = lon;
+	t->cog = cog;
+	t->tst = tst;
+	return (true);
+}
+
+/* Positions of `imei' not published */
+unsigned long thin_suppressed(const char *imei)
+{
+	struct track *t;
+
+	if (!thinning)
+		return (0);
+	HASH_FIND_STR(tracks, imei, t);
+	return (t ? t->suppressed : 0);
+}
+
+/* Fill in the topics' thresholds from the defaults; true if any thin */
+static bool settle(config *cf)
+{
+	struct my_thin *th, *tmp;
+	bool any = thins(&cf->thin);
+
+	HASH_ITER(hh, cf->thins, th, tmp) {
+		if (th->meters < 0)	th->meters = cf->thin.meters;
+		if (th->degrees < 0)	th->degrees = cf->thin.degrees;
+		if (th->seconds < 0)	th->seconds = cf->thin.seconds;
+		if (th->keepalive < 0)	th->keepalive = cf->thin.keepalive;
+		if (thins(th))
+			any = true;
+	}
+	return (any);
+}
+
+bool thin_init(struct udata *ud)
+{
+	if ((thinning = settle(ud->cf)) == true)
+		pool_init(&track_pool, sizeof(struct track), 1024);
+	return (true);
+}
+
+/*
+ * The configuration was reloaded: the thresholds devices had are gone
+ * with the old one, and their topics may have changed, so look up each
+ * device's again. What was last published is kept.
+ */
+
+void thin_reconfigure(struct udata *ud)
+{
+	struct track *t, *tmp;
+
+	thinning = settle(ud->cf);
+	if (thinning && track_pool.size == 0)
+		pool_init(&track_pool, sizeof(struct track), 1024);
+	HASH_ITER(hh, tracks, t, tmp) {
+		t->th = thresholds(ud->cf, t->imei);
+	}
+}
+
+void thin_stats(struct udata *ud)
+{
+	char buf[BUFSIZ];
+
+	if (!thinning)
+		return;
+	snprintf(buf, sizeof(buf), "thin devices=%u checked=%lu suppressed=%lu",
+		HASH_COUNT(tracks), checked, suppressed);
+	xlog(ud, "stats: %s\n", buf);
+	if (ud->cf->reporttopic)
+		pub(ud, (char *)ud->cf->reporttopic, buf, false);
+}
+
+void thin_metrics(struct mbuf *mb)
+{
+	mbuf_printf(mb, "# HELP qtripp_thinned_total Positions not published for want of movement.\n"
+		"# TYPE qtripp_thinned_total counter\n"
+		"qtripp_thinned_total %lu\n", suppressed);
+}
@@ -0,0 +1,36 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _THIN_H_INCL_
+# define  _THIN_H_INCL_
+
+#include <stdbool.h>
+#include <time.h>
+#include "udata.h"
+
+struct mbuf;
+
+bool thin_init(struct udata *ud);
+void thin_reconfigure(struct udata *ud);
+bool thin_pass(struct udata *ud, const char *imei, const char *subtype, double lat, double lon, long cog, time_t tst);
+unsigned long thin_suppressed(const char *imei);
+void thin_stats(struct udata *ud);
+void thin_metrics(struct mbuf *mb);
+
+#endif
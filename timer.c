@@ -0,0 +1,170 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include "timer.h"
+
+#define TIMER_MASK	(TIMER_SLOTS - 1)
+#define TIMER_SPAN	(1UL << (TIMER_BITS * TIMER_LEVELS))
+
+static struct timer *wheel[TIMER_LEVELS][TIMER_SLOTS];
+static unsigned long base;		/* next tick to run */
+static unsigned long npending = 0L;
+static int started = 0;
+
+/* Seconds on a clock which doesn't jump when the time of day is set */
+static unsigned long ticks(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((unsigned long)ts.tv_sec);
+}
+
+static void start(void)
+{
+	if (!started) {
+		base = ticks();
+		started = 1;
+	}
+}
+
+static void unlink_timer(struct timer *t)
+{
+	if ((*t->pprev = t->next) != NULL)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+/*
+ * Put `t' in the slot of the innermost wheel which reaches its expiry;
+ * overdue timers go into the slot which is run next.
+ */
+
+static void link_timer(struct timer *t)
+{
+	unsigned long e = t->expires, delta;
+	struct timer **head;
+	int level;
+
+	if ((long)(e - base) < 0)
+		e = base;
+	if ((delta = e - base) >= TIMER_SPAN) {
+		e = base + TIMER_SPAN - 1;
+		delta = TIMER_SPAN - 1;
+	}
+	for (level = 0; level < TIMER_LEVELS - 1; level++) {
+		if (delta < (1UL << (TIMER_BITS * (level + 1))))
+			break;
+	}
+
+	head = &wheel[level][(e >> (TIMER_BITS * level)) & TIMER_MASK];
+	if ((t->next = *head) != NULL)
+		t->next->pprev = &t->next;
+	*head = t;
+	t->pprev = head;
+}
+
+/* Take the timers out of `slot'; the list they remain on starts at `*list' */
+static void detach(struct timer **slot, struct timer **list)
+{
+	if ((*list = *slot) != NULL)
+		(*list)->pprev = list;
+	*slot = NULL;
+}
+
+void timer_init(struct timer *t, void (*fn)(struct timer *, void *), void *arg)
+{
+	t->next = NULL;
+	t->pprev = NULL;
+	t->expires = 0L;
+	t->fn = fn;
+	t->arg = arg;
+}
+
+/* (Re-)arm `t' to fire `secs' seconds from now */
+void timer_set(struct timer *t, unsigned long secs)
+{
+	unsigned long e;
+
+	start();
+	e = ticks() + secs;
+	if (t->pprev != NULL) {
+		if (t->expires == e)
+			return;
+		unlink_timer(t);
+		npending--;
+	}
+	t->expires = e;
+	link_timer(t);
+	npending++;
+}
+
+void timer_cancel(struct timer *t)
+{
+	if (t->pprev != NULL) {
+		unlink_timer(t);
+		npending--;
+	}
+}
+
+/*
+ * Fire whatever has expired since we last ran. Each tick, the slot of the
+ * innermost wheel is emptied; when that wheel wraps, the next slot of the
+ * one outside it is redistributed (and so on outwards).
+ */
+
+void timer_run(void)
+{
+	unsigned long now, shift;
+	struct timer *list, *t;
+	int level;
+
+	start();
+	now = ticks();
+
+	while ((long)(now - base) >= 0) {
+		if (npending == 0) {
+			base = now + 1;
+			break;
+		}
+
+		for (level = 1; level < TIMER_LEVELS; level++) {
+			shift = TIMER_BITS * level;
+			if ((base & ((1UL << shift) - 1)) != 0)
+				break;
+			detach(&wheel[level][(base >> shift) & TIMER_MASK], &list);
+			while ((t = list) != NULL) {
+				unlink_timer(t);
+				link_timer(t);
+			}
+		}
+
+		/* what callbacks arm for now goes into the next tick */
+		detach(&wheel[0][base & TIMER_MASK], &list);
+		base++;
+		while ((t = list) != NULL) {
+			unlink_timer(t);
+			npending--;
+			t->fn(t, t->arg);
+		}
+	}
+}
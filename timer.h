@@ -0,0 +1,59 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _TIMER_H_INCL_
+# define  _TIMER_H_INCL_
+
+#include <stdbool.h>
+
+/*
+ * Hierarchical timer wheel with one second ticks: TIMER_LEVELS wheels of
+ * TIMER_SLOTS slots each, the first covering the next 64 seconds, the
+ * next 64 minutes, and so on (up to about 194 days; later expiries are
+ * clamped). Arming, re-arming, and cancelling are O(1); timer_run() only
+ * looks at the slot which is due, and now and then moves a slot of an
+ * outer wheel one level in.
+ *
+ * A struct timer is embedded in whatever it is for and must be
+ * timer_init()ed before use. Callbacks may re-arm or cancel any timer,
+ * including the one which fired.
+ */
+
+#define TIMER_BITS	6
+#define TIMER_SLOTS	(1 << TIMER_BITS)
+#define TIMER_LEVELS	4
+
+struct timer {
+	struct timer *next, **pprev;	/* pprev is NULL when not armed */
+	unsigned long expires;		/* tick at which it fires */
+	void (*fn)(struct timer *t, void *arg);
+	void *arg;
+};
+
+void timer_init(struct timer *t, void (*fn)(struct timer *, void *), void *arg);
+void timer_set(struct timer *t, unsigned long secs);
+void timer_cancel(struct timer *t);
+void timer_run(void);
+
+static inline bool timer_pending(struct timer *t)
+{
+	return (t->pprev != NULL);
+}
+
+#endif
@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <math.h>
 #include <mosquitto.h>
@@ -33,13 +34,24 @@
 # include "bean.h"
 #endif
 #include "iinfo.h"
+#include "replay.h"
+#include "prof.h"
+#include "lag.h"
+#include "http.h"
+#include "dedup.h"
+#include "thin.h"
+#include "geo.h"
+#include "trip.h"
+#include "store.h"
+#include "recent.h"
+#include "snap.h"
+#include "hex.h"
 
 #include "models.h"
 #include "devices.h"
 #include "reports.h"
 #include "ignores.h"
 
-#define MAXLINELEN	(8192 * 2)
 #define QOS 		1
 #define NAGIOSREPORT	"nagios/qtripp"
 
@@ -62,6 +74,7 @@ static struct my_stat *report_stats = NULL;
 
 struct my_imeistat {
 	char key[18];
+	unsigned long seq;	/* order in which we first saw it */
 	long reports;
 	time_t last_seen;
 	char *name;
@@ -69,16 +82,25 @@ struct my_imeistat {
 	long cog;
 	time_t tst;
 	bool validpos;
+	struct geostate geo;	/* geofences it's in */
 	UT_hash_handle hh;
 };
 static struct my_imeistat *imei_stats = NULL;
+static unsigned long imei_seq = 0L;
 
 void pub(struct udata *ud, char *topic, char *payload, bool retain)
+{
+	pubn(ud, topic, payload, strlen(payload), retain);
+}
+
+void pubn(struct udata *ud, char *topic, char *payload, size_t len, bool retain)
 {
 	int rc;
 
-	rc = mosquitto_publish(ud->mosq, NULL, topic, strlen(payload), payload, QOS, retain);
-	if (rc) {
+	rc = mosquitto_publish(ud->mosq, NULL, topic, len, payload, QOS, retain);
+	if (rc == MOSQ_ERR_SUCCESS) {
+		ud->published++;
+	} else {
 		xlog(ud, "Publish failed: rc=%d...\n", rc);
 #if 1
 		if (rc == MOSQ_ERR_NO_CONN) {
@@ -94,8 +116,9 @@ static void imei_incr(char *imei, int reports)
 
 	HASH_FIND_STR(imei_stats, imei, is);
 	if (!is) {
-		is = (struct my_imeistat *)malloc(sizeof(struct my_imeistat));
+		is = (struct my_imeistat *)calloc(1, sizeof(struct my_imeistat));
 		strncpy(is->key, imei, 16);
+		is->seq		= ++imei_seq;
 		is->last_seen	= time(0);
 		is->reports	= reports;
 		is->validpos	= false;
@@ -117,8 +140,9 @@ static bool imei_last_position(char *imei, double *lat, double *lon, time_t *tst
 
 	HASH_FIND_STR(imei_stats, imei, is);
 	if (!is) {
-		is = (struct my_imeistat *)malloc(sizeof(struct my_imeistat));
+		is = (struct my_imeistat *)calloc(1, sizeof(struct my_imeistat));
 		strncpy(is->key, imei, 16);
+		is->seq		= ++imei_seq;
 		is->last_seen	= time(0);
 		is->reports	= 0;
 		is->validpos	= false;
@@ -153,6 +177,90 @@ static bool imei_last_position(char *imei, double *lat, double *lon, time_t *tst
 }
 
 
+/* `imei' is at `lat', `lon' as of `tst'; see geo.c */
+static void imei_geo(struct udata *ud, char *imei, double lat, double lon, time_t tst)
+{
+	struct my_imeistat *is;
+
+	HASH_FIND_STR(imei_stats, imei, is);
+	if (is != NULL)
+		geo_update(ud, imei, &is->geo, lat, lon, tst);
+}
+
+/*
+ * Hand each device, in the order we first saw it, to `fn' as a snapshot
+ * record (see snap.c) with its name if lookup_iinfo() has one; stop when
+ * `fn' returns false.
+ */
+
+bool imei_snapshot(bool (*fn)(struct snap_dev *sd, const char *name, void *arg), void *arg)
+{
+	struct my_imeistat *is;
+	struct _iinfo *ii;
+	struct snap_dev sd;
+
+	memset(&sd, 0, sizeof(sd));
+	for (is = imei_stats; is != NULL; is = is->hh.next) {
+		memcpy(sd.imei, is->key, sizeof(sd.imei));
+		sd.seq		= is->seq;
+		sd.reports	= is->reports;
+		sd.last_seen	= is->last_seen;
+		sd.tst		= is->tst;
+		sd.lat		= is->lat;
+		sd.lon		= is->lon;
+		sd.vel		= is->vel;
+		sd.cog		= is->cog;
+		sd.validpos	= is->validpos;
+		ii = cached_iinfo(is->key);
+		if (fn(&sd, ii ? ii->name : NULL, arg) == false)
+			return (false);
+	}
+	return (true);
+}
+
+/*
+ * Take up the `n' devices of a snapshot, before any others are seen, and
+ * their names, at offsets into the `slen' bytes at `strings', into the
+ * cache of lookup_iinfo(). The records are in the order the devices were
+ * first seen, which /devices relies on. Returns how many were taken.
+ */
+
+size_t imei_restore(const struct snap_dev *devs, size_t n, const char *strings, size_t slen)
+{
+	const struct snap_dev *sd;
+	struct my_imeistat *block, *is;
+	size_t count = 0;
+
+	if (imei_stats != NULL || n == 0)
+		return (0);
+
+	/* never freed, like those we add one by one */
+	if ((block = (struct my_imeistat *)calloc(n, sizeof(struct my_imeistat))) == NULL)
+		return (0);
+
+	for (sd = devs; sd < devs + n; sd++) {
+		if (*sd->imei == 0 || sd->seq <= imei_seq)
+			continue;
+		is = &block[count++];
+		memcpy(is->key, sd->imei, sizeof(sd->imei));
+		is->seq		= sd->seq;
+		is->reports	= sd->reports;
+		is->last_seen	= sd->last_seen;
+		is->tst		= sd->tst;
+		is->lat		= sd->lat;
+		is->lon		= sd->lon;
+		is->vel		= sd->vel;
+		is->cog		= sd->cog;
+		is->validpos	= sd->validpos != 0;
+		HASH_ADD_STR(imei_stats, key, is);
+		imei_seq = sd->seq;
+
+		if (sd->name < slen)
+			restore_iinfo(is->key, strings + sd->name);
+	}
+	return (count);
+}
+
 static void stat_incr(char *subtype, char *protov, bool ig)
 {
 	struct my_stat *ms;
@@ -190,9 +298,83 @@ void print_stats(struct udata *ud)
 			pub(ud, (char *)ud->cf->reporttopic, buf, false);
 	}
 
+#ifdef WITH_BEAN
+	bean_stats(buf, sizeof(buf));
+	xlog(ud, "stats: %s\n", buf);
+	if (ud->cf->reporttopic)
+		pub(ud, (char *)ud->cf->reporttopic, buf, false);
+#endif
+
+	lag_stats(ud);
+	dedup_stats(ud);
+	thin_stats(ud);
+	geo_stats(ud);
+	trip_stats(ud);
+	store_stats(ud);
+	recent_stats(ud);
+	snap_stats(ud);
+
 	/* FIXME: consider deleting keys when they've been listed? */
 }
 
+/*
+ * Report counters and the number of devices seen for /metrics.
+ */
+
+void stats_metrics(struct udata *ud, struct mbuf *mb)
+{
+	struct my_stat *ms, *tmp;
+
+	mbuf_printf(mb, "# HELP qtripp_reports_total Reports by subtype and protocol version.\n"
+		"# TYPE qtripp_reports_total counter\n");
+	HASH_ITER(hh, report_stats, ms, tmp) {
+		char *dash = strchr(ms->key, '-');
+
+		mbuf_printf(mb, "qtripp_reports_total{subtype=\"%.*s\",protov=\"%s\",ignored=\"%s\"} %ld\n",
+			dash ? (int)(dash - ms->key) : (int)strlen(ms->key), ms->key,
+			dash ? dash + 1 : "",
+			ms->ignored ? "true" : "false",
+			ms->counter);
+	}
+	mbuf_printf(mb, "# HELP qtripp_devices Devices seen since startup.\n"
+		"# TYPE qtripp_devices gauge\n"
+		"qtripp_devices %u\n", HASH_COUNT(imei_stats));
+}
+
+/* Devices for /devices, in the order we first saw them */
+
+static void *devices_first(unsigned long after)
+{
+	struct my_imeistat *is;
+
+	for (is = imei_stats; is != NULL && is->seq <= after; is = is->hh.next)
+		;
+	return (is);
+}
+
+static void *devices_next(void *it)
+{
+	return (((struct my_imeistat *)it)->hh.next);
+}
+
+static unsigned long devices_json(void *it, struct mbuf *mb)
+{
+	struct my_imeistat *is = (struct my_imeistat *)it;
+
+	mbuf_printf(mb, "{\"imei\": ");
+	mbuf_json_string(mb, is->key);
+	mbuf_printf(mb, ", \"reports\": %ld, \"last_seen\": %ld, \"thinned\": %lu",
+		is->reports, (long)is->last_seen, thin_suppressed(is->key));
+	if (is->validpos) {
+		mbuf_printf(mb, ", \"lat\": %.6f, \"lon\": %.6f, \"tst\": %ld",
+			is->lat, is->lon, (long)is->tst);
+	}
+	mbuf_printf(mb, "}");
+	return (is->seq);
+}
+
+struct http_source http_devices = { "devices", devices_first, devices_next, devices_json };
+
 void pong(struct udata *ud)
 {
 	STATSD_INC(ud->cf->sd, "pong");
@@ -255,24 +437,43 @@ void dump_stats(struct udata *ud)
 		json_delete(obj);
 		fclose(fp);
 	}
+
+	snprintf(path, sizeof(path), "%s/lag.json", ud->cf->dumpdir);
+
+	if ((fp = fopen(path, "w")) != NULL) {
+		JsonNode *obj = lag_json();
+		char *js;
+
+		if ((js = json_stringify(obj, "  ")) != NULL) {
+			fprintf(fp, "%s\n", js);
+			free(js);
+		}
+		json_delete(obj);
+		fclose(fp);
+	}
 	xlog(ud, "Statistics dumped.\n");
 }
 
 
 /*
  * The JSON object we obtained from the tracker is complete and
- * can be published. Check if we have extra JSON stuff we want
- * to add to it.
+ * can be published, to the device's topic or `subtopic' of it.
+ * Check if we have extra JSON stuff we want to add to it.
  */
 
-void transmit_json(struct udata *ud, char *imei, JsonNode *obj)
+static void transmit(struct udata *ud, char *imei, const char *subtopic, JsonNode *obj)
 {
 	JsonNode *e, *extra;
 	char *js;
-	char *topic;
+	char *topic, sub[BUFSIZ];
 
 	topic = device_to_topic(ud->cf, imei);
+	if (subtopic != NULL && topic != NULL) {
+		snprintf(sub, sizeof(sub), "%s/%s", topic, subtopic);
+		topic = sub;
+	}
 
+	PROF_START(t);
 	if ((extra = extra_json(ud->cf, imei)) != NULL) {
 		json_foreach(e, extra) {
 			JsonNode *j;
@@ -294,11 +495,25 @@ void transmit_json(struct udata *ud, char *imei, JsonNode *obj)
 				json_append_member(obj, e->key, json_mkbool(e->bool_));
 		}
 	}
+	PROF_END(PROF_EXTRA, t);
 
-	if ((js = json_encode(obj)) != NULL) {
+	if (ud->onjson)
+		ud->onjson(ud, topic, obj);
+
+	if ((ud->sinks & (SINK_MQTT | SINK_FILE)) && (js = json_encode(obj)) != NULL) {
+		PROF_END(PROF_ENCODE, t);
 		xlog(ud, "PUBLISH: %s %s\n", topic, js);
-		STATSD_INC(ud->cf->sd, "mqtt.message.publish");
-		pub(ud, topic, js, false);
+		if (ud->sinks & SINK_MQTT) {
+			STATSD_INC(ud->cf->sd, "mqtt.message.publish");
+			PROF_RESTART(t);
+			pub(ud, topic, js, false);
+			PROF_END(PROF_PUB, t);
+			if (subtopic == NULL)
+				lag_publish(ud);
+		}
+		if (ud->sinks & SINK_FILE) {
+			sink_json(ud, topic, js);
+		}
 
 //		if (ud->cocorun) mg_printf(ud->coco, "%s", js);	// FIXME remove
 //		fprintf(stderr, "@@@@@@@@@ %d\n", ud->coco->sock);
@@ -311,6 +526,23 @@ void transmit_json(struct udata *ud, char *imei, JsonNode *obj)
 
 }
 
+void transmit_json(struct udata *ud, char *imei, JsonNode *obj)
+{
+	transmit(ud, imei, NULL, obj);
+}
+
+/* An event (e.g. a transition) goes to the device's topic + "/event" */
+void transmit_event(struct udata *ud, char *imei, JsonNode *obj)
+{
+	transmit(ud, imei, "event", obj);
+}
+
+/* ... and a trip's summary to + "/trip" */
+void transmit_trip(struct udata *ud, char *imei, JsonNode *obj)
+{
+	transmit(ud, imei, "trip", obj);
+}
+
 /*
  * Find `elem' in the JSON `obj'. In particular find NUMBERs and convert
  * to our special JSON DOUBLE type with the specified precision.
@@ -351,7 +583,8 @@ void pseudo_lwt(struct udata *ud, char *imei)
 
 	transmit_json(ud, imei, o);
 #ifdef WITH_BEAN
-	bean_put(ud, o);
+	if (ud->sinks & SINK_BEAN)
+		bean_put(ud, o);
 #endif
 	json_delete(o);
 }
@@ -359,65 +592,86 @@ void pseudo_lwt(struct udata *ud, char *imei)
 #define GET_D(n)	((n > 0 && n < nparts && *parts[n]) ? atof(parts[n]) : NAN)
 #define GET_S(n)	((n > 0 && n < nparts && *parts[n]) ? parts[n] : NULL)
 
-/*
- * `line' contains a line of text from a tracker. Do what is necessary,
- * and return the IMEI string if there is one.
- */
-
 static long linecounter = 0L;
 
 /*
- * If anything is to be written back to the device, do so by
- * allocating a string and putting it at `*response'; the caller
- * will write to device and free the string.
+ * Append to what is to be written back to the device. A reply which
+ * doesn't fit is dropped; callers flush long before that can happen.
  */
 
-char *handle_report(struct udata *ud, char *line, char **response)
+void reply_add(struct udata *ud, struct reply *reply, const char *fmt, ...)
 {
-	char **parts, *tparts[4], *imei_dup = NULL;
-	int n, nparts;
-	char abr[24], subtype[24];	/* abr= ACK, BUFF, RESP, i.e. the bit before : */
-        char id[64];
-	struct _device *dp;
-	struct _ignore *ip;
-	bool subtype_ignored = false;
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(reply->buf + reply->len, sizeof(reply->buf) - reply->len, fmt, ap);
+	va_end(ap);
+
+	if (n < 0 || reply->len + n >= sizeof(reply->buf)) {
+		STATSD_INC(ud->cf->sd, "reply.overflow");
+		reply->buf[reply->len] = 0;
+		return;
+	}
+	reply->len += n;
+}
 
+static void record_start(struct udata *ud)
+{
 	STATSD_INC(ud->cf->sd, "reports");
 
 	++linecounter;
+	ud->model = NULL;
+	ud->duplicate = false;
+	ud->ack = false;
+}
 
-#if DBGOUT != 0
-	fprintf(stderr, "DEBUG line #%ld (%lu) %s\n",
-		linecounter, line != NULL ? strlen(line) : 0, line != NULL ? line : "NULL");
-#endif
-	if (*line == '*') {
-		// xlog(ud, "Control: %s\n", line);
+/*
+ * The fields of a report, split from an ASCII line or a binary frame;
+ * `line' is the ASCII report, for the log. Return the IMEI string if
+ * there is one.
+ */
 
-		if (!strncmp(line, "*PING", 5)) {
-			*response = strdup("*PONG");
-		}
-		return (NULL);
-	}
+/*
+ * Acknowledge the record numbered `count' if the device is one of those
+ * with SACK enabled, so that it can drop the record instead of sending
+ * it again.
+ */
 
-	if ((parts = clean_split(ud, line, &nparts)) == NULL) {
-		xlog(ud, "Cannot split line from csv: %s\n", line);
-		return (NULL);
+static void sack(struct udata *ud, struct reply *reply, char *abr, char *subtype, char *imei, char *count)
+{
+	if (ud->cf->sack && count != NULL && name_in(ud->cf->sack_reports, abr) &&
+	    name_in(ud->cf->sack_subtypes, subtype) && name_in(ud->cf->sack_devices, imei)) {
+		STATSD_INC(ud->cf->sd, "reports.sack");
+		reply_add(ud, reply, "+SACK:%s$", count);
 	}
+}
+
+static char *handle_fields(struct udata *ud, char **parts, int nparts, char *line, struct reply *reply)
+{
+	char *imei_dup = NULL, *reccount = NULL, *recsent = NULL, *colon;
+	int n;
+	char abr[24], subtype[24];	/* abr= ACK, BUFF, RESP, i.e. the bit before : */
+        char id[64];
+	struct _device *dp;
+	struct _ignore *ip;
+	bool subtype_ignored = false;
+
+	PROF_START(t);
 
 	/*
-	 * parts[0] contains "RESP:GTFRI". Point `abr' to the initial
-	 * portion and subtype to the second; chop at the ':'
+	 * parts[0] contains "RESP:GTFRI". Copy the initial portion to `abr'
+	 * and the second to `subtype'
 	 */
-	if ((n = splitter(parts[0], ":", tparts)) != 2) {
+	if ((colon = strchr(parts[0], ':')) == NULL ||
+	    colon - parts[0] >= (long)sizeof(abr) || strlen(colon + 1) >= sizeof(subtype)) {
 		xlog(ud, "Cannot split type from parts[0]\n");
-		if (n != -1)
-			splitterfree(tparts);
 		goto finish;
 	}
-	strcpy(abr, tparts[0]);
-	strcpy(subtype, tparts[1]);
-	splitterfree(tparts);
-
+	memcpy(abr, parts[0], colon - parts[0]);
+	abr[colon - parts[0]] = 0;
+	strcpy(subtype, colon + 1);
+	ud->ack = strcmp(abr, "ACK") == 0 && strcmp(subtype, "GTHBD") != 0;
 
 	char *imei = GET_S(2);
 	char *protov = GET_S(1);	/* MOMAMI
@@ -448,12 +702,19 @@ char *handle_report(struct udata *ud, char *line, char **response)
 			(ip->reason && *ip->reason) ? ip->reason : "<nil>",
 			(rp && rp->desc && *rp->desc) ? rp->desc : "unknown report type");
 		xlog(ud, "+++ I=%s Ignored LINE=%s\n", imei, line);
+
+		/*
+		 * Devices send some of these (GTINF, GTBAT, ...) routinely;
+		 * with no layout to find it by, the count is the last field.
+		 */
+		sack(ud, reply, abr, subtype, imei, GET_S(nparts - 1));
 		goto finish;
 	}
 
 	imei_dup = strdup(imei);
 
 	struct _model *model = lookup_models(protov);
+	ud->model = model ? model->desc : NULL;
 	struct _iinfo *iinfo = lookup_iinfo(ud->cf->namesdir, imei);
 
 	xlog(ud, "+++ I=%s (%s) M=%s np=%d P=%s C=%ld T=%s:%s (%s) LINE=%s\n",
@@ -467,8 +728,6 @@ char *handle_report(struct udata *ud, char *line, char **response)
 
 
 	if (strcmp(abr, "ACK") == 0) {
-		char rr[BUFSIZ];
-
 		if (!strcmp(subtype, "GTHBD")) {
 			double last_lat, last_lon, last_vel;
 			long last_cog;
@@ -476,8 +735,7 @@ char *handle_report(struct udata *ud, char *line, char **response)
 
 			STATSD_INC(ud->cf->sd, "reports.gthbd");
 
-			snprintf(rr, sizeof(rr), "+SACK:GTHBD,,%s$", GET_S(5) ? GET_S(5) : "0000");
-			*response = strdup(rr);
+			reply_add(ud, reply, "+SACK:GTHBD,,%s$", GET_S(5) ? GET_S(5) : "0000");
 
 			/*
 			 * If we have a last valid lat/lon, we create a small "p"ing type
@@ -511,8 +769,12 @@ char *handle_report(struct udata *ud, char *line, char **response)
 	//fprintf(stderr, "lookup_devices %s %s\n", subtype, protov ? protov : "NULL");
 	if ((dp = lookup_devices(subtype, protov)) == NULL) {
 		xlog(ud, "MISSING: device definition for %s-%s\n", subtype, protov);
+		sack(ud, reply, abr, subtype, imei, GET_S(nparts - 1));
 		goto finish;
 	}
+	PROF_END(PROF_LOOKUP, t);
+
+	lag_record(ud, imei, model ? model->desc : NULL, subtype, strcmp(abr, "BUFF") == 0);
 
         snprintf(id, sizeof(id), "%s-%s", subtype, protov);
 	if (strcmp(dp->id, id)) {
@@ -531,7 +793,72 @@ char *handle_report(struct udata *ud, char *line, char **response)
 		}
 	}
 
-	JsonNode *jmerge = json_mkobject(), *jm;
+	/* io status (ios) is present if indicated (in the report id) for one protocol version */
+	bool iospresent = true;
+	if (!strcmp(subtype, "GTFRI") && !strcmp(protov, "300800")) {
+		double frid = GET_D(dp->rid), frit = GET_D(dp->rit);
+		int rid = !isnan(frit) ? floor(frit / 10.0) : !isnan(frid) ? frid : 0;
+		if ((rid & 0x01) == 0) {
+			iospresent = false;
+		}
+	}
+
+        /* some messages have an erim state. if so, two bits indicate the presence of other optional parts */
+	bool ac100present = true;
+	int ac100number = 1;
+	bool canpresent = true;
+	if (dp->erim > 0) {
+		char *erimstring = GET_S(dp->erim);
+		if (erimstring != NULL) {
+			unsigned long erim = strtoul(erimstring, NULL, 16);
+			//fprintf(stderr, "erim string %s long %08lx\n", erimstring, erim);
+			ac100present = ((erim & 0x02) != 0);
+			//fprintf(stderr, "ac100present bool %d\n", ac100present);
+			canpresent = ((erim & 0x04) != 0);
+			//fprintf(stderr, "canpresent bool %d\n", canpresent);
+		}
+	}
+
+	/* "uart" indicates the possible optional components for analog sensor data */
+	double uart = GET_D(((nreports - 1) * 12) + dp->uart);
+	//fprintf(stderr, "uart double %g\n", uart);
+	if (ac100present && !isnan(uart) && uart == 2) {
+		/* "anum" up to 19 analog data readings may be present */
+		double anum = GET_D(((nreports - 1) * 12) + dp->anum);
+		if (!isnan(anum) && anum > 0) {
+			ac100number = anum;
+		}
+	}
+
+	/*
+	 * Where "sent" and "count" are, behind the repeated position blocks
+	 * and the optional parts, so that a report we've already had (a
+	 * resend, or +BUFF overlapping with what came in live) goes no
+	 * further, not even into JSON, but is acknowledged again.
+	 */
+
+	int trailer = ((nreports - 1) * 12)
+			+ (iospresent ? 0 : -1)
+			+ (ac100present ? 0 : -1)
+			+ (ac100present ? ((ac100number - 1) * 3) : 0)
+			+ (canpresent ? 0 : -1);
+
+	if (nreports > 0) {
+		if (dp->sent > 0)
+			recsent = GET_S(dp->sent + trailer);
+		if (dp->count > 0)
+			reccount = GET_S(dp->count + trailer);
+	}
+
+	JsonNode *jmerge = NULL, *jm;
+
+	if (dedup_seen(ud, imei, subtype, reccount, GET_S(dp->utc) ? GET_S(dp->utc) : recsent)) {
+		xlog(ud, "Duplicate: I=%s %s count=%s\n", imei, subtype, reccount);
+		ud->duplicate = true;
+		goto acknowledge;
+	}
+
+	jmerge = json_mkobject();
 
 	/* "vin" is the optional vehicle identification number */
 	if (dp->vin > 0) {
@@ -590,30 +917,6 @@ char *handle_report(struct udata *ud, char *line, char **response)
 		json_append_member(jmerge, "mst", json_mknumber(mst));
 	}
 
-	/* io status (ios) is present if indicated for one protocol version */
-	bool iospresent = true;
-	if (!strcmp(subtype, "GTFRI") && !strcmp(protov, "300800")) {
-		if ((rid & 0x01) == 0) {
-			iospresent = false;
-		}
-	}
-
-        /* some messages have an erim state. if so, two bits indicate the presence of other optional parts */
-	bool ac100present = true;
-	int ac100number = 1;
-	bool canpresent = true;
-	if (dp->erim > 0) {
-		char *erimstring = GET_S(dp->erim);
-		if (erimstring != NULL) {
-			unsigned long erim = strtoul(erimstring, NULL, 16);
-			//fprintf(stderr, "erim string %s long %08lx\n", erimstring, erim);
-			ac100present = ((erim & 0x02) != 0);
-			//fprintf(stderr, "ac100present bool %d\n", ac100present);
-			canpresent = ((erim & 0x04) != 0);
-			//fprintf(stderr, "canpresent bool %d\n", canpresent);
-		}
-	}
-
 	/* "ubatt" is battery voltage in V */
 	if (dp->ubatt > 0) {
 		double ubatt = GET_D(dp->ubatt);
@@ -648,8 +951,6 @@ char *handle_report(struct udata *ud, char *line, char **response)
 	}
 
 	/* "uart" indicates the possible optional components for analog sensor data */
-	double uart = GET_D(((nreports - 1) * 12) + dp->uart);
-	//fprintf(stderr, "uart double %g\n", uart);
 	if (!isnan(uart) && uart == 2) {
 		/* "ac100present" was set from the erimask and indicates if there are any ac100 data following */
 		if (ac100present) {
@@ -660,7 +961,6 @@ char *handle_report(struct udata *ud, char *line, char **response)
 				int a;
 
 				json_append_member(jmerge, "anum", json_mknumber(anum));
-				ac100number = anum;
 				for (a = 0; a < anum; a++) {
 					/* "adid", "adty", "adda" for each item we have id, type and data*/
 					//fprintf(stderr, "adid offset %d\n", ((nreports - 1) * 12) + a * 3 + dp->adid);
@@ -826,57 +1126,22 @@ char *handle_report(struct udata *ud, char *line, char **response)
 		}
 
 		/* "sent" sent time at device*/
-		DLOG(1, "DEBUG sent %d\n", dp->sent);
-		if (dp->sent > 0) {
-			DLOG(1, "DEBUG sent %d [%d]\n",
-					dp->sent,
-					dp->sent
-					+ ((nreports - 1) * 12) 
-					+ (iospresent ? 0 : -1)
-					+ (ac100present ? 0 : -1)
-					+ (ac100present ? ((ac100number - 1) * 3) : 0)
-					+ (canpresent ? 0 : -1)
-					);
-			char *sent = GET_S(dp->sent
-					+ ((nreports - 1) * 12) 
-					+ (iospresent ? 0 : -1)
-					+ (ac100present ? 0 : -1)
-					+ (ac100present ? ((ac100number - 1) * 3) : 0)
-					+ (canpresent ? 0 : -1)
-					);
-		        DLOG(1, "DEBUG sent %d [%d] %s\n",
-					dp->sent,
-					dp->sent
-					+ ((nreports - 1) * 12) 
-					+ (iospresent ? 0 : -1)
-					+ (ac100present ? 0 : -1)
-					+ (ac100present ? ((ac100number - 1) * 3) : 0)
-					+ (canpresent ? 0 : -1),
-					sent ? sent : "NULL");
-
-			if (sent != NULL) {
-				time_t epoch;
-
-				if (str_time_to_secs(sent, &epoch) != 1) {
-					xlog(ud, "Cannot convert sent time from [%s]\n", sent);
-				} else {
-					json_append_member(jmerge, "sent", json_mknumber(epoch));
-				}
+		DLOG(1, "DEBUG sent %d [%d] %s\n",
+				dp->sent, dp->sent + trailer, recsent ? recsent : "NULL");
+		if (recsent != NULL) {
+			time_t epoch;
+
+			if (str_time_to_secs(recsent, &epoch) != 1) {
+				xlog(ud, "Cannot convert sent time from [%s]\n", recsent);
+			} else {
+				json_append_member(jmerge, "sent", json_mknumber(epoch));
+				lag_sent(ud, epoch);
 			}
 		}
 
 		/* "count" is counter for sent messages */
-		if (dp->count > 0) {
-			char *count = GET_S(dp->count 
-					+ ((nreports - 1) * 12) 
-					+ (iospresent ? 0 : -1)
-					+ (ac100present ? 0 : -1)
-					+ (ac100present ? ((ac100number - 1) * 3) : 0)
-					+ (canpresent ? 0 : -1)
-					);
-			if (count != NULL) {
-				json_append_member(jmerge, "count", json_mkstring(count));
-			}
+		if (reccount != NULL) {
+			json_append_member(jmerge, "count", json_mkstring(reccount));
 		}
 
 	}
@@ -892,7 +1157,8 @@ char *handle_report(struct udata *ud, char *line, char **response)
 		double lat, lon;
 		double vel, alt;
 		double mcc, mnc;
-		long cog;
+		long cog = -1;
+		time_t tst = 0;
 		char *s;
 		JsonNode *obj;
 
@@ -940,7 +1206,9 @@ char *handle_report(struct udata *ud, char *line, char **response)
 				continue;
 			}
 			json_append_member(obj, "tst", json_mknumber(epoch));
+			tst = epoch;
 		        imei_last_position(imei, &lat, &lon, &epoch, &vel, &cog, true);
+			lag_fix(ud, epoch);
 		}
 
 		mcc = GET_D(pos + dp->mcc);
@@ -1097,23 +1365,27 @@ char *handle_report(struct udata *ud, char *line, char **response)
 			json_append_member(obj, "t", json_mkstring(subtype));
 		}
 
+		if (tst != 0 && geo_enabled())
+			imei_geo(ud, imei, lat, lon, tst);
+		if (tst != 0 && trip_enabled())
+			trip_update(ud, imei, subtype, lat, lon, vel, tst, jmerge);
+		if (tst != 0 && store_enabled())
+			store_add(ud, imei, lat, lon, vel, cog, tst);
+		if (tst != 0 && recent_enabled())
+			recent_add(imei, lat, lon, vel, cog, tst);
+
+		/* Not far enough from what we last published; see thin.c */
+		if (!thin_pass(ud, imei, subtype, lat, lon, cog, tst)) {
+			lastlat = lat;
+			lastlon = lon;
+			json_delete(obj);
+			continue;
+		}
+
 		//fprintf(stderr, "lastlat\n");
 		if (!isnan(lastlat)) {
 			double meters = haversine_dist(lastlat, lastlon, lat, lon);
 
-#ifdef NOTREQUIRED
-			// FIXME: Experimental if we haven't moved, skip the publish
-
-			if (meters < 0.1) {
-				lastlat = lat;
-				lastlon = lon;
-				json_delete(obj);
-				xlog(ud, "Dropping segment %2d/%d because %.2lf distance covered\n",
-					rep + 1, nreports, meters);
-				continue;
-			}
-#endif /* NOTREQUIRED */
-
 			json_append_member(obj, "meters", json_mkdouble(meters, 1));
 		}
 		lastlat = lat;
@@ -1131,45 +1403,100 @@ char *handle_report(struct udata *ud, char *line, char **response)
 				json_append_member(obj, jm->key, json_mkbool(jm->bool_));
 		}
 
+		PROF_END(PROF_BUILD, t);
 		transmit_json(ud, imei, obj);
 
 
 #ifdef WITH_BEAN
-		json_append_member(obj, "imei", json_mkstring(imei));
-		json_append_member(obj, "raw_line", json_mkstring(line));
-		bean_put(ud, obj);
+		if (ud->sinks & SINK_BEAN) {
+			PROF_RESTART(t);
+			json_append_member(obj, "imei", json_mkstring(imei));
+			json_append_member(obj, "raw_line", json_mkstring(line));
+			bean_put(ud, obj);
+			PROF_END(PROF_BEAN, t);
+		}
 #endif
 		json_delete(obj);
+		PROF_RESTART(t);
 
 	} while (++rep < nreports);
 
+  acknowledge:
 	if (jmerge != NULL) {
 		json_delete(jmerge);
 	}
 
+	/*
+	 * The record has been published: a device with SACK enabled can
+	 * now drop it, instead of sending it again.
+	 */
+
+	sack(ud, reply, abr, subtype, imei, reccount);
+
   finish:
-	splitterfree(parts);
+	lag_done();
 	return (imei_dup);
 }
 
-int handle_file_reports(struct udata *ud, FILE *fp)
+/*
+ * `line' contains a line of text from a tracker. Do what is necessary,
+ * and return the IMEI string if there is one. Whatever is to be written
+ * back to the device is added to `reply'; the caller writes it to the
+ * device.
+ */
+
+char *handle_report(struct udata *ud, char *line, struct reply *reply)
 {
-	char line[MAXLINELEN];
-	char *response = NULL, *r;
+	char **parts, *imei;
+	int nparts;
 
-	while (fgets(line, sizeof(line) - 1, fp) != NULL) {
-		if (*line == '#' || *line == '\n')
-			continue;
+	record_start(ud);
 
-		line[strcspn(line, "\r\n")] = '\0';
+#if DBGOUT != 0
+	fprintf(stderr, "DEBUG line #%ld (%lu) %s\n",
+		linecounter, line != NULL ? strlen(line) : 0, line != NULL ? line : "NULL");
+#endif
+	if (*line == '*') {
+		// xlog(ud, "Control: %s\n", line);
 
-		response = NULL;
-		r = handle_report(ud, line, &response);
-		if (r)
-			free(r);
-		if (response && *response)
-			free(response);
-		mosquitto_loop(ud->mosq, 0, 1);
+		if (!strncmp(line, "*PING", 5)) {
+			reply_add(ud, reply, "*PONG");
+		}
+		return (NULL);
 	}
-	return (0);
+
+	PROF_START(t);
+	if ((parts = clean_split(ud, line, &nparts)) == NULL) {
+		xlog(ud, "Cannot split line from csv: %s\n", line);
+		return (NULL);
+	}
+	PROF_END(PROF_SPLIT, t);
+
+	imei = handle_fields(ud, parts, nparts, line, reply);
+	splitterfree(parts);
+	return (imei);
+}
+
+/*
+ * As handle_report(), for the binary frame of `len' bytes at `frame';
+ * the equivalent ASCII report goes to `line'.
+ */
+
+char *handle_hex(struct udata *ud, char *frame, size_t len, char *line, size_t size, struct reply *reply)
+{
+	char **parts;
+	int nparts;
+
+	record_start(ud);
+	*line = 0;
+
+	PROF_START(t);
+	if ((parts = hex_split(ud, frame, len, &nparts)) == NULL ||
+	    hex_line(parts, nparts, line, size) < 0) {
+		STATSD_INC(ud->cf->sd, "reports.bad");
+		return (NULL);
+	}
+	PROF_END(PROF_SPLIT, t);
+
+	return (handle_fields(ud, parts, nparts, line, reply));
 }
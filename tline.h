@@ -17,11 +17,32 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+struct mbuf;
+struct snap_dev;
 
-char *handle_report(struct udata *ud, char *line, char **resp);
-int handle_file_reports(struct udata *ud, FILE *fp);
+#define REPLYSIZE	1024
+
+/*
+ * What is to be written back to a device, accumulated over the records
+ * of one read so it goes out in one write; flushed by the caller.
+ */
+
+struct reply {
+	size_t len;
+	char buf[REPLYSIZE];
+};
+
+void reply_add(struct udata *ud, struct reply *reply, const char *fmt, ...);
+char *handle_report(struct udata *ud, char *line, struct reply *reply);
+char *handle_hex(struct udata *ud, char *frame, size_t len, char *line, size_t size, struct reply *reply);
 void pub(struct udata *ud, char *topic, char *payload, bool retain);
+void pubn(struct udata *ud, char *topic, char *payload, size_t len, bool retain);
 void print_stats(struct udata *ud);
 void dump_stats(struct udata *ud);
+void stats_metrics(struct udata *ud, struct mbuf *mb);
 void pong(struct udata *ud);
 void pseudo_lwt(struct udata *ud, char *imei);
+void transmit_event(struct udata *ud, char *imei, struct JsonNode *obj);
+void transmit_trip(struct udata *ud, char *imei, struct JsonNode *obj);
+bool imei_snapshot(bool (*fn)(struct snap_dev *sd, const char *name, void *arg), void *arg);
+size_t imei_restore(const struct snap_dev *devs, size_t n, const char *strings, size_t slen);
@@ -0,0 +1,309 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "track.h"
+
+/* The format is described in track.h */
+
+static unsigned char *put_varint(unsigned char *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (v & 0x7F) | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return (p);
+}
+
+static const unsigned char *get_varint(const unsigned char *p, const unsigned char *end, uint64_t *v)
+{
+	uint64_t val = 0;
+	int shift = 0;
+
+	while (p < end && shift < 64) {
+		val |= (uint64_t)(*p & 0x7F) << shift;
+		if ((*p++ & 0x80) == 0) {
+			*v = val;
+			return (p);
+		}
+		shift += 7;
+	}
+	return (NULL);
+}
+
+static uint64_t zigzag(int64_t v)
+{
+	return (((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+	return ((int64_t)(v >> 1) ^ -(int64_t)(v & 1));
+}
+
+static int64_t micro(double deg)
+{
+	return ((int64_t)llround(deg * 1e6));
+}
+
+/* The most a block of `count' fixes can take, header included */
+size_t trk_maxlen(int count)
+{
+	return (sizeof(struct trk_block) + 5 * TRK_MAXVARINT * count + TRK_ALIGN);
+}
+
+/*
+ * Encode `count' fixes, in time order, as a block at `buf', which has
+ * room for trk_maxlen(count); returns its length.
+ */
+
+size_t trk_encode(const struct trk_fix *fixes, int count, unsigned char *buf)
+{
+	struct trk_block *b = (struct trk_block *)buf;
+	unsigned char *p = buf + sizeof(struct trk_block);
+	int64_t prev;
+	int n;
+
+	memset(b, 0, sizeof(struct trk_block));
+	b->magic = TRK_MAGIC;
+	b->count = count;
+	b->tmin = fixes[0].tst;
+	b->tmax = fixes[count - 1].tst;
+
+	for (prev = b->tmin, n = 0; n < count; n++) {
+		p = put_varint(p, fixes[n].tst - prev);
+		prev = fixes[n].tst;
+	}
+	for (prev = 0, n = 0; n < count; n++) {
+		p = put_varint(p, zigzag(micro(fixes[n].lat) - prev));
+		prev = micro(fixes[n].lat);
+	}
+	for (prev = 0, n = 0; n < count; n++) {
+		p = put_varint(p, zigzag(micro(fixes[n].lon) - prev));
+		prev = micro(fixes[n].lon);
+	}
+	for (n = 0; n < count; n++)
+		p = put_varint(p, isnan(fixes[n].vel) || fixes[n].vel < 0 ? 0 : llround(fixes[n].vel * 10) + 1);
+	for (n = 0; n < count; n++)
+		p = put_varint(p, fixes[n].cog < 0 ? 0 : fixes[n].cog + 1);
+
+	while ((p - buf) % TRK_ALIGN)
+		*p++ = 0;
+	b->len = p - buf - sizeof(struct trk_block);
+	return (p - buf);
+}
+
+/* The file of the day of `tst', YYYYMMDD.trk, at `buf' */
+static void dayname(time_t tst, char *buf, size_t size)
+{
+	struct tm tm;
+
+	gmtime_r(&tst, &tm);
+	snprintf(buf, size, "%04d%02d%02d.trk", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+}
+
+/*
+ * True if `imei' may name a device's directory: it comes from what the
+ * device sent, so only up to TRK_MAXIMEI digits, nothing like "../x".
+ */
+
+bool trk_imei(const char *imei)
+{
+	size_t n;
+
+	for (n = 0; imei[n] != 0; n++) {
+		if (imei[n] < '0' || imei[n] > '9' || n == TRK_MAXIMEI)
+			return (false);
+	}
+	return (n > 0);
+}
+
+/* The file of `imei' for the day of `tst'; -1 if `imei' isn't one */
+int trk_path(const char *dir, const char *imei, time_t tst, char *path, size_t size)
+{
+	char day[32];
+
+	if (!trk_imei(imei))
+		return (-1);
+	dayname(tst, day, sizeof(day));
+	return (snprintf(path, size, "%s/%s/%s", dir, imei, day));
+}
+
+/*
+ * Decode the block `b' (whose columns end at `end') and hand its fixes
+ * from `from' to `to' to `fn'; returns how many, or -1 if the block is
+ * damaged. `*stop' is set if `fn' said to.
+ */
+
+static long decode(const struct trk_block *b, const unsigned char *end, time_t from, time_t to, trk_fn fn, void *arg, bool *stop)
+{
+	static struct trk_fix fixes[TRK_MAXBLOCK];
+	const unsigned char *p = (const unsigned char *)(b + 1);
+	uint64_t v;
+	int64_t acc;
+	uint32_t n, first, last;
+	long handed = 0;
+
+	if (b->count == 0 || b->count > TRK_MAXBLOCK)
+		return (-1);
+
+	/* times first: perhaps only some of the block is wanted */
+	for (acc = b->tmin, n = 0; n < b->count; n++) {
+		if ((p = get_varint(p, end, &v)) == NULL)
+			return (-1);
+		acc += v;
+		fixes[n].tst = acc;
+	}
+	for (first = 0; first < b->count && fixes[first].tst < from; first++)
+		;
+	for (last = first; last < b->count && fixes[last].tst <= to; last++)
+		;
+
+	for (acc = 0, n = 0; n < b->count; n++) {
+		if ((p = get_varint(p, end, &v)) == NULL)
+			return (-1);
+		acc += unzigzag(v);
+		fixes[n].lat = acc / 1e6;
+	}
+	for (acc = 0, n = 0; n < b->count; n++) {
+		if ((p = get_varint(p, end, &v)) == NULL)
+			return (-1);
+		acc += unzigzag(v);
+		fixes[n].lon = acc / 1e6;
+	}
+	for (n = 0; n < b->count; n++) {
+		if ((p = get_varint(p, end, &v)) == NULL)
+			return (-1);
+		fixes[n].vel = v == 0 ? NAN : (v - 1) / 10.0;
+	}
+	for (n = 0; n < b->count; n++) {
+		if ((p = get_varint(p, end, &v)) == NULL)
+			return (-1);
+		fixes[n].cog = (int)v - 1;
+	}
+
+	for (n = first; n < last && !*stop; n++, handed++)
+		*stop = !fn(&fixes[n], arg);
+	return (handed);
+}
+
+/* Scan the file at `path'; returns how many fixes were handed to `fn' */
+static long scan_file(const char *path, time_t from, time_t to, trk_fn fn, void *arg, bool *stop)
+{
+	const unsigned char *base, *p, *end;
+	const struct trk_block *b;
+	struct stat st;
+	long n, handed = 0;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return (0);
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct trk_block)) {
+		close(fd);
+		return (0);
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return (0);
+
+	end = base + st.st_size;
+	for (p = base; p + sizeof(struct trk_block) <= end; p += sizeof(struct trk_block) + b->len) {
+		b = (const struct trk_block *)p;
+		/* anything after a damaged or half-written block is lost */
+		if (b->magic != TRK_MAGIC || b->len % TRK_ALIGN || (size_t)(end - p) < sizeof(struct trk_block) + b->len)
+			break;
+		if (b->tmax < from || b->tmin > to)
+			continue;
+		if ((n = decode(b, p + sizeof(struct trk_block) + b->len, from, to, fn, arg, stop)) < 0)
+			break;
+		handed += n;
+		if (*stop)
+			break;
+	}
+	munmap((void *)base, st.st_size);
+	return (handed);
+}
+
+static int bydate(const void *a, const void *b)
+{
+	return (strcmp(*(char * const *)a, *(char * const *)b));
+}
+
+/*
+ * Hand the fixes of `imei' from `from' through `to' to `fn', day by day,
+ * and within a day in the order they were written (a backlog a device
+ * sent late comes after what it sent before). Returns how many, or -1
+ * if there is no such device.
+ */
+
+long trk_scan(const char *dir, const char *imei, time_t from, time_t to, trk_fn fn, void *arg)
+{
+	char path[BUFSIZ], lo[32], hi[32], **names = NULL;
+	struct dirent *de;
+	DIR *dp;
+	int n, nnames = 0, size = 0;
+	long handed = 0;
+	bool stop = false;
+
+	if (!trk_imei(imei))
+		return (-1);
+	snprintf(path, sizeof(path), "%s/%s", dir, imei);
+	if ((dp = opendir(path)) == NULL)
+		return (-1);
+
+	/* the names of the days, YYYYMMDD.trk, sort by date */
+	dayname(from < 0 ? 0 : from, lo, sizeof(lo));
+	dayname(to, hi, sizeof(hi));
+	while ((de = readdir(dp)) != NULL) {
+		if (strlen(de->d_name) != 12 || strcmp(de->d_name + 8, ".trk") != 0 ||
+		    strcmp(de->d_name, lo) < 0 || strcmp(de->d_name, hi) > 0)
+			continue;
+		if (nnames == size) {
+			size = size ? size * 2 : 32;
+			if ((names = realloc(names, size * sizeof(char *))) == NULL)
+				break;
+		}
+		names[nnames++] = strdup(de->d_name);
+	}
+	closedir(dp);
+	if (names == NULL)
+		return (0);
+	qsort(names, nnames, sizeof(char *), bydate);
+
+	for (n = 0; n < nnames; n++) {
+		if (!stop) {
+			snprintf(path, sizeof(path), "%s/%s/%s", dir, imei, names[n]);
+			handed += scan_file(path, from, to, fn, arg, &stop);
+		}
+		free(names[n]);
+	}
+	free(names);
+	return (handed);
+}
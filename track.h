@@ -0,0 +1,80 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _TRACK_H_INCL_
+# define  _TRACK_H_INCL_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * The track store: the fixes of a device, one file per UTC day of their
+ * time, <dir>/<imei>/YYYYMMDD.trk. A file is a sequence of blocks,
+ * appended as they are written and never changed, each
+ *
+ *	struct trk_block	count, and the first and last fix time
+ *	tst			\
+ *	lat			 | `count' values each, as varints, in
+ *	lon			 | that order, padded to TRK_ALIGN
+ *	vel			 |
+ *	cog			/
+ *
+ * in host byte order. Within a block fixes are in time order: tst is
+ * the seconds since the previous one (the first: 0, it being `tmin'),
+ * lat and lon are the zig-zagged change in millionths of a degree from
+ * the previous fix (the first: from 0), vel is tenths of a km/h and cog
+ * degrees, both plus 1, with 0 for unknown. The block headers are a
+ * sparse time index: a scan hops from one to the next and decodes only
+ * the blocks which overlap what it wants.
+ */
+
+#define TRK_MAGIC	0x316b7274	/* "trk1" */
+#define TRK_ALIGN	8
+#define TRK_MAXBLOCK	4096		/* fixes in a block */
+#define TRK_MAXVARINT	10
+
+struct trk_block {
+	uint32_t magic;
+	uint32_t count;			/* fixes */
+	uint32_t len;			/* bytes of columns which follow */
+	uint32_t reserved;
+	int64_t tmin, tmax;
+};
+
+struct trk_fix {
+	time_t tst;
+	double lat, lon;
+	double vel;			/* km/h; NAN: unknown */
+	int cog;			/* -1: unknown */
+};
+
+/* Return false to end the scan */
+typedef bool (*trk_fn)(struct trk_fix *fix, void *arg);
+
+#define TRK_MAXIMEI	15		/* digits */
+
+bool trk_imei(const char *imei);
+size_t trk_maxlen(int count);
+size_t trk_encode(const struct trk_fix *fixes, int count, unsigned char *buf);
+int trk_path(const char *dir, const char *imei, time_t tst, char *path, size_t size);
+long trk_scan(const char *dir, const char *imei, time_t from, time_t to, trk_fn fn, void *arg);
+
+#endif
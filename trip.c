@@ -0,0 +1,377 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <math.h>
+#include "uthash.h"
+#include "json.h"
+#include "conf.h"
+#include "util.h"
+#include "tline.h"
+#include "timer.h"
+#include "pool.h"
+#include "http.h"
+#include "trip.h"
+
+/*
+ * Trips, worked out as positions come in rather than afterwards from all
+ * of them. Per IMEI we keep the trip it is on, if any, in a fixed-size
+ * struct trip. A device which reports its ignition (GTIGN/GTIGF/GTIGL, or
+ * the "ign" bit of its status) is on a trip from ignition on to off; one
+ * which doesn't is on a trip from when it goes faster than `speed' km/h
+ * until it has been slower than that for `stop' seconds. A trip is also
+ * closed when nothing is heard from the device for `timeout' seconds.
+ *
+ * While on a trip, positions add up distance, the top speed, the time
+ * spent stationary ("idle"), and, from `fcon', the fuel used; the change
+ * of `odometer' and `hmc' is taken from the first and last values seen.
+ * When the trip ends, a summary with `_type: trip' is published to the
+ * device's topic + "/trip". Positions older than the last one (e.g. from
+ * +BUFF) are ignored.
+ *
+ * The trips are written to `file' every `save' seconds and read back at
+ * startup, so those under way survive a restart.
+ */
+
+#define TRIP_MAGIC	"qtr1"
+
+struct trip {
+	char imei[16];
+	signed char ign;		/* -1: never reported */
+	bool open;
+	time_t start, last, moved;	/* first and last position, last moving */
+	time_t seen;			/* when we last heard of it */
+	double lat0, lon0;		/* where it started */
+	double lat, lon;		/* the last position */
+	double meters, maxvel, fuel;
+	long idle;
+	double odo0, odo, hmc0, hmc;	/* NAN: unknown */
+	UT_hash_handle hh;		/* not saved */
+};
+#define TRIP_SAVED	offsetof(struct trip, hh)
+
+static struct trip *trips = NULL;
+static struct pool trip_pool;
+static struct timer save_timer, sweep_timer;
+static bool tripping = false, dirty = false;
+static unsigned long opened = 0, closed = 0, nopen = 0;
+
+static struct trip *trip_for(const char *imei, bool create)
+{
+	struct trip *t;
+
+	HASH_FIND_STR(trips, imei, t);
+	if (t == NULL && create && (t = (struct trip *)pool_get(&trip_pool)) != NULL) {
+		memset(t, 0, sizeof(struct trip));
+		snprintf(t->imei, sizeof(t->imei), "%s", imei);
+		t->ign = -1;
+		HASH_ADD_STR(trips, imei, t);
+	}
+	return (t);
+}
+
+/* The number `key' of `extra' (what the record had besides positions) */
+static double extra_d(JsonNode *extra, const char *key)
+{
+	JsonNode *j;
+
+	if (extra == NULL || (j = json_find_member(extra, key)) == NULL)
+		return (NAN);
+	if (j->tag == JSON_NUMBER || j->tag == JSON_DOUBLE)
+		return (j->number_);
+	if (j->tag == JSON_BOOL)
+		return (j->bool_ ? 1 : 0);
+	return (NAN);
+}
+
+static void trip_open(struct trip *t, double lat, double lon, time_t tst, double odo, double hmc)
+{
+	t->open = true;
+	t->start = t->last = t->moved = tst;
+	t->lat0 = t->lat = lat;
+	t->lon0 = t->lon = lon;
+	t->meters = t->maxvel = t->fuel = 0;
+	t->idle = 0;
+	t->odo0 = t->odo = odo;
+	t->hmc0 = t->hmc = hmc;
+	opened++;
+	nopen++;
+}
+
+/* Publish the summary of `t's trip, which ended at `end' */
+static void trip_close(struct udata *ud, struct trip *t, time_t end, const char *why)
+{
+	JsonNode *obj = json_mkobject();
+
+	json_append_member(obj, "_type", json_mkstring("trip"));
+	json_append_member(obj, "start", json_mknumber(t->start));
+	json_append_member(obj, "end", json_mknumber(end));
+	json_append_member(obj, "duration", json_mknumber(end - t->start));
+	json_append_member(obj, "idle", json_mknumber(t->idle));
+	json_append_member(obj, "meters", json_mkdouble(t->meters, 1));
+	json_append_member(obj, "maxvel", json_mkdouble(t->maxvel, 1));
+	json_append_member(obj, "lat0", json_mkdouble(t->lat0, 6));
+	json_append_member(obj, "lon0", json_mkdouble(t->lon0, 6));
+	json_append_member(obj, "lat", json_mkdouble(t->lat, 6));
+	json_append_member(obj, "lon", json_mkdouble(t->lon, 6));
+	if (!isnan(t->odo0) && !isnan(t->odo))
+		json_append_member(obj, "odometer", json_mkdouble(t->odo - t->odo0, 1));
+	if (!isnan(t->hmc0) && !isnan(t->hmc))
+		json_append_member(obj, "hmc", json_mknumber(t->hmc - t->hmc0));
+	if (t->fuel > 0)
+		json_append_member(obj, "fuel", json_mkdouble(t->fuel, 2));
+	json_append_member(obj, "reason", json_mkstring(why));
+
+	transmit_trip(ud, t->imei, obj);
+	json_delete(obj);
+
+	t->open = false;
+	closed++;
+	nopen--;
+	dirty = true;
+	STATSD_INC(ud->cf->sd, "trips.closed");
+}
+
+/*
+ * `imei' reported `subtype' with a position at `lat', `lon', going `vel'
+ * km/h (NAN if unknown) at `tst'; `extra' has what else the record said.
+ */
+
+void trip_update(struct udata *ud, char *imei, const char *subtype, double lat, double lon, double vel, time_t tst, JsonNode *extra)
+{
+	config *cf = ud->cf;
+	struct trip *t;
+	double ign, odo, hmc, fcon, d;
+	bool moving = !isnan(vel) && vel >= cf->trip_speed;
+
+	if (!tripping || (t = trip_for(imei, true)) == NULL || tst < t->last)
+		return;
+
+	t->seen = time(0);
+	dirty = true;
+
+	ign = extra_d(extra, "ign");
+	if (strcmp(subtype, "GTIGN") == 0)
+		ign = 1;
+	else if (strcmp(subtype, "GTIGF") == 0)
+		ign = 0;
+	else if (strcmp(subtype, "GTIGL") == 0)
+		ign = extra_d(extra, "rty") == 1 ? 0 : 1;
+	odo = extra_d(extra, "odometer");
+	hmc = extra_d(extra, "hmc");
+	fcon = extra_d(extra, "fcon");
+
+	if (t->open) {
+		d = haversine_dist(t->lat, t->lon, lat, lon);
+		t->meters += d;
+		if (!moving)
+			t->idle += tst - t->last;
+		if (!isnan(vel) && vel > t->maxvel)
+			t->maxvel = vel;
+		if (!isnan(fcon) && fcon > 0)
+			t->fuel += d / 1000.0 * fcon / 100.0;
+		if (isnan(t->odo0))
+			t->odo0 = odo;
+		if (isnan(t->hmc0))
+			t->hmc0 = hmc;
+		if (!isnan(odo))
+			t->odo = odo;
+		if (!isnan(hmc))
+			t->hmc = hmc;
+		if (moving)
+			t->moved = tst;
+		t->lat = lat;
+		t->lon = lon;
+	}
+	t->last = tst;
+
+	if (!isnan(ign)) {
+		t->ign = ign != 0;
+		if (t->ign && !t->open)
+			trip_open(t, lat, lon, tst, odo, hmc);
+		else if (!t->ign && t->open)
+			trip_close(ud, t, tst, "ignition");
+		return;
+	}
+	if (t->ign >= 0)
+		return;
+
+	/* no ignition: by movement alone */
+	if (!t->open && moving) {
+		trip_open(t, lat, lon, tst, odo, hmc);
+		t->maxvel = vel;
+	} else if (t->open && !moving && tst - t->moved >= cf->trip_stop) {
+		/* it ended when it stopped, not `stop' seconds later */
+		t->idle -= t->last - t->moved;
+		trip_close(ud, t, t->moved, "stopped");
+	}
+}
+
+/* Close the trips of devices we've not heard of for `timeout' seconds */
+static void sweep_expired(struct timer *tm, void *arg)
+{
+	struct udata *ud = (struct udata *)arg;
+	struct trip *t, *tmp;
+	time_t now = time(0);
+
+	HASH_ITER(hh, trips, t, tmp) {
+		if (t->open && now - t->seen >= ud->cf->trip_timeout)
+			trip_close(ud, t, t->last, "timeout");
+	}
+	timer_set(tm, 60);
+}
+
+/*
+ * File format: the magic and the number of trips as a 32-bit integer in
+ * host order, then each trip as it is in memory up to `hh'.
+ */
+
+static void load(struct udata *ud, const char *path)
+{
+	struct trip *t, in;
+	uint32_t count;
+	char magic[4];
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		if (errno != ENOENT)
+			xlog(ud, "Trips: cannot open %s: %s\n", path, strerror(errno));
+		return;
+	}
+	if (fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, TRIP_MAGIC, 4) != 0 ||
+	    fread(&count, sizeof(count), 1, fp) != 1) {
+		xlog(ud, "Trips: %s is not a trip file; ignored\n", path);
+		fclose(fp);
+		return;
+	}
+	while (count-- > 0) {
+		if (fread(&in, TRIP_SAVED, 1, fp) != 1)
+			break;
+		in.imei[sizeof(in.imei) - 1] = 0;
+		if ((t = trip_for(in.imei, true)) == NULL)
+			break;
+		memcpy(t, &in, TRIP_SAVED);
+		/* a restart is not the device going silent */
+		t->seen = time(0);
+		if (t->open)
+			nopen++;
+	}
+	fclose(fp);
+	xlog(ud, "Trips: %u devices from %s, %lu on a trip\n", HASH_COUNT(trips), path, nopen);
+}
+
+/* Write the trips to a new file and rename it into place */
+bool trip_save(struct udata *ud)
+{
+	const char *path = ud->cf->trip_file;
+	char tmp[BUFSIZ];
+	struct trip *t, *ttmp;
+	uint32_t count;
+	bool ok;
+	FILE *fp;
+
+	if (!tripping || path == NULL || !dirty)
+		return (true);
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		xlog(ud, "Trips: cannot create %s: %s\n", tmp, strerror(errno));
+		return (false);
+	}
+	count = HASH_COUNT(trips);
+	ok = fwrite(TRIP_MAGIC, 4, 1, fp) == 1 && fwrite(&count, sizeof(count), 1, fp) == 1;
+	HASH_ITER(hh, trips, t, ttmp) {
+		if (!ok)
+			break;
+		ok = fwrite(t, TRIP_SAVED, 1, fp) == 1;
+	}
+	if (fclose(fp) != 0)
+		ok = false;
+	if (!ok || rename(tmp, path) == -1) {
+		xlog(ud, "Trips: cannot write %s: %s\n", path, strerror(errno));
+		unlink(tmp);
+		return (false);
+	}
+	dirty = false;
+	return (true);
+}
+
+static void save_expired(struct timer *t, void *arg)
+{
+	struct udata *ud = (struct udata *)arg;
+
+	trip_save(ud);
+	timer_set(t, ud->cf->trip_save);
+}
+
+bool trip_enabled(void)
+{
+	return (tripping);
+}
+
+bool trip_init(struct udata *ud)
+{
+	config *cf = ud->cf;
+
+	if ((tripping = cf->trips) == false)
+		return (true);
+	pool_init(&trip_pool, sizeof(struct trip), 1024);
+
+	if (cf->trip_file != NULL) {
+		load(ud, cf->trip_file);
+		if (cf->trip_save > 0) {
+			timer_init(&save_timer, save_expired, ud);
+			timer_set(&save_timer, cf->trip_save);
+		}
+	}
+	if (cf->trip_timeout > 0) {
+		timer_init(&sweep_timer, sweep_expired, ud);
+		timer_set(&sweep_timer, 60);
+	}
+	return (true);
+}
+
+void trip_stats(struct udata *ud)
+{
+	char buf[BUFSIZ];
+
+	if (!tripping)
+		return;
+	snprintf(buf, sizeof(buf), "trips devices=%u open=%lu opened=%lu closed=%lu",
+		HASH_COUNT(trips), nopen, opened, closed);
+	xlog(ud, "stats: %s\n", buf);
+	if (ud->cf->reporttopic)
+		pub(ud, (char *)ud->cf->reporttopic, buf, false);
+}
+
+void trip_metrics(struct mbuf *mb)
+{
+	mbuf_printf(mb, "# HELP qtripp_trips_open Devices on a trip.\n"
+		"# TYPE qtripp_trips_open gauge\n"
+		"qtripp_trips_open %lu\n", nopen);
+	mbuf_printf(mb, "# HELP qtripp_trips_total Trips completed.\n"
+		"# TYPE qtripp_trips_total counter\n"
+		"qtripp_trips_total %lu\n", closed);
+}
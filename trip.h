@@ -0,0 +1,37 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _TRIP_H_INCL_
+# define  _TRIP_H_INCL_
+
+#include <stdbool.h>
+#include <time.h>
+#include "udata.h"
+
+struct mbuf;
+struct JsonNode;
+
+bool trip_init(struct udata *ud);
+bool trip_enabled(void);
+void trip_update(struct udata *ud, char *imei, const char *subtype, double lat, double lon, double vel, time_t tst, struct JsonNode *extra);
+bool trip_save(struct udata *ud);
+void trip_stats(struct udata *ud);
+void trip_metrics(struct mbuf *mb);
+
+#endif
@@ -22,6 +22,14 @@
 
 #include <stdbool.h>
 
+/* Where decoded reports go (bits of `sinks'); none is a pure decode */
+#define SINK_NULL	0x00
+#define SINK_MQTT	0x01
+#define SINK_FILE	0x02		/* JSON lines to `sinkfd' */
+#define SINK_BEAN	0x04
+
+struct JsonNode;
+
 struct udata {
 	bool debugging;
 	FILE *logfp;			/* open logfile */
@@ -33,9 +41,15 @@ struct udata {
         struct config *cf;
 	struct mg_connection *coco;	/* if configured, the mirror connection */
 	bool cocorun;			/* true if connected; false if to be connected */
-#ifdef WITH_BEAN
-	int bean_socket;
-#endif
+	int sinks;			/* SINK_* */
+	int sinkfd;
+	unsigned long published;	/* MQTT publishes handed to libmosquitto */
+	unsigned long acked;		/* ... and acknowledged by the broker */
+	void (*onjson)(struct udata *, char *topic, struct JsonNode *obj);	/* sees each report before sinks */
+	long long received_us;		/* wall_us() when process() got the record; 0 replaying */
+	const char *model;		/* model of the last record handle_report() saw, or NULL */
+	bool duplicate;			/* ... and whether it was one we'd already had */
+	bool ack;			/* ... or the +ACK to a command */
 };
 
 #endif
@@ -0,0 +1,484 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#define _GNU_SOURCE		/* recvmmsg, sendmmsg */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "mongoose.h"
+#include "uthash.h"
+#include "conf.h"
+#include "util.h"
+#include "tline.h"
+#include "timer.h"
+#include "pool.h"
+#include "conn.h"
+#include "lanes.h"
+#include "hex.h"
+#include "udp.h"
+
+/*
+ * Devices reporting over UDP, on the same port as TCP. Each datagram
+ * carries one or more complete records. They're read in batches of
+ * UDP_BATCH with recvmmsg(2), and the SACKs and other replies to the
+ * records of a datagram go back in one datagram; those of a batch are
+ * sent in one go with sendmmsg(2). Systems
+ * without those get the same batching over recvfrom(2)/sendto(2).
+ *
+ * A peer is a source address plus the IMEI reporting from it. Peers
+ * are forgotten after the idle timeout of their model, with a pseudo-LWT
+ * if the device has no other way in. The most recent peer of an IMEI is
+ * where commands from MQTT go.
+ *
+ * mongoose only has to tell us when to read: the socket is given to it
+ * as if it were listening, so select() watches it (its accept() fails
+ * harmlessly), and we drain it on every MG_EV_POLL.
+ *
+ * As over TCP, +BUFF records wait in their peer's lane for the scheduler;
+ * what doesn't fit there is dropped, unacknowledged, for the device to
+ * send again.
+ *
+ * A datagram may carry binary frames as well as ASCII records.
+ */
+
+#if defined(__linux__)
+# define HAVE_MMSG
+#endif
+
+#define UDP_BATCH	64
+#define UDP_MAXDGRAM	4096
+#define UDP_MAXBATCHES	16		/* per poll, so TCP gets its turn */
+#define UDP_RCVBUF	(4 * 1024 * 1024)
+
+union udp_addr {
+	struct sockaddr sa;
+	struct sockaddr_in sin;
+	struct sockaddr_in6 sin6;
+};
+
+struct udp_key {
+	union udp_addr addr;		/* only family, port, and address set */
+	char imei[24];
+};
+
+struct udp_peer {
+	struct udp_key key;
+	socklen_t addrlen;
+	const char *model;
+	unsigned long records;
+	struct timer idle;
+	struct lane lane;		/* its +BUFF records */
+	bool current;			/* the IMEI's most recent peer */
+	UT_hash_handle hh;		/* by key */
+	UT_hash_handle hh_imei;		/* current peers by IMEI */
+};
+
+static int udp_fd = -1;
+static struct udata *udp_ud;
+static process_fn udp_process;
+static struct udp_peer *peers = NULL, *peers_by_imei = NULL;
+static struct pool peer_pool;
+
+static char inbuf[UDP_BATCH][UDP_MAXDGRAM];
+static union udp_addr inaddr[UDP_BATCH];
+static socklen_t inaddrlen[UDP_BATCH];
+static size_t inlen[UDP_BATCH];
+static int intrunc[UDP_BATCH];
+
+static char outbuf[UDP_BATCH][REPLYSIZE];
+static union udp_addr *outaddr[UDP_BATCH];
+static socklen_t outaddrlen[UDP_BATCH];
+static size_t outlen[UDP_BATCH];
+static int nout = 0;
+
+static const char *addrstr(union udp_addr *a, char *buf, size_t size)
+{
+	char host[64];
+	int port;
+
+	if (a->sa.sa_family == AF_INET6) {
+		inet_ntop(AF_INET6, &a->sin6.sin6_addr, host, sizeof(host));
+		port = ntohs(a->sin6.sin6_port);
+	} else {
+		inet_ntop(AF_INET, &a->sin.sin_addr, host, sizeof(host));
+		port = ntohs(a->sin.sin_port);
+	}
+	snprintf(buf, size, "%s:%d", host, port);
+	return (buf);
+}
+
+/* Receive up to UDP_BATCH datagrams; returns how many, 0 if there are none */
+static int recv_batch(void)
+{
+	int n;
+#ifdef HAVE_MMSG
+	static struct mmsghdr msgs[UDP_BATCH];
+	static struct iovec iov[UDP_BATCH];
+
+	for (n = 0; n < UDP_BATCH; n++) {
+		iov[n].iov_base = inbuf[n];
+		iov[n].iov_len = UDP_MAXDGRAM;
+		memset(&msgs[n].msg_hdr, 0, sizeof(struct msghdr));
+		msgs[n].msg_hdr.msg_name = &inaddr[n];
+		msgs[n].msg_hdr.msg_namelen = sizeof(union udp_addr);
+		msgs[n].msg_hdr.msg_iov = &iov[n];
+		msgs[n].msg_hdr.msg_iovlen = 1;
+	}
+	if ((n = recvmmsg(udp_fd, msgs, UDP_BATCH, MSG_DONTWAIT, NULL)) < 0)
+		return (0);
+	for (int i = 0; i < n; i++) {
+		inlen[i] = msgs[i].msg_len;
+		inaddrlen[i] = msgs[i].msg_hdr.msg_namelen;
+		intrunc[i] = (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0;
+	}
+#else
+	ssize_t nr;
+
+	for (n = 0; n < UDP_BATCH; n++) {
+		inaddrlen[n] = sizeof(union udp_addr);
+		nr = recvfrom(udp_fd, inbuf[n], UDP_MAXDGRAM, MSG_DONTWAIT, &inaddr[n].sa, &inaddrlen[n]);
+		if (nr < 0)
+			break;
+		inlen[n] = nr;
+		intrunc[n] = 0;
+	}
+#endif
+	return (n);
+}
+
+static void send_batch(void)
+{
+	int n, sent = 0;
+#ifdef HAVE_MMSG
+	static struct mmsghdr msgs[UDP_BATCH];
+	static struct iovec iov[UDP_BATCH];
+
+	for (n = 0; n < nout; n++) {
+		iov[n].iov_base = outbuf[n];
+		iov[n].iov_len = outlen[n];
+		memset(&msgs[n].msg_hdr, 0, sizeof(struct msghdr));
+		msgs[n].msg_hdr.msg_name = outaddr[n];
+		msgs[n].msg_hdr.msg_namelen = outaddrlen[n];
+		msgs[n].msg_hdr.msg_iov = &iov[n];
+		msgs[n].msg_hdr.msg_iovlen = 1;
+	}
+	while (sent < nout) {
+		if ((n = sendmmsg(udp_fd, msgs + sent, nout - sent, MSG_DONTWAIT)) <= 0)
+			break;
+		sent += n;
+	}
+#else
+	for (n = 0; n < nout; n++) {
+		if (sendto(udp_fd, outbuf[n], outlen[n], MSG_DONTWAIT, &outaddr[n]->sa, outaddrlen[n]) >= 0)
+			sent++;
+	}
+#endif
+	if (sent < nout) {
+		xlog(udp_ud, "UDP: %d of %d replies not sent: %s\n", nout - sent, nout, strerror(errno));
+		STATSD_INC(udp_ud->cf->sd, "udp.reply.dropped");
+	}
+	nout = 0;
+}
+
+/* Queue the reply to the records of datagram `i' */
+static void respond(int i, struct reply *reply)
+{
+	xlog(udp_ud, "Responding to terminal: %s\n", reply->buf);
+	if (nout == UDP_BATCH)
+		send_batch();
+	memcpy(outbuf[nout], reply->buf, reply->len);
+	outlen[nout] = reply->len;
+	outaddr[nout] = &inaddr[i];
+	outaddrlen[nout] = inaddrlen[i];
+	nout++;
+	reply->len = 0;
+}
+
+static void peer_expired(struct timer *t, void *arg)
+{
+	struct udp_peer *p = (struct udp_peer *)arg;
+	struct udata *ud = udp_ud;
+	char buf[80];
+
+	if (lane_queued(&p->lane) > 0) {	/* not before they're handled */
+		timer_set(t, 1);
+		return;
+	}
+
+	xlog(ud, "Forgetting UDP peer %s: IMEI <%s>, %lu records\n",
+		addrstr(&p->key.addr, buf, sizeof(buf)), p->key.imei, p->records);
+	if (p->current) {
+		HASH_DELETE(hh_imei, peers_by_imei, p);
+		if (strcmp(p->key.imei, "123456789012345") != 0 && count_conns(p->key.imei) == 0)
+			pseudo_lwt(ud, p->key.imei);
+	}
+	HASH_DEL(peers, p);
+	pool_put(&peer_pool, p);
+}
+
+static void serve_buffered(struct lane *l, char *rec, size_t len);
+static void served_buffered(struct lane *l);
+
+/* Forget `p' after `secs' of silence; 0 disables it, as for connections */
+static void peer_idle(struct udp_peer *p, int secs)
+{
+	if (secs > 0)
+		timer_set(&p->idle, secs);
+	else
+		timer_cancel(&p->idle);
+}
+
+/* The peer for `imei' at `addr', created if it's new */
+static struct udp_peer *peer_get(union udp_addr *addr, socklen_t addrlen, char *imei)
+{
+	struct udp_key key;
+	struct udp_peer *p;
+
+	memset(&key, 0, sizeof(key));
+	key.addr.sa.sa_family = addr->sa.sa_family;
+	if (addr->sa.sa_family == AF_INET6) {
+		key.addr.sin6.sin6_port = addr->sin6.sin6_port;
+		key.addr.sin6.sin6_addr = addr->sin6.sin6_addr;
+	} else {
+		key.addr.sin.sin_port = addr->sin.sin_port;
+		key.addr.sin.sin_addr = addr->sin.sin_addr;
+	}
+	snprintf(key.imei, sizeof(key.imei), "%s", imei);
+
+	HASH_FIND(hh, peers, &key, sizeof(struct udp_key), p);
+	if (p == NULL) {
+		if ((p = (struct udp_peer *)pool_get(&peer_pool)) == NULL)
+			return (NULL);
+		p->key = key;
+		p->addrlen = addrlen;
+		timer_init(&p->idle, peer_expired, p);
+		peer_idle(p, idle_timeout(udp_ud->cf, NULL));
+		lane_init(&p->lane, serve_buffered, served_buffered, p);
+		HASH_ADD(hh, peers, key, sizeof(struct udp_key), p);
+		STATSD_INC(udp_ud->cf->sd, "udp.peer.new");
+	}
+	return (p);
+}
+
+/* A record of `p''s has been processed: note it and restart its timeout */
+static void peer_seen(struct udp_peer *p)
+{
+	struct udp_peer *cur;
+
+	HASH_FIND(hh_imei, peers_by_imei, p->key.imei, strlen(p->key.imei), cur);
+	if (cur != p) {
+		if (cur != NULL) {
+			HASH_DELETE(hh_imei, peers_by_imei, cur);
+			cur->current = false;
+		}
+		HASH_ADD_KEYPTR(hh_imei, peers_by_imei, p->key.imei, strlen(p->key.imei), p);
+		p->current = true;
+	}
+
+	if (udp_ud->model != NULL)
+		p->model = udp_ud->model;
+	p->records++;
+	peer_idle(p, idle_timeout(udp_ud->cf, p->model));
+}
+
+static struct reply lane_reply;
+
+static void lane_respond(struct udp_peer *p)
+{
+	xlog(udp_ud, "Responding to terminal: %s\n", lane_reply.buf);
+	sendto(udp_fd, lane_reply.buf, lane_reply.len, MSG_DONTWAIT, &p->key.addr.sa, p->addrlen);
+	lane_reply.len = 0;
+}
+
+/* The scheduler hands us a +BUFF record of `l''s peer */
+static void serve_buffered(struct lane *l, char *rec, size_t len)
+{
+	struct udp_peer *p = (struct udp_peer *)l->arg;
+	char *imei;
+
+	if ((imei = udp_process(udp_ud, rec, len, &lane_reply)) != NULL) {
+		peer_seen(p);
+		free(imei);
+	}
+	if (lane_reply.len > REPLYSIZE / 2)
+		lane_respond(p);
+}
+
+static void served_buffered(struct lane *l)
+{
+	if (lane_reply.len > 0)
+		lane_respond((struct udp_peer *)l->arg);
+}
+
+/* Copy the IMEI, the third field, of record `rec' to `imei' */
+static bool record_imei(const char *rec, size_t len, char *imei, size_t size)
+{
+	const char *end = rec + len, *s, *e;
+
+	if ((s = memchr(rec, ',', len)) == NULL || (s = memchr(s + 1, ',', end - s - 1)) == NULL)
+		return (false);
+	s++;
+	if ((e = memchr(s, ',', end - s)) == NULL || e == s || (size_t)(e - s) >= size)
+		return (false);
+	memcpy(imei, s, e - s);
+	imei[e - s] = 0;
+	return (true);
+}
+
+static void udp_handler(struct mg_connection *nc, int ev, void *ev_data)
+{
+	struct udata *ud = udp_ud;
+	int batches, n, i;
+	char *rec, *end, *dgram, *imei, buf[80], id[24];
+	struct reply reply;
+	struct udp_peer *p;
+	size_t len;
+	long hex;
+
+	if (ev != MG_EV_POLL)
+		return;
+
+	for (batches = 0; batches < UDP_MAXBATCHES; batches++) {
+		if ((n = recv_batch()) == 0)
+			break;
+		for (i = 0; i < n; i++) {
+			STATSD_INC(ud->cf->sd, "udp.datagram");
+			if (intrunc[i]) {
+				xlog(ud, "UDP: datagram from %s longer than %d bytes; ignored\n",
+					addrstr(&inaddr[i], buf, sizeof(buf)), UDP_MAXDGRAM);
+				continue;
+			}
+
+			reply.len = 0;
+			for (dgram = rec = inbuf[i]; rec < dgram + inlen[i]; rec += len) {
+				if ((hex = hex_frame(rec, dgram + inlen[i] - rec)) < 0)
+					break;
+				if (hex > 0) {
+					len = hex;
+				} else {
+					if ((end = memchr(rec, '$', dgram + inlen[i] - rec)) == NULL)
+						break;
+					len = end - rec + 1;
+				}
+				if (ud->cf->sched_maxqueue > 0 &&
+				    (hex > 0 ? hex_buffered(rec) && hex_imei(rec, id, sizeof(id)) :
+				     len > 6 && memcmp(rec, "+BUFF:", 6) == 0 && record_imei(rec, len, id, sizeof(id))) &&
+				    (p = peer_get(&inaddr[i], inaddrlen[i], id)) != NULL) {
+					if (lane_push(&p->lane, rec, len) == false)
+						STATSD_INC(ud->cf->sd, "sched.dropped");
+					continue;
+				}
+				if ((imei = udp_process(ud, rec, len, &reply)) != NULL) {
+					if ((p = peer_get(&inaddr[i], inaddrlen[i], imei)) != NULL)
+						peer_seen(p);
+					free(imei);
+				}
+				if (reply.len > REPLYSIZE / 2)
+					respond(i, &reply);
+			}
+			if (reply.len > 0)
+				respond(i, &reply);
+		}
+		if (nout > 0)
+			send_batch();
+		if (n < UDP_BATCH)
+			break;
+	}
+}
+
+/* The most recent peer of `imei' gets `payload'; false if there is none */
+bool udp_send_imei(char *imei, char *payload)
+{
+	struct udp_peer *p;
+
+	if (udp_fd == -1)
+		return (false);
+	HASH_FIND(hh_imei, peers_by_imei, imei, strlen(imei), p);
+	if (p == NULL)
+		return (false);
+	xlog(udp_ud, "UDP %s. Sending %s\n", imei, payload);
+	return (sendto(udp_fd, payload, strlen(payload), MSG_DONTWAIT, &p->key.addr.sa, p->addrlen) >= 0);
+}
+
+/*
+ * Bind to `listen' ([host:]port, as listen_port) and have `process' handle
+ * the records arriving there.
+ */
+
+bool udp_init(struct udata *ud, struct mg_mgr *mgr, const char *listen, process_fn process)
+{
+	struct addrinfo hints, *res = NULL;
+	struct mg_connection *nc;
+	char host[128], *port;
+	int on = 1, rcvbuf = UDP_RCVBUF, rc;
+
+	udp_ud = ud;
+	udp_process = process;
+	pool_init(&peer_pool, sizeof(struct udp_peer), 256);
+
+	snprintf(host, sizeof(host), "%s", listen);
+	if ((port = strrchr(host, ':')) != NULL) {
+		*port++ = 0;
+	} else {
+		port = host;
+	}
+	if (*host == '[' && port != host) {		/* [::1]:5000 */
+		memmove(host, host + 1, strlen(host));
+		host[strcspn(host, "]")] = 0;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_PASSIVE;
+	if ((rc = getaddrinfo(port == host ? NULL : host, port, &hints, &res)) != 0) {
+		xlog(ud, "UDP: cannot resolve %s: %s\n", listen, gai_strerror(rc));
+		return (false);
+	}
+
+	if ((udp_fd = socket(res->ai_family, SOCK_DGRAM, 0)) == -1 ||
+	    setsockopt(udp_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+	    bind(udp_fd, res->ai_addr, res->ai_addrlen) == -1) {
+		xlog(ud, "UDP: cannot listen on %s: %s\n", listen, strerror(errno));
+		if (udp_fd != -1)
+			close(udp_fd);
+		udp_fd = -1;
+		freeaddrinfo(res);
+		return (false);
+	}
+	freeaddrinfo(res);
+	setsockopt(udp_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	if ((nc = mg_add_sock(mgr, udp_fd, udp_handler)) == NULL) {
+		close(udp_fd);
+		udp_fd = -1;
+		return (false);
+	}
+	nc->flags |= MG_F_LISTENING;
+
+	xlog(ud, "Listening for GPRS over UDP on %s\n", listen);
+	return (true);
+}
@@ -0,0 +1,35 @@
+/*
+ * qtripp
+ * Copyright (C) 2018 Jan-Piet Mens <jp@mens.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _UDP_H_INCL_
+# define  _UDP_H_INCL_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "udata.h"
+
+struct mg_mgr;
+struct reply;
+
+typedef char *(*process_fn)(struct udata *ud, char *buf, size_t buflen, struct reply *reply);
+
+bool udp_init(struct udata *ud, struct mg_mgr *mgr, const char *listen, process_fn process);
+bool udp_send_imei(char *imei, char *payload);
+
+#endif
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/*
+ * httpstub.c (C)2018 by Jan-Piet Mens <jp@mens.de>
+ *
+ * A stand-in for Traccar when benchmarking tt: accepts keep-alive HTTP/1.1
+ * POSTs on `port', answers each with 200 (or 503 for `-f percent' of them),
+ * and prints requests per second.
+ *
+ *	./httpstub 5199 &
+ *	./tt -n 100000 -c 32 -u http://127.0.0.1:5199/
+ */
+
+#define MAXCONN 1024
+#define BUFSZ 65536
+
+struct conn {
+	char buf[BUFSZ];
+	size_t len;
+};
+
+static struct conn *conns[MAXCONN];
+
+/*
+ * Answer every complete request in `c'. Returns the number answered,
+ * or -1 if the connection should be closed.
+ */
+
+static int serve(int fd, struct conn *c, int failpct, long *count)
+{
+	char *eoh, *cl;
+	size_t need, clen;
+	int n = 0;
+
+	while ((eoh = memmem(c->buf, c->len, "\r\n\r\n", 4)) != NULL) {
+		clen = 0;
+		*eoh = 0;
+		if ((cl = strcasestr(c->buf, "\ncontent-length:")) != NULL)
+			clen = strtoul(cl + 16, NULL, 10);
+		*eoh = '\r';
+		need = (eoh - c->buf) + 4 + clen;
+		if (c->len < need)
+			break;
+
+		if (failpct > 0 && (rand() % 100) < failpct) {
+			static const char r503[] = "HTTP/1.1 503 Busy\r\nContent-Length: 0\r\n\r\n";
+			if (write(fd, r503, sizeof(r503) - 1) < 0)
+				return (-1);
+		} else {
+			static const char r200[] = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+			if (write(fd, r200, sizeof(r200) - 1) < 0)
+				return (-1);
+		}
+		memmove(c->buf, c->buf + need, c->len - need);
+		c->len -= need;
+		(*count)++;
+		n++;
+	}
+	return (c->len == BUFSZ ? -1 : n);
+}
+
+int main(int argc, char **argv)
+{
+	struct pollfd pfd[MAXCONN + 1];
+	struct sockaddr_in sin;
+	int ls, n, nfds = 1, failpct = 0, ch, one = 1;
+	long count = 0;
+	time_t last = time(0);
+
+	while ((ch = getopt(argc, argv, "f:")) != EOF) {
+		switch (ch) {
+			case 'f': failpct = atoi(optarg); break;
+			default:
+				fprintf(stderr, "Usage: %s [-f failpercent] port\n", *argv);
+				return (2);
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "Usage: %s [-f failpercent] port\n", *argv);
+		return (2);
+	}
+
+	ls = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(atoi(argv[optind]));
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(ls, (struct sockaddr *)&sin, sizeof(sin)) != 0 || listen(ls, 128) != 0) {
+		perror("httpstub: bind");
+		return (1);
+	}
+
+	pfd[0].fd = ls;
+	pfd[0].events = POLLIN;
+
+	while (1) {
+		if (poll(pfd, nfds, 1000) < 0)
+			continue;
+
+		if ((pfd[0].revents & POLLIN) && nfds <= MAXCONN) {
+			int fd = accept(ls, NULL, NULL);
+
+			if (fd >= 0) {
+				pfd[nfds].fd = fd;
+				pfd[nfds].events = POLLIN;
+				conns[nfds] = calloc(1, sizeof(struct conn));
+				nfds++;
+			}
+		}
+
+		for (n = 1; n < nfds; n++) {
+			struct conn *c = conns[n];
+			ssize_t got;
+
+			if (!(pfd[n].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+
+			got = read(pfd[n].fd, c->buf + c->len, BUFSZ - c->len);
+			if (got <= 0 || (c->len += got, serve(pfd[n].fd, c, failpct, &count)) < 0) {
+				close(pfd[n].fd);
+				free(c);
+				pfd[n] = pfd[--nfds];
+				conns[n] = conns[nfds];
+				n--;
+			}
+		}
+
+		if (time(0) != last) {
+			if (count)
+				fprintf(stderr, "httpstub: %ld requests/s, %d connections\n",
+					count / (time(0) - last), nfds - 1);
+			count = 0;
+			last = time(0);
+		}
+	}
+	return (0);
+}
@@ -2,8 +2,9 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <unistd.h>
+#include <time.h>
 #include <curl/curl.h>
-#include <assert.h>
 #include <inttypes.h>
 #include "beanstalk.h"
 
@@ -21,141 +22,388 @@
  * This utility replaces to-traccar.py which we disabled on 2018-MAR-23 due
  * to it causing very many left-over connections, possibly due to an issue in
  * Python requests.
+ *
+ * Jobs are reserved in batches and POSTed with up to `-c' requests in flight
+ * over curl's multi interface, which keeps connections to Traccar alive and
+ * reuses them. A job which fails temporarily (connection trouble, HTTP 5xx,
+ * 408, 429) is released with an increasing delay and retried; it is buried
+ * when it fails permanently (any other 4xx) or after `-r' attempts.
+ *
+ * With `-n count' we don't talk to beanstalkd at all but POST `count'
+ * synthetic jobs as fast as possible; together with httpstub this
+ * benchmarks the uploader.
  */
 
 #define URL "http://127.0.0.1:5144/"	/* OwnTracks protocol in Traccar */
 #define TUBENAME "totraccar"
+#define PRIORITY 1024
+#define MAXSLOTS 256
+#define MAXLAT 100000			/* latency samples per interval */
+
+struct job {
+	int64_t id;
+	char *data;
+	size_t size;
+	BSJ *bsj;			/* NULL in benchmark mode */
+};
+
+struct slot {
+	CURL *cu;
+	struct job *job;
+	double started;
+};
+
+static struct {
+	const char *url;
+	const char *tube;
+	const char *host;
+	int port;
+	int concurrency;
+	int batch;
+	int maxtries;
+	int interval;			/* seconds between statistics */
+	long bench;			/* synthetic jobs to POST */
+} opt = { URL, TUBENAME, "127.0.0.1", 11300, 16, 64, 5, 10, 0 };
+
+static int bs = -1;			/* beanstalk handle */
+static struct slot slots[MAXSLOTS];
+static struct curl_slist *headers = NULL;
+
+static struct job **pending;		/* reserved, not yet started */
+static int npending = 0;
+static long bench_left = 0, bench_next = 1;
+
+static struct {
+	long ok, retried, buried, failed;
+	double lat[MAXLAT];
+	long nlat;
+} st;
+
+/*
+ * Number of times we've tried a job, keyed by job id. Jobs keep their id
+ * when released, so this survives a retry. Small and short-lived.
+ */
 
-struct WriteThis {
-	const char *readptr;
-	size_t sizeleft;
+struct attempts {
+	int64_t id;
+	int n;
+	struct attempts *next;
 };
+static struct attempts *attempts = NULL;
 
-static size_t read_callback(void *dest, size_t size, size_t nmemb, void *userp)
+/*
+ * Count another attempt at job `id' and return the total, or forget
+ * about the job.
+ */
+
+static int tries_bump(int64_t id, bool forget)
 {
-	struct WriteThis *wt = (struct WriteThis *)userp;
-	size_t buffer_size = size * nmemb;
+	struct attempts *t, **tp;
+	int n;
 
-	if (wt->sizeleft) {
-		/*
-		 * copy as much as possible from the source to the
-		 * destination
-		 */
-		size_t copy_this_much = wt->sizeleft;
-		if (copy_this_much > buffer_size)
-			copy_this_much = buffer_size;
-		memcpy(dest, wt->readptr, copy_this_much);
-
-		wt->readptr += copy_this_much;
-		wt->sizeleft -= copy_this_much;
-		return copy_this_much;	/* we copied this many bytes */
+	for (tp = &attempts; (t = *tp) != NULL; tp = &t->next) {
+		if (t->id == id)
+			break;
 	}
-	return 0;		/* no more data left to deliver */
+	if (t == NULL) {
+		if (forget)
+			return (0);
+		t = calloc(1, sizeof(struct attempts));
+		t->id = id;
+		t->next = attempts;
+		attempts = t;
+		tp = &attempts;
+	}
+	n = ++t->n;
+	if (forget) {
+		*tp = t->next;
+		free(t);
+	}
+	return (n);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void job_free(struct job *j)
+{
+	if (j->bsj)
+		bs_free_job(j->bsj);
+	else
+		free(j->data);
+	free(j);
 }
 
 /*
- * Return true if an upload was possible (with http status 200), false otherwise
+ * Top up `pending' with up to `batch' jobs. If nothing at all is going on
+ * we block in reserve for a second so as not to spin.
  */
 
-bool upload(CURL * cu, char *buf)
+static void reserve(bool idle)
 {
-	CURLcode status;
-	long code;
+	while (npending < opt.batch) {
+		struct job *j;
+
+		if (opt.bench) {
+			char buf[256];
+
+			if (bench_left <= 0)
+				return;
+			bench_left--;
+			j = calloc(1, sizeof(struct job));
+			j->id = bench_next++;
+			snprintf(buf, sizeof(buf),
+				"{\"_type\":\"location\",\"lat\":48.858,\"lon\":2.294,\"tst\":%ld,\"imei\":\"%015" PRId64 "\"}",
+				(long)time(0), j->id);
+			j->data = strdup(buf);
+			j->size = strlen(buf);
+		} else {
+			BSJ *bsj;
+
+			if (bs_reserve_with_timeout(bs, (idle && npending == 0) ? 1 : 0, &bsj) != BS_STATUS_OK)
+				return;
+			j = calloc(1, sizeof(struct job));
+			j->bsj	= bsj;
+			j->id	= bsj->id;
+			j->data	= bsj->data;
+			j->size	= bsj->size;
+		}
+		pending[npending++] = j;
+		idle = false;
+	}
+}
 
-	curl_easy_setopt(cu, CURLOPT_POSTFIELDS, buf);
-	curl_easy_setopt(cu, CURLOPT_POSTFIELDSIZE, -1L);
+static void start(CURLM *multi, struct slot *s, struct job *j)
+{
+	s->job = j;
+	s->started = now();
+	curl_easy_setopt(s->cu, CURLOPT_POSTFIELDS, j->data);
+	curl_easy_setopt(s->cu, CURLOPT_POSTFIELDSIZE, (long)j->size);
+	curl_multi_add_handle(multi, s->cu);
+}
 
-	status = curl_easy_perform(cu);
-	if (status != 0) {
+/*
+ * A request has finished; decide what happens to its job.
+ */
+
+static void finish(CURLM *multi, struct slot *s, CURLcode status)
+{
+	struct job *j = s->job;
+	long code = 0;
+	bool transient = false;
+	int tries;
+
+	curl_multi_remove_handle(multi, s->cu);
+	s->job = NULL;
+
+	if (status == CURLE_OK)
+		curl_easy_getinfo(s->cu, CURLINFO_RESPONSE_CODE, &code);
+
+	if (status == CURLE_OK && code >= 200 && code < 300) {
+		if (st.nlat < MAXLAT)
+			st.lat[st.nlat++] = now() - s->started;
+		st.ok++;
+		tries_bump(j->id, true);
+		if (j->bsj && bs_delete(bs, j->id) != BS_STATUS_OK)
+			fprintf(stderr, "tt: cannot delete job %" PRId64 "\n", j->id);
+		job_free(j);
+		return;
+	}
+
+	if (status != CURLE_OK) {
 		fprintf(stderr, "tt: unable to POST data: curl_strerror: %s\n", curl_easy_strerror(status));
-		assert(status == 0);
-		/* unreached */
-		return (false);
+		transient = true;
+	} else {
+		fprintf(stderr, "tt: error: server responded to POST with code %ld: %.*s\n",
+			code, (int)j->size, j->data);
+		transient = (code >= 500 || code == 408 || code == 429);
 	}
-	curl_easy_getinfo(cu, CURLINFO_RESPONSE_CODE, &code);
-	if (code != 200) {
-		fprintf(stderr, "tt: error: server responded to POST with code %ld: %s\n",
-			code, buf);
-		return (false);
+	st.failed++;
+
+	tries = tries_bump(j->id, false);
+	if (transient && tries < opt.maxtries) {
+		unsigned delay = 1u << (tries > 8 ? 8 : tries - 1);	/* seconds */
+
+		st.retried++;
+		if (j->bsj) {
+			if (bs_release(bs, j->id, PRIORITY, delay) != BS_STATUS_OK)
+				fprintf(stderr, "tt: cannot release job %" PRId64 "\n", j->id);
+			job_free(j);
+		} else {
+			pending[npending++] = j;	/* benchmark: retry at once */
+		}
+		return;
 	}
 
-	return (true);
+	st.buried++;
+	tries_bump(j->id, true);
+	if (j->bsj && bs_bury(bs, j->id, PRIORITY) != BS_STATUS_OK)
+		fprintf(stderr, "tt: cannot bury job %" PRId64 "\n", j->id);
+	job_free(j);
 }
 
-CURL *curlsetup(const char *url)
+static int dcmp(const void *a, const void *b)
 {
-	CURL *cu;
-	struct WriteThis wt;
+	double x = *(const double *)a, y = *(const double *)b;
 
-	wt.readptr = malloc(5120);
-	wt.sizeleft = 5120;
+	return (x < y) ? -1 : (x > y);
+}
+
+static void report(double secs)
+{
+	double p50 = 0, p99 = 0, max = 0;
 
+	if (st.nlat > 0) {
+		qsort(st.lat, st.nlat, sizeof(double), dcmp);
+		p50 = st.lat[st.nlat / 2];
+		p99 = st.lat[(long)(st.nlat * 0.99)];
+		max = st.lat[st.nlat - 1];
+	}
+	fprintf(stderr, "tt: %.0f jobs/s ok=%ld retried=%ld buried=%ld failed=%ld latency p50=%.1fms p99=%.1fms max=%.1fms\n",
+		st.ok / secs, st.ok, st.retried, st.buried, st.failed,
+		p50 * 1000.0, p99 * 1000.0, max * 1000.0);
+	memset(&st, 0, sizeof(st));
+}
 
-	cu = curl_easy_init();
+static CURL *curlsetup(const char *url)
+{
+	CURL *cu = curl_easy_init();
 
 	curl_easy_setopt(cu, CURLOPT_POST, 1L);
 	curl_easy_setopt(cu, CURLOPT_URL, url);
 	curl_easy_setopt(cu, CURLOPT_TCP_KEEPALIVE, 1L);
 	curl_easy_setopt(cu, CURLOPT_VERBOSE, 0L);
-
-	curl_easy_setopt(cu, CURLOPT_READFUNCTION, read_callback);
-	curl_easy_setopt(cu, CURLOPT_READDATA, &wt);
-
-	struct curl_slist *headers = NULL;
-	headers = curl_slist_append(headers, "Accept: application/json");
-	headers = curl_slist_append(headers, "Content-Type: application/json");
-	headers = curl_slist_append(headers, "charset: utf-8");
-
+	curl_easy_setopt(cu, CURLOPT_TIMEOUT, 30L);
 	curl_easy_setopt(cu, CURLOPT_HTTPHEADER, headers);
 
 	return (cu);
 }
 
+static size_t discard(void *ptr, size_t size, size_t nmemb, void *userp)
+{
+	return (size * nmemb);
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s [-u url] [-t tube] [-h host] [-p port] [-c concurrency] [-b batch] [-r tries] [-i interval] [-n count]\n", prog);
+	exit(2);
+}
 
 int main(int argc, char **argv)
 {
-	BSJ *job;
-	CURL *cu;
-	bool bf;
-	int handle = bs_connect("127.0.0.1", 11300);
+	CURLM *multi;
+	CURLMsg *msg;
+	int ch, n, running, inflight;
+	double t0, last;
+
+	while ((ch = getopt(argc, argv, "u:t:h:p:c:b:r:i:n:")) != EOF) {
+		switch (ch) {
+			case 'u': opt.url = optarg; break;
+			case 't': opt.tube = optarg; break;
+			case 'h': opt.host = optarg; break;
+			case 'p': opt.port = atoi(optarg); break;
+			case 'c': opt.concurrency = atoi(optarg); break;
+			case 'b': opt.batch = atoi(optarg); break;
+			case 'r': opt.maxtries = atoi(optarg); break;
+			case 'i': opt.interval = atoi(optarg); break;
+			case 'n': opt.bench = atol(optarg); break;
+			default: usage(*argv);
+		}
+	}
+	if (opt.concurrency < 1 || opt.concurrency > MAXSLOTS || opt.batch < 1)
+		usage(*argv);
 
-	fprintf(stderr, "%s: starting. Sleeping 5s\n", *argv);
-	sleep(5);
+	/* room for a full batch plus retries of everything in flight */
+	pending = calloc(opt.batch + opt.concurrency, sizeof(struct job *));
 
-	assert(handle != BS_STATUS_FAIL);
+	if (opt.bench) {
+		bench_left = opt.bench;
+	} else {
+		fprintf(stderr, "%s: starting. Sleeping 5s\n", *argv);
+		sleep(5);
+
+		if ((bs = bs_connect(opt.host, opt.port)) == BS_STATUS_FAIL) {
+			fprintf(stderr, "tt: cannot connect to beanstalkd on %s:%d\n", opt.host, opt.port);
+			return (1);
+		}
+		if (bs_watch(bs, opt.tube) != BS_STATUS_OK || bs_ignore(bs, "default") != BS_STATUS_OK) {
+			fprintf(stderr, "tt: cannot watch tube %s\n", opt.tube);
+			return (1);
+		}
+	}
 
-	assert(bs_watch(handle, TUBENAME) == BS_STATUS_OK);
-	assert(bs_ignore(handle, "default") == BS_STATUS_OK);
+	curl_global_init(CURL_GLOBAL_ALL);
+	headers = curl_slist_append(headers, "Accept: application/json");
+	headers = curl_slist_append(headers, "Content-Type: application/json");
+	headers = curl_slist_append(headers, "charset: utf-8");
 
-	if ((cu = curlsetup(URL)) == NULL) {
-		puts("MEH");
-		return -1;
+	multi = curl_multi_init();
+	curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)opt.concurrency);
+	curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, (long)opt.concurrency);
+
+	for (n = 0; n < opt.concurrency; n++) {
+		slots[n].cu = curlsetup(opt.url);
+		curl_easy_setopt(slots[n].cu, CURLOPT_WRITEFUNCTION, discard);
+		curl_easy_setopt(slots[n].cu, CURLOPT_PRIVATE, &slots[n]);
 	}
 
-	while (bs_reserve(handle, &job) == BS_STATUS_OK) {
-		assert(job);
+	t0 = last = now();
+	inflight = 0;
+	while (1) {
+		reserve(inflight == 0);
+
+		for (n = 0; n < opt.concurrency && npending > 0; n++) {
+			if (slots[n].job == NULL) {
+				start(multi, &slots[n], pending[0]);
+				memmove(pending, pending + 1, --npending * sizeof(struct job *));
+				inflight++;
+			}
+		}
 
-		/*
-		printf("reserve job id: %" PRId64 " size: %lu\n", job->id, job->size);
-		write(fileno(stderr), job->data, job->size);
-		write(fileno(stderr), "\r\n", 2);
-		*/
+		if (inflight == 0 && opt.bench && bench_left <= 0 && npending == 0)
+			break;
 
-		/*
-		printf("%s\n", job->data);
-		*/
+		curl_multi_perform(multi, &running);
+		while ((msg = curl_multi_info_read(multi, &n)) != NULL) {
+			struct slot *s;
 
-		bf = upload(cu, job->data);
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&s);
+			finish(multi, s, msg->data.result);
+			inflight--;
+		}
 
-		if (bf == true) {
-			// printf("delete job id: %" PRId64 "\n", job->id);
-			assert(bs_delete(handle, job->id) == BS_STATUS_OK);
-		} else {
-			assert(bs_bury(handle, job->id, 0) == BS_STATUS_OK);
+		/*
+		 * All slots busy, or nothing to start: wait for a transfer to
+		 * progress rather than spin, briefly, so new jobs are still
+		 * reserved promptly.
+		 */
+		if (inflight > 0)
+			curl_multi_wait(multi, NULL, 0, 10, NULL);
+
+		if (now() - last >= opt.interval) {
+			report(now() - last);
+			last = now();
 		}
-		bs_free_job(job);
 	}
 
-	bs_disconnect(handle);
+	report(now() - last);
+	if (opt.bench)
+		fprintf(stderr, "tt: %ld jobs in %.2fs: %.0f jobs/s\n",
+			opt.bench, now() - t0, opt.bench / (now() - t0));
+
+	for (n = 0; n < opt.concurrency; n++)
+		curl_easy_cleanup(slots[n].cu);
+	curl_multi_cleanup(multi);
+	curl_slist_free_all(headers);
+	if (bs != -1)
+		bs_disconnect(bs);
 	exit(0);
 }
@@ -215,6 +215,8 @@ void xlog(struct udata *ud, char *fmt, ...)
 	off_t pos;
 
 	fp = (ud == NULL) ? stderr : ud->logfp;
+	if (fp == NULL)
+		return;
 
 	fprintf(fp, "%s %lld pid=%d ", tstamp(now), (long long)now, getpid());
 	va_start(ap, fmt);
@@ -280,6 +282,9 @@ JsonNode *extra_json(config *cf, char *did)
 	char *bp = NULL;
 	JsonNode *j = NULL;
 
+	if (cf->extra_json == NULL)
+		return (NULL);
+
 	snprintf(path, sizeof(path), "%s/%s", cf->extra_json, did);
 
 	if ((bp = slurp_file(path, true)) != NULL) {
@@ -325,3 +330,27 @@ double haversine_dist(double th1, double ph1, double th2, double ph2)
         return asin(sqrt(dx * dx + dy * dy + dz * dz) / 2) * 2 * R * 1000;
 }
 
+
+/*
+ * Milliseconds on a monotonic clock, for measuring intervals.
+ */
+
+long long mono_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000L);
+}
+
+/*
+ * Microseconds since the epoch, for comparing with device times.
+ */
+
+long long wall_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000L);
+}
@@ -23,7 +23,9 @@
 #ifndef _XOPEN_SOURCE
 # define _XOPEN_SOURCE
 #endif
-#define __USE_XOPEN
+#ifndef __USE_XOPEN
+# define __USE_XOPEN
+#endif
 #define __GNU_SOURCE
 #include <time.h>
 #include "udata.h"
@@ -45,5 +47,7 @@ char *device_to_topic(config *cf, char *did);
 JsonNode *extra_json(config *cf, char *did);
 double temp(char *hexs);
 double haversine_dist(double th1, double ph1, double th2, double ph2);
+long long mono_ms(void);
+long long wall_us(void);
 
 #endif